@@ -22,10 +22,6 @@ namespace flashroute {
 
   Ipv4Address* Ipv4Address::clone() const { return new Ipv4Address(*this); }
 
-  uint32_t Ipv4Address::getIpv4Address() const {
-    return address_;
-  }
-
   absl::uint128 Ipv4Address::getIpv6Address() const {
     return 0;
   }
@@ -56,10 +52,6 @@ namespace flashroute {
     return *this;
   }
 
-  bool Ipv4Address::isIpv4() const {
-    return true;
-  }
-
   size_t Ipv4Address::hash() const { return (address_) % __SIZE_MAX__; }
 
   // Ipv6 implementation
@@ -83,10 +75,6 @@ namespace flashroute {
     return 0;
   }
 
-  absl::uint128 Ipv6Address::getIpv6Address() const {
-    return address_;
-  }
-
   absl::uint128 Ipv6Address::getPrefix(uint8_t length) const {
     return address_ >> (128 - length);
   }
@@ -128,10 +116,6 @@ namespace flashroute {
     return *this;
   }
 
-  bool Ipv6Address::isIpv4() const {
-    return false;
-  }
-
   size_t Ipv6Address::hash() const {
     return (absl::Uint128High64(address_) ^ absl::Uint128Low64(address_)) %
            __SIZE_MAX__;
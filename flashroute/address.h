@@ -13,6 +13,8 @@ namespace flashroute {
 
 class IpAddress {
  public:
+  virtual ~IpAddress() = default;
+
   virtual IpAddress* clone() const = 0;
 
   // return ipv4 decimal address if there is one.
@@ -74,7 +76,9 @@ class IpAddress {
   virtual IpAddress& set_to(const IpAddress& rhs) = 0;
 };
 
-class Ipv4Address : public IpAddress {
+// Ipv4Address and Ipv6Address are final and define their accessors inline, so
+// calls through the concrete types are resolved at compile time.
+class Ipv4Address final : public IpAddress {
  public:
   Ipv4Address();
   explicit Ipv4Address(uint32_t ipv4);
@@ -82,11 +86,11 @@ class Ipv4Address : public IpAddress {
   // vitrual constructor (copy)
   virtual Ipv4Address* clone() const;
 
-  uint32_t getIpv4Address() const override;
+  uint32_t getIpv4Address() const override { return address_; }
   absl::uint128 getIpv6Address() const override;
   absl::uint128 getPrefix(uint8_t length) const override;
   void randomizeAddress(uint8_t length) override;
-  bool isIpv4() const override;
+  bool isIpv4() const override { return true; }
 
   size_t hash() const override;
 
@@ -105,7 +109,7 @@ class Ipv4Address : public IpAddress {
   uint32_t address_;
 };
 
-class Ipv6Address : public IpAddress {
+class Ipv6Address final : public IpAddress {
  public:
   Ipv6Address();
   explicit Ipv6Address(absl::uint128 address);
@@ -114,10 +118,10 @@ class Ipv6Address : public IpAddress {
   virtual Ipv6Address* clone() const;
 
   uint32_t getIpv4Address() const override;
-  absl::uint128 getIpv6Address() const override;
+  absl::uint128 getIpv6Address() const override { return address_; }
   absl::uint128 getPrefix(uint8_t length) const override;
   void randomizeAddress(uint8_t length) override;
-  bool isIpv4() const override;
+  bool isIpv4() const override { return false; }
 
   size_t hash() const override;
 
@@ -41,6 +41,19 @@ class BoundedBuffer {
     mNotFull.notify_one();
   }
 
+  // Pop up to maxCount items without blocking. Items are popped in the same
+  // order as popBack. Return the number of popped items.
+  SizeType popBackBulk(ValueType* pItems, SizeType maxCount) {
+    boost::mutex::scoped_lock lock(mMutex);
+    SizeType count = 0;
+    while (count < maxCount && mUnread > 0) {
+      pItems[count++] = mContainer[--mUnread];
+    }
+    lock.unlock();
+    if (count != 0) mNotFull.notify_all();
+    return count;
+  }
+
   bool empty() { return mUnread == 0; }
   SizeType size() { return mUnread; }
 
@@ -0,0 +1,172 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/checksum.h"
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FLASHROUTE_CHECKSUM_X86
+#endif
+
+namespace flashroute {
+
+typedef uint64_t (*ChecksumKernel)(uint64_t sum, const void* data,
+                                   size_t length);
+
+#ifdef FLASHROUTE_CHECKSUM_X86
+
+// Vector kernels zero-extend each 16-bit word into a 32-bit lane. A lane grows
+// by at most 2 * 0xFFFF per iteration, so the lanes are drained into the
+// 64-bit sum before they can overflow.
+const size_t kChecksumLaneIterations = 0x7FFF;
+
+uint64_t addChecksumWordsSse2(uint64_t sum, const void* data, size_t length) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  const __m128i zero = _mm_setzero_si128();
+  while (length >= 16) {
+    __m128i lanes = _mm_setzero_si128();
+    for (size_t i = 0; i < kChecksumLaneIterations && length >= 16; i++) {
+      __m128i words =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+      lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(words, zero));
+      lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(words, zero));
+      bytes += 16;
+      length -= 16;
+    }
+    uint32_t drained[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(drained), lanes);
+    sum += static_cast<uint64_t>(drained[0]) + drained[1] + drained[2] +
+           drained[3];
+  }
+  return addChecksumWordsPortable(sum, bytes, length);
+}
+
+__attribute__((target("avx2"))) uint64_t addChecksumWordsAvx2(
+    uint64_t sum, const void* data, size_t length) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  const __m256i zero = _mm256_setzero_si256();
+  while (length >= 32) {
+    __m256i lanes = _mm256_setzero_si256();
+    for (size_t i = 0; i < kChecksumLaneIterations && length >= 32; i++) {
+      __m256i words =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes));
+      lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(words, zero));
+      lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(words, zero));
+      bytes += 32;
+      length -= 32;
+    }
+    uint32_t drained[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(drained), lanes);
+    for (int i = 0; i < 8; i++) sum += drained[i];
+  }
+  // Not the SSE2 kernel: mixing legacy SSE with AVX code stalls.
+  return addChecksumWordsPortable(sum, bytes, length);
+}
+
+#endif
+
+static ChecksumKernel getChecksumKernel(
+    ChecksumImplementation implementation) {
+  switch (implementation) {
+#ifdef FLASHROUTE_CHECKSUM_X86
+    case ChecksumImplementation::AVX2:
+      return addChecksumWordsAvx2;
+    case ChecksumImplementation::SSE2:
+      return addChecksumWordsSse2;
+#endif
+    default:
+      return addChecksumWordsPortable;
+  }
+}
+
+bool isChecksumImplementationSupported(ChecksumImplementation implementation) {
+  switch (implementation) {
+    case ChecksumImplementation::PORTABLE:
+      return true;
+#ifdef FLASHROUTE_CHECKSUM_X86
+    case ChecksumImplementation::SSE2:
+      return __builtin_cpu_supports("sse2");
+    case ChecksumImplementation::AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+static ChecksumImplementation detectChecksumImplementation() {
+#ifdef FLASHROUTE_CHECKSUM_X86
+  // Detection runs in a static initializer, possibly before the one of the
+  // runtime.
+  __builtin_cpu_init();
+#endif
+  // The SSE2 kernel is no faster than the portable one at any length, so it is
+  // never selected by default.
+  if (isChecksumImplementationSupported(ChecksumImplementation::AVX2)) {
+    return ChecksumImplementation::AVX2;
+  }
+  return ChecksumImplementation::PORTABLE;
+}
+
+// Constant-initialized, so checksums computed by other static initializers
+// are correct, only slower.
+static ChecksumImplementation checksumImplementation =
+    ChecksumImplementation::PORTABLE;
+static ChecksumKernel checksumKernel = addChecksumWordsPortable;
+
+ChecksumImplementation getChecksumImplementation() {
+  return checksumImplementation;
+}
+
+bool setChecksumImplementation(ChecksumImplementation implementation) {
+  if (!isChecksumImplementationSupported(implementation)) return false;
+  checksumImplementation = implementation;
+  checksumKernel = getChecksumKernel(implementation);
+  return true;
+}
+
+static const bool checksumImplementationDetected =
+    setChecksumImplementation(detectChecksumImplementation());
+
+uint64_t addChecksumWordsWith(ChecksumImplementation implementation,
+                              uint64_t sum, const void* data, size_t length) {
+  return getChecksumKernel(implementation)(sum, data, length);
+}
+
+uint64_t addChecksumWordsVector(uint64_t sum, const void* data,
+                                size_t length) {
+  return checksumKernel(sum, data, length);
+}
+
+uint16_t getInternetChecksum(const void* data, size_t length) {
+  return finishChecksum(addChecksumWords(0, data, length));
+}
+
+uint16_t getIpv4PseudoHeaderChecksum(uint32_t source, uint32_t destination,
+                                     uint8_t protocol, const void* data,
+                                     size_t length) {
+  uint64_t sum = static_cast<uint64_t>(source) + destination;
+  sum += htons(protocol);
+  sum += htons(static_cast<uint16_t>(length));
+  return finishChecksum(addChecksumWords(sum, data, length));
+}
+
+uint16_t getIpv6PseudoHeaderChecksum(const void* source,
+                                     const void* destination,
+                                     uint8_t protocol, const void* data,
+                                     size_t length) {
+  uint64_t sum = addChecksumWordsPortable(0, source, 16);
+  sum = addChecksumWordsPortable(sum, destination, 16);
+  sum += htonl(protocol);
+  sum += htonl(static_cast<uint32_t>(length));
+  return finishChecksum(addChecksumWords(sum, data, length));
+}
+
+void fillIpv4HeaderChecksum(uint8_t* packet) {
+  struct ip* header = reinterpret_cast<struct ip*>(packet);
+  header->ip_sum = 0;
+  header->ip_sum = getInternetChecksum(packet, header->ip_hl * 4u);
+}
+
+}  // namespace flashroute
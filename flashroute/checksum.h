@@ -0,0 +1,142 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace flashroute {
+
+/**
+ * Internet checksum (RFC 1071) shared by the probers and the packet sockets.
+ *
+ * A partial sum is kept in 64 bits and folded to 16 bits only when the
+ * checksum is finished. The sum does not depend on byte order, so words are
+ * added as they are stored and a finished checksum can be stored into a header
+ * as it is.
+ *
+ * Buffers of kChecksumVectorMinLength bytes or more are summed by the AVX2
+ * kernel if the CPU supports it, which is detected once at startup. Shorter
+ * buffers, which include every probe and address, are summed inline.
+ *
+ * Example:
+ *
+ * // Checksum of a whole buffer.
+ * ip->ip_sum = 0;
+ * ip->ip_sum = getInternetChecksum(ip, sizeof(struct ip));
+ *
+ * // Checksum of a UDP segment including the Ipv4 pseudo header.
+ * udp->check = getIpv4PseudoHeaderChecksum(source, destination, IPPROTO_UDP,
+ *                                          udp, udpLength);
+ */
+
+// The checksum kernels which can be selected at runtime.
+enum class ChecksumImplementation { PORTABLE, SSE2, AVX2 };
+
+// Measured with checksum_benchmark: below 512 bytes, including the 28 to 236
+// bytes of a probe, the inline loop is as fast as the vector kernels, whose
+// indirect call and lane draining outweigh the wider loads.
+const size_t kChecksumVectorMinLength = 512;
+
+// Add the 16-bit words of data to a partial sum with 32-bit loads into 64-bit
+// accumulators. An odd trailing byte is padded with zero, so only the last
+// piece of a checksummed buffer may have an odd length.
+inline uint64_t addChecksumWordsPortable(uint64_t sum, const void* data,
+                                         size_t length) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  uint64_t sum1 = 0;
+  uint32_t word;
+  for (; length >= 8; bytes += 8, length -= 8) {
+    memcpy(&word, bytes, sizeof(word));
+    sum += word;
+    memcpy(&word, bytes + 4, sizeof(word));
+    sum1 += word;
+  }
+  if (length >= 4) {
+    memcpy(&word, bytes, sizeof(word));
+    sum += word;
+    bytes += 4;
+    length -= 4;
+  }
+  if (length > 0) {
+    uint8_t last[4] = {0, 0, 0, 0};
+    memcpy(last, bytes, length);
+    memcpy(&word, last, sizeof(word));
+    sum1 += word;
+  }
+  return sum + sum1;
+}
+
+// Same as addChecksumWords but use the given kernel. The kernel must be
+// supported by the CPU.
+uint64_t addChecksumWordsWith(ChecksumImplementation implementation,
+                              uint64_t sum, const void* data, size_t length);
+
+// Add data to a partial sum with the selected kernel.
+uint64_t addChecksumWordsVector(uint64_t sum, const void* data, size_t length);
+
+// Add the 16-bit words of data to a ones' complement partial sum. An odd
+// trailing byte is padded with zero.
+inline uint64_t addChecksumWords(uint64_t sum, const void* data,
+                                 size_t length) {
+  if (length < kChecksumVectorMinLength) {
+    return addChecksumWordsPortable(sum, data, length);
+  }
+  return addChecksumWordsVector(sum, data, length);
+}
+
+// Fold a partial sum to 16 bits with end-around carries.
+inline uint16_t foldChecksum(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return static_cast<uint16_t>(sum);
+}
+
+// Fold a partial sum and return its complement, which can be stored into a
+// header as it is.
+inline uint16_t finishChecksum(uint64_t sum) {
+  return static_cast<uint16_t>(~foldChecksum(sum));
+}
+
+// Update a stored checksum after some 16-bit words covered by it changed from
+// zero to the values summed in addedSum (RFC 1624, Eqn. 3).
+inline uint16_t updateChecksum(uint16_t checksum, uint64_t addedSum) {
+  // HC' = ~(~HC + ~m + m'), where m = 0 so ~m is a negative zero.
+  return finishChecksum(static_cast<uint16_t>(~checksum) + addedSum);
+}
+
+// Return the checksum of a buffer.
+uint16_t getInternetChecksum(const void* data, size_t length);
+
+// Return the checksum of an upper-layer segment and the Ipv4 pseudo header.
+// Addresses are in network order.
+uint16_t getIpv4PseudoHeaderChecksum(uint32_t source, uint32_t destination,
+                                     uint8_t protocol, const void* data,
+                                     size_t length);
+
+// Return the checksum of an upper-layer segment and the Ipv6 pseudo header.
+// Addresses point to 16 bytes in network order.
+uint16_t getIpv6PseudoHeaderChecksum(const void* source,
+                                     const void* destination,
+                                     uint8_t protocol, const void* data,
+                                     size_t length);
+
+// Fill in the header checksum of an Ipv4 packet. This is needed when the packet
+// is sent through a packet socket which bypasses the IP stack of kernel.
+void fillIpv4HeaderChecksum(uint8_t* packet);
+
+// Return true if the CPU supports the kernel.
+bool isChecksumImplementationSupported(ChecksumImplementation implementation);
+
+// Return the kernel used by addChecksumWords.
+ChecksumImplementation getChecksumImplementation();
+
+// Select the kernel used by addChecksumWords. The fastest supported one is
+// selected at startup; this is for tests and benchmarks and must be called
+// before any other thread computes checksums. Return false if the CPU does not
+// support the kernel.
+bool setChecksumImplementation(ChecksumImplementation implementation);
+
+}  // namespace flashroute
@@ -0,0 +1,72 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Measure the throughput of the checksum kernels against the 16-bit word loop
+// which the probers used before.
+//
+// bazel run -c opt //flashroute:checksum_benchmark
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "flashroute/checksum.h"
+
+using namespace flashroute;
+
+const uint64_t kBenchmarkBytes = 1ULL << 30;
+// Probes are 28 to 236 bytes; the longer lengths bound the vector threshold.
+const size_t kBenchmarkLengths[] = {28, 60, 128, 236, 384, 512, 1500, 9000};
+
+uint64_t addChecksumWordsLegacy(uint64_t sum, const void* data,
+                                size_t length) {
+  const uint16_t* words = reinterpret_cast<const uint16_t*>(data);
+  uint32_t legacySum = 0;
+  for (size_t i = 0; i < length / 2; i++) legacySum += ntohs(words[i]);
+  return sum + legacySum;
+}
+
+template <class Kernel>
+void runBenchmark(const std::string& name, size_t length, Kernel kernel) {
+  std::vector<uint8_t> buffer(length);
+  for (size_t i = 0; i < length; i++) buffer[i] = static_cast<uint8_t>(i * 7);
+  uint64_t iterations = kBenchmarkBytes / length;
+  uint64_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    // Touch the buffer so the call is not hoisted out of the loop.
+    buffer[0] = static_cast<uint8_t>(i);
+    checksum += kernel(0, buffer.data(), length);
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << name << " " << length << " bytes: "
+            << elapsed * 1e9 / iterations << " ns/call, "
+            << kBenchmarkBytes / elapsed / 1e9 << " GB/s (checksum "
+            << checksum << ")" << std::endl;
+}
+
+int main() {
+  const std::pair<ChecksumImplementation, std::string> implementations[] = {
+      {ChecksumImplementation::PORTABLE, "portable"},
+      {ChecksumImplementation::SSE2, "sse2"},
+      {ChecksumImplementation::AVX2, "avx2"}};
+
+  for (size_t length : kBenchmarkLengths) {
+    runBenchmark("legacy", length, addChecksumWordsLegacy);
+    for (const auto& implementation : implementations) {
+      if (!isChecksumImplementationSupported(implementation.first)) continue;
+      runBenchmark(implementation.second, length,
+                   [&implementation](uint64_t sum, const void* data,
+                                     size_t length) {
+                     return addChecksumWordsWith(implementation.first, sum,
+                                                 data, length);
+                   });
+    }
+    runBenchmark("dispatched", length, addChecksumWords);
+  }
+  return 0;
+}
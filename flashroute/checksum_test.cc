@@ -0,0 +1,134 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "gtest/gtest.h"
+
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "flashroute/checksum.h"
+
+using namespace flashroute;
+
+const ChecksumImplementation kImplementations[] = {
+    ChecksumImplementation::PORTABLE, ChecksumImplementation::SSE2,
+    ChecksumImplementation::AVX2};
+
+// RFC 1071 one 16-bit word at a time, as the probers used to do.
+uint16_t getReferenceChecksum(const uint8_t* data, size_t length) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i + 1 < length; i += 2) {
+    sum += (data[i] << 8) | data[i + 1];
+  }
+  if (length % 2 == 1) sum += data[length - 1] << 8;
+  while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+  return htons(static_cast<uint16_t>(~sum));
+}
+
+std::vector<uint8_t> getRandomBytes(size_t length, uint32_t seed) {
+  std::mt19937 generator(seed);
+  std::vector<uint8_t> bytes(length);
+  for (auto& byte : bytes) byte = static_cast<uint8_t>(generator());
+  return bytes;
+}
+
+TEST(Checksum, KernelsMatchReferenceTest) {
+  std::vector<uint8_t> bytes = getRandomBytes(4096 + 3, 1);
+  for (auto implementation : kImplementations) {
+    if (!isChecksumImplementationSupported(implementation)) continue;
+    // Every length around the vector widths and every misalignment.
+    for (size_t offset = 0; offset < 4; offset++) {
+      for (size_t length = 0; length <= 4096; length++) {
+        if (length > 300 && length % 61 != 0 && length != 4096) continue;
+        uint16_t checksum = finishChecksum(addChecksumWordsWith(
+            implementation, 0, bytes.data() + offset, length));
+        ASSERT_EQ(checksum, getReferenceChecksum(bytes.data() + offset, length))
+            << "Implementation " << static_cast<int>(implementation)
+            << ", offset " << offset << ", length " << length;
+      }
+    }
+  }
+}
+
+TEST(Checksum, KernelsDrainLanesTest) {
+  // All ones fill the vector lanes as fast as possible.
+  std::vector<uint8_t> bytes(4 * 1024 * 1024 + 6, 0xFF);
+  bytes[1] = 0x12;
+  uint16_t expected = getReferenceChecksum(bytes.data(), bytes.size());
+  for (auto implementation : kImplementations) {
+    if (!isChecksumImplementationSupported(implementation)) continue;
+    EXPECT_EQ(finishChecksum(addChecksumWordsWith(implementation, 0,
+                                                  bytes.data(), bytes.size())),
+              expected);
+  }
+}
+
+TEST(Checksum, SelectImplementationTest) {
+  ChecksumImplementation selected = getChecksumImplementation();
+  EXPECT_TRUE(isChecksumImplementationSupported(selected));
+  std::vector<uint8_t> bytes = getRandomBytes(1500, 2);
+  for (auto implementation : kImplementations) {
+    if (!setChecksumImplementation(implementation)) continue;
+    EXPECT_EQ(getChecksumImplementation(), implementation);
+    EXPECT_EQ(getInternetChecksum(bytes.data(), bytes.size()),
+              getReferenceChecksum(bytes.data(), bytes.size()));
+  }
+  EXPECT_TRUE(setChecksumImplementation(selected));
+}
+
+TEST(Checksum, PseudoHeaderTest) {
+  std::vector<uint8_t> segment = getRandomBytes(333, 3);
+  uint8_t protocol = IPPROTO_UDP;
+
+  // Ipv4: source, destination, zero, protocol, 16-bit length.
+  uint32_t source = htonl(0x0A000001);
+  uint32_t destination = htonl(0xC0A80101);
+  std::vector<uint8_t> ipv4(12);
+  memcpy(ipv4.data(), &source, 4);
+  memcpy(ipv4.data() + 4, &destination, 4);
+  ipv4[9] = protocol;
+  ipv4[10] = segment.size() >> 8;
+  ipv4[11] = segment.size() & 0xFF;
+  ipv4.insert(ipv4.end(), segment.begin(), segment.end());
+  EXPECT_EQ(getIpv4PseudoHeaderChecksum(source, destination, protocol,
+                                        segment.data(), segment.size()),
+            getReferenceChecksum(ipv4.data(), ipv4.size()));
+
+  // Ipv6: source, destination, 32-bit length, zero, next header.
+  std::vector<uint8_t> addresses = getRandomBytes(32, 4);
+  std::vector<uint8_t> ipv6(addresses);
+  ipv6.resize(40, 0);
+  ipv6[34] = segment.size() >> 8;
+  ipv6[35] = segment.size() & 0xFF;
+  ipv6[39] = protocol;
+  ipv6.insert(ipv6.end(), segment.begin(), segment.end());
+  EXPECT_EQ(getIpv6PseudoHeaderChecksum(addresses.data(),
+                                        addresses.data() + 16, protocol,
+                                        segment.data(), segment.size()),
+            getReferenceChecksum(ipv6.data(), ipv6.size()));
+}
+
+TEST(Checksum, Ipv4HeaderTest) {
+  uint8_t header[20] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40,
+                        0x00, 0x40, 0x11, 0xAB, 0xCD, 0xC0, 0xA8,
+                        0x00, 0x01, 0xC0, 0xA8, 0x00, 0xC7};
+  fillIpv4HeaderChecksum(header);
+  EXPECT_EQ(header[10], 0xB8);
+  EXPECT_EQ(header[11], 0x61);
+  EXPECT_EQ(getInternetChecksum(header, sizeof(header)), 0);
+}
+
+TEST(Checksum, UpdateChecksumTest) {
+  std::vector<uint8_t> bytes = getRandomBytes(128, 5);
+  std::vector<uint8_t> zeroed(bytes);
+  memset(zeroed.data() + 10, 0, 6);
+  uint16_t checksum = updateChecksum(
+      getInternetChecksum(zeroed.data(), zeroed.size()),
+      addChecksumWords(0, bytes.data() + 10, 6));
+  // 0x0000 and 0xFFFF are the same in ones' complement.
+  uint16_t expected = getInternetChecksum(bytes.data(), bytes.size());
+  EXPECT_TRUE(checksum == expected ||
+              (checksum == 0xFFFF && expected == 0) ||
+              (checksum == 0 && expected == 0xFFFF));
+}
@@ -0,0 +1,130 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/cyclic_permutation.h"
+
+#include <random>
+#include <vector>
+
+#include "absl/numeric/int128.h"
+#include "glog/logging.h"
+
+namespace flashroute {
+
+namespace {
+
+bool isPrime(uint64_t value) {
+  if (value < 2) return false;
+  for (uint64_t divisor = 2; divisor * divisor <= value; divisor++) {
+    if (value % divisor == 0) return false;
+  }
+  return true;
+}
+
+// Return the distinct prime factors of the value.
+std::vector<uint64_t> getPrimeFactors(uint64_t value) {
+  std::vector<uint64_t> factors;
+  for (uint64_t divisor = 2; divisor * divisor <= value; divisor++) {
+    if (value % divisor != 0) continue;
+    factors.push_back(divisor);
+    while (value % divisor == 0) value /= divisor;
+  }
+  if (value > 1) factors.push_back(value);
+  return factors;
+}
+
+// Return the smallest prime larger than the size such that the multiplicative
+// group of its integers splits into shardCount cosets of equal size.
+uint64_t getShardablePrime(const uint64_t size, const uint32_t shardCount) {
+  uint64_t prime = getNextPrime(size);
+  while ((prime - 1) % shardCount != 0) prime = getNextPrime(prime);
+  return prime;
+}
+
+}  // namespace
+
+uint64_t getNextPrime(const uint64_t value) {
+  uint64_t candidate = value + 1;
+  while (!isPrime(candidate)) candidate++;
+  return candidate;
+}
+
+CyclicPermutation::CyclicPermutation(const uint64_t size, const uint64_t seed,
+                                     const uint32_t shardCount,
+                                     const uint32_t shard)
+    : size_(size), prime_(2), generator_(1) {
+  if (size > kMaxPermutationSize || shardCount == 0 || shard >= shardCount) {
+    LOG(FATAL) << "CyclicPermutation: Invalid size " << size << " or shard "
+               << shard << " of " << shardCount << ".";
+  }
+  prime_ = getShardablePrime(size, shardCount);
+  std::mt19937_64 random(seed);
+  uint64_t order = prime_ - 1;
+  if (prime_ > 2) {
+    // g is a primitive root if g^(order / q) != 1 for every prime factor q of
+    // the order. Search from a random candidate, the roots are dense enough.
+    std::vector<uint64_t> factors = getPrimeFactors(order);
+    uint64_t candidate = 2 + random() % (prime_ - 2);
+    for (;; candidate = candidate + 1 < prime_ ? candidate + 1 : 2) {
+      bool primitive = true;
+      for (uint64_t factor : factors) {
+        if (power(candidate, order / factor) == 1) {
+          primitive = false;
+          break;
+        }
+      }
+      if (primitive) break;
+    }
+    generator_ = candidate;
+  }
+  uint64_t start = 1 + random() % order;
+
+  step_ = power(generator_, shardCount);
+  first_ = multiply(start, power(generator_, shard));
+  shardLength_ = order / shardCount;
+  // The elements first_ * g^(jk) of the shard are exactly the elements y with
+  // (y / first_)^(order / k) = 1, since g has the order p - 1.
+  firstInverse_ = power(first_, prime_ - 2);
+  shardExponent_ = order / shardCount;
+  restart();
+}
+
+bool CyclicPermutation::next(uint64_t* index) {
+  while (remaining_ > 0) {
+    uint64_t element = current_;
+    current_ = multiply(current_, step_);
+    remaining_--;
+    // The elements are 1 .. prime_ - 1, of which the first size_ are used.
+    if (element <= size_) {
+      *index = element - 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+void CyclicPermutation::restart() {
+  current_ = first_;
+  remaining_ = shardLength_;
+}
+
+bool CyclicPermutation::contains(const uint64_t index) const {
+  if (index >= size_) return false;
+  return power(multiply(index + 1, firstInverse_), shardExponent_) == 1;
+}
+
+uint64_t CyclicPermutation::multiply(uint64_t x, uint64_t y) const {
+  if (prime_ <= (1ULL << 32)) return x * y % prime_;
+  return static_cast<uint64_t>(absl::uint128(x) * y % prime_);
+}
+
+uint64_t CyclicPermutation::power(uint64_t base, uint64_t exponent) const {
+  uint64_t result = 1 % prime_;
+  base %= prime_;
+  while (exponent > 0) {
+    if (exponent & 1) result = multiply(result, base);
+    base = multiply(base, base);
+    exponent >>= 1;
+  }
+  return result;
+}
+
+}  // namespace flashroute
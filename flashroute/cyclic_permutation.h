@@ -0,0 +1,93 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <cstdint>
+
+namespace flashroute {
+
+// Targets are addresses of blocks, so the size fits in 32 bits and the prime
+// is small enough for trial division.
+const uint64_t kMaxPermutationSize = 1ULL << 32;
+
+/**
+ * CyclicPermutation walks the indices 0 .. size - 1 in a pseudorandom order
+ * without storing the order. It iterates the multiplicative group of integers
+ * modulo a prime p just above the size: starting from an element x, the walk
+ * visits x * g^i mod p for a primitive root g, which reaches every element of
+ * 1 .. p - 1 exactly once, and skips the elements above the size. The seed
+ * picks the primitive root and the starting element, so every instance with
+ * the same size and seed walks the same order.
+ *
+ * The cycle can be split into disjoint shards, e.g., one per host or per
+ * thread. Shard i of k takes the positions i, i + k, i + 2k, ... of the cycle,
+ * so the shards together visit every index once. The prime is picked so that
+ * k divides p - 1, then an element is in shard i if it is x * g^i times a k-th
+ * power residue, which contains() tests without walking the cycle.
+ *
+ * Example:
+ *
+ * CyclicPermutation permutation(
+ *    1 << 24,  // size
+ *    seed,     // the same on every host
+ *    4,        // shard count
+ *    1         // the shard of this host
+ * );
+ *
+ * uint64_t index;
+ * while (permutation.next(&index)) {
+ *   // visit index.
+ * }
+ *
+ * // or, in any order:
+ * for (uint64_t index = 0; index < 1 << 24; index++) {
+ *   if (permutation.contains(index)) // visit index.
+ * }
+ */
+class CyclicPermutation {
+ public:
+  CyclicPermutation(const uint64_t size, const uint64_t seed,
+                    const uint32_t shardCount = 1, const uint32_t shard = 0);
+
+  // Set index to the next index of the shard. Return false at the end of the
+  // shard.
+  bool next(uint64_t* index);
+
+  // Restart the shard from its first index.
+  void restart();
+
+  // Return whether the index is in the shard.
+  bool contains(const uint64_t index) const;
+
+  uint64_t getPrime() const { return prime_; }
+
+  uint64_t getGenerator() const { return generator_; }
+
+ private:
+  uint64_t size_;
+  uint64_t prime_;
+  // A primitive root modulo prime_.
+  uint64_t generator_;
+
+  // generator_ to the power of the shard count, the distance between the
+  // positions of a shard.
+  uint64_t step_;
+  uint64_t first_;
+  // The inverse of first_ and the exponent which maps the elements of the
+  // shard, divided by first_, to 1.
+  uint64_t firstInverse_;
+  uint64_t shardExponent_;
+  // The number of positions of the cycle in the shard.
+  uint64_t shardLength_;
+
+  uint64_t current_;
+  uint64_t remaining_;
+
+  uint64_t multiply(uint64_t x, uint64_t y) const;
+
+  uint64_t power(uint64_t base, uint64_t exponent) const;
+};
+
+// Return the smallest prime larger than the value.
+uint64_t getNextPrime(const uint64_t value);
+
+}  // namespace flashroute
@@ -0,0 +1,102 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/cyclic_permutation.h"
+
+using namespace flashroute;
+
+namespace {
+
+// Return the indices of the shard in the order they are visited.
+std::vector<uint64_t> walk(uint64_t size, uint64_t seed,
+                           uint32_t shardCount = 1, uint32_t shard = 0) {
+  CyclicPermutation permutation(size, seed, shardCount, shard);
+  std::vector<uint64_t> order;
+  uint64_t index;
+  while (permutation.next(&index)) order.push_back(index);
+  return order;
+}
+
+}  // namespace
+
+TEST(CyclicPermutation, NextPrimeTest) {
+  EXPECT_EQ(getNextPrime(0), 2);
+  EXPECT_EQ(getNextPrime(2), 3);
+  EXPECT_EQ(getNextPrime(1000), 1009);
+  EXPECT_EQ(getNextPrime(1 << 24), 16777259);
+  EXPECT_EQ(getNextPrime(1ULL << 32), 4294967311ULL);
+}
+
+TEST(CyclicPermutation, PermutationTest) {
+  for (uint64_t size : {0, 1, 2, 10, 1000, 65539}) {
+    std::vector<uint64_t> order = walk(size, 7);
+    ASSERT_EQ(order.size(), size);
+    std::vector<bool> visited(size, false);
+    for (uint64_t index : order) {
+      ASSERT_LT(index, size);
+      EXPECT_FALSE(visited[index]);
+      visited[index] = true;
+    }
+  }
+
+  // The order depends on the seed only.
+  EXPECT_EQ(walk(1000, 7), walk(1000, 7));
+  EXPECT_NE(walk(1000, 7), walk(1000, 8));
+
+  // The whole IPv4 space, whose prime needs 128-bit products.
+  CyclicPermutation large(1ULL << 32, 7);
+  uint64_t previous = 1ULL << 32;
+  for (uint32_t i = 0; i < 1000; i++) {
+    uint64_t index;
+    ASSERT_TRUE(large.next(&index));
+    EXPECT_LT(index, 1ULL << 32);
+    EXPECT_NE(index, previous);
+    previous = index;
+  }
+
+  CyclicPermutation permutation(1000, 7);
+  uint64_t first;
+  uint64_t index;
+  permutation.next(&first);
+  permutation.next(&index);
+  permutation.restart();
+  permutation.next(&index);
+  EXPECT_EQ(index, first);
+}
+
+TEST(CyclicPermutation, ShardTest) {
+  const uint64_t kSize = 10000;
+  const uint32_t kShards = 3;
+  std::vector<uint32_t> visits(kSize, 0);
+  for (uint32_t shard = 0; shard < kShards; shard++) {
+    std::vector<uint64_t> order = walk(kSize, 7, kShards, shard);
+    // Shards are balanced up to the elements skipped above the size.
+    EXPECT_NEAR(order.size(), kSize / kShards, 20);
+    for (uint64_t index : order) visits[index]++;
+  }
+  for (uint64_t i = 0; i < kSize; i++) EXPECT_EQ(visits[i], 1);
+
+  // More shards than elements.
+  EXPECT_EQ(walk(1, 7, 4, 0).size() + walk(1, 7, 4, 1).size() +
+                walk(1, 7, 4, 2).size() + walk(1, 7, 4, 3).size(),
+            1);
+}
+
+TEST(CyclicPermutation, ContainsTest) {
+  const uint64_t kSize = 10000;
+  for (uint32_t shardCount : {1, 3, 4, 7}) {
+    for (uint32_t shard = 0; shard < shardCount; shard++) {
+      CyclicPermutation permutation(kSize, 7, shardCount, shard);
+      std::vector<bool> members(kSize, false);
+      for (uint64_t index : walk(kSize, 7, shardCount, shard)) {
+        members[index] = true;
+      }
+      for (uint64_t i = 0; i < kSize; i++) {
+        EXPECT_EQ(permutation.contains(i), members[i]) << "Index " << i;
+      }
+      EXPECT_FALSE(permutation.contains(kSize));
+    }
+  }
+}
@@ -1,155 +1,165 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #include "flashroute/dcb.h"
 
-#include <memory>
-#include <mutex>
-#include <utility>
+namespace flashroute {
 
+namespace {
 
-namespace flashroute {
+// Layout of the state word.
+const uint32_t kNextBackwardHopShift = 0;
+const uint32_t kNextForwardHopShift = 8;
+const uint32_t kForwardHorizonShift = 16;
+const uint32_t kInitialTtlShift = 24;
+const uint64_t kPreprobedMark = 1ULL << 32;
+const uint64_t kAccurateDistanceMark = 1ULL << 33;
+const uint64_t kMarks = kPreprobedMark | kAccurateDistanceMark;
+
+inline uint8_t getField(uint64_t state, uint32_t shift) {
+  return static_cast<uint8_t>(state >> shift);
+}
+
+inline uint64_t setField(uint64_t state, uint32_t shift, uint8_t value) {
+  return (state & ~(0xFFULL << shift)) |
+         (static_cast<uint64_t>(value) << shift);
+}
+
+// The state of a block whose probing starts at the TTL, without marks.
+uint64_t makeState(uint8_t ttl) {
+  return (static_cast<uint64_t>(ttl) << kNextBackwardHopShift) |
+         (static_cast<uint64_t>(static_cast<uint8_t>(ttl + 1))
+          << kNextForwardHopShift) |
+         (static_cast<uint64_t>(ttl) << kForwardHorizonShift) |
+         (static_cast<uint64_t>(ttl) << kInitialTtlShift);
+}
+
+}  // namespace
+
+DestinationControlBlock::DestinationControlBlock()
+    : DestinationControlBlock(nullptr, nullptr, nullptr, 0) {}
 
 DestinationControlBlock::DestinationControlBlock(
-    const IpAddress* ip, DestinationControlBlock* _nextElement,
+    IpAddress* ip, DestinationControlBlock* _nextElement,
     DestinationControlBlock* _previousElement, const uint8_t initialTtl)
-    : nextElement(_nextElement),
+    : ipAddress(ip),
+      nextElement(_nextElement),
       previousElement(_previousElement),
       removed(false),
-      initialBackwardProbingTtl(initialTtl),
-      nextBackwardHop_(initialTtl),
-      preprobedMark_(false),
-      accurateDistanceMark_(false),
-      nextForwardHop_(initialTtl + 1),
-      forwardHorizon_(initialTtl) {
-  ipAddress.reset(ip->clone());
-  testAndSet = std::make_unique<std::atomic_flag>();
-  (*testAndSet).clear();
-}
+      snapshotIndex(0),
+      state_(makeState(initialTtl)) {}
 
 bool DestinationControlBlock::updateSplitTtl(uint8_t ttlToUpdate,
-                                               bool confirmResult) {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {}
-  bool result = !preprobedMark_;
-  // If the target does not have any confirmed hop-distance, we are allowed to
-  // update it.
-  if (!accurateDistanceMark_) {
-    nextBackwardHop_ = ttlToUpdate;
-    // update the initial TTL for backward probing.
-    initialBackwardProbingTtl = ttlToUpdate;
-    // Also update the next forward hop.
-    nextForwardHop_ = ttlToUpdate + 1;
-    forwardHorizon_ = ttlToUpdate;
-    // If the updated TTL is from an accurate preprobing result, we lock the
-    // future update.
-    if (confirmResult) {
-      accurateDistanceMark_ = true;
-    }
-    preprobedMark_ = true;
-  }
-  testAndSet->clear(std::memory_order_release);
-  return result;
+                                             bool confirmResult) {
+  uint64_t state = state_.load(std::memory_order_acquire);
+  uint64_t updated;
+  do {
+    // If the target has a confirmed hop-distance, we are not allowed to
+    // update it.
+    if (state & kAccurateDistanceMark) return !(state & kPreprobedMark);
+    // Update the initial TTL for backward probing, the next forward hop and
+    // the forward horizon. If the updated TTL is from an accurate preprobing
+    // result, we lock the future update.
+    updated = makeState(ttlToUpdate) | kPreprobedMark |
+              (confirmResult ? kAccurateDistanceMark : 0);
+  } while (!state_.compare_exchange_weak(state, updated,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire));
+  return !(state & kPreprobedMark);
 }
 
 uint8_t DestinationControlBlock::stopBackwardProbing() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {}
-  uint8_t remains = nextBackwardHop_;
-  nextBackwardHop_ = 0;
-  testAndSet->clear(std::memory_order_release);
-  return remains;
+  uint64_t state = state_.fetch_and(~(0xFFULL << kNextBackwardHopShift),
+                                    std::memory_order_acq_rel);
+  return getField(state, kNextBackwardHopShift);
 }
 
 uint8_t DestinationControlBlock::pullBackwardTask(int16_t ttlOffset) {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {}
-  if (nextBackwardHop_ > ttlOffset) {
-    auto tmp = nextBackwardHop_--;
-    testAndSet->clear(std::memory_order_release);
-    return tmp;
-  } else {
-    testAndSet->clear(std::memory_order_release);
-    return 0;
-  }
+  uint64_t state = state_.load(std::memory_order_acquire);
+  uint8_t hop;
+  do {
+    hop = getField(state, kNextBackwardHopShift);
+    if (hop <= ttlOffset) return 0;
+  } while (!state_.compare_exchange_weak(
+      state, setField(state, kNextBackwardHopShift, hop - 1),
+      std::memory_order_acq_rel, std::memory_order_acquire));
+  return hop;
 }
 
 bool DestinationControlBlock::hasBackwardTask() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  auto tmp = nextBackwardHop_ > 0;
-  testAndSet->clear(std::memory_order_release);
-  return tmp;
+  return peekBackwardTask() > 0;
 }
 
 uint8_t DestinationControlBlock::peekBackwardTask() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  auto tmp = nextBackwardHop_;
-  testAndSet->clear(std::memory_order_release);
-  return tmp;
+  return getField(state_.load(std::memory_order_acquire),
+                  kNextBackwardHopShift);
 }
 
 bool DestinationControlBlock::hasForwardTask() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  auto tmp = forwardHorizon_ >= nextForwardHop_;
-  testAndSet->clear(std::memory_order_release);
-  return tmp;
+  uint64_t state = state_.load(std::memory_order_acquire);
+  return getField(state, kForwardHorizonShift) >=
+         getField(state, kNextForwardHopShift);
 }
 
 uint8_t DestinationControlBlock::pullForwardTask() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  if (forwardHorizon_ >= nextForwardHop_) {
-    auto tmp = nextForwardHop_++;
-    testAndSet->clear(std::memory_order_release);
-    return tmp;
-  } else {
-    testAndSet->clear(std::memory_order_release);
-    return 0;
-  }
+  uint64_t state = state_.load(std::memory_order_acquire);
+  uint8_t hop;
+  do {
+    hop = getField(state, kNextForwardHopShift);
+    if (getField(state, kForwardHorizonShift) < hop) return 0;
+  } while (!state_.compare_exchange_weak(
+      state, setField(state, kNextForwardHopShift, hop + 1),
+      std::memory_order_acq_rel, std::memory_order_acquire));
+  return hop;
 }
 
 void DestinationControlBlock::stopForwardProbing() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  forwardHorizon_ = 0;
-  testAndSet->clear(std::memory_order_release);
+  state_.fetch_and(~(0xFFULL << kForwardHorizonShift),
+                   std::memory_order_acq_rel);
 }
 
 int16_t DestinationControlBlock::getMaxProbedDistance() {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  auto tmp = nextForwardHop_ - 1;
-  testAndSet->clear(std::memory_order_release);
-  return tmp;
+  return getField(state_.load(std::memory_order_acquire),
+                  kNextForwardHopShift) -
+         1;
 }
 
 void DestinationControlBlock::setForwardHorizon(uint8_t forwardExploredHop) {
-  while (testAndSet->test_and_set(std::memory_order_acquire)) {
-  }
-  // forwardHorizon_ == 0 means that the forward probing is done;
-  // therefore, we will not update the variable regarding the forward probing.
-  if (forwardHorizon_ == 0) {
-    testAndSet->clear(std::memory_order_release);
-    return;
-  }
-  if (forwardExploredHop > forwardHorizon_) {
-    forwardHorizon_ = forwardExploredHop;
-  }
-  testAndSet->clear(std::memory_order_release);
+  uint64_t state = state_.load(std::memory_order_acquire);
+  do {
+    uint8_t horizon = getField(state, kForwardHorizonShift);
+    // forwardHorizon == 0 means that the forward probing is done;
+    // therefore, we will not update the variable regarding the forward
+    // probing.
+    if (horizon == 0 || forwardExploredHop <= horizon) return;
+  } while (!state_.compare_exchange_weak(
+      state, setField(state, kForwardHorizonShift, forwardExploredHop),
+      std::memory_order_acq_rel, std::memory_order_acquire));
 }
 
 void DestinationControlBlock::resetProbingProgress(uint8_t ttl) {
-  nextBackwardHop_ = ttl;
-  initialBackwardProbingTtl = ttl;
-  nextForwardHop_ = ttl + 1;
-  forwardHorizon_ = ttl;
+  uint64_t marks = state_.load(std::memory_order_relaxed) & kMarks;
+  state_.store(makeState(ttl) | marks, std::memory_order_release);
   removed = false;
 }
 
-bool DestinationControlBlock::isPreprobed() const { return preprobedMark_; }
+bool DestinationControlBlock::isPreprobed() const {
+  return state_.load(std::memory_order_acquire) & kPreprobedMark;
+}
 
 uint8_t DestinationControlBlock::peekForwardHop() const {
-  return nextForwardHop_;
-};
+  return getField(state_.load(std::memory_order_acquire),
+                  kNextForwardHopShift);
+}
 
-}  // namespace flashroute
+uint8_t DestinationControlBlock::getInitialBackwardProbingTtl() const {
+  return getField(state_.load(std::memory_order_acquire), kInitialTtlShift);
+}
 
+uint64_t DestinationControlBlock::saveState() const {
+  return state_.load(std::memory_order_acquire);
+}
+
+void DestinationControlBlock::restoreState(uint64_t state) {
+  state_.store(state, std::memory_order_release);
+}
 
+}  // namespace flashroute
@@ -1,8 +1,8 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #pragma once
 
-#include <memory>
-#include <mutex>
+#include <atomic>
+#include <cstdint>
 
 #include "flashroute/address.h"
 
@@ -10,16 +10,20 @@ namespace flashroute {
 
 class DestinationControlBlock {
  public:
-  std::unique_ptr<IpAddress> ipAddress;
+  // Not owned. The DcbManager, or the dense store of an IPv4 scan, owns the
+  // address.
+  IpAddress* ipAddress;
   DestinationControlBlock* nextElement;
   DestinationControlBlock* previousElement;
   bool removed;
-  // the initial TTL when we start backward probing. This value will be used to
-  // prevent the traceroute to put router interfaces discovered in
-  // forward-probing into the stop set.
-  uint8_t initialBackwardProbingTtl;
+  // Position of the block in the snapshot of its DcbManager, which lets a
+  // deleted block leave a tombstone there in O(1).
+  uint32_t snapshotIndex;
 
-  DestinationControlBlock(const IpAddress* ip,
+  // An empty block, which is initialized in place by a dense store.
+  DestinationControlBlock();
+
+  DestinationControlBlock(IpAddress* ip,
                           DestinationControlBlock* _nextElement,
                           DestinationControlBlock* _previousElement,
                           const uint8_t initialTtl);
@@ -86,25 +90,34 @@ class DestinationControlBlock {
 
   uint8_t peekForwardHop() const;
 
+  /**
+   * return the initial TTL when we start backward probing. This value will be
+   * used to prevent the traceroute to put router interfaces discovered in
+   * forward-probing into the stop set.
+   */
+  uint8_t getInitialBackwardProbingTtl() const;
+
+  /**
+   * return the probing state packed in one word, which restoreState() brings
+   * back.
+   */
+  uint64_t saveState() const;
+
+  void restoreState(uint64_t state);
+
  private:
-  uint8_t nextBackwardHop_;
-  // std::unique_ptr<std::mutex> ttlToProbeMutex_;
-
-  bool preprobedMark_;
-  // if true, the current initial TTL is from the accurate distance measurement
-  // result, otherwise, false.
-  bool accurateDistanceMark_;
-  // std::unique_ptr<std::mutex> preprobedMarkMutex_;
-
-  // The maximal hop-distance that is probed already.
-  uint8_t nextForwardHop_;
-  // std::unique_ptr<std::mutex> maxProbedHopMutex_;
-
-  // The maximal hop-distance that is expected to be explored by forward
-  // probbing. We probe router
-  uint8_t forwardHorizon_;
-  // std::unique_ptr<std::mutex> forwardExploredHopMutex_;
-  std::unique_ptr<std::atomic_flag> testAndSet;
+  // The probing state packed in one word, so that every update is a single
+  // compare-and-swap instead of a locked section. The word holds, from the
+  // lowest byte:
+  //   - the next backward hop;
+  //   - the next forward hop, one above the maximal hop-distance that is
+  //     probed already;
+  //   - the forward horizon, the maximal hop-distance that is expected to be
+  //     explored by forward probing;
+  //   - the initial backward probing TTL;
+  //   - the preprobed mark and the accurate distance mark, which is set if
+  //     the current initial TTL is from the accurate distance measurement.
+  std::atomic<uint64_t> state_;
 };
 
 }  // namespace flashroute
@@ -0,0 +1,142 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Measure the probing state updates of DestinationControlBlock against the
+// spin-locked state it replaced, on many blocks from one thread and on a few
+// blocks shared by several threads.
+//
+// bazel run -c opt //flashroute:dcb_benchmark
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flashroute/dcb.h"
+
+using namespace flashroute;
+
+const uint64_t kBlocks = 1 << 20;
+const uint64_t kSharedBlocks = 64;
+const uint32_t kThreads = 4;
+const uint64_t kOperationsPerThread = 10000000;
+
+// The probing state guarded by a heap-allocated spin lock, as
+// DestinationControlBlock kept it before.
+class SpinLockDcb {
+ public:
+  SpinLockDcb() : testAndSet_(new std::atomic_flag) { testAndSet_->clear(); }
+
+  uint8_t pullBackwardTask(int16_t ttlOffset) {
+    lock();
+    uint8_t hop = 0;
+    if (nextBackwardHop_ > ttlOffset) hop = nextBackwardHop_--;
+    unlock();
+    return hop;
+  }
+
+  uint8_t pullForwardTask() {
+    lock();
+    uint8_t hop = 0;
+    if (forwardHorizon_ >= nextForwardHop_) hop = nextForwardHop_++;
+    unlock();
+    return hop;
+  }
+
+  void setForwardHorizon(uint8_t forwardExploredHop) {
+    lock();
+    if (forwardHorizon_ != 0 && forwardExploredHop > forwardHorizon_) {
+      forwardHorizon_ = forwardExploredHop;
+    }
+    unlock();
+  }
+
+  void resetProbingProgress(uint8_t ttl) {
+    nextBackwardHop_ = ttl;
+    initialBackwardProbingTtl_ = ttl;
+    nextForwardHop_ = ttl + 1;
+    forwardHorizon_ = ttl;
+  }
+
+ private:
+  IpAddress* ipAddress_ = nullptr;
+  SpinLockDcb* nextElement_ = nullptr;
+  SpinLockDcb* previousElement_ = nullptr;
+  bool removed_ = false;
+  uint8_t initialBackwardProbingTtl_ = 0;
+  uint8_t nextBackwardHop_ = 0;
+  bool preprobedMark_ = false;
+  bool accurateDistanceMark_ = false;
+  uint8_t nextForwardHop_ = 0;
+  uint8_t forwardHorizon_ = 0;
+  std::unique_ptr<std::atomic_flag> testAndSet_;
+
+  void lock() {
+    while (testAndSet_->test_and_set(std::memory_order_acquire)) {
+    }
+  }
+
+  void unlock() { testAndSet_->clear(std::memory_order_release); }
+};
+
+// One probing step of a block: a backward task and a forward task, whose
+// horizon is raised by a response.
+template <class Dcb>
+uint64_t runStep(Dcb* dcb, uint64_t i) {
+  if (dcb->pullBackwardTask(0) == 0) dcb->resetProbingProgress(32);
+  dcb->setForwardHorizon(33 + i % 200);
+  return dcb->pullForwardTask();
+}
+
+template <class Dcb>
+void runBenchmark(const std::string& name, uint64_t bytesPerBlock) {
+  std::unique_ptr<Dcb[]> dcbs(new Dcb[kBlocks]);
+  for (uint64_t i = 0; i < kBlocks; i++) dcbs[i].resetProbingProgress(32);
+
+  uint64_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < kOperationsPerThread; i++) {
+    // Visit the blocks in a scattered order, as a shuffled scan does.
+    checksum += runStep(&dcbs[i * 2654435761ULL % kBlocks], i);
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << name << ", " << bytesPerBlock << " bytes/block" << std::endl;
+  std::cout << "  " << kBlocks << " blocks, 1 thread: "
+            << static_cast<uint64_t>(kOperationsPerThread / elapsed)
+            << " steps/sec (checksum " << checksum << ")" << std::endl;
+
+  std::atomic<uint64_t> sharedChecksum(0);
+  start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t thread = 0; thread < kThreads; thread++) {
+    threads.emplace_back([&dcbs, &sharedChecksum, thread]() {
+      uint64_t localChecksum = 0;
+      for (uint64_t i = 0; i < kOperationsPerThread; i++) {
+        localChecksum += runStep(&dcbs[(i + thread) % kSharedBlocks], i);
+      }
+      sharedChecksum += localChecksum;
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+                .count();
+  std::cout << "  " << kSharedBlocks << " blocks, " << kThreads
+            << " threads: "
+            << static_cast<uint64_t>(kThreads * kOperationsPerThread / elapsed)
+            << " steps/sec (checksum " << sharedChecksum << ")" << std::endl;
+}
+
+int main() {
+  // The spin lock is a separate heap object of at least 16 bytes with the
+  // allocator's header.
+  runBenchmark<SpinLockDcb>("Spin lock",
+                            sizeof(SpinLockDcb) + 2 * sizeof(void*));
+  runBenchmark<DestinationControlBlock>("Atomic state word",
+                                        sizeof(DestinationControlBlock));
+  return 0;
+}
@@ -1,12 +1,18 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #include "flashroute/dcb_manager.h"
 
+#include <algorithm>
+#include <random>
 #include <vector>
 
+#include "flashroute/cyclic_permutation.h"
 #include "glog/logging.h"
 
 namespace flashroute {
 
+// The number of DCBs fetched ahead by reset().
+const uint64_t kResetPrefetchDistance = 16;
+
 // When granularity has been set to 0, it will be updated based on the type of
 // the first inserted address.
 DcbManager::DcbManager(const uint64_t reservedSpace, const uint32_t granularity,
@@ -16,8 +22,6 @@ DcbManager::DcbManager(const uint64_t reservedSpace, const uint32_t granularity,
       granularity_(granularity),
       seed_(seed),
       currentDcb_(NULL),
-      lastAddedDcb_(NULL),
-      firstAddedDcb_(NULL),
       specialDcb_(NULL) {
   map_ =
       std::unique_ptr<std::unordered_map<IpAddress*, DestinationControlBlock*,
@@ -36,12 +40,38 @@ DcbManager::DcbManager(const uint64_t reservedSpace, const uint32_t granularity,
     coarseMap_->reserve(reservedSpace);
   }
 
+  initializeIteration();
+}
+
+DcbManager::DcbManager(const Ipv4Address& firstAddress,
+                       const uint64_t blockCount, const uint32_t granularity,
+                       const uint32_t seed, const bool coarseFind)
+    : scanRound(0),
+      liveDcbCount_(0),
+      granularity_(granularity),
+      seed_(seed),
+      currentDcb_(NULL),
+      specialDcb_(NULL) {
+  denseStore_ = std::make_unique<Ipv4DcbStore>(firstAddress.getIpv4Address(),
+                                               blockCount, granularity);
+  if (coarseFind) {
+    coarseMap_ = std::unique_ptr<
+        std::unordered_map<IpNetwork*, std::vector<DestinationControlBlock*>,
+                           IpNetworkHash, IpNetworkEquality>>(
+        new std::unordered_map<IpNetwork*,
+                               std::vector<DestinationControlBlock*>,
+                               IpNetworkHash, IpNetworkEquality>());
+    coarseMap_->reserve(blockCount);
+  }
+
+  initializeIteration();
+}
 
-  // insert the special dcb.
-  specialDcb_ = addDcb(Ipv4Address(0), 0);
+void DcbManager::initializeIteration() {
+  specialDcb_ = new DestinationControlBlock(&specialAddress_, NULL, NULL, 0);
+  specialDcb_->nextElement = specialDcb_;
+  specialDcb_->previousElement = specialDcb_;
   currentDcb_ = specialDcb_;
-  // reset live Dcb count to 0
-  liveDcbCount_ = 0;
 }
 
 void DcbManager::releaseCoarseMapping() {
@@ -61,8 +91,11 @@ void DcbManager::releaseAccurateMapping() {
     while (!map_->empty()) {
       auto element = map_->begin();
       auto keyAddress = element->first;
+      DestinationControlBlock* dcb = element->second;
       map_->erase(keyAddress);
       delete keyAddress;
+      delete dcb->ipAddress;
+      delete dcb;
     }
 
     VLOG(2) << "DcbManager: accurate address mapping is released.";
@@ -72,6 +105,7 @@ void DcbManager::releaseAccurateMapping() {
 DcbManager::~DcbManager() {
   releaseCoarseMapping();
   releaseAccurateMapping();
+  delete specialDcb_;
   VLOG(2) << "DcbManager: cleanup is finished.";
 }
 
@@ -108,30 +142,89 @@ void DcbManager::resetIterator() {
 }
 
 void DcbManager::shuffleOrder() {
-  // TODO(neohuang): add logic to shuffle the order of iteration.
-  // we can put everything in an temp array first and shuffle the order from the
-  // array.
-
-  if (map_->size() > RAND_MAX) {
-    LOG(FATAL) << "Randomization failed: the sequence range is larger than "
-                  "the range of randomization function";
+  if (denseStore_ == nullptr) {
+    mergeShuffle();
+    currentDcb_ = specialDcb_;
+    return;
   }
+  // Relink the DCBs in iteration in the order of a cyclic permutation of the
+  // blocks, which needs neither a copy of the list nor random swaps.
+  DestinationControlBlock* last = specialDcb_;
+  CyclicPermutation permutation(denseStore_->getBlockCount(), seed_);
+  uint64_t index;
+  while (permutation.next(&index)) {
+    DestinationControlBlock* dcb = denseStore_->get(index);
+    if (dcb == nullptr || dcb->removed) continue;
+    last->nextElement = dcb;
+    dcb->previousElement = last;
+    last = dcb;
+  }
+  last->nextElement = specialDcb_;
+  specialDcb_->previousElement = last;
+  currentDcb_ = specialDcb_;
+}
 
-  std::vector<DestinationControlBlock*> tmpArray;
-  {
-    for (auto it = map_->begin(); it != map_->end(); it++) {
-      tmpArray.push_back(it->second);
+void DcbManager::mergeShuffle() {
+  DestinationControlBlock* head = specialDcb_->nextElement;
+  if (head == specialDcb_) return;
+  // Sort the list bottom-up as a merge sort would, but pick the next DCB of a
+  // merge from either run with a probability proportional to the DCBs left in
+  // the run. Every merge is then a uniformly random interleaving, so the
+  // result is a uniformly random order.
+  specialDcb_->previousElement->nextElement = nullptr;
+  std::mt19937_64 random(seed_);
+  for (uint64_t width = 1;; width *= 2) {
+    DestinationControlBlock* left = head;
+    DestinationControlBlock** tail = &head;
+    uint64_t merges = 0;
+    while (left != nullptr) {
+      merges++;
+      DestinationControlBlock* right = left;
+      uint64_t leftSize = 0;
+      while (right != nullptr && leftSize < width) {
+        right = right->nextElement;
+        leftSize++;
+      }
+      DestinationControlBlock* rest = right;
+      uint64_t rightSize = 0;
+      while (rest != nullptr && rightSize < width) {
+        rest = rest->nextElement;
+        rightSize++;
+      }
+      while (leftSize + rightSize > 0) {
+        DestinationControlBlock* dcb;
+        if (random() % (leftSize + rightSize) < leftSize) {
+          dcb = left;
+          left = left->nextElement;
+          leftSize--;
+        } else {
+          dcb = right;
+          right = right->nextElement;
+          rightSize--;
+        }
+        *tail = dcb;
+        tail = &dcb->nextElement;
+      }
+      left = rest;
     }
+    *tail = nullptr;
+    if (merges <= 1) break;
   }
 
-  srand(seed_);
-  for (uint64_t i = 0; i < map_->size(); i++) {
-    swapDcbElementSequence(tmpArray[i], tmpArray[rand() % map_->size()]);
+  // Restore the backward links and close the ring at specialDcb_.
+  DestinationControlBlock* last = specialDcb_;
+  for (DestinationControlBlock* dcb = head; dcb != nullptr;
+       dcb = dcb->nextElement) {
+    last->nextElement = dcb;
+    dcb->previousElement = last;
+    last = dcb;
   }
+  last->nextElement = specialDcb_;
+  specialDcb_->previousElement = last;
 }
 
 void DcbManager::randomizeAddress() {
-  for (uint64_t i = 0; i < map_->size() - 1; i++) {
+  for (uint64_t i = 0; i < dcbCount_; i++) {
     DestinationControlBlock* dcb = this->next();
     dcb->ipAddress->randomizeAddress(granularity_);
   }
@@ -139,6 +232,7 @@ void DcbManager::randomizeAddress() {
 
 DestinationControlBlock* DcbManager::getDcbByAddress(
     const IpAddress& addr) const {
+  if (denseStore_ != nullptr) return denseStore_->find(addr);
   auto result = map_->find(&(const_cast<IpAddress&>(addr)));
   if (result != map_->end()) {
     return result->second;
@@ -159,61 +253,77 @@ std::vector<DestinationControlBlock*>* DcbManager::getDcbsByAddress(
 
 DestinationControlBlock* DcbManager::addDcb(const IpAddress& addr,
                                             const uint8_t initialTtl) {
-  // if granularity is not set, update granularity based on the dcb.
-  if (map_->size() != 0 && granularity_ == 0) {
-    if (addr.isIpv4())
-      granularity_ = 32;
-    else
-      granularity_ = 128;
-  }
-
-  if (map_->find(&(const_cast<IpAddress&>(addr))) != map_->end()) {
-    return nullptr;
-  }
+  DestinationControlBlock* tmp;
+  if (denseStore_ != nullptr) {
+    if (!addr.isIpv4()) return nullptr;
+    tmp = denseStore_->add(static_cast<const Ipv4Address&>(addr), initialTtl);
+    if (tmp == nullptr) return nullptr;
+  } else {
+    // if granularity is not set, update granularity based on the dcb.
+    if (granularity_ == 0) {
+      if (addr.isIpv4())
+        granularity_ = 32;
+      else
+        granularity_ = 128;
+    }
 
-  DestinationControlBlock* tmp =
-      new DestinationControlBlock(&addr, NULL, NULL, initialTtl);
-  map_->insert({addr.clone(), tmp});
+    if (map_->find(&(const_cast<IpAddress&>(addr))) != map_->end()) {
+      return nullptr;
+    }
 
-  if (lastAddedDcb_ == NULL && firstAddedDcb_ == NULL) {
-    lastAddedDcb_ = tmp;
-    firstAddedDcb_ = tmp;
-  } else {
-    tmp->nextElement = firstAddedDcb_;
-    tmp->previousElement = lastAddedDcb_;
-    lastAddedDcb_->nextElement = tmp;
-    firstAddedDcb_->previousElement = tmp;
-    lastAddedDcb_ = tmp;
+    tmp = new DestinationControlBlock(addr.clone(), NULL, NULL, initialTtl);
+    map_->insert({addr.clone(), tmp});
   }
 
-  liveDcbCount_++;
+  appendToIteration(tmp);
+  dcbCount_++;
   // add to corse map for distance prediction.
   addToCoarseMap(tmp);
   return tmp;
 }
 
+void DcbManager::appendToIteration(DestinationControlBlock* dcb) {
+  // The list is a ring, so the last element precedes specialDcb_.
+  DestinationControlBlock* last = specialDcb_->previousElement;
+  dcb->nextElement = specialDcb_;
+  dcb->previousElement = last;
+  last->nextElement = dcb;
+  specialDcb_->previousElement = dcb;
+  dcb->removed = false;
+  liveDcbCount_++;
+}
+
 void DcbManager::removeDcbFromIteration(DestinationControlBlock* dcb) {
   DestinationControlBlock* previous = dcb->previousElement;
   DestinationControlBlock* next = dcb->nextElement;
   previous->nextElement = next;
   next->previousElement = previous;
+  dcb->removed = true;
   liveDcbCount_--;
 }
 
 void DcbManager::removeDcbFromIteration(const IpAddress& addr) {
-  auto result = map_->find(&(const_cast<IpAddress&>(addr)));
-  if (result == map_->end()) {
+  DestinationControlBlock* dcb = getDcbByAddress(addr);
+  if (dcb == nullptr) {
     return;
   }
-  DestinationControlBlock* previous = result->second->previousElement;
-  DestinationControlBlock* next = result->second->nextElement;
-  previous->nextElement = next;
-  next->previousElement = previous;
-  liveDcbCount_--;
+  removeDcbFromIteration(dcb);
 }
 
 // remove DCB permanently. This is for blacklist.
 void DcbManager::deleteDcb(const IpAddress& addr) {
+  if (denseStore_ != nullptr) {
+    DestinationControlBlock* dcb = denseStore_->find(addr);
+    if (dcb == nullptr) {
+      return;
+    }
+    if (!dcb->removed) removeDcbFromIteration(dcb);
+    dropSnapshot(dcb);
+    denseStore_->remove(addr);
+    dcbCount_--;
+    return;
+  }
+
   auto result = map_->find(&(const_cast<IpAddress&>(addr)));
   if (result == map_->end()) {
     return;
@@ -221,96 +331,100 @@ void DcbManager::deleteDcb(const IpAddress& addr) {
 
   IpAddress* tmpKey  = result->first;
   DestinationControlBlock* tmpValue  = result->second;
+  if (!tmpValue->removed) removeDcbFromIteration(tmpValue);
+  dropSnapshot(tmpValue);
   map_->erase(result);
-  free(tmpKey);
-  free(tmpValue);
-  liveDcbCount_--;
+  delete tmpKey;
+  delete tmpValue->ipAddress;
+  delete tmpValue;
+  dcbCount_--;
   return;
 }
 
 void DcbManager::snapshot() {
-  // TODO(neohuang): implement snapshot.
+  snapshot_.clear();
+  snapshot_.reserve(liveDcbCount_);
+  hasSnapshot_ = true;
+  // Only the live DCBs take part in the extra rounds, so the walk over the
+  // ring is bounded by them rather than by the store.
+  for (DestinationControlBlock* dcb = specialDcb_->nextElement;
+       dcb != specialDcb_; dcb = dcb->nextElement) {
+    dcb->snapshotIndex = static_cast<uint32_t>(snapshot_.size());
+    snapshot_.push_back({dcb, dcb->saveState()});
+  }
+  VLOG(2) << "DcbManager: Snapshot of " << snapshot_.size() << " DCBs.";
 }
 
 void DcbManager::reset() {
-  DestinationControlBlock* tmp = nullptr;
-  DestinationControlBlock* first = nullptr;
-  for (auto it = map_->begin(); it != map_->end(); ++it) {
-    if (tmp == nullptr) {
-      tmp = it->second;
-      first = tmp;
-    } else {
-      it->second->previousElement = tmp;
-      tmp->nextElement = it->second;
-      tmp = it->second;
-    }
-    // Reset split TTL.
-    if (it->second != specialDcb_) {
-      if (it->second->isPreprobed()) {
-        // If dcb has preprobing result, new TTL is generated based on the
-        // preprobing result.
-        it->second->resetProbingProgress(
-            rand() % it->second->initialBackwardProbingTtl + 1);
-      } else {
-        // If dcb does not have preprobing result, new TTL is generated based on
-        // the lastest forward probed hop.
-        it->second->resetProbingProgress(rand() % it->second->peekForwardHop() +
-                                         1);
+  // A fast generator seeded per round keeps the rounds reproducible without
+  // the lock of rand().
+  std::minstd_rand random(seed_ + ++resetCount_);
+  DestinationControlBlock* tmp = specialDcb_;
+  uint64_t count = 0;
+  auto restart = [&](DestinationControlBlock* dcb, uint8_t forwardHop) {
+    dcb->previousElement = tmp;
+    tmp->nextElement = dcb;
+    tmp = dcb;
+    count++;
+    // If dcb has preprobing result, new TTL is generated based on the
+    // preprobing result. Otherwise, it is generated based on the lastest
+    // forward probed hop.
+    uint8_t limit =
+        dcb->isPreprobed() ? dcb->getInitialBackwardProbingTtl() : forwardHop;
+    dcb->resetProbingProgress(random() % std::max<uint8_t>(limit, 1) + 1);
+  };
+
+  if (!hasSnapshot_) {
+    forEachDcb([&restart](DestinationControlBlock* dcb) {
+      restart(dcb, dcb->peekForwardHop());
+    });
+  } else {
+    for (uint64_t i = 0; i < snapshot_.size(); i++) {
+      // The DCBs are scattered in the shuffled order, so fetch them ahead.
+      if (i + kResetPrefetchDistance < snapshot_.size()) {
+        __builtin_prefetch(snapshot_[i + kResetPrefetchDistance].dcb, 1);
       }
+      const DcbSnapshot& entry = snapshot_[i];
+      // Skip the tombstones of deleted DCBs.
+      if (entry.dcb == nullptr) continue;
+      // The forward hop reached in the finished round.
+      uint8_t forwardHop = entry.dcb->peekForwardHop();
+      entry.dcb->restoreState(entry.state);
+      restart(entry.dcb, forwardHop);
     }
   }
-  tmp->nextElement = first;
-  first->previousElement = tmp;
+  tmp->nextElement = specialDcb_;
+  specialDcb_->previousElement = tmp;
   currentDcb_ = specialDcb_;
 
-  liveDcbCount_ = map_->size() - 1;
+  liveDcbCount_ = count;
   VLOG(2) << "DcbManager has been reset.";
 }
 
+void DcbManager::dropSnapshot(DestinationControlBlock* dcb) {
+  // A DCB created after the snapshot has a stale index, so check the entry.
+  if (dcb->snapshotIndex < snapshot_.size() &&
+      snapshot_[dcb->snapshotIndex].dcb == dcb) {
+    snapshot_[dcb->snapshotIndex].dcb = nullptr;
+  }
+}
+
 void DcbManager::shuffleAddress() {
-  for (auto it = map_->begin(); it != map_->end(); ++it) {
+  uint32_t granularity = granularity_;
+  forEachDcb([granularity](DestinationControlBlock* dcb) {
     // Shuffle address.
-    if (it->second != specialDcb_) {
-        it->second->ipAddress->randomizeAddress(granularity_); 
-    }
-  }
+    dcb->ipAddress->randomizeAddress(granularity);
+  });
 }
 
 uint64_t DcbManager::size() {
-  return map_->size() - 1;
+  return dcbCount_;
 }
 
 uint64_t DcbManager::liveDcbSize() {
   return liveDcbCount_;
 }
 
-void DcbManager::swapDcbElementSequence(DestinationControlBlock* x,
-                                        DestinationControlBlock* y) {
-  DestinationControlBlock* nextX = x->nextElement;
-  DestinationControlBlock* previousX = x->previousElement;
-  DestinationControlBlock* nextY = y->nextElement;
-  DestinationControlBlock* previousY = y->previousElement;
-  if (x == y || nextX == y || nextY == x || previousX == y || previousY == x) {
-    return;
-  }
-
-  // Not swap element with removed element.
-  if (x->removed == true || y->removed == true) {
-    return;
-  }
-
-  x->nextElement = nextY;
-  x->previousElement = previousY;
-  y->nextElement = nextX;
-  y->previousElement = previousX;
-
-  nextY->previousElement = x;
-  nextX->previousElement = y;
-
-  previousY->nextElement = x;
-  previousX->nextElement = y;
-}
-
 void DcbManager::addToCoarseMap(DestinationControlBlock* dcb) {
   if (coarseMap_.get() == nullptr) return;
   IpNetwork* ipNetwork = new IpNetwork(*dcb->ipAddress, granularity_);
@@ -9,6 +9,7 @@
 
 #include "flashroute/address.h"
 #include "flashroute/dcb.h"
+#include "flashroute/dcb_store.h"
 
 
 namespace flashroute {
@@ -20,6 +21,12 @@ class DcbManager {
   explicit DcbManager(const uint64_t reservedSpace, const uint32_t granularity,
                       const uint32_t seed, const bool coarseFind);
 
+  // Keep the DCBs of an IPv4 network in a dense store of blockCount blocks
+  // from firstAddress, which is looked up without hashing.
+  DcbManager(const Ipv4Address& firstAddress, const uint64_t blockCount,
+             const uint32_t granularity, const uint32_t seed,
+             const bool coarseFind);
+
   ~DcbManager();
 
   // return true if there is any dcb in iteration list.
@@ -34,7 +41,8 @@ class DcbManager {
   // reset iterator position.
   void resetIterator();
 
-  // shuffle the order of iteration.
+  // shuffle the order of iteration into a pseudorandom permutation derived
+  // from the seed.
   void shuffleOrder();
 
   // randomize addresses.
@@ -59,10 +67,13 @@ class DcbManager {
   // remove DCB permanently. This is for blacklist.
   void deleteDcb(const IpAddress& addr);
 
-  // snapshot the current status.
+  // snapshot the iteration order and the probing state of the live DCBs.
   void snapshot();
 
-  // recover to the snapshot.
+  // recover the iteration order and the probing state of the snapshot, and
+  // restart the probing of every DCB in it from a random TTL below its
+  // distance. Without a snapshot, every DCB restarts in the order of the
+  // store.
   void reset();
 
   // Shuffle address using the method.
@@ -79,9 +90,25 @@ class DcbManager {
 
  private:
   uint64_t liveDcbCount_ = 0;
+  // The number of DCBs, excluding specialDcb_.
+  uint64_t dcbCount_ = 0;
   uint32_t granularity_;
   uint32_t seed_;
 
+  // Set for an IPv4 network scan, in which case map_ is not used.
+  std::unique_ptr<Ipv4DcbStore> denseStore_;
+
+  struct DcbSnapshot {
+    DestinationControlBlock* dcb;
+    uint64_t state;
+  };
+  // The live DCBs in iteration order, taken by snapshot(). A deleted DCB
+  // leaves a null tombstone, which reset() skips.
+  std::vector<DcbSnapshot> snapshot_;
+  bool hasSnapshot_ = false;
+  // The number of resets, which varies the random TTLs of every round.
+  uint32_t resetCount_ = 0;
+
   std::unique_ptr<std::unordered_map<IpAddress*, DestinationControlBlock*,
                                      IpAddressHash, IpAddressEquality>>
       map_;
@@ -92,14 +119,37 @@ class DcbManager {
       coarseMap_;
 
   DestinationControlBlock* currentDcb_;
-  DestinationControlBlock* lastAddedDcb_;
-  DestinationControlBlock* firstAddedDcb_;
 
   // specialDcb helps identify the beginning of iteration.
   DestinationControlBlock* specialDcb_;
-
-  void swapDcbElementSequence(DestinationControlBlock* x,
-                              DestinationControlBlock* y);
+  Ipv4Address specialAddress_;
+
+  // Create specialDcb_, which starts the iteration list.
+  void initializeIteration();
+
+  void appendToIteration(DestinationControlBlock* dcb);
+
+  // Shuffle the DCBs in iteration in place by random merges, for the DCBs of
+  // the map, which cannot be visited by index.
+  void mergeShuffle();
+
+  // Replace the entry of a deleted DCB in the snapshot by a tombstone.
+  void dropSnapshot(DestinationControlBlock* dcb);
+
+  // Visit every DCB in the store, excluding specialDcb_.
+  template <class Visitor>
+  void forEachDcb(Visitor visit) const {
+    if (denseStore_ != nullptr) {
+      for (uint64_t i = 0; i < denseStore_->getBlockCount(); i++) {
+        DestinationControlBlock* dcb = denseStore_->get(i);
+        if (dcb != nullptr) visit(dcb);
+      }
+    } else {
+      for (auto it = map_->begin(); it != map_->end(); ++it) {
+        visit(it->second);
+      }
+    }
+  }
 
   void addToCoarseMap(DestinationControlBlock* dcb);
 
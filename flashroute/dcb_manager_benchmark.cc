@@ -0,0 +1,129 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Measure the memory and the throughput of DcbManager with the hash map and
+// the dense IPv4 store, for one target in each /24 block. The default of 2^24
+// targets covers the whole IPv4 space.
+//
+// bazel run -c opt //flashroute:dcb_manager_benchmark -- [log2 targets]
+//     [dense|hash|both]
+// e.g., bazel run -c opt //flashroute:dcb_manager_benchmark -- 24 dense
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "flashroute/address.h"
+#include "flashroute/dcb_manager.h"
+
+using namespace flashroute;
+
+const uint32_t kDefaultTargetBits = 24;
+const uint32_t kGranularity = 24;
+const uint8_t kSplitTtl = 16;
+const uint64_t kLookups = 10000000;
+
+// The target of the block, which avoids the first and last address.
+uint32_t getTarget(uint64_t block) {
+  return static_cast<uint32_t>(block << (32 - kGranularity)) +
+         static_cast<uint32_t>(block * 7 % 250) + 2;
+}
+
+// Resident memory of the process in bytes.
+uint64_t getResidentMemory() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0;
+  uint64_t resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+double getElapsedSeconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Pull the tasks of every live DCB once, as a scan round does.
+void runPass(const std::string& name, DcbManager* dcbManager) {
+  uint64_t dcbs = dcbManager->liveDcbSize();
+  uint64_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < dcbs; i++) {
+    DestinationControlBlock* dcb = dcbManager->next();
+    checksum += dcb->pullBackwardTask(0) + dcb->ipAddress->getIpv4Address();
+  }
+  double elapsed = getElapsedSeconds(start);
+  std::cout << "  " << name << ": " << static_cast<uint64_t>(dcbs / elapsed)
+            << " DCBs/sec (checksum " << checksum << ")" << std::endl;
+}
+
+void runBenchmark(bool dense, uint32_t targetBits) {
+  uint64_t targets = 1ULL << targetBits;
+  std::cout << (dense ? "Dense store" : "Hash map") << ", " << targets
+            << " targets" << std::endl;
+
+  uint64_t memoryBefore = getResidentMemory();
+  auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<DcbManager> dcbManager(
+      dense ? new DcbManager(Ipv4Address(0), targets, kGranularity, 1, false)
+            : new DcbManager(1000, kGranularity, 1, false));
+  for (uint64_t i = 0; i < targets; i++) {
+    dcbManager->addDcb(Ipv4Address(getTarget(i)), kSplitTtl);
+  }
+  double elapsed = getElapsedSeconds(start);
+  uint64_t memory = getResidentMemory() - memoryBefore;
+  std::cout << "  Build: " << elapsed << " s, " << memory / (1 << 20)
+            << " MiB (" << memory / targets << " bytes/target)" << std::endl;
+
+  runPass("Sequential pass", dcbManager.get());
+
+  // Look up the targets in a pseudorandom order, as responses arrive.
+  std::vector<Ipv4Address> addresses;
+  addresses.reserve(kLookups);
+  for (uint64_t i = 0; i < kLookups; i++) {
+    addresses.emplace_back(getTarget(i * 2654435761ULL & (targets - 1)));
+  }
+  uint64_t found = 0;
+  start = std::chrono::steady_clock::now();
+  for (const Ipv4Address& address : addresses) {
+    found += dcbManager->getDcbByAddress(address) != nullptr;
+  }
+  elapsed = getElapsedSeconds(start);
+  std::cout << "  Lookup: " << static_cast<uint64_t>(kLookups / elapsed)
+            << " lookups/sec (found " << found << ")" << std::endl;
+
+  start = std::chrono::steady_clock::now();
+  dcbManager->shuffleOrder();
+  std::cout << "  Shuffle: " << getElapsedSeconds(start) << " s" << std::endl;
+  runPass("Shuffled pass", dcbManager.get());
+
+  // Start the extra rounds of a multi-round scan.
+  start = std::chrono::steady_clock::now();
+  dcbManager->snapshot();
+  std::cout << "  Snapshot: " << getElapsedSeconds(start) << " s"
+            << std::endl;
+  start = std::chrono::steady_clock::now();
+  dcbManager->reset();
+  std::cout << "  Reset: " << getElapsedSeconds(start) << " s" << std::endl;
+  runPass("Pass after reset", dcbManager.get());
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t targetBits =
+      argc > 1 ? std::strtoul(argv[1], nullptr, 10) : kDefaultTargetBits;
+  std::string backend = argc > 2 ? argv[2] : "both";
+  if (targetBits > kGranularity || targetBits == 0) {
+    std::cerr << "Targets must be between 2^1 and 2^" << kGranularity
+              << std::endl;
+    return 1;
+  }
+  if (backend != "hash") runBenchmark(true, targetBits);
+  if (backend != "dense") runBenchmark(false, targetBits);
+  return 0;
+}
@@ -0,0 +1,193 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/dcb_manager.h"
+#include "flashroute/dcb_store.h"
+
+using namespace flashroute;
+
+namespace {
+
+const uint32_t kFirstAddress = 0x0A000000;  // 10.0.0.0
+const uint64_t kBlocks = 256;               // 10.0.0.0/16 in /24 blocks.
+
+// The address of a target in the block.
+uint32_t getTarget(uint64_t block) {
+  return kFirstAddress + (static_cast<uint32_t>(block) << 8) + 7;
+}
+
+// Create a DcbManager of either backend with a target in every block.
+std::unique_ptr<DcbManager> createDcbManager(bool dense) {
+  std::unique_ptr<DcbManager> dcbManager(
+      dense ? new DcbManager(Ipv4Address(kFirstAddress), kBlocks, 24, 1, true)
+            : new DcbManager(1000, 24, 1, true));
+  for (uint64_t i = 0; i < kBlocks; i++) {
+    EXPECT_NE(dcbManager->addDcb(Ipv4Address(getTarget(i)), 16), nullptr);
+  }
+  return dcbManager;
+}
+
+// Return the addresses of one round of iteration.
+std::set<uint32_t> iterateRound(DcbManager* dcbManager) {
+  std::set<uint32_t> visited;
+  for (uint64_t i = 0; i < dcbManager->liveDcbSize(); i++) {
+    visited.insert(dcbManager->next()->ipAddress->getIpv4Address());
+  }
+  return visited;
+}
+
+}  // namespace
+
+TEST(Ipv4DcbStore, LookupTest) {
+  Ipv4DcbStore store(kFirstAddress, kBlocks, 24);
+  DestinationControlBlock* dcb = store.add(Ipv4Address(0x0A000102), 16);
+  ASSERT_NE(dcb, nullptr);
+  EXPECT_EQ(dcb->ipAddress->getIpv4Address(), 0x0A000102);
+  EXPECT_EQ(dcb->peekBackwardTask(), 16);
+  EXPECT_EQ(store.size(), 1);
+
+  EXPECT_EQ(store.find(Ipv4Address(0x0A000102)), dcb);
+  EXPECT_EQ(store.get(1), dcb);
+  // Another address of the same block, or a second target in it.
+  EXPECT_EQ(store.find(Ipv4Address(0x0A000103)), nullptr);
+  EXPECT_EQ(store.add(Ipv4Address(0x0A000103), 16), nullptr);
+  // Out of the range.
+  EXPECT_EQ(store.add(Ipv4Address(0x09FFFFFF), 16), nullptr);
+  EXPECT_EQ(store.add(Ipv4Address(0x0A010000), 16), nullptr);
+  EXPECT_EQ(store.find(Ipv6Address(1)), nullptr);
+  EXPECT_EQ(store.get(0), nullptr);
+
+  EXPECT_EQ(store.remove(Ipv4Address(0x0A000102)), dcb);
+  EXPECT_EQ(store.find(Ipv4Address(0x0A000102)), nullptr);
+  EXPECT_EQ(store.size(), 0);
+}
+
+class DcbManagerTest : public ::testing::TestWithParam<bool> {};
+
+TEST_P(DcbManagerTest, IterationTest) {
+  std::unique_ptr<DcbManager> dcbManager = createDcbManager(GetParam());
+  EXPECT_EQ(dcbManager->size(), kBlocks);
+  EXPECT_EQ(dcbManager->liveDcbSize(), kBlocks);
+  EXPECT_EQ(dcbManager->addDcb(Ipv4Address(getTarget(3)), 16), nullptr);
+
+  // Sequential scans visit the targets in the order they were added.
+  EXPECT_EQ(dcbManager->peek()->ipAddress->getIpv4Address(), getTarget(0));
+  dcbManager->shuffleOrder();
+  EXPECT_EQ(iterateRound(dcbManager.get()).size(), kBlocks);
+  EXPECT_EQ(dcbManager->scanRound, 0);
+
+  DestinationControlBlock* dcb =
+      dcbManager->getDcbByAddress(Ipv4Address(getTarget(5)));
+  ASSERT_NE(dcb, nullptr);
+  EXPECT_EQ(dcb->ipAddress->getIpv4Address(), getTarget(5));
+  EXPECT_EQ(dcbManager->getDcbByAddress(Ipv4Address(getTarget(5) + 1)),
+            nullptr);
+  ASSERT_NE(dcbManager->getDcbsByAddress(Ipv4Address(getTarget(5) + 1)),
+            nullptr);
+  EXPECT_EQ(
+      dcbManager->getDcbsByAddress(Ipv4Address(getTarget(5) + 1))->at(0), dcb);
+
+  dcbManager->removeDcbFromIteration(dcb);
+  dcbManager->removeDcbFromIteration(Ipv4Address(getTarget(6)));
+  EXPECT_EQ(dcbManager->liveDcbSize(), kBlocks - 2);
+  std::set<uint32_t> visited = iterateRound(dcbManager.get());
+  EXPECT_EQ(visited.size(), kBlocks - 2);
+  EXPECT_EQ(visited.count(getTarget(5)), 0);
+
+  // Shuffling keeps the removed targets out.
+  dcbManager->shuffleOrder();
+  EXPECT_EQ(iterateRound(dcbManager.get()), visited);
+
+  dcbManager->deleteDcb(Ipv4Address(getTarget(7)));
+  EXPECT_EQ(dcbManager->size(), kBlocks - 1);
+  EXPECT_EQ(dcbManager->getDcbByAddress(Ipv4Address(getTarget(7))), nullptr);
+
+  // Reset brings back every remaining target.
+  dcbManager->reset();
+  EXPECT_EQ(dcbManager->liveDcbSize(), kBlocks - 1);
+  visited = iterateRound(dcbManager.get());
+  EXPECT_EQ(visited.size(), kBlocks - 1);
+  EXPECT_EQ(visited.count(getTarget(5)), 1);
+  EXPECT_EQ(visited.count(getTarget(7)), 0);
+}
+
+TEST_P(DcbManagerTest, ShuffleTest) {
+  std::unique_ptr<DcbManager> dcbManager = createDcbManager(GetParam());
+  dcbManager->removeDcbFromIteration(Ipv4Address(getTarget(5)));
+  dcbManager->shuffleOrder();
+  std::vector<uint32_t> order;
+  for (uint64_t i = 0; i < dcbManager->liveDcbSize(); i++) {
+    order.push_back(dcbManager->next()->ipAddress->getIpv4Address());
+  }
+
+  // Every live target once, not in the order they were added.
+  std::vector<uint32_t> sorted = order;
+  std::sort(sorted.begin(), sorted.end());
+  ASSERT_EQ(sorted.size(), kBlocks - 1);
+  EXPECT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) ==
+              sorted.end());
+  EXPECT_EQ(std::count(sorted.begin(), sorted.end(), getTarget(5)), 0);
+  EXPECT_NE(order, sorted);
+
+  // The order depends on the seed only.
+  std::unique_ptr<DcbManager> other = createDcbManager(GetParam());
+  other->removeDcbFromIteration(Ipv4Address(getTarget(5)));
+  other->shuffleOrder();
+  for (uint64_t i = 0; i < order.size(); i++) {
+    EXPECT_EQ(other->next()->ipAddress->getIpv4Address(), order[i]);
+  }
+}
+
+TEST_P(DcbManagerTest, SnapshotTest) {
+  std::unique_ptr<DcbManager> dcbManager = createDcbManager(GetParam());
+  dcbManager->shuffleOrder();
+  dcbManager->removeDcbFromIteration(Ipv4Address(getTarget(5)));
+  DestinationControlBlock* dcb =
+      dcbManager->getDcbByAddress(Ipv4Address(getTarget(6)));
+  dcb->updateSplitTtl(10, true);
+
+  dcbManager->snapshot();
+  std::vector<DestinationControlBlock*> order;
+  for (uint64_t i = 0; i < dcbManager->liveDcbSize(); i++) {
+    order.push_back(dcbManager->next());
+  }
+  ASSERT_EQ(order.size(), kBlocks - 1);
+
+  // Probe and remove targets in the round.
+  dcb->pullBackwardTask(0);
+  dcbManager->removeDcbFromIteration(dcb);
+  dcbManager->removeDcbFromIteration(order[0]);
+
+  // Reset brings back the targets of the snapshot in its order, and restarts
+  // them below the distance they had then.
+  uint8_t maxTtl = 0;
+  for (int round = 0; round < 3; round++) {
+    dcbManager->reset();
+    EXPECT_EQ(dcbManager->liveDcbSize(), kBlocks - 1);
+    for (uint64_t i = 0; i < order.size(); i++) {
+      EXPECT_EQ(dcbManager->next(), order[i]);
+    }
+    EXPECT_FALSE(dcb->removed);
+    EXPECT_GE(dcb->getInitialBackwardProbingTtl(), 1);
+    EXPECT_LE(dcb->getInitialBackwardProbingTtl(), 10);
+    maxTtl = std::max(maxTtl, dcb->getInitialBackwardProbingTtl());
+    dcb->resetProbingProgress(1);
+  }
+  EXPECT_GT(maxTtl, 1);
+
+  // A deleted target leaves the order of the snapshot.
+  dcbManager->deleteDcb(Ipv4Address(getTarget(6)));
+  dcbManager->reset();
+  EXPECT_EQ(dcbManager->liveDcbSize(), kBlocks - 2);
+  for (uint64_t i = 0; i < order.size(); i++) {
+    if (order[i] == dcb) continue;
+    EXPECT_EQ(dcbManager->next(), order[i]);
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, DcbManagerTest, ::testing::Bool());
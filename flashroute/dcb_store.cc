@@ -0,0 +1,60 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/dcb_store.h"
+
+#include "glog/logging.h"
+
+namespace flashroute {
+
+Ipv4DcbStore::Ipv4DcbStore(const uint32_t firstAddress,
+                           const uint64_t blockCount,
+                           const uint32_t granularity)
+    : firstAddress_(firstAddress),
+      blockCount_(blockCount),
+      blockBits_(32 - granularity),
+      size_(0),
+      dcbs_(new DestinationControlBlock[blockCount]),
+      addresses_(new Ipv4Address[blockCount]) {
+  VLOG(2) << "Ipv4DcbStore: allocated " << blockCount << " blocks of /"
+          << granularity << ".";
+}
+
+DestinationControlBlock* Ipv4DcbStore::add(const Ipv4Address& address,
+                                           const uint8_t initialTtl) {
+  uint64_t block = getBlock(address);
+  if (block == blockCount_ || dcbs_[block].ipAddress != nullptr) {
+    return nullptr;
+  }
+  addresses_[block] = address;
+  DestinationControlBlock& dcb = dcbs_[block];
+  dcb.ipAddress = &addresses_[block];
+  dcb.resetProbingProgress(initialTtl);
+  size_++;
+  return &dcb;
+}
+
+DestinationControlBlock* Ipv4DcbStore::find(const IpAddress& address) const {
+  uint64_t block = getBlock(address);
+  if (block == blockCount_ || dcbs_[block].ipAddress == nullptr ||
+      addresses_[block].getIpv4Address() != address.getIpv4Address()) {
+    return nullptr;
+  }
+  return &dcbs_[block];
+}
+
+DestinationControlBlock* Ipv4DcbStore::remove(const IpAddress& address) {
+  DestinationControlBlock* dcb = find(address);
+  if (dcb == nullptr) return nullptr;
+  dcb->ipAddress = nullptr;
+  size_--;
+  return dcb;
+}
+
+uint64_t Ipv4DcbStore::getBlock(const IpAddress& address) const {
+  if (!address.isIpv4()) return blockCount_;
+  uint32_t ipv4 = address.getIpv4Address();
+  if (ipv4 < firstAddress_) return blockCount_;
+  uint64_t block = static_cast<uint64_t>(ipv4 - firstAddress_) >> blockBits_;
+  return block < blockCount_ ? block : blockCount_;
+}
+
+}  // namespace flashroute
@@ -0,0 +1,74 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "flashroute/address.h"
+#include "flashroute/dcb.h"
+
+namespace flashroute {
+
+/**
+ * Ipv4DcbStore keeps the DCBs of an IPv4 network scan in one array indexed by
+ * block number, next to an array of their addresses. Finding the DCB of an
+ * address takes a subtraction and a shift instead of hashing, and the DCBs of
+ * neighbouring blocks share cache lines instead of being spread over the heap.
+ * Both arrays are allocated once for the whole range, so the store suits
+ * scans of networks rather than sparse lists of targets.
+ *
+ * Example:
+ *
+ * Ipv4DcbStore store(
+ *    0x0A000000,  // The first address of the range, 10.0.0.0.
+ *    1 << 16,     // The number of blocks, 10.0.0.0/8 in /24 blocks.
+ *    24           // The granularity of blocks.
+ * );
+ *
+ * DestinationControlBlock* dcb = store.add(Ipv4Address(0x0A000102), 16);
+ * store.find(Ipv4Address(0x0A000102));  // dcb
+ * store.get(1);                         // dcb, the block of 10.0.1.0/24.
+ */
+class Ipv4DcbStore {
+ public:
+  Ipv4DcbStore(const uint32_t firstAddress, const uint64_t blockCount,
+               const uint32_t granularity);
+
+  // Add the DCB of the address. Return nullptr if the address is out of the
+  // range or its block has a DCB already.
+  DestinationControlBlock* add(const Ipv4Address& address,
+                               const uint8_t initialTtl);
+
+  // Return the DCB of the address, nullptr if there is none.
+  DestinationControlBlock* find(const IpAddress& address) const;
+
+  // Return the DCB of the block, nullptr if there is none.
+  DestinationControlBlock* get(const uint64_t block) const {
+    return dcbs_[block].ipAddress == nullptr ? nullptr : &dcbs_[block];
+  }
+
+  // Remove the DCB of the address from the store. Return the removed DCB, or
+  // nullptr if there is none.
+  DestinationControlBlock* remove(const IpAddress& address);
+
+  uint64_t getBlockCount() const { return blockCount_; }
+
+  // Return the number of DCBs in the store.
+  uint64_t size() const { return size_; }
+
+ private:
+  const uint32_t firstAddress_;
+  const uint64_t blockCount_;
+  // The number of address bits within a block.
+  const uint32_t blockBits_;
+  uint64_t size_;
+
+  // A block without a DCB has a null ipAddress.
+  std::unique_ptr<DestinationControlBlock[]> dcbs_;
+  std::unique_ptr<Ipv4Address[]> addresses_;
+
+  // Return the block of the address, or blockCount_ if it is out of range.
+  uint64_t getBlock(const IpAddress& address) const;
+};
+
+}  // namespace flashroute
@@ -0,0 +1,111 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/dcb.h"
+
+using namespace flashroute;
+
+namespace {
+
+const uint32_t kThreads = 8;
+const uint32_t kRounds = 2000;
+
+// Run the function on kThreads threads at once.
+template <class Function>
+void runConcurrently(Function function) {
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < kThreads; i++) threads.emplace_back(function, i);
+  for (auto& thread : threads) thread.join();
+}
+
+}  // namespace
+
+TEST(DestinationControlBlock, TaskTest) {
+  Ipv4Address address(0x0A000001);
+  DestinationControlBlock dcb(&address, nullptr, nullptr, 3);
+  EXPECT_EQ(dcb.getInitialBackwardProbingTtl(), 3);
+  EXPECT_FALSE(dcb.isPreprobed());
+
+  // Backward probing stops above the TTL offset.
+  EXPECT_EQ(dcb.pullBackwardTask(1), 3);
+  EXPECT_EQ(dcb.pullBackwardTask(1), 2);
+  EXPECT_EQ(dcb.pullBackwardTask(1), 0);
+  EXPECT_EQ(dcb.stopBackwardProbing(), 1);
+  EXPECT_FALSE(dcb.hasBackwardTask());
+
+  // Forward probing follows the horizon, which only grows until it stops.
+  EXPECT_FALSE(dcb.hasForwardTask());
+  dcb.setForwardHorizon(5);
+  dcb.setForwardHorizon(4);
+  EXPECT_EQ(dcb.pullForwardTask(), 4);
+  EXPECT_EQ(dcb.pullForwardTask(), 5);
+  EXPECT_EQ(dcb.pullForwardTask(), 0);
+  EXPECT_EQ(dcb.getMaxProbedDistance(), 5);
+  dcb.stopForwardProbing();
+  dcb.setForwardHorizon(10);
+  EXPECT_FALSE(dcb.hasForwardTask());
+
+  // A confirmed distance locks out later updates.
+  EXPECT_TRUE(dcb.updateSplitTtl(8, false));
+  EXPECT_FALSE(dcb.updateSplitTtl(9, true));
+  EXPECT_FALSE(dcb.updateSplitTtl(10, true));
+  EXPECT_EQ(dcb.getInitialBackwardProbingTtl(), 9);
+  EXPECT_EQ(dcb.peekBackwardTask(), 9);
+  EXPECT_EQ(dcb.peekForwardHop(), 10);
+
+  // Resetting the progress keeps the marks.
+  dcb.resetProbingProgress(4);
+  EXPECT_TRUE(dcb.isPreprobed());
+  EXPECT_EQ(dcb.peekBackwardTask(), 4);
+  EXPECT_FALSE(dcb.updateSplitTtl(12, true));
+  EXPECT_EQ(dcb.peekBackwardTask(), 4);
+}
+
+TEST(DestinationControlBlock, ConcurrentPullTest) {
+  Ipv4Address address(0x0A000001);
+  for (uint32_t round = 0; round < kRounds; round++) {
+    DestinationControlBlock dcb(&address, nullptr, nullptr, 32);
+    std::atomic<uint32_t> pulled[2][256] = {};
+    // Half of the threads pull backward tasks, the others raise the horizon
+    // and pull forward tasks.
+    runConcurrently([&dcb, &pulled](uint32_t thread) {
+      for (uint32_t i = 0; i < 64; i++) {
+        if (thread % 2 == 0) {
+          pulled[0][dcb.pullBackwardTask(0)]++;
+        } else {
+          dcb.setForwardHorizon(33 + i % 16 + thread);
+          pulled[1][dcb.pullForwardTask()]++;
+        }
+      }
+    });
+    // Every hop is handed out exactly once.
+    for (uint32_t hop = 1; hop <= 32; hop++) EXPECT_EQ(pulled[0][hop], 1);
+    for (uint32_t hop = 33; hop <= 48 + kThreads - 1; hop++) {
+      EXPECT_EQ(pulled[1][hop], 1);
+    }
+    EXPECT_EQ(dcb.getMaxProbedDistance(), 48 + kThreads - 1);
+    EXPECT_EQ(dcb.peekBackwardTask(), 0);
+  }
+}
+
+TEST(DestinationControlBlock, ConcurrentUpdateTest) {
+  Ipv4Address address(0x0A000001);
+  for (uint32_t round = 0; round < kRounds; round++) {
+    DestinationControlBlock dcb(&address, nullptr, nullptr, 16);
+    std::atomic<uint32_t> firstUpdates(0);
+    runConcurrently([&dcb, &firstUpdates](uint32_t thread) {
+      // Predicted distances race with the confirmed one.
+      if (dcb.updateSplitTtl(thread + 1, thread == 0)) firstUpdates++;
+      dcb.pullBackwardTask(0);
+    });
+    // Only one update sees the target before it is preprobed, and the
+    // confirmed distance is never overwritten by a prediction.
+    EXPECT_EQ(firstUpdates, 1);
+    EXPECT_TRUE(dcb.isPreprobed());
+    EXPECT_EQ(dcb.getInitialBackwardProbingTtl(), 1);
+  }
+}
@@ -1,6 +1,9 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #include "flashroute/dump_result.h"
 
+#include <algorithm>
+#include <vector>
+
 #include "glog/logging.h"
 #include "absl/numeric/int128.h"
 
@@ -13,16 +16,19 @@ const uint32_t kThreadPoolSize = 2;           // Default thread pool size.
 const uint32_t kDumpingTmpBufferSize = 128;   // Char buffer size to dump.
 const uint32_t kDumpingIntervalMs = 100;      // Sleep interval.
 const uint32_t kDumpingBufferSize = 100000;
+const uint32_t kDumpingBatchSize = 1024;      // Elements popped at once.
 
-ResultDumper::ResultDumper(const std::string& resultFilepath)
+ResultDumper::ResultDumper(const std::string& resultFilepath,
+                           const uint32_t receivingThreads)
     : resultFilepath_(resultFilepath),
       stopDumping_(false),
-      dumpedCount_(0),
-      scheduledCount_(0) {
+      dumpedCount_(0) {
   resultFilepath_ = resultFilepath;
   threadPool_ = std::make_unique<boost::asio::thread_pool>(kThreadPoolSize);
-  dumpingBuffer_ =
-      std::make_unique<BoundedBuffer<DataElement>>(kDumpingBufferSize);
+  for (uint32_t i = 0; i < std::max<uint32_t>(1, receivingThreads); i++) {
+    dumpingBuffers_.push_back(
+        std::make_unique<SpscRing<DataElement>>(kDumpingBufferSize));
+  }
 
   if (resultFilepath_.size() == 0) {
     stopDumping_ = true;
@@ -39,7 +45,7 @@ ResultDumper::ResultDumper(const std::string& resultFilepath)
 }
 
 ResultDumper::~ResultDumper() {
-  while (!dumpingBuffer_->empty()) {
+  while (!allDumped()) {
     std::this_thread::sleep_for(
         std::chrono::milliseconds(100));
   }
@@ -47,16 +53,29 @@ ResultDumper::~ResultDumper() {
 
   threadPool_->join();
   VLOG(2) << "ResultDumper: ResultDumper recycled.";
-  VLOG(2) << "ResultDumper:" << scheduledCount_ << " scheduled " << dumpedCount_
-          << " dumped.";
+  VLOG(2) << "ResultDumper:" << scheduledCount_.get() << " scheduled "
+          << dumpedCount_ << " dumped " << droppedCount_.get()
+          << " dropped.";
+}
+
+bool ResultDumper::allDumped() const {
+  for (const auto& ring : dumpingBuffers_) {
+    if (!ring->empty()) return false;
+  }
+  return true;
 }
 
-void ResultDumper::scheduleDumpData(const IpAddress& destination,
+void ResultDumper::scheduleDumpData(uint32_t receiverIndex,
+                                    const IpAddress& destination,
                                     const IpAddress& responder,
                                     uint8_t distance, uint32_t rtt,
                                     bool fromDestination, bool ipv4,
                                     void* buffer, size_t size) {
-  scheduledCount_++;
+  scheduledCount_.add();
+  if (receiverIndex >= dumpingBuffers_.size()) {
+    droppedCount_.add();
+    return;
+  }
   if (!stopDumping_) {
     absl::uint128 destinationAddr = 0;
     absl::uint128 responderAddr = 0;
@@ -68,25 +87,32 @@ void ResultDumper::scheduleDumpData(const IpAddress& destination,
       responderAddr = ntohll(responder.getIpv6Address());
     }
 
-    dumpingBuffer_->pushFront({destinationAddr, responderAddr, rtt, distance,
-                               static_cast<uint8_t>(fromDestination ? 1 : 0),
-                               static_cast<uint8_t>(ipv4 ? 1 : 0)});
+    dumpingBuffers_[receiverIndex]->pushFront(
+        {destinationAddr, responderAddr, rtt, distance,
+         static_cast<uint8_t>(fromDestination ? 1 : 0),
+         static_cast<uint8_t>(ipv4 ? 1 : 0), StageStamp::now()});
   }
 }
 
 void ResultDumper::runDumpingThread() {
   VLOG(2) << "ResultDumper: Dumping thread initialized.";
+  std::vector<DataElement> elements(kDumpingBatchSize);
   while (!stopDumping_) {
     std::ofstream dumpFile;
     dumpFile.open(resultFilepath_, std::ofstream::binary | std::ofstream::app);
     uint8_t buffer[kDumpingTmpBufferSize];
-    DataElement tmp;
-    int64_t size = dumpingBuffer_->size();
-    for (int64_t i = 0; i < size; i++) {
-      dumpingBuffer_->popBack(&tmp);
-      size_t dumpedSize = binaryDumping(buffer, kDumpingTmpBufferSize, tmp);
-      dumpFile.write(reinterpret_cast<char*>(buffer), dumpedSize);
-      dumpedCount_++;
+    for (const auto& ring : dumpingBuffers_) {
+      size_t count = 0;
+      while ((count = ring->popBackBulk(elements.data(), kDumpingBatchSize)) !=
+             0) {
+        for (size_t i = 0; i < count; i++) {
+          recordStage(PipelineStage::DUMP_QUEUE, elements[i].scheduled);
+          size_t dumpedSize =
+              binaryDumping(buffer, kDumpingTmpBufferSize, elements[i]);
+          dumpFile.write(reinterpret_cast<char*>(buffer), dumpedSize);
+        }
+        dumpedCount_ += count;
+      }
     }
     dumpFile.close();
     std::this_thread::sleep_for(std::chrono::milliseconds(kDumpingIntervalMs));
@@ -1,8 +1,10 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/process.hpp>
@@ -10,7 +12,9 @@
 #include "absl/numeric/int128.h"
 
 #include "flashroute/address.h"
-#include "flashroute/bounded_buffer.h"
+#include "flashroute/latency_histogram.h"
+#include "flashroute/metrics.h"
+#include "flashroute/spsc_ring.h"
 
 namespace flashroute {
 
@@ -21,15 +25,25 @@ struct DataElement {
   uint8_t distance;
   uint8_t fromDestination;
   uint8_t ipv4;
+  // When the result entered the dumping buffer.
+  StageStamp scheduled;
 };
 
 
+/**
+ * ResultDumper writes the results of the receiving threads to a file on a
+ * thread of its own. Every receiving thread pushes into a dumping ring of its
+ * own, picked by its receiver index, so the threads never wait for each other.
+ */
 class ResultDumper {
  public:
-  explicit ResultDumper(const std::string& resultFilepath);
+  ResultDumper(const std::string& resultFilepath,
+               const uint32_t receivingThreads = 1);
   ~ResultDumper();
 
-  void scheduleDumpData(const IpAddress& destination,
+  // Can be called by many threads at once, as long as each passes its own
+  // receiver index. Results of an index without a ring are dropped.
+  void scheduleDumpData(uint32_t receiverIndex, const IpAddress& destination,
                         const IpAddress& responder, uint8_t distance,
                         uint32_t rtt, bool fromDestination, bool ipv4,
                         void* buffer, size_t size);
@@ -41,12 +55,17 @@ class ResultDumper {
   // Thread pool
   std::unique_ptr<boost::asio::thread_pool> threadPool_;
 
-  std::unique_ptr<BoundedBuffer<DataElement>> dumpingBuffer_;
+  // One dumping ring per receiving thread, which is its only producer.
+  std::vector<std::unique_ptr<SpscRing<DataElement>>> dumpingBuffers_;
 
-  bool stopDumping_;
+  std::atomic<bool> stopDumping_;
 
   uint64_t dumpedCount_;
-  uint64_t scheduledCount_;
+  Counter scheduledCount_;
+  Counter droppedCount_;
+
+  // Return whether every dumping ring is empty.
+  bool allDumped() const;
 
   // Dumping thread.
   void runDumpingThread();
@@ -0,0 +1,297 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// A fake Internet behind a TUN device. Probes routed into the device are
+// answered with TTL-accurate ICMP errors from a SimulatedNetwork, so the
+// sockets and threads of NetworkManager run end to end without touching the
+// Internet. Only Ipv4 is supported.
+//
+// The device takes a default route, so run it with flashroute in a network
+// namespace of their own. A user namespace makes it unprivileged:
+//
+// unshare -rn sh -c 'ip link set lo up;
+//     bazel-bin/flashroute/fake_internet --topology topology.txt &
+//     sleep 1; bazel-bin/flashroute/flashroute --interface fr0
+//     --remove_reserved_addresses=false 10.0.0.0/16'
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <net/route.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "glog/logging.h"
+
+#include "flashroute/output_parser.h"
+#include "flashroute/simulated_network.h"
+
+ABSL_FLAG(std::string, tun, "fr0", "Name of the TUN device to create.");
+ABSL_FLAG(std::string, address, "192.168.0.2/24",
+          "Address and prefix of the vantage point on the TUN device.");
+ABSL_FLAG(std::string, route, "0.0.0.0/0",
+          "Destinations routed into the TUN device.");
+ABSL_FLAG(std::string, topology, "",
+          "Topology file of recorded routes, see SimulatedRoutes. "
+          "Destinations which are not covered use the synthetic topology.");
+ABSL_FLAG(std::string, replay, "",
+          "FlashRoute output whose hops are replayed as the routes of the "
+          "/24 prefixes of its destinations.");
+ABSL_FLAG(uint64_t, seed, 1, "Seed of the synthetic topology.");
+ABSL_FLAG(double, loss_rate, 0.01,
+          "Probability that a probe or its reply is lost.");
+ABSL_FLAG(uint32_t, icmp_rate_limit, 1000,
+          "ICMP errors a router sends per second. 0 disables rate limiting.");
+ABSL_FLAG(int32_t, report_interval, 1,
+          "Seconds between two reports of throughput and pacing.");
+
+using namespace flashroute;
+
+namespace {
+
+const size_t kTunBufferSize = 2048;
+const size_t kReplyBatchSize = 64;
+const int32_t kReplyTimeoutMs = 100;
+
+std::atomic<bool> stopped(false);
+
+void signalHandler(int /* signal */) { stopped = true; }
+
+bool parsePrefix(const std::string& text, uint32_t* prefix,
+                 uint8_t* prefixLength) {
+  size_t slash = text.find('/');
+  struct in_addr address;
+  if (slash == std::string::npos ||
+      inet_pton(AF_INET, text.substr(0, slash).c_str(), &address) != 1) {
+    return false;
+  }
+  int32_t length = atoi(text.c_str() + slash + 1);
+  if (length < 0 || length > 32) return false;
+  *prefix = ntohl(address.s_addr);
+  *prefixLength = static_cast<uint8_t>(length);
+  return true;
+}
+
+struct sockaddr getSocketAddress(uint32_t address) {
+  struct sockaddr socketAddress;
+  memset(&socketAddress, 0, sizeof(socketAddress));
+  struct sockaddr_in* in =
+      reinterpret_cast<struct sockaddr_in*>(&socketAddress);
+  in->sin_family = AF_INET;
+  in->sin_addr.s_addr = htonl(address);
+  return socketAddress;
+}
+
+int openTun(const std::string& name) {
+  int tun = open("/dev/net/tun", O_RDWR);
+  struct ifreq request;
+  memset(&request, 0, sizeof(request));
+  request.ifr_flags = IFF_TUN | IFF_NO_PI;
+  strncpy(request.ifr_name, name.c_str(), IFNAMSIZ - 1);
+  if (tun < 0 || ioctl(tun, TUNSETIFF, &request) < 0) {
+    LOG(FATAL) << "Failed to create TUN device " << name
+               << ". Errno: " << errno;
+  }
+  return tun;
+}
+
+// Assign the address to the device, bring it up and route the destinations
+// into it.
+void configureTun(const std::string& name, uint32_t address,
+                  uint8_t prefixLength, uint32_t route,
+                  uint8_t routePrefixLength) {
+  int control = socket(AF_INET, SOCK_DGRAM, 0);
+  struct ifreq request;
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, name.c_str(), IFNAMSIZ - 1);
+  request.ifr_addr = getSocketAddress(address);
+  bool success = control >= 0 && ioctl(control, SIOCSIFADDR, &request) == 0;
+  request.ifr_netmask = getSocketAddress(
+      prefixLength == 0 ? 0 : ~0U << (32 - prefixLength));
+  success = success && ioctl(control, SIOCSIFNETMASK, &request) == 0;
+  success = success && ioctl(control, SIOCGIFFLAGS, &request) == 0;
+  request.ifr_flags |= IFF_UP | IFF_RUNNING;
+  success = success && ioctl(control, SIOCSIFFLAGS, &request) == 0;
+
+  uint32_t routeMask =
+      routePrefixLength == 0 ? 0 : ~0U << (32 - routePrefixLength);
+  struct rtentry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.rt_dst = getSocketAddress(route & routeMask);
+  entry.rt_genmask = getSocketAddress(routeMask);
+  entry.rt_flags = RTF_UP;
+  entry.rt_dev = const_cast<char*>(name.c_str());
+  success = success && ioctl(control, SIOCADDRT, &entry) == 0;
+  if (!success) {
+    LOG(FATAL) << "Failed to configure TUN device " << name
+               << ". Errno: " << errno;
+  }
+  close(control);
+}
+
+// Build the routes of the /24 prefixes of the destinations in a FlashRoute
+// output. Hops which did not reply are silent; a destination which replied
+// sets the length of the route.
+void loadReplay(const std::string& filePath, SimulatedRoutes* routes) {
+  struct ObservedRoute {
+    std::map<uint8_t, uint32_t> hops;
+    uint8_t destinationDistance = 0;
+  };
+  std::unordered_map<uint32_t, ObservedRoute> observedRoutes;
+  OutputParser parser(filePath);
+  while (parser.hasNext()) {
+    ParsedElement& element = parser.next();
+    if (!element.ipv4 || element.distance == 0) continue;
+    ObservedRoute& route =
+        observedRoutes[element.destinationV4.getIpv4Address() & 0xFFFFFF00];
+    if (element.fromDestination) {
+      route.destinationDistance = element.distance;
+    } else {
+      route.hops[element.distance] = element.responderV4.getIpv4Address();
+    }
+  }
+  for (auto& observed : observedRoutes) {
+    ObservedRoute& route = observed.second;
+    uint8_t length = route.destinationDistance;
+    if (length == 0) {
+      length = route.hops.empty() ? 1 : route.hops.rbegin()->first + 1;
+    }
+    length = std::min<uint8_t>(length, 32);
+    SimulatedRoute simulatedRoute;
+    simulatedRoute.routers.assign(length - 1, 0);
+    for (const auto& hop : route.hops) {
+      if (hop.first < length) {
+        simulatedRoute.routers[hop.first - 1] = hop.second;
+      }
+    }
+    simulatedRoute.responsive = route.destinationDistance != 0;
+    routes->addRoute(observed.first, 24, simulatedRoute);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  absl::SetProgramUsageMessage("Fake Internet for FlashRoute.");
+  absl::ParseCommandLine(argc, argv);
+  FLAGS_alsologtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+
+  uint32_t address = 0;
+  uint8_t prefixLength = 0;
+  uint32_t route = 0;
+  uint8_t routePrefixLength = 0;
+  if (!parsePrefix(absl::GetFlag(FLAGS_address), &address, &prefixLength) ||
+      !parsePrefix(absl::GetFlag(FLAGS_route), &route, &routePrefixLength)) {
+    LOG(FATAL) << "Malformed --address or --route.";
+  }
+
+  SimulatedRoutes routes;
+  if (!absl::GetFlag(FLAGS_topology).empty() &&
+      !routes.loadTopologyFile(absl::GetFlag(FLAGS_topology))) {
+    LOG(FATAL) << "Failed to load the topology.";
+  }
+  if (!absl::GetFlag(FLAGS_replay).empty()) {
+    loadReplay(absl::GetFlag(FLAGS_replay), &routes);
+  }
+  LOG(INFO) << "Loaded " << routes.size() << " routes.";
+
+  SimulatedNetworkConfig config;
+  config.seed = absl::GetFlag(FLAGS_seed);
+  config.localAddress = address;
+  config.lossRate = absl::GetFlag(FLAGS_loss_rate);
+  config.icmpRateLimit = absl::GetFlag(FLAGS_icmp_rate_limit);
+  config.routes = &routes;
+  SimulatedNetwork network(config);
+
+  std::string name = absl::GetFlag(FLAGS_tun);
+  int tun = openTun(name);
+  configureTun(name, address, prefixLength, route, routePrefixLength);
+  LOG(INFO) << "Answering probes routed into " << name << ".";
+
+  std::signal(SIGINT, signalHandler);
+  std::signal(SIGTERM, signalHandler);
+
+  // Replies are written back into the device when they are due.
+  std::atomic<uint64_t> writtenReplies(0);
+  std::thread replier([&network, &writtenReplies, tun]() {
+    std::vector<uint8_t> buffers(kReplyBatchSize * kTunBufferSize);
+    std::vector<ReceivedPacket> packets(kReplyBatchSize);
+    while (!stopped) {
+      size_t count =
+          network.receive(buffers.data(), kTunBufferSize, packets.data(),
+                          kReplyBatchSize, kReplyTimeoutMs);
+      for (size_t i = 0; i < count; i++) {
+        if (write(tun, packets[i].buffer, packets[i].size) > 0) {
+          writtenReplies.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    }
+  });
+
+  // Probes are read until interrupted. The reports show how evenly the
+  // sender paces them.
+  uint8_t buffer[kTunBufferSize];
+  uint64_t probes = 0;
+  uint64_t intervalProbes = 0;
+  int64_t maxGapUs = 0;
+  auto lastProbe = std::chrono::steady_clock::now();
+  auto lastReport = lastProbe;
+  auto reportInterval =
+      std::chrono::seconds(std::max(1, absl::GetFlag(FLAGS_report_interval)));
+  struct timeval timeout = {0, kReplyTimeoutMs * 1000};
+  while (!stopped) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(tun, &readable);
+    struct timeval wait = timeout;
+    if (select(tun + 1, &readable, nullptr, nullptr, &wait) > 0) {
+      ssize_t size = read(tun, buffer, sizeof(buffer));
+      if (size > 0) {
+        auto now = std::chrono::steady_clock::now();
+        if (intervalProbes > 0) {
+          maxGapUs = std::max<int64_t>(
+              maxGapUs, std::chrono::duration_cast<std::chrono::microseconds>(
+                            now - lastProbe)
+                            .count());
+        }
+        lastProbe = now;
+        intervalProbes += 1;
+        network.send(buffer, size);
+      }
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastReport >= reportInterval) {
+      double elapsed = std::chrono::duration<double>(now - lastReport).count();
+      SimulatedNetworkStats stats = network.getStats();
+      probes += intervalProbes;
+      LOG(INFO) << static_cast<uint64_t>(intervalProbes / elapsed)
+                << " probes/s, max gap " << maxGapUs << " us, "
+                << probes << " probes, " << writtenReplies << " replies, "
+                << stats.lostPackets << " lost, " << stats.rateLimitedReplies
+                << " rate-limited, " << stats.routerInterfaces
+                << " interfaces.";
+      intervalProbes = 0;
+      maxGapUs = 0;
+      lastReport = now;
+    }
+  }
+  replier.join();
+  close(tun);
+  return 0;
+}
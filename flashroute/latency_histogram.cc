@@ -0,0 +1,117 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/latency_histogram.h"
+
+#include <cmath>
+
+#include "flashroute/metrics.h"
+
+namespace flashroute {
+
+namespace {
+
+// Threads are spread over the shards by their metric slot.
+const uint32_t kHistogramShards = 8;
+const uint64_t kHistogramSubBuckets = 1 << kHistogramSubBucketBits;
+
+const char* const kPipelineStageNames[kPipelineStages] = {
+    "enqueue_to_send",  "pack_probe",     "send_call",
+    "receive_to_parse", "parse_callback", "dump_queue"};
+
+}  // namespace
+
+uint32_t getHistogramBucket(uint64_t value) {
+  if (value < kHistogramSubBuckets) return static_cast<uint32_t>(value);
+  uint32_t exponent = 63 - __builtin_clzll(value);
+  if (exponent >= kHistogramMaxExponent) return kHistogramBuckets - 1;
+  uint32_t shift = exponent - kHistogramSubBucketBits;
+  return ((shift + 1) << kHistogramSubBucketBits) +
+         static_cast<uint32_t>((value >> shift) & (kHistogramSubBuckets - 1));
+}
+
+uint64_t getHistogramBucketUpperBound(uint32_t bucket) {
+  if (bucket < kHistogramSubBuckets) return bucket;
+  uint32_t shift = (bucket >> kHistogramSubBucketBits) - 1;
+  uint64_t subBucket = bucket & (kHistogramSubBuckets - 1);
+  return ((kHistogramSubBuckets + subBucket + 1) << shift) - 1;
+}
+
+uint64_t HistogramSnapshot::getPercentile(double share) const {
+  if (count == 0) return 0;
+  uint64_t rank = static_cast<uint64_t>(std::ceil(share * count));
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < counts.size(); i++) {
+    seen += counts[i];
+    if (seen >= rank) return getHistogramBucketUpperBound(i);
+  }
+  return getHistogramBucketUpperBound(kHistogramBuckets - 1);
+}
+
+HistogramSnapshot HistogramSnapshot::since(
+    const HistogramSnapshot& earlier) const {
+  HistogramSnapshot interval = *this;
+  for (uint32_t i = 0; i < counts.size() && i < earlier.counts.size(); i++) {
+    interval.counts[i] -= earlier.counts[i];
+  }
+  interval.count -= earlier.count;
+  interval.sum -= earlier.sum;
+  return interval;
+}
+
+LatencyHistogram::LatencyHistogram() : shards_(new Shard[kHistogramShards]) {
+  for (uint32_t i = 0; i < kHistogramShards; i++) {
+    for (uint32_t j = 0; j < kHistogramBuckets; j++) {
+      shards_[i].counts[j].store(0, std::memory_order_relaxed);
+    }
+    shards_[i].sum.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::record(uint64_t value) {
+  Shard& shard = shards_[getMetricSlot() % kHistogramShards];
+  shard.counts[getHistogramBucket(value)].fetch_add(1,
+                                                    std::memory_order_relaxed);
+  shard.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+HistogramSnapshot LatencyHistogram::snapshot() const {
+  HistogramSnapshot snapshot;
+  snapshot.counts.assign(kHistogramBuckets, 0);
+  for (uint32_t i = 0; i < kHistogramShards; i++) {
+    for (uint32_t j = 0; j < kHistogramBuckets; j++) {
+      uint64_t count = shards_[i].counts[j].load(std::memory_order_relaxed);
+      snapshot.counts[j] += count;
+      snapshot.count += count;
+    }
+    snapshot.sum += shards_[i].sum.load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+const char* getPipelineStageName(PipelineStage stage) {
+  return kPipelineStageNames[static_cast<uint32_t>(stage)];
+}
+
+#ifdef FLASHROUTE_STAGE_TIMING
+
+LatencyHistogram* getStageHistogram(PipelineStage stage) {
+  static LatencyHistogram histograms[kPipelineStages];
+  return &histograms[static_cast<uint32_t>(stage)];
+}
+
+std::vector<HistogramSnapshot> snapshotStageHistograms() {
+  std::vector<HistogramSnapshot> snapshots;
+  for (uint32_t i = 0; i < kPipelineStages; i++) {
+    snapshots.push_back(
+        getStageHistogram(static_cast<PipelineStage>(i))->snapshot());
+  }
+  return snapshots;
+}
+
+#else
+
+std::vector<HistogramSnapshot> snapshotStageHistograms() { return {}; }
+
+#endif
+
+}  // namespace flashroute
@@ -0,0 +1,160 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Stage timing is compiled in unless FLASHROUTE_NO_STAGE_TIMING is defined,
+// e.g., bazel build --cxxopt="-DFLASHROUTE_NO_STAGE_TIMING" flashroute.
+#ifndef FLASHROUTE_NO_STAGE_TIMING
+#define FLASHROUTE_STAGE_TIMING
+#endif
+
+namespace flashroute {
+
+// Values below 8 have a bucket each, every power of two above is split into 8
+// buckets, so a bucket is at most 12.5% wide. Values from 2^40 ns (18 minutes)
+// on share the last bucket.
+const uint32_t kHistogramSubBucketBits = 3;
+const uint32_t kHistogramMaxExponent = 40;
+const uint32_t kHistogramBuckets =
+    (kHistogramMaxExponent - kHistogramSubBucketBits + 1)
+    << kHistogramSubBucketBits;
+
+uint32_t getHistogramBucket(uint64_t value);
+
+// The largest value of a bucket.
+uint64_t getHistogramBucketUpperBound(uint32_t bucket);
+
+// The counts of a histogram at some point in time.
+struct HistogramSnapshot {
+  std::vector<uint64_t> counts;
+  uint64_t count = 0;
+  uint64_t sum = 0;
+
+  // The upper bound of the bucket holding the given share (0 to 1) of the
+  // values, or 0 if there are none.
+  uint64_t getPercentile(double share) const;
+
+  uint64_t getMax() const { return getPercentile(1); }
+
+  double getMean() const {
+    return count == 0 ? 0 : static_cast<double>(sum) / count;
+  }
+
+  // The values recorded between an earlier snapshot of the same histogram and
+  // this one.
+  HistogramSnapshot since(const HistogramSnapshot& earlier) const;
+};
+
+/**
+ * LatencyHistogram counts durations in nanoseconds into logarithmic buckets,
+ * in the manner of HDR histograms. Recording is a relaxed atomic increment in
+ * one of a few shards, chosen by thread, so that concurrent threads rarely
+ * share a cache line.
+ *
+ * Example:
+ *
+ * LatencyHistogram histogram;
+ *
+ * // Any thread.
+ * histogram.record(elapsedNanoseconds);
+ *
+ * // Monitoring thread.
+ * HistogramSnapshot snapshot = histogram.snapshot();
+ * LOG(INFO) << snapshot.getPercentile(0.99);
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void record(uint64_t value);
+
+  HistogramSnapshot snapshot() const;
+
+ private:
+  struct Shard {
+    std::atomic<uint64_t> counts[kHistogramBuckets];
+    std::atomic<uint64_t> sum;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+};
+
+// The stages of the probing pipeline.
+// ENQUEUE_TO_SEND: a probe waits in the sending buffer of its shard.
+// PACK_PROBE: the prober packs a probe.
+// SEND_CALL: one call putting probes on wire, sendto or sendmmsg, or the flush
+// of a ring.
+// RECEIVE_TO_PARSE: from the return of a receive call to the end of parsing
+// the packets it returned, response callbacks included.
+// PARSE_CALLBACK: the tracerouter handles a response, waiting for its lock
+// included.
+// DUMP_QUEUE: a result waits in the dumping buffer.
+enum class PipelineStage {
+  ENQUEUE_TO_SEND,
+  PACK_PROBE,
+  SEND_CALL,
+  RECEIVE_TO_PARSE,
+  PARSE_CALLBACK,
+  DUMP_QUEUE
+};
+
+const uint32_t kPipelineStages = 6;
+
+const char* getPipelineStageName(PipelineStage stage);
+
+#ifdef FLASHROUTE_STAGE_TIMING
+
+const bool kStageTimingEnabled = true;
+
+// A point in time of the pipeline.
+class StageStamp {
+ public:
+  StageStamp() : time_(0) {}
+
+  static StageStamp now() {
+    StageStamp stamp;
+    stamp.time_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    return stamp;
+  }
+
+  int64_t getTime() const { return time_; }
+
+ private:
+  int64_t time_;
+};
+
+LatencyHistogram* getStageHistogram(PipelineStage stage);
+
+// Record the time from start to now in the histogram of the stage.
+inline void recordStage(PipelineStage stage, const StageStamp& start) {
+  int64_t elapsed = StageStamp::now().getTime() - start.getTime();
+  getStageHistogram(stage)->record(elapsed > 0 ? elapsed : 0);
+}
+
+#else
+
+const bool kStageTimingEnabled = false;
+
+// Compiled out: stamps are empty and nothing is recorded.
+class StageStamp {
+ public:
+  static StageStamp now() { return StageStamp(); }
+};
+
+inline void recordStage(PipelineStage stage, const StageStamp& start) {}
+
+#endif
+
+// Snapshots of the histograms of all stages, indexed by stage, or none if
+// stage timing is compiled out.
+std::vector<HistogramSnapshot> snapshotStageHistograms();
+
+}  // namespace flashroute
@@ -0,0 +1,64 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/latency_histogram.h"
+
+using namespace flashroute;
+
+TEST(LatencyHistogram, BucketTest) {
+  // Small values are exact.
+  for (uint64_t value = 0; value < 8; value++) {
+    EXPECT_EQ(getHistogramBucket(value), value);
+    EXPECT_EQ(getHistogramBucketUpperBound(value), value);
+  }
+  // Every value falls into the bucket which bounds it, within 12.5%.
+  for (uint64_t value = 8; value < (1ULL << 36); value = value * 3 / 2 + 1) {
+    uint32_t bucket = getHistogramBucket(value);
+    uint64_t upperBound = getHistogramBucketUpperBound(bucket);
+    EXPECT_GE(upperBound, value);
+    EXPECT_LE(upperBound - value, value / 8);
+    EXPECT_LT(getHistogramBucketUpperBound(bucket - 1), value);
+  }
+  EXPECT_EQ(getHistogramBucket(1ULL << 50), kHistogramBuckets - 1);
+}
+
+TEST(LatencyHistogram, PercentileTest) {
+  LatencyHistogram histogram;
+  for (uint64_t value = 1; value <= 100; value++) histogram.record(value);
+
+  HistogramSnapshot snapshot = histogram.snapshot();
+  EXPECT_EQ(snapshot.count, 100);
+  EXPECT_EQ(snapshot.sum, 5050);
+  EXPECT_DOUBLE_EQ(snapshot.getMean(), 50.5);
+  // Buckets of 48-51 and 96-103.
+  EXPECT_EQ(snapshot.getPercentile(0.5), 51);
+  EXPECT_EQ(snapshot.getMax(), 103);
+
+  for (uint32_t i = 0; i < 10; i++) histogram.record(1000);
+  HistogramSnapshot interval = histogram.snapshot().since(snapshot);
+  EXPECT_EQ(interval.count, 10);
+  EXPECT_EQ(interval.getPercentile(0.5), 1023);
+  EXPECT_EQ(HistogramSnapshot().getPercentile(0.99), 0);
+}
+
+TEST(LatencyHistogram, ConcurrentRecordTest) {
+  LatencyHistogram histogram;
+  const uint32_t kThreads = 16;
+  const uint64_t kRecords = 10000;
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < kThreads; i++) {
+    threads.emplace_back([&histogram, i]() {
+      for (uint64_t j = 0; j < kRecords; j++) histogram.record(i);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  HistogramSnapshot snapshot = histogram.snapshot();
+  EXPECT_EQ(snapshot.count, kThreads * kRecords);
+  for (uint32_t i = 0; i < kThreads; i++) {
+    EXPECT_GT(snapshot.counts[getHistogramBucket(i)], 0);
+  }
+}
@@ -2,6 +2,7 @@
 
 #include <csignal>
 #include <iostream>
+#include <memory>
 #include <unordered_map>
 #include <tuple>
 
@@ -17,6 +18,9 @@
 #include "flashroute/dcb_manager.h"
 #include "flashroute/hitlist.h"
 #include "flashroute/network.h"
+#include "flashroute/metrics.h"
+#include "flashroute/metrics_exporter.h"
+#include "flashroute/simulated_network.h"
 #include "flashroute/targets.h"
 #include "flashroute/traceroute.h"
 #include "flashroute/udp_prober.h"
@@ -53,6 +57,39 @@ ABSL_FLAG(
 
 ABSL_FLAG(std::string, interface, "", "Relay Interface.");
 ABSL_FLAG(int32_t, probing_rate, 400000, "Probing rate.");
+ABSL_FLAG(int32_t, sending_burst, 64,
+          "Max probes sent back-to-back at line rate. Probes are otherwise "
+          "evenly spaced at the probing rate.");
+ABSL_FLAG(int32_t, sending_threads, 1,
+          "The number of sending threads. Probes are sharded among them by "
+          "destination and each of them sends at an equal share of the "
+          "probing rate.");
+ABSL_FLAG(int32_t, receiving_threads, 1,
+          "The number of receiving threads. With more than one, responses are "
+          "spread among them by a PACKET_FANOUT group of packet sockets.");
+ABSL_FLAG(std::string, sending_backend, "raw",
+          "The backend to put probes on wire. Options: raw (one sendto per "
+          "probe), tx_ring (batched memory-mapped PACKET_TX_RING), sendmmsg "
+          "(batched sendmmsg on the raw socket), xdp (AF_XDP socket for both "
+          "sending and receiving), simulated (probes are answered in process "
+          "by a synthetic topology, IPv4 only).");
+ABSL_FLAG(std::string, receiving_backend, "raw",
+          "The backend to capture responses. Options: raw (one recv per "
+          "packet), rx_ring (memory-mapped TPACKET_V3 PACKET_RX_RING), "
+          "recvmmsg (batched recvmmsg on the raw socket). Ignored by xdp "
+          "sending backend.");
+ABSL_FLAG(std::string, timestamping, "none",
+          "The timestamps RTTs are computed from. Options: none (a 16-bit "
+          "millisecond clock encoded in probes), software (kernel timestamps "
+          "of probes and responses, SO_TIMESTAMPING), hardware (NIC "
+          "timestamps). RTTs are in microseconds with software and hardware "
+          "timestamps.");
+ABSL_FLAG(bool, response_filter, true,
+          "Attach a BPF filter to the receiving sockets which drops the "
+          "packets that are not responses to our probes in the kernel.");
+ABSL_FLAG(std::string, gateway_mac, "",
+          "MAC address of the gateway used by tx_ring and xdp backends. "
+          "Resolved from the ARP table if empty (IPv4 only).");
 ABSL_FLAG(std::string, default_payload_message,
           "flashroute",
           "Message embedded in payload of probe.");
@@ -92,6 +129,9 @@ ABSL_FLAG(std::string, bogon_filter_potaroo, "",
 ABSL_FLAG(std::string, output, "", "Output path.");
 
 ABSL_FLAG(std::string, tcpdump_output, "", "Tcpdump output path.");
+ABSL_FLAG(std::string, metrics_address, "",
+          "Serve the metrics of the scan in OpenMetrics text format over HTTP "
+          "on host:port or a Unix socket unix:path. Disabled if empty.");
 ABSL_FLAG(std::string, hitlist, "", "Hitlist filepath.");
 ABSL_FLAG(std::string, targets, "",
               "Target filepath.");
@@ -114,8 +154,18 @@ ABSL_FLAG(int32_t, seed, 0,
           "Seed for all randomization procedure: including destiantion "
           "generation and probing sequence.");
 
+ABSL_FLAG(int32_t, shards, 1,
+          "Split the targets into disjoint shards of a permutation derived "
+          "from the seed, e.g., one per host. Every host must use the same "
+          "seed and shard count.");
+ABSL_FLAG(int32_t, shard, 0, "The shard of the targets to scan, from 0.");
+
 ABSL_FLAG(int32_t, scan_count, 1, "Number of main scans.");
 
+ABSL_FLAG(int32_t, probe_interval, 1000,
+          "Minimum interval in milliseconds between two probes to the same "
+          "target. It should exceed the round trip time of the targets.");
+
 ABSL_FLAG(bool, randomize_address_in_extra_scans, false,
           "If set to true, addresses will be randomized in the extra scans. "
           "Otherwise, only port number will be randomized.");
@@ -164,6 +214,20 @@ void printFlags() {
                    (absl::GetFlag(FLAGS_sequential_scan) ? "true" : "false");
   VLOG(1) << boost::format("Probing rate: %|30t|%1% Packet Per Second") %
                    absl::GetFlag(FLAGS_probing_rate);
+  VLOG(1) << boost::format("Sending Burst: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_sending_burst);
+  VLOG(1) << boost::format("Sending Threads: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_sending_threads);
+  VLOG(1) << boost::format("Receiving Threads: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_receiving_threads);
+  VLOG(1) << boost::format("Sending Backend: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_sending_backend);
+  VLOG(1) << boost::format("Receiving Backend: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_receiving_backend);
+  VLOG(1) << boost::format("Timestamping: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_timestamping);
+  VLOG(1) << boost::format("Response Filter: %|30t|%1%") %
+                   absl::GetFlag(FLAGS_response_filter);
 
   VLOG(1) << " ========== Experiment Feature ========== ";
 
@@ -186,8 +250,12 @@ void printFlags() {
                    absl::GetFlag(FLAGS_split_ttl);
   VLOG(1) << boost::format("Random Seed: %|30t|%1%") %
                    absl::GetFlag(FLAGS_seed);
+  VLOG(1) << boost::format("Shard: %|30t|%1% of %2%") %
+                   absl::GetFlag(FLAGS_shard) % absl::GetFlag(FLAGS_shards);
   VLOG(1) << boost::format("Scan Count: %|30t|%1%") %
                    absl::GetFlag(FLAGS_scan_count);
+  VLOG(1) << boost::format("Probe Interval: %|30t|%1% ms") %
+                   absl::GetFlag(FLAGS_probe_interval);
   VLOG(1) << boost::format("Randomize address: %|30t|%1%") %
                  (absl::GetFlag(FLAGS_randomize_address_in_extra_scans)
                       ? "true"
@@ -200,6 +268,8 @@ void printFlags() {
   VLOG(1) << boost::format("Hitlist: %|15t|%1%") % absl::GetFlag(FLAGS_hitlist);
   VLOG(1) << boost::format("Target: %|15t|%1%") % absl::GetFlag(FLAGS_targets);
   VLOG(1) << boost::format("Output: %|15t|%1%") % absl::GetFlag(FLAGS_output);
+  VLOG(1) << boost::format("Metrics: %|15t|%1%") %
+                 absl::GetFlag(FLAGS_metrics_address);
   VLOG(1) << boost::format("Nonstop set: %|15t|%1%") % absl::GetFlag(FLAGS_nonstop_set_file);
 }
 
@@ -227,6 +297,57 @@ int main(int argc, char* argv[]) {
     LOG(FATAL) << "Unkown prober type.";
   }
 
+  SendingBackend sendingBackend = SendingBackend::RAW_SOCKET;
+  if (absl::GetFlag(FLAGS_sending_backend).compare("raw") == 0) {
+    sendingBackend = SendingBackend::RAW_SOCKET;
+  } else if (absl::GetFlag(FLAGS_sending_backend).compare("tx_ring") == 0) {
+    sendingBackend = SendingBackend::TX_RING;
+  } else if (absl::GetFlag(FLAGS_sending_backend).compare("sendmmsg") == 0) {
+    sendingBackend = SendingBackend::SENDMMSG;
+  } else if (absl::GetFlag(FLAGS_sending_backend).compare("xdp") == 0) {
+    sendingBackend = SendingBackend::XDP;
+  } else if (absl::GetFlag(FLAGS_sending_backend).compare("simulated") == 0) {
+    sendingBackend = SendingBackend::SIMULATED;
+  } else {
+    LOG(FATAL) << "Unkown sending backend.";
+  }
+
+  ReceivingBackend receivingBackend = ReceivingBackend::RAW_SOCKET;
+  if (absl::GetFlag(FLAGS_receiving_backend).compare("raw") == 0) {
+    receivingBackend = ReceivingBackend::RAW_SOCKET;
+  } else if (absl::GetFlag(FLAGS_receiving_backend).compare("rx_ring") == 0) {
+    receivingBackend = ReceivingBackend::RX_RING;
+  } else if (absl::GetFlag(FLAGS_receiving_backend).compare("recvmmsg") == 0) {
+    receivingBackend = ReceivingBackend::RECVMMSG;
+  } else {
+    LOG(FATAL) << "Unkown receiving backend.";
+  }
+
+  TimestampingMode timestampingMode = TimestampingMode::NONE;
+  if (absl::GetFlag(FLAGS_timestamping).compare("none") == 0) {
+    timestampingMode = TimestampingMode::NONE;
+  } else if (absl::GetFlag(FLAGS_timestamping).compare("software") == 0) {
+    timestampingMode = TimestampingMode::SOFTWARE;
+  } else if (absl::GetFlag(FLAGS_timestamping).compare("hardware") == 0) {
+    timestampingMode = TimestampingMode::HARDWARE;
+  } else {
+    LOG(FATAL) << "Unkown timestamping mode.";
+  }
+
+  if (absl::GetFlag(FLAGS_probe_interval) < 1) {
+    LOG(FATAL) << "The probe interval must be at least 1 ms.";
+  }
+
+  if (absl::GetFlag(FLAGS_sending_threads) < 1) {
+    LOG(FATAL) << "There must be at least 1 sending thread.";
+  }
+  if (absl::GetFlag(FLAGS_receiving_threads) < 1 ||
+      absl::GetFlag(FLAGS_receiving_threads) >
+          static_cast<int32_t>(kMaxReceivingThreads)) {
+    LOG(FATAL) << "The number of receiving threads must be between 1 and "
+               << kMaxReceivingThreads << ".";
+  }
+
   // gflags::ParseCommandLineFlags(&argc, &argv, true);
   // Get propositional parameters.
   std::string target = std::string(argv[argc - 1]);
@@ -276,10 +397,21 @@ int main(int argc, char* argv[]) {
 
     Targets targetLoader(absl::GetFlag(FLAGS_split_ttl), seed, &blacklist,
                          &bogonFilter);
+    int32_t shards = absl::GetFlag(FLAGS_shards);
+    int32_t shard = absl::GetFlag(FLAGS_shard);
+    if (shards < 1 || shard < 0 || shard >= shards) {
+      LOG(FATAL) << "The shard must be between 0 and " << shards - 1 << ".";
+    }
+    if (shards > 1 && absl::GetFlag(FLAGS_seed) == 0) {
+      LOG(FATAL) << "Sharding requires an explicit --seed shared by all "
+                    "shards.";
+    }
+    targetLoader.setShard(shards, shard);
 
     ResultDumper* resultDumper = nullptr;
     if (!absl::GetFlag(FLAGS_output).empty()) {
-      resultDumper = new ResultDumper(absl::GetFlag(FLAGS_output));
+      resultDumper = new ResultDumper(absl::GetFlag(FLAGS_output),
+                                      absl::GetFlag(FLAGS_receiving_threads));
     }
 
     // We enable course address finding capability for dcbmanager if either we
@@ -300,6 +432,13 @@ int main(int argc, char* argv[]) {
           target, static_cast<uint8_t>(absl::GetFlag(FLAGS_granularity)),
           enableCourseAddressFinding);
     }
+    if (dcbManager == nullptr) {
+      if (!absl::GetFlag(FLAGS_tcpdump_output).empty()) {
+        commandExecutor->stop();
+      }
+      if (resultDumper != nullptr) delete resultDumper;
+      return 1;
+    }
 
     // Learn route length from the history
     if (!absl::GetFlag(FLAGS_history_probing_result).empty()) {
@@ -314,8 +453,32 @@ int main(int argc, char* argv[]) {
       ipv4 = dcbManager->peek()->ipAddress->isIpv4();
     }
 
-    NetworkManager networkManager(NULL, finalInterface,
-                                  absl::GetFlag(FLAGS_probing_rate), ipv4);
+    // Declared first, so that it outlives the registered components.
+    MetricsRegistry metricsRegistry;
+    std::unique_ptr<SimulatedNetwork> simulatedNetwork;
+    std::unique_ptr<NetworkManager> networkManager;
+    if (sendingBackend == SendingBackend::SIMULATED) {
+      if (!ipv4) LOG(FATAL) << "Simulated network only supports IPv4.";
+      SimulatedNetworkConfig simulatedNetworkConfig;
+      simulatedNetworkConfig.seed = seed;
+      simulatedNetwork =
+          std::make_unique<SimulatedNetwork>(simulatedNetworkConfig);
+      networkManager = std::make_unique<NetworkManager>(
+          nullptr, simulatedNetwork.get(), absl::GetFlag(FLAGS_probing_rate),
+          absl::GetFlag(FLAGS_sending_burst),
+          absl::GetFlag(FLAGS_sending_threads),
+          absl::GetFlag(FLAGS_receiving_threads));
+    } else {
+      networkManager = std::make_unique<NetworkManager>(
+          nullptr, finalInterface, absl::GetFlag(FLAGS_probing_rate), ipv4,
+          sendingBackend, absl::GetFlag(FLAGS_gateway_mac), receivingBackend,
+          absl::GetFlag(FLAGS_sending_burst),
+          absl::GetFlag(FLAGS_sending_threads),
+          absl::GetFlag(FLAGS_receiving_threads));
+    }
+    networkManager->setTimestampingMode(timestampingMode);
+    networkManager->setResponseFiltering(absl::GetFlag(FLAGS_response_filter));
+    networkManager->registerMetrics(&metricsRegistry);
     NonstopSet* nonstopSet = nullptr;
     if (!absl::GetFlag(FLAGS_nonstop_set_file).empty()) {
       nonstopSet = new NonstopSet();
@@ -323,7 +486,7 @@ int main(int argc, char* argv[]) {
     }
 
     Tracerouter traceRouter(
-        dcbManager, &networkManager, resultDumper, nonstopSet,
+        dcbManager, networkManager.get(), resultDumper, nonstopSet,
         absl::GetFlag(FLAGS_split_ttl), absl::GetFlag(FLAGS_preprobing_ttl),
         absl::GetFlag(FLAGS_forward_probing), absl::GetFlag(FLAGS_gaplimit),
         absl::GetFlag(FLAGS_remove_redundancy), absl::GetFlag(FLAGS_preprobing),
@@ -332,8 +495,16 @@ int main(int argc, char* argv[]) {
         absl::GetFlag(FLAGS_src_port), absl::GetFlag(FLAGS_dst_port),
         absl::GetFlag(FLAGS_default_payload_message),
         absl::GetFlag(FLAGS_encode_timestamp), absl::GetFlag(FLAGS_ttl_offset),
-        absl::GetFlag(FLAGS_randomize_address_in_extra_scans));
+        absl::GetFlag(FLAGS_randomize_address_in_extra_scans),
+        absl::GetFlag(FLAGS_probe_interval));
     traceRouterPtr = &traceRouter;
+    traceRouter.setMetricsRegistry(&metricsRegistry);
+    // Stops serving before the registered components are destroyed.
+    std::unique_ptr<MetricsExporter> metricsExporter;
+    if (!absl::GetFlag(FLAGS_metrics_address).empty()) {
+      metricsExporter = std::make_unique<MetricsExporter>(
+          &metricsRegistry, absl::GetFlag(FLAGS_metrics_address));
+    }
 
     // Load hitlist.
     if (!absl::GetFlag(FLAGS_hitlist).empty()) {
@@ -353,6 +524,10 @@ int main(int argc, char* argv[]) {
 
     traceRouter.startScan(proberType, ipv4, false);
 
+    for (const MetricValue& metric : metricsRegistry.collect()) {
+      VLOG(1) << boost::format("%1%: %|40t|%2%") % metric.name % metric.value;
+    }
+
     // Terminate Tcpdump.
     if (!absl::GetFlag(FLAGS_tcpdump_output).empty()) {
       commandExecutor->stop();
@@ -0,0 +1,55 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/metrics.h"
+
+namespace flashroute {
+
+Counter::Counter() : slots_(new Slot[kMetricSlots]) {}
+
+uint64_t Counter::get() const {
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < kMetricSlots; i++) {
+    sum += slots_[i].value.load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+void Counter::reset() {
+  for (uint32_t i = 0; i < kMetricSlots; i++) {
+    slots_[i].value.store(0, std::memory_order_relaxed);
+  }
+}
+
+void MetricsRegistry::registerCounter(const std::string& name,
+                                      const std::string& help,
+                                      const Counter* counter) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  metrics_[name] = {help, MetricType::COUNTER, counter, nullptr};
+}
+
+void MetricsRegistry::registerGauge(const std::string& name,
+                                    const std::string& help,
+                                    const Gauge* gauge) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  metrics_[name] = {help, MetricType::GAUGE, nullptr, gauge};
+}
+
+void MetricsRegistry::remove(const std::string& name) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  metrics_.erase(name);
+}
+
+std::vector<MetricValue> MetricsRegistry::collect() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  std::vector<MetricValue> values;
+  values.reserve(metrics_.size());
+  for (const auto& metric : metrics_) {
+    int64_t value = metric.second.type == MetricType::COUNTER
+                        ? static_cast<int64_t>(metric.second.counter->get())
+                        : metric.second.gauge->get();
+    values.push_back(
+        {metric.first, metric.second.help, metric.second.type, value});
+  }
+  return values;
+}
+
+}  // namespace flashroute
@@ -0,0 +1,137 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace flashroute {
+
+// Number of slots of a counter. Every thread updates a slot of its own as
+// long as there are no more threads than slots.
+const uint32_t kMetricSlots = 64;
+
+// Index of the slot of the calling thread, assigned when the thread first
+// updates a counter.
+inline uint32_t getMetricSlot() {
+  static std::atomic<uint32_t> nextSlot(0);
+  static thread_local uint32_t slot =
+      nextSlot.fetch_add(1, std::memory_order_relaxed) % kMetricSlots;
+  return slot;
+}
+
+/**
+ * Counter counts events of many threads without contention: each thread adds
+ * to its own slot, padded to a cache line, with relaxed atomics, and reading
+ * the counter sums the slots. Reads are not synchronized with the updates,
+ * they see every update which happened before them and some of the
+ * concurrent ones.
+ *
+ * Example:
+ *
+ * Counter sentPackets;
+ *
+ * // Sending threads.
+ * sentPackets.add();
+ *
+ * // Monitoring thread.
+ * LOG(INFO) << sentPackets.get();
+ */
+class Counter {
+ public:
+  Counter();
+
+  void add(uint64_t value = 1) {
+    slots_[getMetricSlot()].value.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const;
+
+  // Set the counter to 0. No thread may update it meanwhile.
+  void reset();
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> value{0};
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+};
+
+/**
+ * Gauge is a value which goes up and down, e.g., the number of live
+ * destinations. It is a single relaxed atomic, so it suits values which are
+ * set from time to time rather than updated per packet.
+ */
+class Gauge {
+ public:
+  void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+
+  void add(int64_t delta) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  int64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+enum class MetricType { COUNTER, GAUGE };
+
+// The value of a metric when the registry was read.
+struct MetricValue {
+  std::string name;
+  std::string help;
+  MetricType type;
+  int64_t value;
+};
+
+/**
+ * MetricsRegistry names the counters and gauges of the running components,
+ * so that they can be read together. It does not own the metrics: a
+ * component registers its metrics, and registers them again or removes them
+ * before they are destroyed. Registering a name again replaces the metric;
+ * once it returns, no reader uses the replaced metric anymore.
+ *
+ * Example:
+ *
+ * MetricsRegistry registry;
+ * registry.registerCounter("flashroute_sent_packets", "Probes sent.",
+ *                          &sentPackets);
+ *
+ * for (const MetricValue& metric : registry.collect()) {
+ *   LOG(INFO) << metric.name << " " << metric.value;
+ * }
+ */
+class MetricsRegistry {
+ public:
+  void registerCounter(const std::string& name, const std::string& help,
+                       const Counter* counter);
+
+  void registerGauge(const std::string& name, const std::string& help,
+                     const Gauge* gauge);
+
+  void remove(const std::string& name);
+
+  // Read all metrics, ordered by name.
+  std::vector<MetricValue> collect() const;
+
+ private:
+  struct Metric {
+    std::string help;
+    MetricType type;
+    const Counter* counter;
+    const Gauge* gauge;
+  };
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Metric> metrics_;
+};
+
+}  // namespace flashroute
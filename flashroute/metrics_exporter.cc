@@ -0,0 +1,217 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/metrics_exporter.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include <boost/asio.hpp>
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "glog/logging.h"
+
+namespace flashroute {
+
+namespace {
+
+const char kUnixAddressPrefix[] = "unix:";
+const char kContentType[] =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+const int32_t kAcceptTimeoutMs = 100;  // Bounds the time to notice stop.
+const int32_t kClientTimeoutMs = 1000;  // A slow client cannot hold the
+                                        // thread for longer.
+const size_t kMaxRequestSize = 4096;
+const int kListenBacklog = 16;
+
+std::string escapeHelp(const std::string& help) {
+  std::string escaped;
+  for (char c : help) {
+    if (c == '\\') {
+      escaped += "\\\\";
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+bool writeAll(int socket, const std::string& data) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t written = send(socket, data.data() + offset, data.size() - offset,
+                           MSG_NOSIGNAL);
+    if (written <= 0) return false;
+    offset += written;
+  }
+  return true;
+}
+
+}  // namespace
+
+std::string formatOpenMetrics(const std::vector<MetricValue>& metrics) {
+  std::string result;
+  for (const MetricValue& metric : metrics) {
+    bool counter = metric.type == MetricType::COUNTER;
+    absl::StrAppend(&result, "# TYPE ", metric.name,
+                    counter ? " counter\n" : " gauge\n");
+    absl::StrAppend(&result, "# HELP ", metric.name, " ",
+                    escapeHelp(metric.help), "\n");
+    // Samples of counters carry the _total suffix.
+    absl::StrAppend(&result, metric.name, counter ? "_total " : " ",
+                    metric.value, "\n");
+  }
+  result += "# EOF\n";
+  return result;
+}
+
+MetricsExporter::MetricsExporter(const MetricsRegistry* registry,
+                                 const std::string& address)
+    : registry_(registry),
+      listeningSocket_(-1),
+      port_(0),
+      stopServing_(false) {
+  size_t prefixLength = strlen(kUnixAddressPrefix);
+  bool listening =
+      address.compare(0, prefixLength, kUnixAddressPrefix) == 0
+          ? listenUnix(address.substr(prefixLength))
+          : listenTcp(address);
+  if (!listening) {
+    LOG(FATAL) << "Metrics Exporter: Failed to listen on " << address
+               << ". Errno: " << errno;
+  }
+  threadPool_ = std::make_unique<boost::asio::thread_pool>(1);
+  boost::asio::post(*threadPool_.get(), [this]() { runServingThread(); });
+  if (socketPath_.empty()) {
+    LOG(INFO) << "Metrics Exporter: Serving metrics on port " << port_ << ".";
+  } else {
+    LOG(INFO) << "Metrics Exporter: Serving metrics on " << socketPath_
+              << ".";
+  }
+}
+
+MetricsExporter::~MetricsExporter() {
+  stopServing_ = true;
+  threadPool_->join();
+  close(listeningSocket_);
+  if (!socketPath_.empty()) unlink(socketPath_.c_str());
+  VLOG(2) << "Metrics Exporter: Exporter recycled.";
+}
+
+bool MetricsExporter::listenTcp(const std::string& address) {
+  size_t separator = address.rfind(':');
+  if (separator == std::string::npos) return false;
+  std::string host = address.substr(0, separator);
+  uint32_t port = 0;
+  struct sockaddr_in socketAddress;
+  memset(&socketAddress, 0, sizeof(socketAddress));
+  socketAddress.sin_family = AF_INET;
+  socketAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (!absl::SimpleAtoi(address.substr(separator + 1), &port) ||
+      port > 0xFFFF ||
+      (!host.empty() &&
+       inet_pton(AF_INET, host.c_str(), &socketAddress.sin_addr) != 1)) {
+    LOG(ERROR) << "Metrics Exporter: Malformed address " << address
+               << ", expected host:port or unix:path.";
+    return false;
+  }
+  socketAddress.sin_port = htons(static_cast<uint16_t>(port));
+
+  listeningSocket_ = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  if (listeningSocket_ < 0 ||
+      setsockopt(listeningSocket_, SOL_SOCKET, SO_REUSEADDR, &on,
+                 sizeof(on)) < 0 ||
+      bind(listeningSocket_, reinterpret_cast<struct sockaddr*>(&socketAddress),
+           sizeof(socketAddress)) < 0 ||
+      listen(listeningSocket_, kListenBacklog) < 0) {
+    return false;
+  }
+  socklen_t length = sizeof(socketAddress);
+  getsockname(listeningSocket_,
+              reinterpret_cast<struct sockaddr*>(&socketAddress), &length);
+  port_ = ntohs(socketAddress.sin_port);
+  return true;
+}
+
+bool MetricsExporter::listenUnix(const std::string& path) {
+  struct sockaddr_un socketAddress;
+  memset(&socketAddress, 0, sizeof(socketAddress));
+  socketAddress.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(socketAddress.sun_path)) {
+    LOG(ERROR) << "Metrics Exporter: Malformed Unix socket path " << path
+               << ".";
+    return false;
+  }
+  memcpy(socketAddress.sun_path, path.c_str(), path.size());
+  // Replace the socket left by an earlier run.
+  unlink(path.c_str());
+
+  listeningSocket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listeningSocket_ < 0 ||
+      bind(listeningSocket_, reinterpret_cast<struct sockaddr*>(&socketAddress),
+           sizeof(socketAddress)) < 0 ||
+      listen(listeningSocket_, kListenBacklog) < 0) {
+    return false;
+  }
+  socketPath_ = path;
+  return true;
+}
+
+void MetricsExporter::runServingThread() {
+  VLOG(2) << "Metrics Exporter: Serving thread initialized.";
+  struct pollfd listening = {listeningSocket_, POLLIN, 0};
+  while (!stopServing_) {
+    if (poll(&listening, 1, kAcceptTimeoutMs) <= 0) continue;
+    int client = accept(listeningSocket_, nullptr, nullptr);
+    if (client < 0) continue;
+    serveClient(client);
+    close(client);
+  }
+  VLOG(2) << "Metrics Exporter: Serving thread recycled.";
+}
+
+void MetricsExporter::serveClient(int client) {
+  struct timeval timeout;
+  timeout.tv_sec = kClientTimeoutMs / 1000;
+  timeout.tv_usec = (kClientTimeoutMs % 1000) * 1000;
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // Read the request up to the end of its headers, the body is ignored.
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < kMaxRequestSize) {
+    ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+    if (received <= 0) return;
+    request.append(buffer, received);
+  }
+
+  std::string requestLine = request.substr(0, request.find("\r\n"));
+  std::string status;
+  std::string contentType;
+  std::string body;
+  if (requestLine.compare(0, 13, "GET /metrics ") == 0 ||
+      requestLine.compare(0, 6, "GET / ") == 0) {
+    status = "200 OK";
+    contentType = kContentType;
+    body = formatOpenMetrics(registry_->collect());
+  } else {
+    status = "404 Not Found";
+    contentType = "text/plain; charset=utf-8";
+    body = "Metrics are served at /metrics.\n";
+  }
+  writeAll(client, absl::StrCat("HTTP/1.1 ", status,
+                                "\r\nContent-Type: ", contentType,
+                                "\r\nContent-Length: ", body.size(),
+                                "\r\nConnection: close\r\n\r\n", body));
+}
+
+}  // namespace flashroute
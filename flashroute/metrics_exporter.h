@@ -0,0 +1,66 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/thread_pool.hpp>
+
+#include "flashroute/metrics.h"
+
+namespace flashroute {
+
+// Render metrics in the OpenMetrics text format, terminated by "# EOF".
+std::string formatOpenMetrics(const std::vector<MetricValue>& metrics);
+
+/**
+ * MetricsExporter serves the metrics of a registry over HTTP in the
+ * OpenMetrics text format, so that a Prometheus server can scrape a running
+ * scan. It listens on a TCP address or a Unix socket and answers one request
+ * at a time on its own thread. Serving only reads the counters and gauges, so
+ * it never blocks the sending and receiving threads.
+ *
+ * Example:
+ *
+ * MetricsExporter exporter(
+ *    &registry,
+ *    "127.0.0.1:9100"  // Or "unix:/run/flashroute.sock".
+ * );
+ *
+ * // curl http://127.0.0.1:9100/metrics
+ * // curl --unix-socket /run/flashroute.sock http://localhost/metrics
+ */
+class MetricsExporter {
+ public:
+  MetricsExporter(const MetricsRegistry* registry, const std::string& address);
+
+  ~MetricsExporter();
+
+  // The TCP port listened on, e.g., when port 0 was requested, or 0 for a
+  // Unix socket.
+  uint16_t getPort() const { return port_; }
+
+ private:
+  const MetricsRegistry* registry_;
+  int listeningSocket_;
+  uint16_t port_;
+  // Path of the Unix socket, removed on destruction.
+  std::string socketPath_;
+
+  std::atomic<bool> stopServing_;
+  std::unique_ptr<boost::asio::thread_pool> threadPool_;
+
+  bool listenTcp(const std::string& address);
+
+  bool listenUnix(const std::string& path);
+
+  void runServingThread();
+
+  // Read one request from the client and answer it.
+  void serveClient(int client);
+};
+
+}  // namespace flashroute
@@ -0,0 +1,102 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/metrics_exporter.h"
+
+using namespace flashroute;
+
+namespace {
+
+// Send a request over a connected socket and return the whole response.
+std::string fetch(int client, const std::string& request) {
+  send(client, request.data(), request.size(), 0);
+  std::string response;
+  char buffer[1024];
+  ssize_t received;
+  while ((received = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, received);
+  }
+  close(client);
+  return response;
+}
+
+}  // namespace
+
+TEST(MetricsExporter, FormatTest) {
+  std::vector<MetricValue> metrics = {
+      {"flashroute_live_destinations", "Live.", MetricType::GAUGE, 12},
+      {"flashroute_sent_packets", "Sent\nprobes.", MetricType::COUNTER, 3}};
+  EXPECT_EQ(formatOpenMetrics(metrics),
+            "# TYPE flashroute_live_destinations gauge\n"
+            "# HELP flashroute_live_destinations Live.\n"
+            "flashroute_live_destinations 12\n"
+            "# TYPE flashroute_sent_packets counter\n"
+            "# HELP flashroute_sent_packets Sent\\nprobes.\n"
+            "flashroute_sent_packets_total 3\n"
+            "# EOF\n");
+}
+
+TEST(MetricsExporter, ServeTest) {
+  MetricsRegistry registry;
+  Counter sentPackets;
+  sentPackets.add(7);
+  registry.registerCounter("flashroute_sent_packets", "Sent.", &sentPackets);
+
+  // TCP on a port chosen by the kernel.
+  {
+    MetricsExporter exporter(&registry, "127.0.0.1:0");
+    ASSERT_NE(exporter.getPort(), 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(exporter.getPort());
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(client, reinterpret_cast<struct sockaddr*>(&address),
+                      sizeof(address)),
+              0);
+    std::string response =
+        fetch(client, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    EXPECT_EQ(response.find("HTTP/1.1 200 OK\r\n"), 0);
+    EXPECT_NE(response.find("application/openmetrics-text"),
+              std::string::npos);
+    EXPECT_NE(response.find("\r\n\r\n# TYPE flashroute_sent_packets counter"),
+              std::string::npos);
+    EXPECT_NE(response.find("flashroute_sent_packets_total 7\n# EOF\n"),
+              std::string::npos);
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(client, reinterpret_cast<struct sockaddr*>(&address),
+                      sizeof(address)),
+              0);
+    response = fetch(client, "GET /other HTTP/1.1\r\n\r\n");
+    EXPECT_EQ(response.find("HTTP/1.1 404 Not Found\r\n"), 0);
+  }
+
+  // Unix socket, which reads the counters at the time of the request.
+  std::string path = "/tmp/flashroute_metrics_exporter_test.sock";
+  MetricsExporter exporter(&registry, "unix:" + path);
+  EXPECT_EQ(exporter.getPort(), 0);
+  sentPackets.add(1);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_EQ(connect(client, reinterpret_cast<struct sockaddr*>(&address),
+                    sizeof(address)),
+            0);
+  std::string response = fetch(client, "GET /metrics HTTP/1.0\r\n\r\n");
+  EXPECT_NE(response.find("flashroute_sent_packets_total 8\n"),
+            std::string::npos);
+}
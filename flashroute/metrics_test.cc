@@ -0,0 +1,67 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/metrics.h"
+
+using namespace flashroute;
+
+TEST(Counter, ConcurrentAddTest) {
+  Counter counter;
+  // More threads than slots, so that some of them share a slot.
+  const uint32_t kThreads = kMetricSlots + 8;
+  const uint64_t kAdds = 10000;
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < kThreads; i++) {
+    threads.emplace_back([&counter]() {
+      for (uint64_t j = 0; j < kAdds; j++) counter.add();
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_EQ(counter.get(), kThreads * kAdds);
+
+  counter.add(5);
+  EXPECT_EQ(counter.get(), kThreads * kAdds + 5);
+  counter.reset();
+  EXPECT_EQ(counter.get(), 0);
+}
+
+TEST(MetricsRegistry, CollectTest) {
+  MetricsRegistry registry;
+  Counter sentPackets;
+  Counter receivedPackets;
+  Gauge liveDestinations;
+  sentPackets.add(3);
+  receivedPackets.add(2);
+  liveDestinations.set(7);
+  liveDestinations.add(-1);
+
+  registry.registerCounter("sent", "Sent.", &sentPackets);
+  registry.registerCounter("received", "Received.", &receivedPackets);
+  registry.registerGauge("live", "Live.", &liveDestinations);
+
+  std::vector<MetricValue> values = registry.collect();
+  ASSERT_EQ(values.size(), 3);
+  // Ordered by name.
+  EXPECT_EQ(values[0].name, "live");
+  EXPECT_EQ(values[0].type, MetricType::GAUGE);
+  EXPECT_EQ(values[0].value, 6);
+  EXPECT_EQ(values[1].name, "received");
+  EXPECT_EQ(values[1].value, 2);
+  EXPECT_EQ(values[2].name, "sent");
+  EXPECT_EQ(values[2].help, "Sent.");
+  EXPECT_EQ(values[2].type, MetricType::COUNTER);
+  EXPECT_EQ(values[2].value, 3);
+
+  // Registering a name again replaces the metric.
+  Counter resentPackets;
+  resentPackets.add(9);
+  registry.registerCounter("sent", "Sent.", &resentPackets);
+  registry.remove("live");
+  values = registry.collect();
+  ASSERT_EQ(values.size(), 2);
+  EXPECT_EQ(values[1].name, "sent");
+  EXPECT_EQ(values[1].value, 9);
+}
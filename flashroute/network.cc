@@ -1,15 +1,25 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #include "flashroute/network.h"
 
+#include <net/if.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <thread>
 
 #include "glog/logging.h"
 #include <boost/asio.hpp>
 #include <boost/circular_buffer.hpp>
 
-#include "flashroute/bounded_buffer.h"
 #include "flashroute/prober.h"
+#include "flashroute/udp_idempotent_prober.h"
+#include "flashroute/udp_prober.h"
+#include "flashroute/udp_prober_v6.h"
 #include "flashroute/utils.h"
 
 namespace flashroute {
@@ -20,18 +30,75 @@ const uint16_t kReceivingBufferSize =
     2000;  // Default receiving buffer size which will be used to store received
            // packets.
 const uint32_t kThreadPoolSize = 4;  // Default thread pool size.
+const uint32_t kTxRingFlushBatchSize = 256;  // Frames to pack before flushing
+                                             // PACKET_TX_RING.
+const uint32_t kSendingBatchSize = 64;  // Max probes sent by one sendmmsg.
+const uint32_t kSendingBatchMaxRetries = 100;  // Retries of a batch when the
+                                               // kernel runs out of buffers.
+const uint32_t kReceivingBatchSize = 64;  // Max packets read by one recvmmsg.
+const std::chrono::microseconds kIdleTimeout(1000);  // Bounds the time to
+                                                     // notice stopListening().
+const int32_t kReceivingTimeoutMs = 100;  // Bounds the time for ring and
+                                          // fanout receivers to notice
+                                          // stopListening().
+const size_t kProbeTimestampSlots = 1 << 20;  // Outnumbers the probes in
+                                              // flight at 100 Kpps.
+const uint32_t kTransmitTimestampInterval = 64;  // Probes sent between two
+                                                 // reads of transmit
+                                                 // timestamps.
+
+// Index of the receiving thread which runs on this thread.
+thread_local uint32_t currentReceiverIndex = 0;
+
+// The probe unit and the sending buffer of a shard for an address family.
+template <class AddressT>
+struct ProbeUnitTraits;
+
+template <>
+struct ProbeUnitTraits<Ipv4Address> {
+  typedef ProbeUnitIpv4 Unit;
+  static SpscRing<Unit>* getBuffer(SendingShard* shard) {
+    return shard->buffer.get();
+  }
+  static uint64_t getKey(const Ipv4Address& address) {
+    return getDestinationKey(address.getIpv4Address());
+  }
+};
+
+template <>
+struct ProbeUnitTraits<Ipv6Address> {
+  typedef ProbeUnitIpv6 Unit;
+  static SpscRing<Unit>* getBuffer(SendingShard* shard) {
+    return shard->buffer6.get();
+  }
+  static uint64_t getKey(const Ipv6Address& address) {
+    return getDestinationKey(address.getIpv6Address());
+  }
+};
 
 NetworkManager::NetworkManager(Prober* prober, const std::string& interface,
-                               const uint64_t sendingRate, const bool ipv4)
+                               const uint64_t sendingRate, const bool ipv4,
+                               const SendingBackend sendingBackend,
+                               const std::string& gatewayMac,
+                               const ReceivingBackend receivingBackend,
+                               const uint32_t sendingBurstSize,
+                               const uint32_t sendingThreads,
+                               const uint32_t receivingThreads)
     : prober_(prober),
       ipv4_(ipv4),
+      mainReceivingSocket_(-1),
+      sendingBackend_(sendingBackend),
+      simulatedNetwork_(nullptr),
+      receivingBackend_(receivingBackend),
+      receivingThreads_(std::min(std::max<uint32_t>(1, receivingThreads),
+                                 kMaxReceivingThreads)),
+      timestampingMode_(TimestampingMode::NONE),
+      responseFiltering_(true),
       interface_(interface),
       stopReceiving_(false),
       expectedRate_(static_cast<double>(sendingRate)),
-      sentPackets_(0),
-      receivedPackets_(0) {
-  createRawSocket();
-
+      sendingBurstSize_(sendingBurstSize),
+      sendingThreads_(std::max<uint32_t>(1, sendingThreads)) {
   if (!interface.empty()) {
     localIpAddress_ = std::unique_ptr<IpAddress>(
         parseIpFromStringToIpAddress(getAddressByInterface(interface, ipv4_)));
@@ -39,14 +106,82 @@ NetworkManager::NetworkManager(Prober* prober, const std::string& interface,
     LOG(FATAL) << "Network Module: Local address is not configured.";
   }
 
-  // Initialize sending buffer
-  if (ipv4_) {
-    sendingBuffer_ =
-        std::make_unique<BoundedBuffer<ProbeUnitIpv4>>(expectedRate_);
-  } else {
-    sendingBuffer6_ =
-        std::make_unique<BoundedBuffer<ProbeUnitIpv6>>(expectedRate_);
+  uint8_t gatewayMacAddress[ETH_ALEN];
+  if (sendingBackend_ == SendingBackend::TX_RING ||
+      sendingBackend_ == SendingBackend::XDP) {
+    resolveGatewayMac(gatewayMac, gatewayMacAddress);
+  }
+  if (sendingBackend_ == SendingBackend::XDP) {
+    if (sendingThreads_ > 1) {
+      LOG(WARNING) << "Network Module: AF_XDP backend binds a single queue, "
+                      "only one sending thread is used.";
+      sendingThreads_ = 1;
+    }
+    if (receivingThreads_ > 1) {
+      LOG(WARNING) << "Network Module: AF_XDP backend binds a single queue, "
+                      "only one receiving thread is used.";
+      receivingThreads_ = 1;
+    }
+    createXdpSocket(gatewayMacAddress);
+  }
+  if (sendingBackend_ == SendingBackend::SENDMMSG) {
+    createBatchAddresses();
+  }
+  createSendingShards(gatewayMacAddress);
+}
+
+NetworkManager::NetworkManager(Prober* prober,
+                               SimulatedNetwork* simulatedNetwork,
+                               const uint64_t sendingRate,
+                               const uint32_t sendingBurstSize,
+                               const uint32_t sendingThreads,
+                               const uint32_t receivingThreads)
+    : prober_(prober),
+      localIpAddress_(
+          std::make_unique<Ipv4Address>(simulatedNetwork->getLocalAddress())),
+      ipv4_(true),
+      mainReceivingSocket_(-1),
+      sendingBackend_(SendingBackend::SIMULATED),
+      simulatedNetwork_(simulatedNetwork),
+      receivingBackend_(ReceivingBackend::RAW_SOCKET),
+      receivingThreads_(std::min(std::max<uint32_t>(1, receivingThreads),
+                                 kMaxReceivingThreads)),
+      timestampingMode_(TimestampingMode::NONE),
+      responseFiltering_(true),
+      stopReceiving_(false),
+      expectedRate_(static_cast<double>(sendingRate)),
+      sendingBurstSize_(sendingBurstSize),
+      sendingThreads_(std::max<uint32_t>(1, sendingThreads)) {
+  createSendingShards(nullptr);
+}
+
+void NetworkManager::createSendingShards(const uint8_t* gatewayMacAddress) {
+  // Initialize sending shards. Each of them has its own socket and buffer.
+  for (uint32_t i = 0; i < sendingThreads_; i++) {
+    std::unique_ptr<SendingShard> shard = std::make_unique<SendingShard>();
+    if (sendingBackend_ == SendingBackend::TX_RING) {
+      createTxRing(shard.get(), gatewayMacAddress);
+    } else if (sendingBackend_ != SendingBackend::XDP &&
+               sendingBackend_ != SendingBackend::SIMULATED) {
+      createRawSocket(shard.get());
+    }
+    if (sendingBackend_ == SendingBackend::SENDMMSG) {
+      createBatchBuffers(shard.get());
+    }
+    shard->packetBuffer.assign(kPacketBufferSize, 0);
+
+    // Initialize sending buffer
+    if (ipv4_) {
+      shard->buffer = std::make_unique<SpscRing<ProbeUnitIpv4>>(
+          expectedRate_ / sendingThreads_);
+    } else {
+      shard->buffer6 = std::make_unique<SpscRing<ProbeUnitIpv6>>(
+          expectedRate_ / sendingThreads_);
+    }
+    sendingShards_.push_back(std::move(shard));
   }
+  VLOG(2) << "Network Module: " << sendingThreads_
+          << " sending threads initialized.";
 
   if (expectedRate_ < 1) {
     VLOG(2) << "Network Module: Sendg rate limit is disabled since expected "
@@ -57,63 +192,260 @@ NetworkManager::NetworkManager(Prober* prober, const std::string& interface,
 
 NetworkManager::~NetworkManager() {
   stopListening();
-  close(sendingSocket_);
+  for (auto& shard : sendingShards_) {
+    if (shard->socket >= 0) {
+      close(shard->socket);
+    }
+  }
 }
 
 void NetworkManager::resetProber(Prober* prober) {
   prober_ = prober;
+  if (prober_ != nullptr) prober_->setProbeTimestamps(probeTimestamps_.get());
 }
 
-void NetworkManager::probeRemoteHost(const IpAddress& destinationIp,
+void NetworkManager::setTimestampingMode(TimestampingMode mode) {
+  if (mode == TimestampingMode::HARDWARE &&
+      (sendingBackend_ == SendingBackend::TX_RING ||
+       sendingBackend_ == SendingBackend::XDP ||
+       sendingBackend_ == SendingBackend::SIMULATED ||
+       !enableHardwareTimestamping(interface_))) {
+    LOG(WARNING) << "Network Module: Hardware timestamps are unavailable, "
+                    "fall back to software timestamps.";
+    mode = TimestampingMode::SOFTWARE;
+  }
+  timestampingMode_ = mode;
+  if (mode == TimestampingMode::NONE) {
+    probeTimestamps_.reset();
+  } else {
+    probeTimestamps_ = std::make_unique<ProbeTimestamps>(kProbeTimestampSlots);
+  }
+  if (hasKernelTransmitTimestamps()) {
+    for (auto& shard : sendingShards_) {
+      enableSocketTimestamping(shard->socket, mode, true);
+    }
+  }
+  resetProber(prober_);
+}
+
+void NetworkManager::setResponseFiltering(bool enabled) {
+  responseFiltering_ = enabled;
+}
+
+void NetworkManager::updateResponseFilter() {
+  ResponseFilter filter;
+  if (!responseFiltering_ || prober_ == nullptr ||
+      !prober_->getResponseFilter(&filter)) {
+    return;
+  }
+  if (mainReceivingSocket_ >= 0) {
+    attachResponseFilter(mainReceivingSocket_, filter);
+  }
+  for (int fanoutSocket : fanoutSockets_) {
+    attachResponseFilter(fanoutSocket, filter);
+  }
+  for (auto& rxRing : rxRings_) {
+    rxRing->setResponseFilter(filter);
+  }
+}
+
+bool NetworkManager::hasKernelTransmitTimestamps() const {
+  return timestampingMode_ != TimestampingMode::NONE &&
+         (sendingBackend_ == SendingBackend::RAW_SOCKET ||
+          sendingBackend_ == SendingBackend::SENDMMSG);
+}
+
+void NetworkManager::readTransmitTimestamps(SendingShard* shard) {
+  if (hasKernelTransmitTimestamps()) {
+    probeTimestamps_->readTransmitTimestamps(shard->socket, timestampingMode_);
+  }
+}
+
+template <class ProberT, class AddressT>
+void NetworkManager::probeRemoteHost(SendingShard* shard, ProberT* prober,
+                                     const AddressT& destinationIp,
+                                     const AddressT& sourceIp,
                                      const uint8_t ttl) {
-  static uint8_t buffer[kPacketBufferSize];
-  size_t packetSize =
-      prober_->packProbe(destinationIp, *localIpAddress_, ttl, buffer);
+  if (probeTimestamps_ != nullptr && !hasKernelTransmitTimestamps()) {
+    // The backend does not report when the probe leaves, take the time it is
+    // packed.
+    probeTimestamps_->record(ProbeUnitTraits<AddressT>::getKey(destinationIp),
+                             ttl, getRealtimeNanoseconds());
+  }
+  if (sendingBackend_ == SendingBackend::TX_RING) {
+    // Pack the probe directly into the frame of ring.
+    uint8_t* frame = shard->txRing->acquireFrame();
+    StageStamp packing = StageStamp::now();
+    size_t packetSize = prober->packProbe(destinationIp, sourceIp, ttl, frame);
+    recordStage(PipelineStage::PACK_PROBE, packing);
+    shard->txRing->commitFrame(packetSize);
+    if (shard->txRing->pendingFrames() >= kTxRingFlushBatchSize) {
+      flushTxRing(shard);
+    }
+    return;
+  }
+  if (sendingBackend_ == SendingBackend::XDP) {
+    uint8_t* frame = xdpSocket_->acquireFrame();
+    StageStamp packing = StageStamp::now();
+    size_t packetSize = prober->packProbe(destinationIp, sourceIp, ttl, frame);
+    recordStage(PipelineStage::PACK_PROBE, packing);
+    xdpSocket_->commitFrame(packetSize);
+    if (xdpSocket_->pendingFrames() >= kTxRingFlushBatchSize) {
+      flushTxRing(shard);
+    }
+    return;
+  }
+
+  uint8_t* buffer = shard->packetBuffer.data();
+  StageStamp packing = StageStamp::now();
+  size_t packetSize = prober->packProbe(destinationIp, sourceIp, ttl, buffer);
+  recordStage(PipelineStage::PACK_PROBE, packing);
 
-  sendRawPacket(buffer, packetSize);
+  sendRawPacket(shard, buffer, packetSize);
+}
+
+SendingShard* NetworkManager::getSendingShard(uint64_t destinationKey) {
+  if (sendingShards_.size() == 1) return sendingShards_[0].get();
+  // Fibonacci hashing spreads adjacent addresses over all shards.
+  uint64_t key = (destinationKey * 0x9E3779B97F4A7C15ULL) >> 32;
+  return sendingShards_[key % sendingShards_.size()].get();
+}
+
+uint32_t getReceiverIndex() { return currentReceiverIndex; }
+
+template <class AddressT>
+const AddressT& NetworkManager::getLocalAddress() const {
+  return static_cast<const AddressT&>(*localIpAddress_);
 }
 
 void NetworkManager::scheduleProbeRemoteHost(const IpAddress& destinationIp,
                                              const uint8_t ttl) {
+  if (destinationIp.isIpv4()) {
+    scheduleProbeRemoteHost(dynamic_cast<const Ipv4Address&>(destinationIp),
+                            ttl);
+  } else {
+    scheduleProbeRemoteHost(dynamic_cast<const Ipv6Address&>(destinationIp),
+                            ttl);
+  }
+}
+
+void NetworkManager::scheduleProbeRemoteHost(const Ipv4Address& destinationIp,
+                                             const uint8_t ttl) {
+  scheduleProbe(destinationIp,
+                ProbeUnitTraits<Ipv4Address>::getKey(destinationIp), ttl);
+}
+
+void NetworkManager::scheduleProbeRemoteHost(const Ipv6Address& destinationIp,
+                                             const uint8_t ttl) {
+  scheduleProbe(destinationIp,
+                ProbeUnitTraits<Ipv6Address>::getKey(destinationIp), ttl);
+}
+
+template <class AddressT>
+void NetworkManager::scheduleProbe(const AddressT& destinationIp,
+                                   uint64_t destinationKey, const uint8_t ttl) {
+  // Probes to the same destination always go through the same shard, so
+  // they are sent in the scheduled order.
+  SendingShard* shard = getSendingShard(destinationKey);
   if (expectedRate_ >= 1) {
-    if (destinationIp.isIpv4()) {
-      ProbeUnitIpv4 tmp(dynamic_cast<const Ipv4Address&>(destinationIp), ttl);
-      sendingBuffer_->pushFront(tmp);
-    } else {
-      // TODO(neohuang): handle IPv6.
-      ProbeUnitIpv6 tmp(dynamic_cast<const Ipv6Address&>(destinationIp), ttl);
-      sendingBuffer6_->pushFront(tmp);
-    }
+    typename ProbeUnitTraits<AddressT>::Unit unit(destinationIp, ttl);
+    unit.enqueued = StageStamp::now();
+    ProbeUnitTraits<AddressT>::getBuffer(shard)->pushFront(unit);
   } else {
     // if we disable rate limit.
-    probeRemoteHost(destinationIp, ttl);
+    probeRemoteHost(shard, prober_, destinationIp,
+                    getLocalAddress<AddressT>(), ttl);
+    if (sendingBackend_ == SendingBackend::TX_RING ||
+        sendingBackend_ == SendingBackend::XDP) {
+      flushTxRing(shard);
+    }
+    readTransmitTimestamps(shard);
   }
 }
 
 void NetworkManager::startListening() {
   stopReceiving_ = false;
-  createIcmpSocket();
-
-  threadPool_.reset(new boost::asio::thread_pool(kThreadPoolSize));
-  // Initialize sending thread. Sending thread is to drain the sending buffer
-  // and put the packet on wire.
-  boost::asio::post(*threadPool_.get(), [this]() { runSendingThread(); });
-
-  boost::asio::post(*threadPool_.get(), [this]() { receiveIcmpPacket(); });
+  // Group id of the fanout sockets, unique among the running instances.
+  uint16_t fanoutGroup = static_cast<uint16_t>(getpid() & 0xFFFF);
+  // XDP and SIMULATED backends receive responses from their own socket or
+  // network.
+  if (sendingBackend_ != SendingBackend::XDP &&
+      sendingBackend_ != SendingBackend::SIMULATED) {
+    if (receivingBackend_ == ReceivingBackend::RX_RING) {
+      for (uint32_t i = 0; i < receivingThreads_; i++) {
+        rxRings_.push_back(std::make_unique<PacketRxRing>(
+            interface_, ipv4_, receivingThreads_ > 1 ? fanoutGroup : 0));
+        if (timestampingMode_ == TimestampingMode::HARDWARE) {
+          rxRings_.back()->enableHardwareTimestamps();
+        }
+      }
+    } else if (receivingThreads_ > 1) {
+      createFanoutSockets(fanoutGroup);
+    } else {
+      createIcmpSocket();
+    }
+    updateResponseFilter();
+  }
+  threadPool_.reset(new boost::asio::thread_pool(std::max<uint32_t>(
+      kThreadPoolSize, sendingThreads_ + receivingThreads_)));
+  startSendingThreads();
+  startReceivingThreads();
 
   VLOG(2) << "Network Module: Start capturing incoming ICMP packets.";
 }
 
+void NetworkManager::startReceivingThreads() {
+  // Every receiving thread takes its index before it runs its loop, so the
+  // response callbacks know which thread they run on.
+  auto receiver = [this](uint32_t receiverIndex,
+                         std::function<void()> receivingLoop) {
+    boost::asio::post(*threadPool_.get(), [receiverIndex, receivingLoop]() {
+      currentReceiverIndex = receiverIndex;
+      receivingLoop();
+    });
+  };
+  if (sendingBackend_ == SendingBackend::XDP) {
+    receiver(0, [this]() { receiveXdpPacket(); });
+  } else if (sendingBackend_ == SendingBackend::SIMULATED) {
+    for (uint32_t i = 0; i < receivingThreads_; i++) {
+      receiver(i, [this]() { receiveSimulatedPacket(); });
+    }
+  } else if (receivingBackend_ == ReceivingBackend::RX_RING) {
+    for (uint32_t i = 0; i < receivingThreads_; i++) {
+      receiver(i, [this, i]() { receiveRxRingPacket(i); });
+    }
+  } else if (receivingThreads_ > 1) {
+    for (uint32_t i = 0; i < receivingThreads_; i++) {
+      receiver(i, [this, i]() { receiveFanoutPacket(i); });
+    }
+  } else if (receivingBackend_ == ReceivingBackend::RECVMMSG) {
+    receiver(0, [this]() { receiveIcmpPacketBatch(); });
+  } else {
+    receiver(0, [this]() { receiveIcmpPacket(); });
+  }
+}
+
 void NetworkManager::stopListening() {
-  if (mainReceivingSocket_ != 0) {
+  if (mainReceivingSocket_ >= 0) {
     shutdown(mainReceivingSocket_, SHUT_RDWR);
-    {
-      std::lock_guard<std::mutex> guard(stopReceivingMutex_);
-      stopReceiving_ = true;
-    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(stopReceivingMutex_);
+    stopReceiving_ = true;
+  }
+  if (threadPool_ != nullptr) {
     threadPool_->join();
+    threadPool_.reset();
+  }
+  if (mainReceivingSocket_ >= 0) {
     close(mainReceivingSocket_);
+    mainReceivingSocket_ = -1;
   }
+  for (int fanoutSocket : fanoutSockets_) {
+    close(fanoutSocket);
+  }
+  fanoutSockets_.clear();
+  rxRings_.clear();
   VLOG(2) << "Network Module: All working threads are recycled.";
 }
 
@@ -158,28 +490,70 @@ bool NetworkManager::createIcmpSocket() {
   } else {
     VLOG(2) << "Network Module: Receiving buffer has been set to " << bufsize;
   }
+  // The Ipv6 packet socket reports its drops with PACKET_STATISTICS.
+  if (ipv4_) enableDropCounter(mainReceivingSocket_);
+  enableSocketTimestamping(mainReceivingSocket_, timestampingMode_, false);
   VLOG(2) << "Network Module: Raw ICMP receiving socket initialized.";
   return true;
 }
 
-bool NetworkManager::createRawSocket() {
+bool NetworkManager::createFanoutSockets(uint16_t fanoutGroup) {
+  // Datagram packet sockets strip the ethernet header, so packets start at the
+  // IP header for both Ipv4 and Ipv6.
+  uint16_t protocol = htons(ipv4_ ? ETH_P_IP : ETH_P_IPV6);
+  struct sockaddr_ll device;
+  memset(&device, 0, sizeof(device));
+  device.sll_family = AF_PACKET;
+  device.sll_protocol = protocol;
+  device.sll_ifindex = if_nametoindex(interface_.c_str());
+  // Bounds the time for the receiving threads to notice stopListening().
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = kReceivingTimeoutMs * 1000;
+  int bufsize = 400 * 1024;
+
+  for (uint32_t i = 0; i < receivingThreads_; i++) {
+    int fanoutSocket = socket(AF_PACKET, SOCK_DGRAM, protocol);
+    if (fanoutSocket < 0 || device.sll_ifindex == 0 ||
+        bind(fanoutSocket, reinterpret_cast<struct sockaddr*>(&device),
+             sizeof(device)) < 0) {
+      LOG(FATAL) << "Network Module: Fanout receiving socket failed to "
+                    "initialize.";
+      return false;
+    }
+    fanoutSockets_.push_back(fanoutSocket);
+    if (setsockopt(fanoutSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout)) < 0 ||
+        setsockopt(fanoutSocket, SOL_SOCKET, SO_RCVBUF, &bufsize,
+                   sizeof(bufsize)) < 0) {
+      VLOG(2) << "Network Module: Failed to set receiving socket options.";
+    }
+    enableSocketTimestamping(fanoutSocket, timestampingMode_, false);
+    if (!joinPacketFanout(fanoutSocket, fanoutGroup)) return false;
+  }
+  VLOG(2) << "Network Module: " << receivingThreads_
+          << " fanout receiving sockets initialized.";
+  return true;
+}
+
+bool NetworkManager::createRawSocket(SendingShard* shard) {
   // create raw socket return -1 if failed
   if (ipv4_) {
-    sendingSocket_ = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    shard->socket = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
     int on = 1;
-    if (sendingSocket_ < 0 ||
-        setsockopt(sendingSocket_, IPPROTO_IP, IP_HDRINCL,
+    if (shard->socket < 0 ||
+        setsockopt(shard->socket, IPPROTO_IP, IP_HDRINCL,
                    reinterpret_cast<char*>(&on), sizeof(on)) < 0) {
       LOG(FATAL) << "The sending socket initialize failed.";
       return false;
     }
     VLOG(2) << "Network Module: Raw Ipv4 sending socket initialized.";
   } else {
-    sendingSocket_ = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+    shard->socket = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
     int on = 1;
 #ifdef IPV6_HDRINCL
-    if (sendingSocket_ < 0 ||
-        setsockopt(sendingSocket_, IPPROTO_IPV6, IPV6_HDRINCL,
+    if (shard->socket < 0 ||
+        setsockopt(shard->socket, IPPROTO_IPV6, IPV6_HDRINCL,
                    reinterpret_cast<char*>(&on), sizeof(on)) < 0) {
       LOG(FATAL) << "The sending socket initialize failed.";
       return false;
@@ -192,49 +566,276 @@ bool NetworkManager::createRawSocket() {
   return true;
 }
 
-void NetworkManager::runSendingThread() {
+bool NetworkManager::resolveGatewayMac(const std::string& gatewayMac,
+                                       uint8_t* mac) {
+  if (!gatewayMac.empty()) {
+    if (!parseMacAddress(gatewayMac, mac)) {
+      LOG(FATAL) << "Network Module: Gateway MAC address is malformed: "
+                 << gatewayMac;
+      return false;
+    }
+  } else if (!ipv4_ || !getGatewayMacAddress(interface_, mac)) {
+    LOG(FATAL) << "Network Module: Failed to resolve gateway MAC address. "
+                  "Please specify it for the sending backend.";
+    return false;
+  }
+  return true;
+}
+
+bool NetworkManager::createTxRing(SendingShard* shard,
+                                  const uint8_t* destinationMac) {
+  shard->txRing =
+      std::make_unique<PacketTxRing>(interface_, destinationMac, ipv4_);
+  VLOG(2) << "Network Module: PACKET_TX_RING sending backend initialized.";
+  return true;
+}
+
+bool NetworkManager::createXdpSocket(const uint8_t* destinationMac) {
+  // The socket is bound to queue 0, the interface should have a single queue
+  // so that all responses arrive there.
+  xdpSocket_ =
+      std::make_unique<XdpSocket>(interface_, 0, destinationMac, ipv4_);
+  VLOG(2) << "Network Module: AF_XDP sending backend initialized"
+          << (xdpSocket_->isZeroCopy() ? " in zero-copy mode." : ".");
+  return true;
+}
+
+void NetworkManager::flushTxRing(SendingShard* shard) {
+  StageStamp sending = StageStamp::now();
+  int32_t flushed = sendingBackend_ == SendingBackend::XDP
+                        ? xdpSocket_->flush()
+                        : shard->txRing->flush();
+  if (flushed > 0) {
+    recordStage(PipelineStage::SEND_CALL, sending);
+    sentPackets_.add(flushed);
+  }
+}
+
+void NetworkManager::startSendingThreads() {
+  // Resolve the concrete prober once, so the sending loops pack probes without
+  // virtual calls or address casts.
+  if (ipv4_) {
+    if (auto* prober = dynamic_cast<UdpProber*>(prober_)) {
+      startSendingThreads<UdpProber, Ipv4Address>(prober);
+    } else if (auto* prober = dynamic_cast<UdpIdempotentProber*>(prober_)) {
+      startSendingThreads<UdpIdempotentProber, Ipv4Address>(prober);
+    } else {
+      startSendingThreads<Prober, Ipv4Address>(prober_);
+    }
+  } else {
+    if (auto* prober = dynamic_cast<UdpProberIpv6*>(prober_)) {
+      startSendingThreads<UdpProberIpv6, Ipv6Address>(prober);
+    } else {
+      startSendingThreads<Prober, Ipv6Address>(prober_);
+    }
+  }
+}
+
+template <class ProberT, class AddressT>
+void NetworkManager::startSendingThreads(ProberT* prober) {
+  // Each sending thread is to drain the sending buffer of its shard and put
+  // the packet on wire.
+  for (auto& shard : sendingShards_) {
+    SendingShard* shardPtr = shard.get();
+    if (sendingBackend_ == SendingBackend::SENDMMSG) {
+      boost::asio::post(*threadPool_.get(), [this, shardPtr, prober]() {
+        runBatchSendingThread<ProberT, AddressT>(shardPtr, prober);
+      });
+    } else {
+      boost::asio::post(*threadPool_.get(), [this, shardPtr, prober]() {
+        runSendingThread<ProberT, AddressT>(shardPtr, prober);
+      });
+    }
+  }
+}
+
+template <class ProberT, class AddressT>
+void NetworkManager::runSendingThread(SendingShard* shard, ProberT* prober) {
   if (expectedRate_ < 1) {
+    // Probes are sent by the caller of scheduleProbeRemoteHost.
     VLOG(2) << "Network module: sending thread disabled.";
+    return;
   }
   VLOG(2) << "Network module: Sending thread initialized.";
-  ProbeUnitIpv4 tmp;
-  ProbeUnitIpv6 tmp6;
+  typename ProbeUnitTraits<AddressT>::Unit tmp;
+  SpscRing<typename ProbeUnitTraits<AddressT>::Unit>* buffer =
+      ProbeUnitTraits<AddressT>::getBuffer(shard);
+  const AddressT& localAddress = getLocalAddress<AddressT>();
 
-  uint64_t sentProbes = 0;
-  auto lastSeenTimestamp = std::chrono::steady_clock::now();
+  bool txRing = sendingBackend_ == SendingBackend::TX_RING ||
+                sendingBackend_ == SendingBackend::XDP;
+  // Every shard gets an equal slice of the sending rate.
+  RatePacer pacer(expectedRate_ / sendingThreads_,
+                  std::max<uint32_t>(1, sendingBurstSize_ / sendingThreads_));
+  uint64_t totalSentProbes = 0;
+  auto firstSentTimestamp = std::chrono::steady_clock::now();
   while (!isStopReceiving()) {
-    if ((ipv4_ && sendingBuffer_->empty()) ||
-        (!ipv4_ && sendingBuffer6_->empty())) {
+    if (buffer->empty()) {
+      // Do not hold packed frames while there is nothing else to send.
+      if (txRing) flushTxRing(shard);
+      readTransmitTimestamps(shard);
+      waitForProbes(shard);
       continue;
     }
-    double timeDifference =
-        std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now() - lastSeenTimestamp)
-            .count();
-    if (timeDifference >= 1000) {
-      sentProbes = 0;
-      lastSeenTimestamp = std::chrono::steady_clock::now();
+    if (pacer.tryAcquire(1) == 0) {
+      // Put packed frames on wire before waiting for the next slot.
+      if (txRing) flushTxRing(shard);
+      readTransmitTimestamps(shard);
+      pacer.acquire(1);
+    }
+    if (totalSentProbes == 0) {
+      firstSentTimestamp = std::chrono::steady_clock::now();
+    }
+    buffer->popBack(&tmp);
+    recordStage(PipelineStage::ENQUEUE_TO_SEND, tmp.enqueued);
+    probeRemoteHost(shard, prober, tmp.ip, localAddress, tmp.ttl);
+    totalSentProbes += 1;
+    if (totalSentProbes % kTransmitTimestampInterval == 0) {
+      readTransmitTimestamps(shard);
+    }
+  }
+  if (txRing) flushTxRing(shard);
+
+  reportSendingRate(totalSentProbes, firstSentTimestamp);
+  VLOG(2) << "Network module: Sending thread recycled.";
+}
+
+template <class ProberT, class AddressT>
+void NetworkManager::runBatchSendingThread(SendingShard* shard,
+                                           ProberT* prober) {
+  if (expectedRate_ < 1) {
+    VLOG(2) << "Network module: Batch sending thread disabled.";
+    return;
+  }
+  VLOG(2) << "Network module: Batch sending thread initialized.";
+  std::vector<typename ProbeUnitTraits<AddressT>::Unit> units(
+      kSendingBatchSize);
+  SpscRing<typename ProbeUnitTraits<AddressT>::Unit>* buffer =
+      ProbeUnitTraits<AddressT>::getBuffer(shard);
+  const AddressT& localAddress = getLocalAddress<AddressT>();
+
+  RatePacer pacer(expectedRate_ / sendingThreads_,
+                  std::max<uint32_t>(1, sendingBurstSize_ / sendingThreads_));
+  uint64_t totalSentProbes = 0;
+  auto firstSentTimestamp = std::chrono::steady_clock::now();
+  while (!isStopReceiving()) {
+    uint32_t queued = static_cast<uint32_t>(buffer->size());
+    if (queued == 0) {
+      readTransmitTimestamps(shard);
+      waitForProbes(shard);
+      continue;
     }
-    if (sentProbes >= expectedRate_) {
+    // Never take more tokens than probes to send, this thread is the only
+    // consumer so all of them can be popped.
+    uint32_t budget =
+        pacer.acquire(std::min<uint32_t>(kSendingBatchSize, queued));
+
+    uint32_t count = buffer->popBackBulk(units.data(), budget);
+    if (count == 0) {
       continue;
     }
+    if (totalSentProbes == 0) {
+      firstSentTimestamp = std::chrono::steady_clock::now();
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      recordStage(PipelineStage::ENQUEUE_TO_SEND, units[i].enqueued);
+      uint8_t* packet = &shard->batchBuffer[i * kPacketBufferSize];
+      StageStamp packing = StageStamp::now();
+      shard->batchIovecs[i].iov_len =
+          prober->packProbe(units[i].ip, localAddress, units[i].ttl, packet);
+      recordStage(PipelineStage::PACK_PROBE, packing);
+    }
+    sendRawPacketBatch(shard, count);
+    totalSentProbes += count;
+    readTransmitTimestamps(shard);
+  }
+
+  reportSendingRate(totalSentProbes, firstSentTimestamp);
+  VLOG(2) << "Network module: Batch sending thread recycled.";
+}
+
+bool NetworkManager::waitForProbes(SendingShard* shard) {
+  if (ipv4_) {
+    return shard->buffer->waitNotEmpty(kIdleTimeout);
+  } else {
+    return shard->buffer6->waitNotEmpty(kIdleTimeout);
+  }
+}
+
+void NetworkManager::reportSendingRate(
+    uint64_t sentProbes,
+    std::chrono::steady_clock::time_point firstSentTimestamp) {
+  double elapsedTime =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - firstSentTimestamp)
+          .count();
+  if (sentProbes != 0 && elapsedTime > 0) {
+    LOG(INFO) << "Network module: Sending thread achieved "
+              << static_cast<uint64_t>(sentProbes / elapsedTime * 1000000)
+              << " pps (" << sentProbes << " probes).";
+  }
+}
+
+void NetworkManager::createBatchAddresses() {
+  memset(&batchAddress_, 0, sizeof(batchAddress_));
+  batchAddress_.sin_family = AF_INET;
+  batchAddress_.sin_port = 80;
+  batchAddress_.sin_addr.s_addr = 1;
+  memset(&batchAddress6_, 0, sizeof(batchAddress6_));
+  batchAddress6_.sin6_family = AF_INET6;
+  batchAddress6_.sin6_port = 0;
+}
+
+void NetworkManager::createBatchBuffers(SendingShard* shard) {
+  shard->batchBuffer.assign(kSendingBatchSize * kPacketBufferSize, 0);
+  shard->batchIovecs.resize(kSendingBatchSize);
+  shard->batchMessages.resize(kSendingBatchSize);
+
+  for (uint32_t i = 0; i < kSendingBatchSize; i++) {
+    struct iovec* iov = &shard->batchIovecs[i];
+    struct mmsghdr* message = &shard->batchMessages[i];
+    iov->iov_base = &shard->batchBuffer[i * kPacketBufferSize];
+    iov->iov_len = 0;
+    memset(message, 0, sizeof(struct mmsghdr));
+    message->msg_hdr.msg_iov = iov;
+    message->msg_hdr.msg_iovlen = 1;
     if (ipv4_) {
-      sendingBuffer_->popBack(&tmp);
-      probeRemoteHost(tmp.ip, tmp.ttl);
+      message->msg_hdr.msg_name = &batchAddress_;
+      message->msg_hdr.msg_namelen = sizeof(batchAddress_);
     } else {
-      sendingBuffer6_->popBack(&tmp6);
-      probeRemoteHost(tmp6.ip, tmp6.ttl);
+      message->msg_hdr.msg_name = &batchAddress6_;
+      message->msg_hdr.msg_namelen = sizeof(batchAddress6_);
     }
-    sentProbes += 1;
   }
-  VLOG(2) << "Network module: Sending thread recycled.";
+  VLOG(2) << "Network Module: sendmmsg sending backend initialized.";
 }
 
 void NetworkManager::receiveIcmpPacket() {
   VLOG(2) << "Network module: Receiving thread initialized.";
   uint8_t buffer[kReceivingBufferSize];
+  uint8_t control[kTimestampControlSize];
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer);
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  ReceivedPacket packet;
+  ReceiveBuffer receiveBuffer(mainReceivingSocket_, !ipv4_, true);
   while (!isStopReceiving()) {
-    int32_t packetSize = recv(mainReceivingSocket_, &buffer, sizeof(buffer), 0);
+    if (timestampingMode_ != TimestampingMode::NONE || ipv4_) {
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+    }
+    int32_t packetSize = recvmsg(mainReceivingSocket_, &message, 0);
+    StageStamp received = StageStamp::now();
+    if (packetSize >= 0 && ipv4_) receiveBuffer.updateDropCount(&message);
+    collectDrops(&receiveBuffer);
+    packet.timestamp = timestampingMode_ != TimestampingMode::NONE
+                           ? getControlTimestamp(&message, timestampingMode_)
+                           : 0;
     // an icmp packet has to have an 8-byte ip header and a 20-byte icmp
     // header
     if (ipv4_) {
@@ -242,62 +843,323 @@ void NetworkManager::receiveIcmpPacket() {
         continue;
       }
 
-      {
-        std::lock_guard<std::mutex> guard(receivedPacketMutex_);
-        receivedPackets_ += 1;
-      }
-      prober_->parseResponse(buffer, packetSize, SocketType::ICMP);
+      receivedPackets_.add(1);
+      packet.buffer = buffer;
+      packet.size = packetSize;
+      prober_->parseResponses(&packet, 1, SocketType::ICMP);
+      recordStage(PipelineStage::RECEIVE_TO_PARSE, received);
     } else {
       if (packetSize < 48) {
         continue;
       }
 
-      {
-        std::lock_guard<std::mutex> guard(receivedPacketMutex_);
-        receivedPackets_ += 1;
-      }
+      receivedPackets_.add(1);
       // Currently the IPv6 socket returns the entire ethernet frame.
-      prober_->parseResponse(buffer + 14, packetSize - 14, SocketType::ICMP);
+      packet.buffer = buffer + 14;
+      packet.size = packetSize - 14;
+      prober_->parseResponses(&packet, 1, SocketType::ICMP);
+      recordStage(PipelineStage::RECEIVE_TO_PARSE, received);
     }
   }
   VLOG(2) << "Network module: Receiving thread recycled.";
 }
 
-void NetworkManager::sendRawPacket(uint8_t* buffer, size_t length) {
+void NetworkManager::receiveIcmpPacketBatch() {
+  VLOG(2) << "Network module: Batch receiving thread initialized.";
+  std::vector<uint8_t> buffer(kReceivingBatchSize * kReceivingBufferSize);
+  std::vector<struct iovec> iovecs(kReceivingBatchSize);
+  std::vector<struct mmsghdr> messages(kReceivingBatchSize);
+  std::vector<uint8_t> controls;
+  std::vector<ReceivedPacket> packets(kReceivingBatchSize);
+  for (uint32_t i = 0; i < kReceivingBatchSize; i++) {
+    iovecs[i].iov_base = &buffer[i * kReceivingBufferSize];
+    iovecs[i].iov_len = kReceivingBufferSize;
+    memset(&messages[i], 0, sizeof(struct mmsghdr));
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  ReceiveBuffer receiveBuffer(mainReceivingSocket_, !ipv4_, true);
+  while (!isStopReceiving()) {
+    setReceivingControls(&messages, &controls, ipv4_);
+    // Block until at least one packet arrives, then take whatever is queued.
+    int result = recvmmsg(mainReceivingSocket_, messages.data(),
+                          kReceivingBatchSize, MSG_WAITFORONE, nullptr);
+    StageStamp received = StageStamp::now();
+    collectDrops(&receiveBuffer);
+    if (result <= 0) {
+      continue;
+    }
+    uint32_t count = 0;
+    for (int i = 0; i < result; i++) {
+      uint8_t* packet = &buffer[i * kReceivingBufferSize];
+      uint32_t packetSize = messages[i].msg_len;
+      if (ipv4_) receiveBuffer.updateDropCount(&messages[i].msg_hdr);
+      // Same size limits as receiveIcmpPacket.
+      if (ipv4_) {
+        if (packetSize < 28) continue;
+        packets[count].buffer = packet;
+        packets[count].size = packetSize;
+      } else {
+        if (packetSize < 48) continue;
+        // Currently the IPv6 socket returns the entire ethernet frame.
+        packets[count].buffer = packet + 14;
+        packets[count].size = packetSize - 14;
+      }
+      packets[count].timestamp =
+          timestampingMode_ != TimestampingMode::NONE
+              ? getControlTimestamp(&messages[i].msg_hdr, timestampingMode_)
+              : 0;
+      count++;
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    receivedPackets_.add(count);
+    prober_->parseResponses(packets.data(), count, SocketType::ICMP);
+    recordStage(PipelineStage::RECEIVE_TO_PARSE, received);
+  }
+  VLOG(2) << "Network module: Batch receiving thread recycled.";
+}
+
+void NetworkManager::receiveRxRingPacket(uint32_t receiverIndex) {
+  VLOG(2) << "Network module: RX ring receiving thread initialized.";
+  PacketRxRing* rxRing = rxRings_[receiverIndex].get();
+  RxRingPacketHandler handler = [this](uint8_t* packet, size_t packetSize,
+                                       int64_t timestamp) {
+    handleIcmpPacket(packet, packetSize, timestamp);
+  };
+  // Frames are dropped when the ring is full, which cannot grow.
+  ReceiveBuffer receiveBuffer(rxRing->getSocket(), true, false);
+  while (!isStopReceiving()) {
+    rxRing->receive(handler, kReceivingTimeoutMs);
+    collectDrops(&receiveBuffer);
+  }
+  VLOG(2) << "Network module: RX ring receiving thread recycled.";
+}
+
+void NetworkManager::receiveXdpPacket() {
+  VLOG(2) << "Network module: XDP receiving thread initialized.";
+  XdpPacketHandler handler = [this](uint8_t* packet, size_t packetSize) {
+    // AF_XDP carries no receive time, take it when the frame is read.
+    handleIcmpPacket(packet, packetSize,
+                     timestampingMode_ != TimestampingMode::NONE
+                         ? getRealtimeNanoseconds()
+                         : 0);
+  };
+  while (!isStopReceiving()) {
+    xdpSocket_->receive(handler, kReceivingTimeoutMs);
+  }
+  VLOG(2) << "Network module: XDP receiving thread recycled.";
+}
+
+void NetworkManager::receiveSimulatedPacket() {
+  VLOG(2) << "Network module: Simulated receiving thread initialized.";
+  std::vector<uint8_t> buffer(kReceivingBatchSize * kReceivingBufferSize);
+  std::vector<ReceivedPacket> packets(kReceivingBatchSize);
+  while (!isStopReceiving()) {
+    size_t count = simulatedNetwork_->receive(
+        buffer.data(), kReceivingBufferSize, packets.data(),
+        kReceivingBatchSize, kReceivingTimeoutMs);
+    StageStamp received = StageStamp::now();
+    if (count == 0) {
+      continue;
+    }
+    if (timestampingMode_ != TimestampingMode::NONE) {
+      int64_t timestamp = getRealtimeNanoseconds();
+      for (size_t i = 0; i < count; i++) packets[i].timestamp = timestamp;
+    }
+    receivedPackets_.add(count);
+    prober_->parseResponses(packets.data(), count, SocketType::ICMP);
+    recordStage(PipelineStage::RECEIVE_TO_PARSE, received);
+  }
+  VLOG(2) << "Network module: Simulated receiving thread recycled.";
+}
+
+void NetworkManager::receiveFanoutPacket(uint32_t receiverIndex) {
+  VLOG(2) << "Network module: Fanout receiving thread initialized.";
+  int fanoutSocket = fanoutSockets_[receiverIndex];
+  std::vector<uint8_t> buffer(kReceivingBatchSize * kReceivingBufferSize);
+  std::vector<struct iovec> iovecs(kReceivingBatchSize);
+  std::vector<struct sockaddr_ll> addresses(kReceivingBatchSize);
+  std::vector<struct mmsghdr> messages(kReceivingBatchSize);
+  std::vector<uint8_t> controls;
+  std::vector<ReceivedPacket> packets(kReceivingBatchSize);
+  for (uint32_t i = 0; i < kReceivingBatchSize; i++) {
+    iovecs[i].iov_base = &buffer[i * kReceivingBufferSize];
+    iovecs[i].iov_len = kReceivingBufferSize;
+    memset(&messages[i], 0, sizeof(struct mmsghdr));
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+    messages[i].msg_hdr.msg_name = &addresses[i];
+  }
+
+  ReceiveBuffer receiveBuffer(fanoutSocket, true, true);
+  while (!isStopReceiving()) {
+    for (uint32_t i = 0; i < kReceivingBatchSize; i++) {
+      messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+    }
+    setReceivingControls(&messages, &controls, false);
+    int result = recvmmsg(fanoutSocket, messages.data(), kReceivingBatchSize,
+                          MSG_WAITFORONE, nullptr);
+    StageStamp received = StageStamp::now();
+    collectDrops(&receiveBuffer);
+    if (result <= 0) {
+      continue;
+    }
+    uint32_t count = 0;
+    for (int i = 0; i < result; i++) {
+      uint8_t* packet = &buffer[i * kReceivingBufferSize];
+      uint32_t packetSize = messages[i].msg_len;
+      // Packet socket also captures the probes sent by the host itself.
+      if (addresses[i].sll_pkttype == PACKET_OUTGOING) continue;
+      // Same size limits as handleIcmpPacket.
+      if (ipv4_) {
+        if (packetSize < 28 || packet[9] != IPPROTO_ICMP) continue;
+      } else {
+        if (packetSize < 34) continue;
+      }
+      packets[count].buffer = packet;
+      packets[count].size = packetSize;
+      packets[count].timestamp =
+          timestampingMode_ != TimestampingMode::NONE
+              ? getControlTimestamp(&messages[i].msg_hdr, timestampingMode_)
+              : 0;
+      count++;
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    receivedPackets_.add(count);
+    prober_->parseResponses(packets.data(), count, SocketType::ICMP);
+    recordStage(PipelineStage::RECEIVE_TO_PARSE, received);
+  }
+  VLOG(2) << "Network module: Fanout receiving thread recycled.";
+}
+
+void NetworkManager::handleIcmpPacket(uint8_t* packet, size_t packetSize,
+                                      int64_t timestamp) {
+  // Same size limits as receiveIcmpPacket without the ethernet header.
+  if (ipv4_) {
+    // Packet socket captures all Ipv4 packets, not only ICMP.
+    if (packetSize < 28 || packet[9] != IPPROTO_ICMP) return;
+  } else {
+    if (packetSize < 34) return;
+  }
+  StageStamp received = StageStamp::now();
+  receivedPackets_.add(1);
+  ReceivedPacket receivedPacket = {packet, packetSize, timestamp};
+  prober_->parseResponses(&receivedPacket, 1, SocketType::ICMP);
+  recordStage(PipelineStage::RECEIVE_TO_PARSE, received);
+}
+
+void NetworkManager::setReceivingControls(
+    std::vector<struct mmsghdr>* messages, std::vector<uint8_t>* controls,
+    bool dropCounts) {
+  if (timestampingMode_ == TimestampingMode::NONE && !dropCounts) return;
+  controls->resize(messages->size() * kTimestampControlSize);
+  for (size_t i = 0; i < messages->size(); i++) {
+    // The kernel shrinks the length to the control messages it wrote.
+    (*messages)[i].msg_hdr.msg_control =
+        &(*controls)[i * kTimestampControlSize];
+    (*messages)[i].msg_hdr.msg_controllen = kTimestampControlSize;
+  }
+}
+
+void NetworkManager::sendRawPacket(SendingShard* shard, uint8_t* buffer,
+                                   size_t length) {
+  StageStamp sending = StageStamp::now();
+  if (sendingBackend_ == SendingBackend::SIMULATED) {
+    simulatedNetwork_->send(buffer, length);
+    recordStage(PipelineStage::SEND_CALL, sending);
+    sentPackets_.add(1);
+    return;
+  }
   if (ipv4_) {
     struct sockaddr_in sin;
     sin.sin_family = AF_INET;
     sin.sin_port = 80;
     sin.sin_addr.s_addr = 1;
-    if (sendto(sendingSocket_, buffer, length, 0, (struct sockaddr*)&sin,
+    if (sendto(shard->socket, buffer, length, 0, (struct sockaddr*)&sin,
                sizeof(sin)) < 0) {
       LOG(ERROR) << "Send packet failed. Errno: " << errno;
     } else {
-      std::lock_guard<std::mutex> guard(sentPacketsMutex_);
-      sentPackets_ += 1;
+      recordStage(PipelineStage::SEND_CALL, sending);
+      sentPackets_.add(1);
     }
   } else {
     struct sockaddr_in6 sin;
     sin.sin6_family = AF_INET6;
     sin.sin6_port = 0;
-    if (sendto(sendingSocket_, buffer, length, 0, (struct sockaddr*)&sin,
+    if (sendto(shard->socket, buffer, length, 0, (struct sockaddr*)&sin,
                sizeof(sin)) < 0) {
       LOG(ERROR) << "Send packet failed. Errno: " << errno;
     } else {
-      std::lock_guard<std::mutex> guard(sentPacketsMutex_);
-      sentPackets_ += 1;
+      recordStage(PipelineStage::SEND_CALL, sending);
+      sentPackets_.add(1);
     }
   }
 }
 
-uint64_t NetworkManager::getSentPacketCount() {
-  std::lock_guard<std::mutex> guard(sentPacketsMutex_);
-  return sentPackets_;
+uint32_t NetworkManager::sendRawPacketBatch(SendingShard* shard,
+                                            uint32_t count) {
+  uint32_t offset = 0;
+  uint32_t sent = 0;
+  uint32_t retries = 0;
+  while (offset < count) {
+    StageStamp sending = StageStamp::now();
+    int result = sendmmsg(shard->socket, &shard->batchMessages[offset],
+                          count - offset, 0);
+    if (result > 0) {
+      recordStage(PipelineStage::SEND_CALL, sending);
+      // Partial send, continue with the rest of the batch.
+      offset += result;
+      sent += result;
+      retries = 0;
+    } else if ((errno == ENOBUFS || errno == EAGAIN || errno == EINTR) &&
+               retries < kSendingBatchMaxRetries) {
+      // The device queue is full. Give the kernel a moment to drain it.
+      retries += 1;
+      std::this_thread::yield();
+    } else {
+      // sendmmsg only fails if the first message can not be sent, skip it.
+      LOG(ERROR) << "Send packet failed. Errno: " << errno;
+      offset += 1;
+      retries = 0;
+    }
+  }
+  if (sent != 0) {
+    sentPackets_.add(sent);
+  }
+  return sent;
 }
 
+uint64_t NetworkManager::getSentPacketCount() { return sentPackets_.get(); }
+
 uint64_t NetworkManager::getReceivedPacketCount() {
-  std::lock_guard<std::mutex> guard(receivedPacketMutex_);
-  return receivedPackets_;
+  return receivedPackets_.get();
+}
+
+uint64_t NetworkManager::getDroppedPacketCount() {
+  return droppedPackets_.get();
+}
+
+void NetworkManager::registerMetrics(MetricsRegistry* registry) const {
+  registry->registerCounter("flashroute_sent_packets", "Probes sent.",
+                            &sentPackets_);
+  registry->registerCounter("flashroute_received_packets",
+                            "ICMP responses received.", &receivedPackets_);
+  registry->registerCounter(
+      "flashroute_kernel_dropped_packets",
+      "Responses dropped by the kernel because a receiving socket was full.",
+      &droppedPackets_);
+}
+
+void NetworkManager::collectDrops(ReceiveBuffer* receiveBuffer) {
+  uint64_t droppedPackets = receiveBuffer->collectDrops();
+  if (droppedPackets > 0) droppedPackets_.add(droppedPackets);
 }
 
 bool NetworkManager::isStopReceiving() {
@@ -2,19 +2,31 @@
 #pragma once
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <linux/if_ether.h>   // ETH_P_IP = 0x0800, ETH_P_IPV6 = 0x86DD
 #include <linux/if_packet.h>  // struct sockaddr_ll (see man 7 packet)
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "flashroute/address.h"
 #include <boost/asio/thread_pool.hpp>
-#include "flashroute/bounded_buffer.h"
+#include "flashroute/latency_histogram.h"
+#include "flashroute/metrics.h"
+#include "flashroute/packet_ring.h"
 #include "flashroute/prober.h"
+#include "flashroute/rate_pacer.h"
+#include "flashroute/receive_buffer.h"
+#include "flashroute/simulated_network.h"
+#include "flashroute/spsc_ring.h"
+#include "flashroute/timestamping.h"
+#include "flashroute/xdp_socket.h"
 
 namespace flashroute {
 
@@ -22,6 +34,8 @@ class ProbeUnitIpv4 {
  public:
   Ipv4Address ip;
   uint8_t ttl;
+  // When the probe entered the sending buffer.
+  StageStamp enqueued;
   ProbeUnitIpv4() : ip(0), ttl(0) {}
   ProbeUnitIpv4(const Ipv4Address& _ip, const uint8_t _ttl)
       : ip(_ip), ttl(_ttl) {}
@@ -31,11 +45,67 @@ class ProbeUnitIpv6 {
  public:
   Ipv6Address ip;
   uint8_t ttl;
+  StageStamp enqueued;
   ProbeUnitIpv6() : ip(0), ttl(0) {}
   ProbeUnitIpv6(const Ipv6Address& _ip, const uint8_t _ttl)
       : ip(_ip), ttl(_ttl) {}
 };
 
+// The way the sending thread puts probes on wire.
+// RAW_SOCKET: one sendto() per probe on an IPPROTO_RAW socket.
+// TX_RING: probes are packed into a memory-mapped PACKET_TX_RING and
+// flushed in batches; requires the MAC address of the gateway.
+// SENDMMSG: probes are drained from the sending buffer in batches and sent by
+// one sendmmsg() on the raw socket.
+// XDP: probes are packed into the UMEM of an AF_XDP socket and responses are
+// steered into the same socket by an XDP program; requires the MAC address of
+// the gateway.
+// SIMULATED: probes are answered in process by a SimulatedNetwork, which needs
+// neither root nor a NIC. Set by the constructor which takes the network.
+enum class SendingBackend { RAW_SOCKET, TX_RING, SENDMMSG, XDP, SIMULATED };
+
+// The way the receiving threads capture ICMP responses. Ignored by XDP and
+// SIMULATED sending backends which receive from their own socket or network.
+// RAW_SOCKET: one recv() per packet on a raw ICMP socket (Ipv4) or a packet
+// socket (Ipv6).
+// RX_RING: whole blocks of packets are read in place from a memory-mapped
+// PACKET_RX_RING (TPACKET_V3).
+// RECVMMSG: packets are read in batches by one recvmmsg() on the raw socket
+// and parsed by the prober per batch.
+// With more than one receiving thread, every thread has its own packet socket
+// (RAW_SOCKET and RECVMMSG) or PACKET_RX_RING in a PACKET_FANOUT group, which
+// spreads the responses among the threads by flow hash.
+enum class ReceivingBackend { RAW_SOCKET, RX_RING, RECVMMSG };
+
+// Upper bound of the receiving threads of a network manager.
+const uint32_t kMaxReceivingThreads = 64;
+
+// Return the index, from 0, of the receiving thread the caller runs on. The
+// response callbacks use it to keep per-thread state without locking.
+uint32_t getReceiverIndex();
+
+// State owned by one sending thread. Probes are assigned to shards by
+// destination, so the probes to a destination are sent in order.
+struct SendingShard {
+  // Sending buffer. The probing thread is the only producer and the sending
+  // thread of the shard is the only consumer.
+  std::unique_ptr<SpscRing<ProbeUnitIpv4>> buffer;
+  std::unique_ptr<SpscRing<ProbeUnitIpv6>> buffer6;
+
+  // Raw socket of RAW_SOCKET and SENDMMSG backends.
+  int socket = -1;
+  std::unique_ptr<PacketTxRing> txRing;
+
+  // Zero-filled buffer to pack single probes into, so that the bytes a prober
+  // leaves untouched are never stale memory.
+  std::vector<uint8_t> packetBuffer;
+
+  // Pre-allocated packet buffers and message headers for sendmmsg.
+  std::vector<uint8_t> batchBuffer;
+  std::vector<struct iovec> batchIovecs;
+  std::vector<struct mmsghdr> batchMessages;
+};
+
 /**
  * Network manager handles sending and receiving packets.
  *
@@ -53,9 +123,28 @@ class ProbeUnitIpv6 {
  *  &prober,  // The prober to process packets.
  *  "eth0",   // The interface to send the probe.
  *  100000,   // The packet sending rate.
- *  true      // Tell network manager to use ipv4 or ipv6 sockets.
+ *  true,     // Tell network manager to use ipv4 or ipv6 sockets.
+ *  SendingBackend::RAW_SOCKET,  // (Optional) The sending backend.
+ *  ""        // (Optional) Gateway MAC address for TX_RING and XDP backends.
+ *            // Resolved from the ARP table if empty (Ipv4 only).
+ *  ReceivingBackend::RAW_SOCKET,  // (Optional) The receiving backend.
+ *  64,       // (Optional) Max probes sent back-to-back at line rate.
+ *  1,        // (Optional) The number of sending threads. XDP backend
+ *            // always uses one.
+ *  1         // (Optional) The number of receiving threads, at most
+ *            // kMaxReceivingThreads. XDP backend always uses one.
+ * );
+ *
+ * // Or answer the probes by a simulated network.
+ * NetworkManager networkManager(
+ *  &prober,            // The prober to process packets.
+ *  &simulatedNetwork,  // The network which answers the probes.
+ *  100000              // The packet sending rate.
  * );
  *
+ * // (Optional) Measure RTTs from kernel timestamps of probes and responses.
+ * networkManager.setTimestampingMode(TimestampingMode::SOFTWARE);
+ *
  * // Start capturing the incoming packets.
  * networkManager.startListening();
  *
@@ -73,7 +162,23 @@ class ProbeUnitIpv6 {
 class NetworkManager {
  public:
   NetworkManager(Prober* prober, const std::string& interface,
-                 const uint64_t sendingRate, const bool ipv4);
+                 const uint64_t sendingRate, const bool ipv4,
+                 const SendingBackend sendingBackend =
+                     SendingBackend::RAW_SOCKET,
+                 const std::string& gatewayMac = "",
+                 const ReceivingBackend receivingBackend =
+                     ReceivingBackend::RAW_SOCKET,
+                 const uint32_t sendingBurstSize = 64,
+                 const uint32_t sendingThreads = 1,
+                 const uint32_t receivingThreads = 1);
+
+  // Send the probes to a simulated network instead of an interface. Only
+  // Ipv4 is supported.
+  NetworkManager(Prober* prober, SimulatedNetwork* simulatedNetwork,
+                 const uint64_t sendingRate,
+                 const uint32_t sendingBurstSize = 64,
+                 const uint32_t sendingThreads = 1,
+                 const uint32_t receivingThreads = 1);
 
   ~NetworkManager();
 
@@ -82,6 +187,14 @@ class NetworkManager {
   void scheduleProbeRemoteHost(const IpAddress& destinationIp,
                                const uint8_t ttl);
 
+  // Same as above but skip the address family check and the cast, for callers
+  // which know the concrete address type.
+  void scheduleProbeRemoteHost(const Ipv4Address& destinationIp,
+                               const uint8_t ttl);
+
+  void scheduleProbeRemoteHost(const Ipv6Address& destinationIp,
+                               const uint8_t ttl);
+
   // Start capturing the packets.
   void startListening();
 
@@ -93,8 +206,34 @@ class NetworkManager {
 
   uint64_t getReceivedPacketCount();
 
+  // Return the number of responses the kernel dropped because the receiving
+  // sockets were full. The buffers of the sockets grow when drops appear.
+  uint64_t getDroppedPacketCount();
+
+  // Register the packet counters, which live as long as the manager.
+  void registerMetrics(MetricsRegistry* registry) const;
+
+  // The sending threads bind to the concrete type of the prober when they
+  // start, so the prober must be reset while not listening.
   void resetProber(Prober* prober);
 
+  // Record the time every probe is sent and every response is received, and
+  // let the prober compute RTTs in microseconds from them. RAW_SOCKET and
+  // SENDMMSG backends take the send times from the kernel, the others when
+  // the probe is packed; responses are timestamped by the kernel except with
+  // XDP and SIMULATED backends. HARDWARE falls back to SOFTWARE if the NIC or
+  // the backend does not support it. Must be called before startListening().
+  void setTimestampingMode(TimestampingMode mode);
+
+  // Attach a BPF filter built from the prober to the receiving sockets, so
+  // that the kernel drops the packets the prober would reject before they
+  // are queued (enabled by default). Must be called before startListening().
+  void setResponseFiltering(bool enabled);
+
+  // Rebuild the filter after the checksum offset of the prober changes while
+  // listening.
+  void updateResponseFilter();
+
  private:
   Prober* prober_;
   std::unique_ptr<IpAddress> localIpAddress_;
@@ -103,7 +242,27 @@ class NetworkManager {
 
   // The socket to receive Icmp packets
   int mainReceivingSocket_;
-  int sendingSocket_;
+
+  SendingBackend sendingBackend_;
+  std::unique_ptr<XdpSocket> xdpSocket_;
+  SimulatedNetwork* simulatedNetwork_;
+
+  ReceivingBackend receivingBackend_;
+  uint32_t receivingThreads_;
+
+  TimestampingMode timestampingMode_;
+  // Send times of the probes, if timestamping is enabled.
+  std::unique_ptr<ProbeTimestamps> probeTimestamps_;
+  // One PACKET_RX_RING per receiving thread.
+  std::vector<std::unique_ptr<PacketRxRing>> rxRings_;
+  // One packet socket per receiving thread if there are more than one of
+  // them.
+  std::vector<int> fanoutSockets_;
+  bool responseFiltering_;
+
+  // Destination addresses shared by the sendmmsg headers of all shards.
+  struct sockaddr_in batchAddress_;
+  struct sockaddr_in6 batchAddress6_;
 
   // Ethernet for Ipv6
   std::string interface_;
@@ -116,31 +275,130 @@ class NetworkManager {
   bool stopReceiving_;
   std::mutex stopReceivingMutex_;
 
-  // Sending buffer
-  std::unique_ptr<BoundedBuffer<ProbeUnitIpv4>> sendingBuffer_;
-  std::unique_ptr<BoundedBuffer<ProbeUnitIpv6>> sendingBuffer6_;
+  // One shard per sending thread.
+  std::vector<std::unique_ptr<SendingShard>> sendingShards_;
 
-  // Rate control
+  // Rate control. The rate and the burst size are split evenly among the
+  // sending threads.
   double expectedRate_;
+  uint32_t sendingBurstSize_;
+  uint32_t sendingThreads_;
 
   // Statistic
-  uint64_t sentPackets_;
-  std::mutex sentPacketsMutex_;
-  uint64_t receivedPackets_;
-  std::mutex receivedPacketMutex_;
+  Counter sentPackets_;
+  Counter receivedPackets_;
+  // Responses dropped by the kernel because the receiving socket was full.
+  Counter droppedPackets_;
 
   bool createIcmpSocket();
 
-  bool createRawSocket();
+  // Create the packet sockets of the receiving threads and add them to a
+  // fanout group.
+  bool createFanoutSockets(uint16_t fanoutGroup);
+
+  bool createRawSocket(SendingShard* shard);
+
+  // Create the sending shard of every sending thread.
+  void createSendingShards(const uint8_t* gatewayMacAddress);
+
+  // Parse the gateway MAC address, or resolve it from the ARP table if it is
+  // empty.
+  bool resolveGatewayMac(const std::string& gatewayMac, uint8_t* mac);
+
+  bool createTxRing(SendingShard* shard, const uint8_t* destinationMac);
+
+  bool createXdpSocket(const uint8_t* destinationMac);
 
-  void runSendingThread();
+  // Hand the frames packed in PACKET_TX_RING or XDP TX ring to kernel.
+  void flushTxRing(SendingShard* shard);
+
+  // Return the shard which sends the probes to the destination. The key is
+  // derived from the destination address.
+  SendingShard* getSendingShard(uint64_t destinationKey);
+
+  template <class AddressT>
+  void scheduleProbe(const AddressT& destinationIp, uint64_t destinationKey,
+                     const uint8_t ttl);
+
+  template <class AddressT>
+  const AddressT& getLocalAddress() const;
+
+  // Start the sending threads of the configured backend, instantiated for the
+  // concrete type of the prober.
+  void startSendingThreads();
+
+  template <class ProberT, class AddressT>
+  void startSendingThreads(ProberT* prober);
+
+  template <class ProberT, class AddressT>
+  void runSendingThread(SendingShard* shard, ProberT* prober);
+
+  // Sending thread of SENDMMSG backend.
+  template <class ProberT, class AddressT>
+  void runBatchSendingThread(SendingShard* shard, ProberT* prober);
+
+  // Spin briefly, then block until the sending buffer of the shard has probes
+  // or the timeout expires. Return true if there are probes to send.
+  bool waitForProbes(SendingShard* shard);
+
+  void reportSendingRate(
+      uint64_t sentProbes,
+      std::chrono::steady_clock::time_point firstSentTimestamp);
+
+  void createBatchAddresses();
+
+  void createBatchBuffers(SendingShard* shard);
+
+  // Return true if the kernel timestamps the probes sent on shard sockets.
+  bool hasKernelTransmitTimestamps() const;
+
+  // Record the send times of the probes timestamped by the kernel.
+  void readTransmitTimestamps(SendingShard* shard);
 
   // Send the probe immediately.
-  void probeRemoteHost(const IpAddress& destinationIp, const uint8_t ttl);
+  template <class ProberT, class AddressT>
+  void probeRemoteHost(SendingShard* shard, ProberT* prober,
+                       const AddressT& destinationIp, const AddressT& sourceIp,
+                       const uint8_t ttl);
+
+  // Start the receiving threads of the configured backend.
+  void startReceivingThreads();
 
   void receiveIcmpPacket();
 
-  void sendRawPacket(uint8_t* buffer, size_t len);
+  // Receiving loop of RECVMMSG backend.
+  void receiveIcmpPacketBatch();
+
+  // Receiving loop of RX_RING backend.
+  void receiveRxRingPacket(uint32_t receiverIndex);
+
+  // Receiving loop of XDP backend.
+  void receiveXdpPacket();
+
+  // Receiving loop of SIMULATED backend.
+  void receiveSimulatedPacket();
+
+  // Receiving loop of a fanout packet socket of RAW_SOCKET and RECVMMSG
+  // backends.
+  void receiveFanoutPacket(uint32_t receiverIndex);
+
+  // Count and parse a received packet which starts at the IP header. The
+  // timestamp is its receive time in nanoseconds, or 0.
+  void handleIcmpPacket(uint8_t* packet, size_t size, int64_t timestamp);
+
+  // Point the message headers of a receiving batch to their control buffers
+  // if responses are timestamped or carry drop counts.
+  void setReceivingControls(std::vector<struct mmsghdr>* messages,
+                            std::vector<uint8_t>* controls, bool dropCounts);
+
+  // Add the drops of the receiving socket to the counter.
+  void collectDrops(ReceiveBuffer* receiveBuffer);
+
+  void sendRawPacket(SendingShard* shard, uint8_t* buffer, size_t len);
+
+  // Send the first count packed messages of the batch of the shard. Return the
+  // number of sent packets.
+  uint32_t sendRawPacketBatch(SendingShard* shard, uint32_t count);
 
   bool isStopReceiving();
 };
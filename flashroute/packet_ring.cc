@@ -0,0 +1,341 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/packet_ring.h"
+
+#include <arpa/inet.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "glog/logging.h"
+
+#include "flashroute/checksum.h"
+#include "flashroute/utils.h"
+
+namespace flashroute {
+
+const uint32_t kTxRingFrameSize = 2048;  // Has to hold an ethernet frame.
+const uint32_t kTxRingBlockSize = 1 << 16;  // Multiple of page size.
+const uint32_t kTxRingBlockCount = 64;      // 2048 frames in total.
+const int32_t kTxRingPollTimeoutMs = 100;
+
+const uint32_t kRxRingFrameSize = 2048;
+const uint32_t kRxRingBlockSize = 1 << 20;  // Multiple of page size.
+const uint32_t kRxRingBlockCount = 64;      // 64 MB in total.
+const uint32_t kRxRingBlockTimeoutMs = 10;  // Retire a partially filled block
+                                            // after this time.
+
+PacketTxRing::PacketTxRing(const std::string& interface,
+                           const uint8_t* destinationMac, const bool ipv4)
+    : socket_(-1),
+      ipv4_(ipv4),
+      ring_(nullptr),
+      ringSize_(0),
+      frameIndex_(0),
+      pendingFrames_(0),
+      dataOffset_(TPACKET2_HDRLEN - sizeof(struct sockaddr_ll)) {
+  memset(&ethernetHeader_, 0, sizeof(ethernetHeader_));
+  memcpy(ethernetHeader_.h_dest, destinationMac, ETH_ALEN);
+  if (!getMacAddressByInterface(interface, ethernetHeader_.h_source)) {
+    LOG(FATAL) << "Packet Ring: Failed to get MAC address of " << interface;
+  }
+  ethernetHeader_.h_proto = htons(ipv4_ ? ETH_P_IP : ETH_P_IPV6);
+
+  createRing(interface);
+}
+
+PacketTxRing::~PacketTxRing() {
+  if (pendingFrames_ != 0) {
+    flush();
+  }
+  if (ring_ != nullptr) {
+    munmap(ring_, ringSize_);
+  }
+  if (socket_ >= 0) {
+    close(socket_);
+  }
+}
+
+bool PacketTxRing::createRing(const std::string& interface) {
+  // Protocol is set to 0 so the socket never receives any packet.
+  socket_ = socket(PF_PACKET, SOCK_RAW, 0);
+  if (socket_ < 0) {
+    LOG(FATAL) << "Packet Ring: Packet socket failed to initialize.";
+    return false;
+  }
+
+  int version = TPACKET_V2;
+  if (setsockopt(socket_, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) < 0) {
+    LOG(FATAL) << "Packet Ring: TPACKET_V2 is not supported.";
+    return false;
+  }
+
+  // Drop malformed frames instead of blocking the ring.
+  int on = 1;
+  if (setsockopt(socket_, SOL_PACKET, PACKET_LOSS, &on, sizeof(on)) < 0) {
+    VLOG(2) << "Packet Ring: Failed to set PACKET_LOSS.";
+  }
+#ifdef PACKET_QDISC_BYPASS
+  // Skip the qdisc layer of kernel. The ring is the only queue we need.
+  if (setsockopt(socket_, SOL_PACKET, PACKET_QDISC_BYPASS, &on, sizeof(on)) <
+      0) {
+    VLOG(2) << "Packet Ring: Failed to bypass qdisc.";
+  }
+#endif
+
+  memset(&request_, 0, sizeof(request_));
+  request_.tp_block_size = kTxRingBlockSize;
+  request_.tp_block_nr = kTxRingBlockCount;
+  request_.tp_frame_size = kTxRingFrameSize;
+  request_.tp_frame_nr =
+      kTxRingBlockSize / kTxRingFrameSize * kTxRingBlockCount;
+  if (setsockopt(socket_, SOL_PACKET, PACKET_TX_RING, &request_,
+                 sizeof(request_)) < 0) {
+    LOG(FATAL) << "Packet Ring: Failed to set up PACKET_TX_RING. Errno: "
+               << errno;
+    return false;
+  }
+
+  ringSize_ = static_cast<size_t>(request_.tp_block_size) *
+              request_.tp_block_nr;
+  void* ring =
+      mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED, socket_, 0);
+  if (ring == MAP_FAILED) {
+    LOG(FATAL) << "Packet Ring: Failed to map the ring. Errno: " << errno;
+    return false;
+  }
+  ring_ = reinterpret_cast<uint8_t*>(ring);
+
+  struct sockaddr_ll device;
+  memset(&device, 0, sizeof(device));
+  device.sll_family = AF_PACKET;
+  device.sll_protocol = 0;
+  device.sll_ifindex = if_nametoindex(interface.c_str());
+  if (device.sll_ifindex == 0 ||
+      bind(socket_, reinterpret_cast<struct sockaddr*>(&device),
+           sizeof(device)) < 0) {
+    LOG(FATAL) << "Packet Ring: Failed to bind to interface " << interface;
+    return false;
+  }
+
+  VLOG(2) << "Packet Ring: PACKET_TX_RING initialized with "
+          << request_.tp_frame_nr << " frames.";
+  return true;
+}
+
+struct tpacket2_hdr* PacketTxRing::getFrame(uint32_t index) const {
+  return reinterpret_cast<struct tpacket2_hdr*>(
+      ring_ + static_cast<size_t>(index) * request_.tp_frame_size);
+}
+
+uint8_t* PacketTxRing::acquireFrame() {
+  struct tpacket2_hdr* header = getFrame(frameIndex_);
+  while (true) {
+    uint32_t status = __atomic_load_n(&header->tp_status, __ATOMIC_ACQUIRE);
+    if (status == TP_STATUS_AVAILABLE) break;
+    if (status == TP_STATUS_WRONG_FORMAT) {
+      LOG(ERROR) << "Packet Ring: Kernel rejected a malformed frame.";
+      __atomic_store_n(&header->tp_status, TP_STATUS_AVAILABLE,
+                       __ATOMIC_RELEASE);
+      break;
+    }
+    // The kernel is still draining the ring, kick it and wait.
+    send(socket_, nullptr, 0, MSG_DONTWAIT);
+    struct pollfd pfd;
+    pfd.fd = socket_;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, kTxRingPollTimeoutMs);
+  }
+  return reinterpret_cast<uint8_t*>(header) + dataOffset_ + sizeof(ethhdr);
+}
+
+void PacketTxRing::commitFrame(size_t length) {
+  struct tpacket2_hdr* header = getFrame(frameIndex_);
+  uint8_t* frame = reinterpret_cast<uint8_t*>(header) + dataOffset_;
+  memcpy(frame, &ethernetHeader_, sizeof(ethernetHeader_));
+  if (ipv4_) {
+    fillIpv4HeaderChecksum(frame + sizeof(ethhdr));
+  }
+  header->tp_len = static_cast<uint32_t>(length + sizeof(ethhdr));
+  __atomic_store_n(&header->tp_status, TP_STATUS_SEND_REQUEST,
+                   __ATOMIC_RELEASE);
+
+  frameIndex_ = (frameIndex_ + 1) % request_.tp_frame_nr;
+  pendingFrames_ += 1;
+}
+
+int32_t PacketTxRing::flush() {
+  if (pendingFrames_ == 0) return 0;
+  if (send(socket_, nullptr, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+      errno != ENOBUFS) {
+    LOG(ERROR) << "Packet Ring: Flush failed. Errno: " << errno;
+    return -1;
+  }
+  int32_t flushed = static_cast<int32_t>(pendingFrames_);
+  pendingFrames_ = 0;
+  return flushed;
+}
+
+bool joinPacketFanout(int socket, uint16_t groupId) {
+  // Fragments are reassembled before hashing so that they reach one socket.
+  int fanout =
+      groupId | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+  if (setsockopt(socket, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) <
+      0) {
+    LOG(FATAL) << "Packet Ring: Failed to join fanout group " << groupId
+               << ". Errno: " << errno;
+    return false;
+  }
+  return true;
+}
+
+PacketRxRing::PacketRxRing(const std::string& interface, const bool ipv4,
+                           const uint16_t fanoutGroup)
+    : socket_(-1), ring_(nullptr), ringSize_(0), blockIndex_(0) {
+  createRing(interface, ipv4, fanoutGroup);
+}
+
+PacketRxRing::~PacketRxRing() {
+  if (ring_ != nullptr) {
+    munmap(ring_, ringSize_);
+  }
+  if (socket_ >= 0) {
+    close(socket_);
+  }
+}
+
+bool PacketRxRing::createRing(const std::string& interface, const bool ipv4,
+                              const uint16_t fanoutGroup) {
+  socket_ = socket(PF_PACKET, SOCK_RAW, htons(ipv4 ? ETH_P_IP : ETH_P_IPV6));
+  if (socket_ < 0) {
+    LOG(FATAL) << "Packet Ring: Packet socket failed to initialize.";
+    return false;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(socket_, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) < 0) {
+    LOG(FATAL) << "Packet Ring: TPACKET_V3 is not supported.";
+    return false;
+  }
+
+  memset(&request_, 0, sizeof(request_));
+  request_.tp_block_size = kRxRingBlockSize;
+  request_.tp_block_nr = kRxRingBlockCount;
+  request_.tp_frame_size = kRxRingFrameSize;
+  request_.tp_frame_nr =
+      kRxRingBlockSize / kRxRingFrameSize * kRxRingBlockCount;
+  request_.tp_retire_blk_tov = kRxRingBlockTimeoutMs;
+  request_.tp_feature_req_word = 0;
+  if (setsockopt(socket_, SOL_PACKET, PACKET_RX_RING, &request_,
+                 sizeof(request_)) < 0) {
+    LOG(FATAL) << "Packet Ring: Failed to set up PACKET_RX_RING. Errno: "
+               << errno;
+    return false;
+  }
+
+  ringSize_ = static_cast<size_t>(request_.tp_block_size) *
+              request_.tp_block_nr;
+  void* ring = mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_LOCKED, socket_, 0);
+  if (ring == MAP_FAILED) {
+    // MAP_LOCKED fails without CAP_IPC_LOCK or enough RLIMIT_MEMLOCK.
+    ring = mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                socket_, 0);
+  }
+  if (ring == MAP_FAILED) {
+    LOG(FATAL) << "Packet Ring: Failed to map the ring. Errno: " << errno;
+    return false;
+  }
+  ring_ = reinterpret_cast<uint8_t*>(ring);
+
+  struct sockaddr_ll device;
+  memset(&device, 0, sizeof(device));
+  device.sll_family = AF_PACKET;
+  device.sll_protocol = htons(ipv4 ? ETH_P_IP : ETH_P_IPV6);
+  device.sll_ifindex = if_nametoindex(interface.c_str());
+  if (device.sll_ifindex == 0 ||
+      bind(socket_, reinterpret_cast<struct sockaddr*>(&device),
+           sizeof(device)) < 0) {
+    LOG(FATAL) << "Packet Ring: Failed to bind to interface " << interface;
+    return false;
+  }
+  // The socket has to be bound before it joins a fanout group.
+  if (fanoutGroup != 0 && !joinPacketFanout(socket_, fanoutGroup)) {
+    return false;
+  }
+
+  VLOG(2) << "Packet Ring: PACKET_RX_RING initialized with "
+          << request_.tp_block_nr << " blocks.";
+  return true;
+}
+
+bool PacketRxRing::enableHardwareTimestamps() {
+  int source = SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (setsockopt(socket_, SOL_PACKET, PACKET_TIMESTAMP, &source,
+                 sizeof(source)) < 0) {
+    LOG(ERROR) << "Packet Ring: Failed to enable hardware timestamps. Errno: "
+               << errno;
+    return false;
+  }
+  return true;
+}
+
+bool PacketRxRing::setResponseFilter(const ResponseFilter& filter) {
+  return attachResponseFilter(socket_, filter);
+}
+
+struct tpacket_block_desc* PacketRxRing::getBlock(uint32_t index) const {
+  return reinterpret_cast<struct tpacket_block_desc*>(
+      ring_ + static_cast<size_t>(index) * request_.tp_block_size);
+}
+
+uint32_t PacketRxRing::receive(const RxRingPacketHandler& handler,
+                               int32_t timeoutMs) {
+  struct tpacket_block_desc* block = getBlock(blockIndex_);
+  if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+       TP_STATUS_USER) == 0) {
+    struct pollfd pfd;
+    pfd.fd = socket_;
+    pfd.events = POLLIN | POLLERR;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeoutMs);
+    if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+         TP_STATUS_USER) == 0) {
+      return 0;
+    }
+  }
+
+  uint32_t frames = block->hdr.bh1.num_pkts;
+  struct tpacket3_hdr* header = reinterpret_cast<struct tpacket3_hdr*>(
+      reinterpret_cast<uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt);
+  for (uint32_t i = 0; i < frames; i++) {
+    uint8_t* frame = reinterpret_cast<uint8_t*>(header);
+    struct sockaddr_ll* address = reinterpret_cast<struct sockaddr_ll*>(
+        frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+    // tp_net points to the IP header whatever the link layer header is.
+    uint32_t linkHeaderSize = header->tp_net - header->tp_mac;
+    if (address->sll_pkttype != PACKET_OUTGOING &&
+        header->tp_snaplen > linkHeaderSize) {
+      handler(frame + header->tp_net, header->tp_snaplen - linkHeaderSize,
+              static_cast<int64_t>(header->tp_sec) * 1000000000 +
+                  header->tp_nsec);
+    }
+    header = reinterpret_cast<struct tpacket3_hdr*>(frame +
+                                                    header->tp_next_offset);
+  }
+
+  // Give the block back to kernel.
+  __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                   __ATOMIC_RELEASE);
+  blockIndex_ = (blockIndex_ + 1) % request_.tp_block_nr;
+  return frames;
+}
+
+}  // namespace flashroute
@@ -0,0 +1,140 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <linux/if_ether.h>   // ETH_P_IP = 0x0800, ETH_P_IPV6 = 0x86DD
+#include <linux/if_packet.h>  // struct tpacket2_hdr, struct tpacket3_hdr
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "flashroute/socket_filter.h"
+
+namespace flashroute {
+
+/**
+ * PacketTxRing wraps a memory-mapped PACKET_TX_RING (TPACKET_V2) bound to an
+ * interface. Probes are packed directly into the frames of the ring, and a
+ * single send() hands all the pending frames to the kernel, which avoids one
+ * syscall per probe.
+ *
+ * Example:
+ *
+ * PacketTxRing ring(
+ *    "eth0",           // The interface to send the probe.
+ *    gatewayMac,       // Destination MAC of the ethernet header.
+ *    true              // Frames carry Ipv4 or Ipv6 packets.
+ * );
+ *
+ * uint8_t* buffer = ring.acquireFrame();
+ * size_t packetSize = prober.packProbe(destination, source, ttl, buffer);
+ * ring.commitFrame(packetSize);
+ *
+ * // Put all committed frames on wire.
+ * ring.flush();
+ */
+class PacketTxRing {
+ public:
+  PacketTxRing(const std::string& interface, const uint8_t* destinationMac,
+               const bool ipv4);
+
+  ~PacketTxRing();
+
+  // Return the buffer of the next free frame which starts at the IP header.
+  // Block and flush the ring if the kernel has not released any frame.
+  uint8_t* acquireFrame();
+
+  // Mark the acquired frame ready to send. Length is the size of IP packet.
+  void commitFrame(size_t length);
+
+  // Send all committed frames. Return the number of frames handed to kernel,
+  // or -1 if the send fails.
+  int32_t flush();
+
+  // Return the number of frames which are committed but not flushed yet.
+  uint32_t pendingFrames() const { return pendingFrames_; }
+
+ private:
+  int socket_;
+  bool ipv4_;
+
+  uint8_t* ring_;
+  size_t ringSize_;
+  struct tpacket_req request_;
+
+  // Index of the frame that will be acquired next.
+  uint32_t frameIndex_;
+  uint32_t pendingFrames_;
+  // Offset of ethernet header from the beginning of a frame.
+  uint32_t dataOffset_;
+
+  // Prefilled ethernet header.
+  struct ethhdr ethernetHeader_;
+
+  bool createRing(const std::string& interface);
+
+  struct tpacket2_hdr* getFrame(uint32_t index) const;
+};
+
+// Add a packet socket to the fanout group of the given id. The sockets in a
+// group bound to the same interface and protocol share the received packets,
+// which are spread among them by flow hash.
+bool joinPacketFanout(int socket, uint16_t groupId);
+
+// The timestamp is the receive time of the packet in nanoseconds.
+using RxRingPacketHandler =
+    std::function<void(uint8_t* packet, size_t size, int64_t timestamp)>;
+
+/**
+ * PacketRxRing wraps a memory-mapped PACKET_RX_RING (TPACKET_V3) bound to an
+ * interface. The kernel fills whole blocks of frames, and each received frame
+ * is handed to the handler in place, starting at its IP header, without being
+ * copied to user space. Frames sent by the host itself are skipped.
+ *
+ * Example:
+ *
+ * PacketRxRing ring(
+ *    "eth0",           // The interface to capture packets.
+ *    true,             // Capture Ipv4 or Ipv6 packets.
+ *    0                 // (Optional) Fanout group to join, 0 for none.
+ * );
+ *
+ * // Wait up to 100 ms for a block and handle all frames in it.
+ * ring.receive(handler, 100);
+ */
+class PacketRxRing {
+ public:
+  PacketRxRing(const std::string& interface, const bool ipv4,
+               const uint16_t fanoutGroup = 0);
+
+  ~PacketRxRing();
+
+  // Wait up to timeoutMs for the next block and pass each frame of it to the
+  // handler. Return the number of frames in the block.
+  uint32_t receive(const RxRingPacketHandler& handler, int32_t timeoutMs);
+
+  // Timestamp frames with the clock of the NIC instead of the system clock.
+  bool enableHardwareTimestamps();
+
+  // Drop the frames rejected by the filter before they fill the ring.
+  bool setResponseFilter(const ResponseFilter& filter);
+
+  int getSocket() const { return socket_; }
+
+ private:
+  int socket_;
+
+  uint8_t* ring_;
+  size_t ringSize_;
+  struct tpacket_req3 request_;
+
+  // Index of the block that will be read next.
+  uint32_t blockIndex_;
+
+  bool createRing(const std::string& interface, const bool ipv4,
+                  const uint16_t fanoutGroup);
+
+  struct tpacket_block_desc* getBlock(uint32_t index) const;
+};
+
+}  // namespace flashroute
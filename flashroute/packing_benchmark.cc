@@ -0,0 +1,68 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Measure the time to pack a probe in FULL and TEMPLATE packing modes.
+//
+// bazel run -c opt //flashroute:packing_benchmark
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "flashroute/address.h"
+#include "flashroute/prober.h"
+#include "flashroute/prober_test_util.h"
+#include "flashroute/udp_idempotent_prober.h"
+#include "flashroute/udp_prober.h"
+#include "flashroute/udp_prober_v6.h"
+
+using namespace flashroute;
+
+const uint32_t kBenchmarkProbes = 10000000;
+const size_t kBenchmarkBufferSize = 2048;
+
+template <class Address, class Generator>
+void runBenchmark(const std::string& name, Prober* prober,
+                  const Address& sourceIp, Generator generator) {
+  static uint8_t buffer[kBenchmarkBufferSize];
+  memset(buffer, 0, sizeof(buffer));
+  for (PackingMode mode : {PackingMode::FULL, PackingMode::TEMPLATE}) {
+    prober->setPackingMode(mode);
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < kBenchmarkProbes; i++) {
+      Address destinationIp = generator(i);
+      size_t size = prober->packProbe(destinationIp, sourceIp,
+                                      static_cast<uint8_t>(i % 32 + 1), buffer);
+      checksum += buffer[size - 1] + buffer[26] + buffer[46];
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    std::cout << name << (mode == PackingMode::FULL ? " FULL: " : " TEMPLATE: ")
+              << elapsed / kBenchmarkProbes << " ns/probe (checksum "
+              << checksum << ")" << std::endl;
+  }
+}
+
+int main() {
+  PacketReceiverCallback callback = getIgnoringCallback();
+  Ipv4Address sourceIp{0xC0A80001};
+  auto ipv4Generator = [](uint32_t i) {
+    return Ipv4Address{0x01000001 + (i << 8)};
+  };
+
+  UdpProber prober(&callback, 0, 1, 53, "test", true, 0);
+  runBenchmark("UdpProber", &prober, sourceIp, ipv4Generator);
+
+  UdpIdempotentProber idempotentProber(&callback, 0, 1, 53, "test", true, 0);
+  runBenchmark("UdpIdempotentProber", &idempotentProber, sourceIp,
+               ipv4Generator);
+
+  UdpProberIpv6 proberIpv6(&callback, 0, 1, 53, "test", 0);
+  Ipv6Address sourceIpv6{absl::MakeUint128(0x20010DB800000000ULL, 1)};
+  runBenchmark("UdpProberIpv6", &proberIpv6, sourceIpv6, [](uint32_t i) {
+    return Ipv6Address{absl::MakeUint128(0x2A00000000000000ULL + i, 1)};
+  });
+  return 0;
+}
@@ -0,0 +1,113 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Measure the per-probe and per-response cost of the virtual prober interface
+// against the typed calls the sending and receiving loops are instantiated
+// with.
+//
+// bazel run -c opt //flashroute:pipeline_benchmark
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "flashroute/address.h"
+#include "flashroute/prober.h"
+#include "flashroute/udp_prober.h"
+
+using namespace flashroute;
+
+const uint32_t kBenchmarkProbes = 10000000;
+const uint32_t kBenchmarkBatches = 200000;
+const size_t kBenchmarkBatchSize = 64;
+const size_t kBenchmarkBufferSize = 512;
+
+double getElapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+template <class ProberT, class AddressT>
+void runPackingBenchmark(const std::string& name, ProberT* prober,
+                         const AddressT& sourceIp) {
+  static uint8_t buffer[kBenchmarkBufferSize];
+  uint64_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < kBenchmarkProbes; i++) {
+    Ipv4Address destinationIp{0x01000001 + (i << 8)};
+    size_t size = prober->packProbe(destinationIp, sourceIp,
+                                    static_cast<uint8_t>(i % 32 + 1), buffer);
+    checksum += buffer[size - 1] + buffer[26];
+  }
+  std::cout << name << ": " << getElapsedNs(start) / kBenchmarkProbes
+            << " ns/probe (checksum " << checksum << ")" << std::endl;
+}
+
+int main() {
+  uint64_t callbackDistances = 0;
+  PacketReceiverCallback callback =
+      [&callbackDistances](const IpAddress& destination,
+                           const IpAddress& /* responder */, uint8_t distance,
+                           uint32_t /* rtt */, bool /* fromDestination */,
+                           bool /* ipv4 */, void* /* packetHeader */,
+                           size_t /* headerLen */) {
+        callbackDistances += distance + destination.getIpv4Address();
+      };
+  UdpProber prober(&callback, 0, 1, 53, "test", false, 0);
+  prober.setPackingMode(PackingMode::TEMPLATE);
+  Prober* virtualProber = &prober;
+  Ipv4Address sourceIp{0xC0A80001};
+
+  // Sending: the generic loop packs through Prober* with IpAddress&, which
+  // the prober downcasts; the typed loop calls the final class directly.
+  runPackingBenchmark("pack virtual", virtualProber,
+                      static_cast<const IpAddress&>(sourceIp));
+  runPackingBenchmark("pack typed", &prober, sourceIp);
+
+  // Receiving: a batch of Time Exceeded responses quoting the probes.
+  std::vector<std::vector<uint8_t>> buffers(
+      kBenchmarkBatchSize, std::vector<uint8_t>(kBenchmarkBufferSize, 0));
+  std::vector<ReceivedPacket> packets(kBenchmarkBatchSize);
+  for (size_t i = 0; i < kBenchmarkBatchSize; i++) {
+    Ipv4Address destinationIp{static_cast<uint32_t>(0x01000001 + (i << 8))};
+    size_t probeSize = prober.packProbe(
+        destinationIp, sourceIp, static_cast<uint8_t>(i % 32 + 1),
+        buffers[i].data() + 28);
+    struct PacketIcmp* response =
+        reinterpret_cast<struct PacketIcmp*>(buffers[i].data());
+    response->ip.ip_src.s_addr = htonl(0x0A000001 + i);
+    response->icmp.icmp_type = 11;
+    response->icmp.icmp_code = 0;
+    packets[i].buffer = buffers[i].data();
+    packets[i].size = 28 + probeSize;
+  }
+  uint64_t responses =
+      static_cast<uint64_t>(kBenchmarkBatches) * kBenchmarkBatchSize;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < kBenchmarkBatches; i++) {
+    virtualProber->parseResponses(packets.data(), kBenchmarkBatchSize,
+                                  SocketType::ICMP);
+  }
+  std::cout << "parse virtual + callback: " << getElapsedNs(start) / responses
+            << " ns/response (checksum " << callbackDistances << ")"
+            << std::endl;
+
+  uint64_t handlerDistances = 0;
+  start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < kBenchmarkBatches; i++) {
+    prober.parseResponses(
+        packets.data(), kBenchmarkBatchSize, SocketType::ICMP,
+        [&handlerDistances](const ProbeResponse<Ipv4Address>& response,
+                            const ReceivedPacket& /* packet */) {
+          handlerDistances +=
+              response.distance + response.destination.getIpv4Address();
+        });
+  }
+  std::cout << "parse typed + handler: " << getElapsedNs(start) / responses
+            << " ns/response (checksum " << handlerDistances << ")"
+            << std::endl;
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include <functional>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <netinet/ip.h>       // ip header
@@ -13,6 +14,8 @@
 #include <netinet/udp.h>  // udp header
 
 #include "flashroute/address.h"
+#include "flashroute/metrics.h"
+#include "flashroute/socket_filter.h"
 
 namespace flashroute {
 
@@ -20,6 +23,12 @@ enum class SocketType { UDP, ICMP, TCP };
 
 const uint32_t kPacketMessageDefaultPayloadSize = 1500;
 
+// Names of the registered metrics of the running prober.
+const char kChecksumMismatchesMetric[] = "flashroute_checksum_mismatches";
+const char kDistanceAbnormalitiesMetric[] =
+    "flashroute_distance_abnormalities";
+const char kOtherMismatchesMetric[] = "flashroute_other_mismatches";
+
 struct PacketIcmp {
   struct ip ip;
   struct icmp icmp;
@@ -37,6 +46,35 @@ struct PacketTcp {
   char payload[kPacketMessageDefaultPayloadSize];
 } __attribute__((packed));
 
+class ProbeTimestamps;
+
+// A received packet which starts at the IP header.
+struct ReceivedPacket {
+  uint8_t* buffer;
+  size_t size;
+  // Receive time in nanoseconds if the packet is timestamped, otherwise 0.
+  int64_t timestamp = 0;
+};
+
+// The way probers fill probe packets.
+// FULL: every header field is written and the checksums are computed over the
+// whole packet for each probe.
+// TEMPLATE: a packet pre-filled at construction is copied, only the fields
+// which differ between probes are written, and the checksum of the template
+// is updated incrementally with them (RFC 1624).
+enum class PackingMode { FULL, TEMPLATE };
+
+// A response accepted by a prober. Probers with a concrete address type hand
+// it to an inlined handler instead of the callback.
+template <class Address>
+struct ProbeResponse {
+  Address destination;
+  Address responder;
+  uint8_t distance = 0;
+  uint32_t rtt = 0;
+  bool fromDestination = false;
+};
+
 using PacketReceiverCallback =
     std::function<void(const IpAddress& destination, const IpAddress& responder,
                        uint8_t distance, uint32_t rtt, bool fromDestination,
@@ -51,11 +89,75 @@ class Prober {
   virtual void parseResponse(uint8_t* buffer, size_t size,
                              SocketType socketType) = 0;
 
+  // Parse a batch of responses received together. Probers override it to
+  // share per-packet work, e.g., reading the clock, across the batch.
+  virtual void parseResponses(const ReceivedPacket* packets, size_t count,
+                              SocketType socketType) {
+    for (size_t i = 0; i < count; i++) {
+      parseResponse(packets[i].buffer, packets[i].size, socketType);
+    }
+  }
+
   virtual void setChecksumOffset(int32_t checksumOffset) = 0;
 
-  virtual uint64_t getChecksumMismatches() = 0;
-  virtual uint64_t getDistanceAbnormalities() = 0;
-  virtual uint64_t getOtherMismatches() = 0;
+  // Describe the responses the prober accepts, so that the receiving sockets
+  // drop the others in the kernel. Return false if it cannot be described.
+  virtual bool getResponseFilter(ResponseFilter* /* filter */) const {
+    return false;
+  }
+
+  // Compute RTTs in microseconds from the send times of probes in the table
+  // and the timestamps of received packets, instead of the clock encoded in
+  // the probes. nullptr restores the encoded clock.
+  void setProbeTimestamps(const ProbeTimestamps* probeTimestamps) {
+    probeTimestamps_ = probeTimestamps;
+  }
+
+  // Probers fall back to FULL packing if the payload does not fit in the
+  // template.
+  void setPackingMode(PackingMode packingMode) { packingMode_ = packingMode; }
+
+  // Counters of the dropped responses, updated by the receiving threads.
+  virtual uint64_t getChecksumMismatches() { return checksumMismatches_.get(); }
+
+  virtual uint64_t getDistanceAbnormalities() {
+    return distanceAbnormalities_.get();
+  }
+
+  virtual uint64_t getOtherMismatches() { return otherMismatches_.get(); }
+
+  // Register the counters, replacing those of the previous prober.
+  void registerMetrics(MetricsRegistry* registry) const {
+    registry->registerCounter(kChecksumMismatchesMetric,
+                              "Responses whose quoted probe fails the "
+                              "checksum of its destination.",
+                              &checksumMismatches_);
+    registry->registerCounter(kDistanceAbnormalitiesMetric,
+                              "Responses with an impossible distance.",
+                              &distanceAbnormalities_);
+    registry->registerCounter(kOtherMismatchesMetric,
+                              "Responses dropped for other reasons.",
+                              &otherMismatches_);
+  }
+
+  static void removeMetrics(MetricsRegistry* registry) {
+    registry->remove(kChecksumMismatchesMetric);
+    registry->remove(kDistanceAbnormalitiesMetric);
+    registry->remove(kOtherMismatchesMetric);
+  }
+
+  virtual ~Prober() {}
+
+ protected:
+  Prober()
+      : packingMode_(PackingMode::TEMPLATE), probeTimestamps_(nullptr) {}
+
+  PackingMode packingMode_;
+  const ProbeTimestamps* probeTimestamps_;
+
+  Counter checksumMismatches_;
+  Counter distanceAbnormalities_;
+  Counter otherMismatches_;
 };
 
 }  // namespace flashroute
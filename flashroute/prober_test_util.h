@@ -0,0 +1,17 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include "flashroute/prober.h"
+
+namespace flashroute {
+
+// Return a callback which ignores every response, for tests and benchmarks
+// which only look at the packets or at the typed response handlers.
+inline PacketReceiverCallback getIgnoringCallback() {
+  return [](const IpAddress& /* destination */,
+            const IpAddress& /* responder */, uint8_t /* distance */,
+            uint32_t /* rtt */, bool /* fromDestination */, bool /* ipv4 */,
+            void* /* packetHeader */, size_t /* headerLen */) {};
+}
+
+}  // namespace flashroute
@@ -0,0 +1,59 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/rate_pacer.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace flashroute {
+
+// Gaps shorter than this are busy-waited since sleeping overshoots them.
+const std::chrono::microseconds kPacerSpinThreshold(100);
+
+RatePacer::RatePacer(const double rate, const uint32_t burstSize,
+                     Clock clock)
+    : rate_(rate),
+      burstSize_(std::max<double>(1, burstSize)),
+      tokens_(1),
+      clock_(clock),
+      lastRefillTimestamp_(clock_()) {}
+
+void RatePacer::refill() {
+  auto now = clock_();
+  double elapsed =
+      std::chrono::duration<double>(now - lastRefillTimestamp_).count();
+  lastRefillTimestamp_ = now;
+  tokens_ = std::min(burstSize_, tokens_ + elapsed * rate_);
+}
+
+uint32_t RatePacer::tryAcquire(uint32_t maxCount) {
+  if (rate_ <= 0) return maxCount;
+  refill();
+  if (tokens_ < 1) return 0;
+  uint32_t granted = static_cast<uint32_t>(
+      std::min<double>(maxCount, static_cast<uint32_t>(tokens_)));
+  tokens_ -= granted;
+  return granted;
+}
+
+uint32_t RatePacer::acquire(uint32_t maxCount) {
+  uint32_t granted = tryAcquire(maxCount);
+  if (granted != 0 || maxCount == 0) return granted;
+
+  // Wait until the bucket holds one token.
+  auto deadline =
+      lastRefillTimestamp_ +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>((1 - tokens_) / rate_));
+  auto wait = deadline - clock_();
+  if (wait > kPacerSpinThreshold) {
+    std::this_thread::sleep_for(wait - kPacerSpinThreshold);
+  }
+  while (clock_() < deadline) {
+  }
+
+  while ((granted = tryAcquire(maxCount)) == 0) {
+  }
+  return granted;
+}
+
+}  // namespace flashroute
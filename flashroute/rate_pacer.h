@@ -0,0 +1,58 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace flashroute {
+
+/**
+ * RatePacer is a token bucket which spreads probes evenly over time. Tokens
+ * are refilled continuously at the given rate, and at most burstSize tokens
+ * can be accumulated, so no more than burstSize probes are ever sent
+ * back-to-back at line rate. A non-positive rate disables pacing.
+ *
+ * Waiting for tokens sleeps for the bulk of the gap and busy-waits for the
+ * last few microseconds, which keeps sub-millisecond gaps accurate without
+ * burning a core at low rates. Time is read from a clock which tests can
+ * replace.
+ *
+ * Example:
+ *
+ * RatePacer pacer(
+ *    100000,   // Tokens (probes) per second.
+ *    64        // Max number of tokens granted at once.
+ * );
+ *
+ * while (...) {
+ *   // Block until at least one token is available, take up to 16.
+ *   uint32_t count = pacer.acquire(16);
+ *   // Send count probes.
+ * }
+ */
+class RatePacer {
+ public:
+  typedef std::function<std::chrono::steady_clock::time_point()> Clock;
+
+  RatePacer(const double rate, const uint32_t burstSize,
+            Clock clock = std::chrono::steady_clock::now);
+
+  // Block until at least one token is available. Return the number of
+  // granted tokens, which is between 1 and maxCount.
+  uint32_t acquire(uint32_t maxCount);
+
+  // Same as acquire but return 0 instead of blocking.
+  uint32_t tryAcquire(uint32_t maxCount);
+
+ private:
+  double rate_;
+  double burstSize_;
+  double tokens_;
+  Clock clock_;
+  std::chrono::steady_clock::time_point lastRefillTimestamp_;
+
+  void refill();
+};
+
+}  // namespace flashroute
@@ -0,0 +1,130 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#include "flashroute/rate_pacer.h"
+
+using namespace flashroute;
+
+// A clock which only moves when the test advances it.
+class FakeClock {
+ public:
+  std::chrono::steady_clock::time_point now() const { return now_; }
+
+  void advance(std::chrono::nanoseconds duration) { now_ += duration; }
+
+  RatePacer::Clock get() {
+    return [this]() { return now(); };
+  }
+
+ private:
+  std::chrono::steady_clock::time_point now_;
+};
+
+TEST(RatePacer, RefillTest) {
+  FakeClock clock;
+  RatePacer pacer(1000, 64, clock.get());
+  // The bucket starts with one token.
+  EXPECT_EQ(pacer.tryAcquire(10), 1);
+  EXPECT_EQ(pacer.tryAcquire(10), 0);
+
+  clock.advance(std::chrono::microseconds(5500));
+  EXPECT_EQ(pacer.tryAcquire(10), 5);
+  EXPECT_EQ(pacer.tryAcquire(10), 0);
+
+  // Fractions of a token are kept until they add up to one.
+  clock.advance(std::chrono::microseconds(300));
+  EXPECT_EQ(pacer.tryAcquire(10), 0);
+  clock.advance(std::chrono::microseconds(300));
+  EXPECT_EQ(pacer.tryAcquire(10), 1);
+
+  // No more than maxCount tokens are granted at once.
+  clock.advance(std::chrono::milliseconds(20));
+  EXPECT_EQ(pacer.tryAcquire(8), 8);
+  EXPECT_EQ(pacer.tryAcquire(100), 12);
+}
+
+TEST(RatePacer, BurstSizeTest) {
+  FakeClock clock;
+  RatePacer pacer(100000, 16, clock.get());
+  // Idle long enough to accumulate far more than the burst size.
+  clock.advance(std::chrono::milliseconds(10));
+  EXPECT_EQ(pacer.tryAcquire(1000), 16);
+  EXPECT_EQ(pacer.tryAcquire(1000), 0);
+  clock.advance(std::chrono::microseconds(15));
+  EXPECT_EQ(pacer.tryAcquire(1000), 1);
+}
+
+TEST(RatePacer, RateWindowTest) {
+  const double kRate = 20000;
+  const uint32_t kBurstSize = 4;
+  FakeClock clock;
+  RatePacer pacer(kRate, kBurstSize, clock.get());
+
+  // Poll at uneven steps for one second, and count the tokens granted in
+  // every 10 ms window.
+  const auto kStep = std::chrono::microseconds(37);
+  const auto kWindow = std::chrono::milliseconds(10);
+  uint64_t granted = 0;
+  uint64_t windowGranted = 0;
+  uint64_t maxWindowGranted = 0;
+  auto windowStart = clock.now();
+  for (auto elapsed = std::chrono::microseconds(0);
+       elapsed < std::chrono::seconds(1); elapsed += kStep) {
+    clock.advance(kStep);
+    if (clock.now() - windowStart >= kWindow) {
+      maxWindowGranted = std::max(maxWindowGranted, windowGranted);
+      windowGranted = 0;
+      windowStart = clock.now();
+    }
+    uint32_t count = pacer.tryAcquire(1000);
+    granted += count;
+    windowGranted += count;
+  }
+
+  // One token at start plus one second of refills.
+  EXPECT_NEAR(granted, kRate + 1, 2);
+  // A token bucket never exceeds rate * window + burst in any window.
+  EXPECT_LE(maxWindowGranted,
+            kRate * std::chrono::duration<double>(kWindow).count() +
+                kBurstSize);
+}
+
+TEST(RatePacer, AcquireTest) {
+  FakeClock clock;
+  // Every read of the clock moves it by 1 us, which stands in for the time
+  // acquire spends busy-waiting.
+  RatePacer pacer(100000, 1, [&clock]() {
+    clock.advance(std::chrono::microseconds(1));
+    return clock.now();
+  });
+  auto start = clock.now();
+  for (uint32_t i = 0; i < 100; i++) {
+    EXPECT_EQ(pacer.acquire(16), 1);
+  }
+  // 99 gaps of 10 us after the initial token.
+  EXPECT_GE(clock.now() - start, std::chrono::microseconds(990));
+}
+
+TEST(RatePacer, AchievedRateTest) {
+  const double kRate = 20000;  // --probing_rate
+  const uint32_t kProbes = 2000;
+  RatePacer pacer(kRate, 1);
+
+  auto start = std::chrono::steady_clock::now();
+  uint32_t sent = 0;
+  while (sent < kProbes) sent += pacer.acquire(1);
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  // A loaded machine may only slow the pacer down.
+  EXPECT_LE((kProbes - 1) / elapsed, kRate * 1.1);
+}
+
+TEST(RatePacer, DisabledTest) {
+  RatePacer pacer(0, 16);
+  EXPECT_EQ(pacer.acquire(1000), 1000);
+}
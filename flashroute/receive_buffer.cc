@@ -0,0 +1,131 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/receive_buffer.h"
+
+#include <linux/if_packet.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "glog/logging.h"
+
+namespace flashroute {
+
+namespace {
+
+const char kMaxReceiveBufferSizePath[] = "/proc/sys/net/core/rmem_max";
+// Default of net.core.rmem_max, used if it cannot be read.
+const int32_t kDefaultMaxReceiveBufferSize = 212992;
+// Bounds the getsockopt calls of packet sockets and the growth rate of the
+// buffer.
+const std::chrono::milliseconds kDropCollectionInterval(100);
+
+}  // namespace
+
+bool enableDropCounter(int socket) {
+  int on = 1;
+  if (setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+    LOG(ERROR) << "Receive Buffer: Failed to enable SO_RXQ_OVFL. Errno: "
+               << errno;
+    return false;
+  }
+  return true;
+}
+
+int64_t getControlDropCount(const struct msghdr* message) {
+  for (struct cmsghdr* control =
+           CMSG_FIRSTHDR(const_cast<struct msghdr*>(message));
+       control != nullptr;
+       control = CMSG_NXTHDR(const_cast<struct msghdr*>(message), control)) {
+    if (control->cmsg_level == SOL_SOCKET &&
+        control->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t dropCount;
+      memcpy(&dropCount, CMSG_DATA(control), sizeof(dropCount));
+      return dropCount;
+    }
+  }
+  return -1;
+}
+
+uint64_t readPacketSocketDrops(int socket) {
+  // Rings of TPACKET_V3 report the larger tpacket_stats_v3, the other packet
+  // sockets fill its tpacket_stats prefix.
+  struct tpacket_stats_v3 statistics;
+  memset(&statistics, 0, sizeof(statistics));
+  socklen_t length = sizeof(statistics);
+  if (getsockopt(socket, SOL_PACKET, PACKET_STATISTICS, &statistics,
+                 &length) < 0) {
+    return 0;
+  }
+  return statistics.tp_drops;
+}
+
+int32_t getMaxReceiveBufferSize() {
+  std::ifstream file(kMaxReceiveBufferSizePath);
+  int32_t size = 0;
+  if (!(file >> size) || size <= 0) return kDefaultMaxReceiveBufferSize;
+  return size;
+}
+
+ReceiveBuffer::ReceiveBuffer(int socket, bool packetSocket, bool growable)
+    : socket_(socket),
+      packetSocket_(packetSocket),
+      growable_(growable),
+      size_(0),
+      controlDropCount_(0),
+      uncollectedDrops_(0) {
+  int32_t reservedSize = 0;
+  socklen_t length = sizeof(reservedSize);
+  if (getsockopt(socket_, SOL_SOCKET, SO_RCVBUF, &reservedSize, &length) ==
+      0) {
+    size_ = reservedSize / 2;
+  }
+  if (packetSocket_) {
+    // Drops before the first collection are not ours to count.
+    readPacketSocketDrops(socket_);
+  }
+}
+
+void ReceiveBuffer::updateDropCount(const struct msghdr* message) {
+  int64_t dropCount = getControlDropCount(message);
+  if (dropCount < 0) return;
+  uint32_t count = static_cast<uint32_t>(dropCount);
+  uncollectedDrops_ += static_cast<uint32_t>(count - controlDropCount_);
+  controlDropCount_ = count;
+}
+
+uint64_t ReceiveBuffer::collectDrops() {
+  auto now = std::chrono::steady_clock::now();
+  if (now - lastCollection_ < kDropCollectionInterval) return 0;
+  lastCollection_ = now;
+  if (packetSocket_) uncollectedDrops_ += readPacketSocketDrops(socket_);
+  uint64_t drops = uncollectedDrops_;
+  uncollectedDrops_ = 0;
+  if (drops > 0 && growable_) growable_ = grow();
+  return drops;
+}
+
+bool ReceiveBuffer::grow() {
+  if (size_ <= 0 || size_ >= kMaxReceiveBufferSize) return false;
+  int32_t size = std::min(size_ * 2, kMaxReceiveBufferSize);
+  // SO_RCVBUFFORCE needs CAP_NET_ADMIN, without it the buffer is bounded by
+  // rmem_max.
+  if (setsockopt(socket_, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) <
+      0) {
+    size = std::min(size, getMaxReceiveBufferSize());
+    if (size <= size_ ||
+        setsockopt(socket_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+      LOG(WARNING) << "Receive Buffer: The kernel drops responses and the "
+                      "receiving buffer cannot grow beyond "
+                   << size_ / 1024 << " KB (net.core.rmem_max).";
+      return false;
+    }
+  }
+  LOG(INFO) << "Receive Buffer: The kernel drops responses, grow the "
+               "receiving buffer to "
+            << size / 1024 << " KB.";
+  size_ = size;
+  return true;
+}
+
+}  // namespace flashroute
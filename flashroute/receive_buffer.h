@@ -0,0 +1,81 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+
+namespace flashroute {
+
+// Largest receiving buffer a socket grows to.
+const int32_t kMaxReceiveBufferSize = 64 * 1024 * 1024;
+
+// Ask the kernel to attach the number of packets the socket has dropped so
+// far to the messages received from it (SO_RXQ_OVFL).
+bool enableDropCounter(int socket);
+
+// Return the drop count carried by a received message, or -1 if there is
+// none, i.e., the socket had not dropped any packet when the message was
+// queued.
+int64_t getControlDropCount(const struct msghdr* message);
+
+// Return the number of packets a packet socket dropped since the last call
+// (PACKET_STATISTICS).
+uint64_t readPacketSocketDrops(int socket);
+
+// net.core.rmem_max, the largest receiving buffer which unprivileged
+// processes may request.
+int32_t getMaxReceiveBufferSize();
+
+/**
+ * ReceiveBuffer accounts the packets which the kernel drops because a
+ * receiving socket is full, and doubles the receiving buffer of the socket
+ * when they appear. Beyond rmem_max, the buffer only grows if the process
+ * may use SO_RCVBUFFORCE. It belongs to the thread which reads the socket.
+ *
+ * Example:
+ *
+ * ReceiveBuffer receiveBuffer(
+ *    socket,  // The receiving socket.
+ *    true,    // Packet sockets report drops with PACKET_STATISTICS, others
+ *             // with the messages received from them (SO_RXQ_OVFL).
+ *    true     // Whether the buffer can grow. The buffer of a
+ *             // PACKET_RX_RING cannot.
+ * );
+ *
+ * // After each receive call.
+ * receiveBuffer.updateDropCount(&message);  // SO_RXQ_OVFL only.
+ * uint64_t dropped = receiveBuffer.collectDrops();
+ */
+class ReceiveBuffer {
+ public:
+  ReceiveBuffer(int socket, bool packetSocket, bool growable);
+
+  // Take the drop count carried by a message received from the socket.
+  void updateDropCount(const struct msghdr* message);
+
+  // Return the number of packets dropped since the last call, and grow the
+  // buffer if there are any. Drops are collected at most once per interval,
+  // 0 is returned in between.
+  uint64_t collectDrops();
+
+  // Size of the buffer requested with SO_RCVBUF, half of the size the kernel
+  // reserves.
+  int32_t getSize() const { return size_; }
+
+ private:
+  int socket_;
+  bool packetSocket_;
+  bool growable_;
+  int32_t size_;
+
+  // The last drop count carried by a message, which wraps around.
+  uint32_t controlDropCount_;
+  uint64_t uncollectedDrops_;
+  std::chrono::steady_clock::time_point lastCollection_;
+
+  bool grow();
+};
+
+}  // namespace flashroute
@@ -0,0 +1,84 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/receive_buffer.h"
+
+using namespace flashroute;
+
+TEST(ReceiveBuffer, CollectDropsTest) {
+  // Overflow a small UDP socket on the loopback interface.
+  int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+  int sender = socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_GE(receiver, 0);
+  ASSERT_GE(sender, 0);
+  int size = 4096;
+  ASSERT_EQ(setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)),
+            0);
+  ASSERT_TRUE(enableDropCounter(receiver));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addressLength = sizeof(address);
+  ASSERT_EQ(bind(receiver, reinterpret_cast<struct sockaddr*>(&address),
+                 sizeof(address)),
+            0);
+  getsockname(receiver, reinterpret_cast<struct sockaddr*>(&address),
+              &addressLength);
+
+  ReceiveBuffer receiveBuffer(receiver, false, true);
+  int32_t initialSize = receiveBuffer.getSize();
+  EXPECT_GT(initialSize, 0);
+
+  uint8_t payload[512];
+  memset(payload, 0, sizeof(payload));
+  const int kSentPackets = 1000;
+  for (int i = 0; i < kSentPackets; i++) {
+    sendto(sender, payload, sizeof(payload), 0,
+           reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+  }
+
+  // Only the messages queued after the drops carry their count, so one more
+  // packet is sent once the socket has been drained.
+  uint8_t buffer[sizeof(payload)];
+  uint8_t control[64];
+  struct iovec iov = {buffer, sizeof(buffer)};
+  uint32_t receivedPackets = 0;
+  bool drained = false;
+  while (true) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(receiver, &message, MSG_DONTWAIT) < 0) {
+      if (drained) break;
+      drained = true;
+      sendto(sender, payload, sizeof(payload), 0,
+             reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+      continue;
+    }
+    receiveBuffer.updateDropCount(&message);
+    receivedPackets += 1;
+  }
+  ASSERT_GT(receivedPackets, 1);
+  ASSERT_LE(receivedPackets, kSentPackets);
+
+  uint64_t drops = receiveBuffer.collectDrops();
+  EXPECT_EQ(drops, kSentPackets + 1 - receivedPackets);
+  // Drops grow the buffer.
+  EXPECT_EQ(receiveBuffer.getSize(), 2 * initialSize);
+  // Nothing new, and collected at most once per interval.
+  EXPECT_EQ(receiveBuffer.collectDrops(), 0);
+
+  close(sender);
+  close(receiver);
+}
@@ -0,0 +1,74 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Run a full scan against the simulated network and report the throughput
+// and the probes spent per discovered interface. The scan uses the default
+// flags of flashroute.
+//
+// bazel run -c opt //flashroute:scan_benchmark -- [network] [probing rate]
+// e.g., bazel run -c opt //flashroute:scan_benchmark -- 10.0.0.0/16 400000
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "flashroute/blacklist.h"
+#include "flashroute/bogon_filter.h"
+#include "flashroute/dcb_manager.h"
+#include "flashroute/network.h"
+#include "flashroute/simulated_network.h"
+#include "flashroute/targets.h"
+#include "flashroute/traceroute.h"
+
+using namespace flashroute;
+
+const char kDefaultTargetNetwork[] = "10.0.0.0/16";
+const uint64_t kDefaultProbingRate = 400000;
+const uint32_t kSeed = 1;
+
+int main(int argc, char* argv[]) {
+  std::string targetNetwork = argc > 1 ? argv[1] : kDefaultTargetNetwork;
+  uint64_t probingRate =
+      argc > 2 ? std::strtoull(argv[2], nullptr, 10) : kDefaultProbingRate;
+
+  Blacklist blacklist;
+  BogonFilter bogonFilter{""};
+  Targets targetLoader(16, kSeed, &blacklist, &bogonFilter);
+  std::unique_ptr<DcbManager> dcbManager(
+      targetLoader.generateTargetsFromNetwork(targetNetwork, 24, true));
+  dcbManager->shuffleOrder();
+  uint64_t targets = dcbManager->liveDcbSize();
+
+  SimulatedNetworkConfig config;
+  config.seed = kSeed;
+  SimulatedNetwork network(config);
+  NetworkManager networkManager(nullptr, &network, probingRate);
+
+  Tracerouter tracerouter(dcbManager.get(), &networkManager, nullptr, nullptr,
+                          16, 32, true, 5, true, true, true, 5, 1, 53, 33434,
+                          "flashroute", true, 0, false, 1000);
+
+  auto start = std::chrono::steady_clock::now();
+  tracerouter.startScan(ProberType::UDP_PROBER, true, false);
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  SimulatedNetworkStats stats = network.getStats();
+  std::cout << "Scanned " << targets << " targets of " << targetNetwork
+            << " in " << elapsed << " s" << std::endl;
+  std::cout << "Probes: " << stats.probes << " ("
+            << static_cast<uint64_t>(stats.probes / elapsed) << " pps)"
+            << std::endl;
+  std::cout << "Replies: " << stats.deliveredReplies << ", lost "
+            << stats.lostPackets << ", rate-limited "
+            << stats.rateLimitedReplies << ", unanswered "
+            << stats.unansweredProbes << std::endl;
+  std::cout << "Router interfaces: " << stats.routerInterfaces << " ("
+            << static_cast<double>(stats.probes) /
+                   std::max<uint64_t>(1, stats.routerInterfaces)
+            << " probes/interface)" << std::endl;
+  return 0;
+}
@@ -0,0 +1,346 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/simulated_network.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "glog/logging.h"
+
+#include "flashroute/checksum.h"
+
+namespace flashroute {
+
+namespace {
+
+const uint8_t kIcmpTimeExceeded = 11;
+const uint8_t kIcmpDestinationUnreachable = 3;
+const uint8_t kIcmpPortUnreachable = 3;
+// Initial TTL of the replies.
+const uint8_t kReplyTtl = 64;
+
+// Size of the quoted IP header and UDP header of the probe.
+const size_t kQuotedProbeSize = 28;
+
+// Salts of hash keys, so that properties of the same address are independent.
+const uint64_t kPathLengthSalt = 1ULL << 56;
+const uint64_t kLengthVariationSalt = 2ULL << 56;
+const uint64_t kRouterSalt = 3ULL << 56;
+const uint64_t kSilentRouterSalt = 4ULL << 56;
+const uint64_t kResponsiveSalt = 5ULL << 56;
+
+// Parse an Ipv4 address into host byte order.
+bool parseAddress(const std::string& text, uint32_t* address) {
+  struct in_addr parsed;
+  if (inet_pton(AF_INET, text.c_str(), &parsed) != 1) return false;
+  *address = ntohl(parsed.s_addr);
+  return true;
+}
+
+uint32_t getPrefixMask(uint8_t prefixLength) {
+  return prefixLength == 0 ? 0 : ~0U << (32 - prefixLength);
+}
+
+}  // namespace
+
+void SimulatedRoutes::addRoute(uint32_t prefix, uint8_t prefixLength,
+                               const SimulatedRoute& route) {
+  prefixLength = std::min<uint8_t>(prefixLength, 32);
+  auto result = routes_[prefixLength].emplace(
+      prefix & getPrefixMask(prefixLength), route);
+  if (result.second) {
+    routeCount_ += 1;
+  } else {
+    result.first->second = route;
+  }
+}
+
+bool SimulatedRoutes::loadTopologyFile(const std::string& filePath) {
+  std::ifstream in(filePath);
+  if (!in.is_open()) {
+    LOG(ERROR) << "Simulated network: Failed to open " << filePath;
+    return false;
+  }
+  std::string line;
+  uint32_t lineNumber = 0;
+  while (std::getline(in, line)) {
+    lineNumber += 1;
+    std::istringstream fields(line);
+    std::string network;
+    if (!(fields >> network) || network[0] == '#') continue;
+
+    size_t slash = network.find('/');
+    uint32_t prefix = 0;
+    int32_t prefixLength = 32;
+    if (slash != std::string::npos) {
+      prefixLength = atoi(network.c_str() + slash + 1);
+    }
+    bool valid = parseAddress(network.substr(0, slash), &prefix) &&
+                 prefixLength >= 0 && prefixLength <= 32;
+    SimulatedRoute route;
+    std::string hop;
+    while (valid && fields >> hop) {
+      uint32_t router = 0;
+      if (hop == "!") {
+        route.responsive = false;
+      } else if (hop == "*") {
+        route.routers.push_back(0);
+      } else if (parseAddress(hop, &router)) {
+        route.routers.push_back(router);
+      } else {
+        valid = false;
+      }
+    }
+    if (!valid || route.routers.size() >= 32) {
+      LOG(ERROR) << "Simulated network: Malformed route at line "
+                 << lineNumber << " of " << filePath;
+      return false;
+    }
+    addRoute(prefix, static_cast<uint8_t>(prefixLength), route);
+  }
+  return true;
+}
+
+const SimulatedRoute* SimulatedRoutes::findRoute(uint32_t destination) const {
+  for (int32_t prefixLength = 32; prefixLength >= 0; prefixLength--) {
+    const auto& routes = routes_[prefixLength];
+    if (routes.empty()) continue;
+    auto result = routes.find(destination & getPrefixMask(prefixLength));
+    if (result != routes.end()) return &result->second;
+  }
+  return nullptr;
+}
+
+SimulatedNetwork::SimulatedNetwork(const SimulatedNetworkConfig& config)
+    : config_(config), random_(config.seed), replyIpId_(0) {
+  if (config_.minPathLength < 2 ||
+      config_.maxPathLength < config_.minPathLength ||
+      config_.maxPathLength > 32) {
+    LOG(FATAL) << "Simulated network: Path lengths must satisfy 2 <= min <= "
+                  "max <= 32.";
+  }
+  if (config_.sharedHops >= config_.minPathLength) {
+    LOG(FATAL) << "Simulated network: Shared hops must be shorter than the "
+                  "shortest path.";
+  }
+}
+
+uint64_t SimulatedNetwork::hash(uint64_t value) const {
+  // SplitMix64 finalizer.
+  uint64_t z = value + config_.seed * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+bool SimulatedNetwork::isHashBelow(uint64_t value, double probability) const {
+  return static_cast<double>(hash(value) >> 11) * (1.0 / (1ULL << 53)) <
+         probability;
+}
+
+uint8_t SimulatedNetwork::getPathLength(uint32_t destination) const {
+  const SimulatedRoute* route =
+      config_.routes != nullptr ? config_.routes->findRoute(destination)
+                                : nullptr;
+  if (route != nullptr) return static_cast<uint8_t>(route->routers.size() + 1);
+  return getSyntheticPathLength(destination);
+}
+
+uint32_t SimulatedNetwork::getRouterAddress(uint32_t destination,
+                                            uint8_t hop) const {
+  const SimulatedRoute* route =
+      config_.routes != nullptr ? config_.routes->findRoute(destination)
+                                : nullptr;
+  if (route != nullptr) {
+    return hop >= 1 && hop <= route->routers.size() ? route->routers[hop - 1]
+                                                    : 0;
+  }
+  uint32_t router = getSyntheticRouterAddress(destination, hop);
+  if (isHashBelow(kSilentRouterSalt | router, config_.silentRouterRate)) {
+    return 0;
+  }
+  return router;
+}
+
+uint8_t SimulatedNetwork::getSyntheticPathLength(uint32_t destination) const {
+  uint32_t prefix = destination >> 8;
+  uint32_t range = config_.maxPathLength - config_.minPathLength + 1;
+  int32_t length =
+      config_.minPathLength + hash(kPathLengthSalt | (prefix >> 4)) % range;
+  // Vary by one hop within the /20.
+  length += static_cast<int32_t>(hash(kLengthVariationSalt | prefix) % 3) - 1;
+  return static_cast<uint8_t>(
+      std::min<int32_t>(std::max<int32_t>(length, config_.minPathLength),
+                        config_.maxPathLength));
+}
+
+uint32_t SimulatedNetwork::getSyntheticRouterAddress(uint32_t destination,
+                                                     uint8_t hop) const {
+  uint64_t key = kRouterSalt | (static_cast<uint64_t>(hop) << 48);
+  if (hop > config_.sharedHops) {
+    // The number of prefixes the router aggregates grows with its distance to
+    // the destination.
+    uint32_t shift = std::min<uint32_t>(
+        24,
+        (getSyntheticPathLength(destination) - 1 - hop) * config_.branchBits);
+    key |= (static_cast<uint64_t>(shift) << 32) | ((destination >> 8) >> shift);
+  }
+  uint32_t address = static_cast<uint32_t>(hash(key));
+  return address != 0 ? address : 1;
+}
+
+bool SimulatedNetwork::isResponsiveDestination(uint32_t destination) const {
+  const SimulatedRoute* route =
+      config_.routes != nullptr ? config_.routes->findRoute(destination)
+                                : nullptr;
+  if (route != nullptr) return route->responsive;
+  return isHashBelow(kResponsiveSalt | destination, config_.responsiveRate);
+}
+
+void SimulatedNetwork::send(const uint8_t* packet, size_t size) {
+  const struct ip* header = reinterpret_cast<const struct ip*>(packet);
+  std::lock_guard<std::mutex> guard(mutex_);
+  stats_.probes += 1;
+  if (size < kQuotedProbeSize || header->ip_v != 4 || header->ip_hl != 5 ||
+      header->ip_p != IPPROTO_UDP) {
+    stats_.malformedProbes += 1;
+    return;
+  }
+  std::uniform_real_distribution<double> uniform(0, 1);
+  if (uniform(random_) < config_.lossRate) {
+    stats_.lostPackets += 1;
+    return;
+  }
+
+  uint32_t destination = ntohl(header->ip_dst.s_addr);
+  uint8_t ttl = header->ip_ttl;
+  uint8_t pathLength = getPathLength(destination);
+  auto now = std::chrono::steady_clock::now();
+  if (ttl == 0) {
+    stats_.unansweredProbes += 1;
+  } else if (ttl < pathLength) {
+    uint32_t router = getRouterAddress(destination, ttl);
+    if (router == 0) {
+      stats_.unansweredProbes += 1;
+    } else if (takeIcmpToken(router, now)) {
+      // The router quotes the probe as it arrived, with one hop to live.
+      scheduleReply(packet, router, kIcmpTimeExceeded, 0, 1, ttl, now);
+    }
+  } else if (!isResponsiveDestination(destination)) {
+    stats_.unansweredProbes += 1;
+  } else if (takeIcmpToken(destination, now)) {
+    scheduleReply(packet, destination, kIcmpDestinationUnreachable,
+                  kIcmpPortUnreachable,
+                  static_cast<uint8_t>(ttl - (pathLength - 1)), pathLength,
+                  now);
+  }
+}
+
+bool SimulatedNetwork::takeIcmpToken(
+    uint32_t router, std::chrono::steady_clock::time_point now) {
+  if (config_.icmpRateLimit == 0) return true;
+  auto result = tokenBuckets_.emplace(
+      router, TokenBucket{static_cast<double>(config_.icmpBurst), now});
+  TokenBucket& bucket = result.first->second;
+  double elapsed =
+      std::chrono::duration<double>(now - bucket.updated).count();
+  bucket.tokens = std::min<double>(
+      config_.icmpBurst, bucket.tokens + elapsed * config_.icmpRateLimit);
+  bucket.updated = now;
+  if (bucket.tokens < 1) {
+    stats_.rateLimitedReplies += 1;
+    return false;
+  }
+  bucket.tokens -= 1;
+  return true;
+}
+
+void SimulatedNetwork::scheduleReply(
+    const uint8_t* probe, uint32_t responder, uint8_t type, uint8_t code,
+    uint8_t quotedTtl, uint8_t distance,
+    std::chrono::steady_clock::time_point now) {
+  std::uniform_real_distribution<double> uniform(0, 1);
+  if (uniform(random_) < config_.lossRate) {
+    stats_.lostPackets += 1;
+    return;
+  }
+  if (type == kIcmpTimeExceeded) routerInterfaces_.insert(responder);
+
+  PendingReply reply;
+  uint32_t rttUs = config_.baseRttUs + distance * config_.hopRttUs;
+  if (config_.jitterUs > 0) rttUs += random_() % config_.jitterUs;
+  reply.due = now + std::chrono::microseconds(rttUs);
+
+  uint8_t* packet = reply.packet;
+  memset(packet, 0, kSimulatedReplySize);
+  struct ip* header = reinterpret_cast<struct ip*>(packet);
+  header->ip_v = 4;
+  header->ip_hl = 5;
+  header->ip_len = htons(kSimulatedReplySize);
+  header->ip_id = htons(replyIpId_++);
+  header->ip_ttl = static_cast<uint8_t>(kReplyTtl - distance);
+  header->ip_p = IPPROTO_ICMP;
+  header->ip_src.s_addr = htonl(responder);
+  memcpy(&header->ip_dst,
+         &reinterpret_cast<const struct ip*>(probe)->ip_src,
+         sizeof(header->ip_dst));
+  fillIpv4HeaderChecksum(packet);
+
+  uint8_t* icmp = packet + 20;
+  icmp[0] = type;
+  icmp[1] = code;
+  memcpy(icmp + 8, probe, kQuotedProbeSize);
+  reinterpret_cast<struct ip*>(icmp + 8)->ip_ttl = quotedTtl;
+  uint16_t checksum = getInternetChecksum(icmp, kSimulatedReplySize - 20);
+  memcpy(icmp + 2, &checksum, sizeof(checksum));
+
+  bool earliest =
+      pendingReplies_.empty() || reply.due < pendingReplies_.top().due;
+  pendingReplies_.push(reply);
+  if (earliest) replyReady_.notify_one();
+}
+
+size_t SimulatedNetwork::receive(uint8_t* buffers, size_t bufferSize,
+                                 ReceivedPacket* packets, size_t maxPackets,
+                                 int32_t timeoutMs) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(timeoutMs);
+  size_t count = 0;
+  while (count < maxPackets) {
+    auto now = std::chrono::steady_clock::now();
+    if (!pendingReplies_.empty() && pendingReplies_.top().due <= now) {
+      uint8_t* buffer = buffers + count * bufferSize;
+      memcpy(buffer, pendingReplies_.top().packet,
+             std::min(bufferSize, kSimulatedReplySize));
+      packets[count].buffer = buffer;
+      packets[count].size = std::min(bufferSize, kSimulatedReplySize);
+      pendingReplies_.pop();
+      count += 1;
+      continue;
+    }
+    // Return the due replies, or wait for the next one.
+    if (count > 0 || now >= deadline) break;
+    auto wakeUp = deadline;
+    if (!pendingReplies_.empty() && pendingReplies_.top().due < wakeUp) {
+      wakeUp = pendingReplies_.top().due;
+    }
+    replyReady_.wait_until(lock, wakeUp);
+  }
+  stats_.deliveredReplies += count;
+  return count;
+}
+
+SimulatedNetworkStats SimulatedNetwork::getStats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  SimulatedNetworkStats stats = stats_;
+  stats.routerInterfaces = routerInterfaces_.size();
+  return stats;
+}
+
+}  // namespace flashroute
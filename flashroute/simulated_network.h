@@ -0,0 +1,229 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "flashroute/prober.h"
+
+namespace flashroute {
+
+// Size of a reply: IP header, ICMP header, and the IP header and the first 8
+// bytes of the probe quoted as RFC 792 requires.
+const size_t kSimulatedReplySize = 56;
+
+// The route to the destinations of a prefix. routers[i] is the interface at
+// hop i + 1, or 0 if the router at the hop is silent. The destinations are one
+// hop beyond the last router.
+struct SimulatedRoute {
+  std::vector<uint32_t> routers;
+  bool responsive = true;
+};
+
+/**
+ * SimulatedRoutes holds recorded routes which override the synthetic topology
+ * of SimulatedNetwork for the destinations they cover. A destination takes the
+ * route of the longest prefix which contains it.
+ *
+ * A topology file has one route per line: a prefix, then the interface of
+ * every hop, '*' for a silent hop. A trailing '!' marks the destinations as
+ * silent. Empty lines and lines starting with '#' are skipped.
+ *
+ * # 10.0.0.0/24 is 4 hops away, the third hop never replies.
+ * 10.0.0.0/24 192.168.1.1 172.16.0.1 * 172.16.3.1
+ * 10.0.1.0/24 192.168.1.1 172.16.0.1 !
+ */
+class SimulatedRoutes {
+ public:
+  // Add or replace the route of a prefix in host byte order.
+  void addRoute(uint32_t prefix, uint8_t prefixLength,
+                const SimulatedRoute& route);
+
+  // Load routes from a topology file. Return false if the file cannot be read
+  // or a line is malformed.
+  bool loadTopologyFile(const std::string& filePath);
+
+  // Return the route of the longest prefix containing the destination, or
+  // nullptr.
+  const SimulatedRoute* findRoute(uint32_t destination) const;
+
+  size_t size() const { return routeCount_; }
+
+ private:
+  // Routes indexed by prefix length, then by prefix.
+  std::unordered_map<uint32_t, SimulatedRoute> routes_[33];
+  size_t routeCount_ = 0;
+};
+
+// Synthetic topology and link behavior of SimulatedNetwork. Every property is
+// derived from the seed and the addresses, so the same configuration always
+// builds the same topology.
+struct SimulatedNetworkConfig {
+  uint64_t seed = 1;
+
+  // Address of the vantage point in host byte order, used as the source of
+  // probes.
+  uint32_t localAddress = 0xC0A80002;  // 192.168.0.2
+
+  // Hop distance of the destinations of a /24 prefix. Prefixes of the same
+  // /20 are within one hop of each other, as the distance prediction of
+  // preprobing assumes.
+  uint8_t minPathLength = 8;
+  uint8_t maxPathLength = 24;
+
+  // The first sharedHops routers are shared by all paths. Beyond them, paths
+  // form a tree which is rooted at the vantage point: the last router before a
+  // destination serves a single /24, and every hop closer to the vantage point
+  // aggregates 2^branchBits times more prefixes.
+  uint8_t sharedHops = 2;
+  uint8_t branchBits = 2;
+
+  // Fraction of destinations which reply Port Unreachable.
+  double responsiveRate = 0.3;
+  // Fraction of routers which never reply.
+  double silentRouterRate = 0.05;
+  // Probability that a probe or its reply is lost.
+  double lossRate = 0.01;
+
+  // ICMP errors a router sends per second and in a burst, like the token
+  // bucket of the Linux icmp_ratelimit. Zero disables rate limiting.
+  uint32_t icmpRateLimit = 1000;
+  uint32_t icmpBurst = 50;
+
+  // The round trip time of a reply from hop distance d is baseRttUs +
+  // d * hopRttUs plus a uniform jitter of up to jitterUs microseconds.
+  uint32_t baseRttUs = 2000;
+  uint32_t hopRttUs = 1000;
+  uint32_t jitterUs = 500;
+
+  // Recorded routes which override the synthetic topology, or nullptr. Must
+  // outlive the network.
+  const SimulatedRoutes* routes = nullptr;
+};
+
+// Counters of SimulatedNetwork.
+struct SimulatedNetworkStats {
+  uint64_t probes = 0;
+  // Probes which are not Ipv4 UDP packets.
+  uint64_t malformedProbes = 0;
+  // Probes which expired at a silent router or reached a destination which
+  // does not reply.
+  uint64_t unansweredProbes = 0;
+  uint64_t lostPackets = 0;
+  uint64_t rateLimitedReplies = 0;
+  uint64_t deliveredReplies = 0;
+  // Distinct router interfaces which replied at least one Time Exceeded.
+  uint64_t routerInterfaces = 0;
+};
+
+/**
+ * SimulatedNetwork answers the probes packed by a prober from a synthetic
+ * topology, so that full scans can be run and benchmarked in process, without
+ * root, a NIC or replies from the Internet. It backs the SIMULATED sending
+ * backend of NetworkManager.
+ *
+ * A probe whose TTL expires before its destination gets a Time Exceeded from
+ * the router at that hop, otherwise the destination replies Port Unreachable
+ * quoting the probe with its remaining TTL. Replies are released after a round
+ * trip time which grows with the hop distance, unless the probe or the reply
+ * is lost, or the router is silent or rate-limited. Recorded routes in
+ * config.routes take precedence over the synthetic topology. Only Ipv4 is
+ * simulated.
+ *
+ * Example:
+ *
+ * SimulatedNetworkConfig config;
+ * config.lossRate = 0;
+ * SimulatedNetwork network(config);
+ *
+ * NetworkManager networkManager(
+ *  &prober,   // The prober to process packets.
+ *  &network,  // Probes are answered by the simulated network.
+ *  100000     // The packet sending rate.
+ * );
+ */
+class SimulatedNetwork {
+ public:
+  explicit SimulatedNetwork(const SimulatedNetworkConfig& config);
+
+  // Answer a probe which starts at the IP header. Thread-safe.
+  void send(const uint8_t* packet, size_t size);
+
+  // Move up to maxPackets replies which are due into buffers, whose size is
+  // bufferSize each, at least kSimulatedReplySize, and describe them in
+  // packets. Wait up to timeoutMs milliseconds for the first reply. Return the
+  // number of replies. Thread-safe.
+  size_t receive(uint8_t* buffers, size_t bufferSize, ReceivedPacket* packets,
+                 size_t maxPackets, int32_t timeoutMs);
+
+  // Return the hop distance of the destination. Exposed for testing.
+  uint8_t getPathLength(uint32_t destination) const;
+
+  // Return the interface of the router at the hop on the path to the
+  // destination, with 0 < hop < getPathLength(destination), or 0 if the
+  // router is silent. Exposed for testing.
+  uint32_t getRouterAddress(uint32_t destination, uint8_t hop) const;
+
+  // Return true if the destination replies Port Unreachable.
+  bool isResponsiveDestination(uint32_t destination) const;
+
+  uint32_t getLocalAddress() const { return config_.localAddress; }
+
+  SimulatedNetworkStats getStats();
+
+ private:
+  struct PendingReply {
+    std::chrono::steady_clock::time_point due;
+    uint8_t packet[kSimulatedReplySize];
+
+    bool operator>(const PendingReply& other) const { return due > other.due; }
+  };
+
+  struct TokenBucket {
+    double tokens;
+    std::chrono::steady_clock::time_point updated;
+  };
+
+  SimulatedNetworkConfig config_;
+
+  std::mutex mutex_;
+  std::condition_variable replyReady_;
+  std::priority_queue<PendingReply, std::vector<PendingReply>,
+                      std::greater<PendingReply>>
+      pendingReplies_;
+  std::mt19937_64 random_;
+  std::unordered_map<uint32_t, TokenBucket> tokenBuckets_;
+  std::unordered_set<uint32_t> routerInterfaces_;
+  uint16_t replyIpId_;
+  SimulatedNetworkStats stats_;
+
+  // Path length and router of the synthetic topology.
+  uint8_t getSyntheticPathLength(uint32_t destination) const;
+  uint32_t getSyntheticRouterAddress(uint32_t destination, uint8_t hop) const;
+
+  // Hash of the value salted by the seed, uniform in [0, 2^64).
+  uint64_t hash(uint64_t value) const;
+
+  // Return true with the probability, which is drawn from hash.
+  bool isHashBelow(uint64_t value, double probability) const;
+
+  // Take a token of the router. Caller must hold mutex_.
+  bool takeIcmpToken(uint32_t router,
+                     std::chrono::steady_clock::time_point now);
+
+  // Build a reply from the responder quoting the probe and queue it. Caller
+  // must hold mutex_.
+  void scheduleReply(const uint8_t* probe, uint32_t responder, uint8_t type,
+                     uint8_t code, uint8_t quotedTtl, uint8_t distance,
+                     std::chrono::steady_clock::time_point now);
+};
+
+}  // namespace flashroute
@@ -0,0 +1,265 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flashroute/address.h"
+#include "flashroute/network.h"
+#include "flashroute/prober_test_util.h"
+#include "flashroute/simulated_network.h"
+#include "flashroute/udp_prober.h"
+
+using namespace flashroute;
+
+const size_t kTestBufferSize = 512;
+
+// A network which answers every probe without delay.
+SimulatedNetworkConfig getLosslessConfig() {
+  SimulatedNetworkConfig config;
+  config.responsiveRate = 1;
+  config.silentRouterRate = 0;
+  config.lossRate = 0;
+  config.icmpRateLimit = 0;
+  config.baseRttUs = 0;
+  config.hopRttUs = 0;
+  config.jitterUs = 0;
+  return config;
+}
+
+// Send a probe and return the decoded replies.
+std::vector<ProbeResponse<Ipv4Address>> sendProbe(SimulatedNetwork* network,
+                                                   UdpProber* prober,
+                                                   uint32_t destination,
+                                                   uint8_t ttl) {
+  uint8_t probe[kTestBufferSize];
+  size_t probeSize =
+      prober->packProbe(Ipv4Address(destination),
+                        Ipv4Address(network->getLocalAddress()), ttl, probe);
+  network->send(probe, probeSize);
+
+  std::vector<uint8_t> buffers(4 * kTestBufferSize);
+  ReceivedPacket packets[4];
+  size_t count =
+      network->receive(buffers.data(), kTestBufferSize, packets, 4, 10);
+  std::vector<ProbeResponse<Ipv4Address>> responses;
+  prober->parseResponses(packets, count, SocketType::ICMP,
+                         [&responses](const ProbeResponse<Ipv4Address>& r,
+                                      const ReceivedPacket& /* packet */) {
+                           responses.push_back(r);
+                         });
+  return responses;
+}
+
+TEST(SimulatedNetwork, TopologyTest) {
+  SimulatedNetworkConfig config = getLosslessConfig();
+  SimulatedNetwork network(config);
+  SimulatedNetwork sameNetwork(config);
+
+  uint32_t lastHopRouters = 0;
+  for (uint32_t prefix = 0x0A0000; prefix < 0x0A0100; prefix++) {
+    uint32_t destination = (prefix << 8) | 1;
+    uint8_t length = network.getPathLength(destination);
+    EXPECT_GE(length, config.minPathLength);
+    EXPECT_LE(length, config.maxPathLength);
+    EXPECT_EQ(length, sameNetwork.getPathLength(destination));
+    // Every address of a /24 is at the same distance.
+    EXPECT_EQ(length, network.getPathLength(destination | 0xFE));
+    // Prefixes of a /20 are within one hop of each other.
+    uint8_t neighborLength = network.getPathLength(destination ^ 0x100);
+    EXPECT_LE(std::abs(length - neighborLength), 2);
+
+    // The first hops are shared by all paths.
+    EXPECT_EQ(network.getRouterAddress(destination, 1),
+              network.getRouterAddress(0x01020304, 1));
+    // The last router serves the /24 only.
+    EXPECT_EQ(network.getRouterAddress(destination, length - 1),
+              network.getRouterAddress(destination | 0xFE, length - 1));
+    if (network.getRouterAddress(destination, length - 1) !=
+        network.getRouterAddress(destination ^ 0x100, length - 1)) {
+      lastHopRouters += 1;
+    }
+  }
+  EXPECT_GT(lastHopRouters, 200);
+}
+
+TEST(SimulatedNetwork, RepliesTest) {
+  SimulatedNetwork network(getLosslessConfig());
+  PacketReceiverCallback callback = getIgnoringCallback();
+  UdpProber prober(&callback, 0, 1, 53, "test", true, 0);
+
+  uint32_t destination = 0x0A010203;
+  uint8_t length = network.getPathLength(destination);
+  for (uint8_t ttl = 1; ttl < length; ttl++) {
+    auto responses = sendProbe(&network, &prober, destination, ttl);
+    ASSERT_EQ(responses.size(), 1);
+    EXPECT_EQ(responses[0].destination.getIpv4Address(), destination);
+    EXPECT_EQ(responses[0].responder.getIpv4Address(),
+              network.getRouterAddress(destination, ttl));
+    EXPECT_EQ(responses[0].distance, ttl);
+    EXPECT_FALSE(responses[0].fromDestination);
+  }
+
+  // The destination replies with the distance of the path.
+  auto responses = sendProbe(&network, &prober, destination, 32);
+  ASSERT_EQ(responses.size(), 1);
+  EXPECT_EQ(responses[0].responder.getIpv4Address(), destination);
+  EXPECT_EQ(responses[0].distance, length);
+  EXPECT_TRUE(responses[0].fromDestination);
+
+  SimulatedNetworkStats stats = network.getStats();
+  EXPECT_EQ(stats.probes, length);
+  EXPECT_EQ(stats.deliveredReplies, length);
+  EXPECT_EQ(stats.routerInterfaces, length - 1);
+}
+
+TEST(SimulatedNetwork, LossAndRateLimitTest) {
+  PacketReceiverCallback callback = getIgnoringCallback();
+  UdpProber prober(&callback, 0, 1, 53, "test", true, 0);
+
+  SimulatedNetworkConfig config = getLosslessConfig();
+  config.lossRate = 1;
+  SimulatedNetwork lossyNetwork(config);
+  EXPECT_TRUE(sendProbe(&lossyNetwork, &prober, 0x0A010203, 1).empty());
+  EXPECT_EQ(lossyNetwork.getStats().lostPackets, 1);
+
+  // The first hop router answers a burst of two, then one per second.
+  config = getLosslessConfig();
+  config.icmpRateLimit = 1;
+  config.icmpBurst = 2;
+  SimulatedNetwork limitedNetwork(config);
+  size_t replies = 0;
+  for (uint32_t i = 0; i < 5; i++) {
+    replies += sendProbe(&limitedNetwork, &prober, 0x0A010203 + (i << 8), 1)
+                   .size();
+  }
+  EXPECT_EQ(replies, 2);
+  EXPECT_EQ(limitedNetwork.getStats().rateLimitedReplies, 3);
+}
+
+TEST(SimulatedNetwork, DelayTest) {
+  SimulatedNetworkConfig config = getLosslessConfig();
+  config.baseRttUs = 50000;
+  SimulatedNetwork network(config);
+  uint8_t probe[kTestBufferSize] = {0x45};
+  probe[8] = 1;  // TTL
+  probe[9] = IPPROTO_UDP;
+  network.send(probe, 28);
+
+  std::vector<uint8_t> buffer(kTestBufferSize);
+  ReceivedPacket packet;
+  // The reply is not due before the round trip time.
+  EXPECT_EQ(network.receive(buffer.data(), kTestBufferSize, &packet, 1, 0), 0);
+  EXPECT_EQ(network.receive(buffer.data(), kTestBufferSize, &packet, 1, 1000),
+            1);
+  EXPECT_EQ(packet.size, kSimulatedReplySize);
+}
+
+TEST(SimulatedNetwork, RecordedRoutesTest) {
+  std::string filePath = testing::TempDir() + "simulated_topology.txt";
+  std::ofstream topology(filePath);
+  topology << "# Recorded routes.\n"
+           << "10.0.0.0/16 192.168.1.1 172.16.0.1 172.16.0.2\n"
+           << "10.0.1.0/24 192.168.1.1 * 172.16.1.1 172.16.1.2 !\n"
+           << "\n";
+  topology.close();
+  SimulatedRoutes routes;
+  ASSERT_TRUE(routes.loadTopologyFile(filePath));
+  std::remove(filePath.c_str());
+  EXPECT_EQ(routes.size(), 2);
+  EXPECT_FALSE(routes.loadTopologyFile(filePath));
+
+  // Destinations take the route of the longest prefix.
+  EXPECT_EQ(routes.findRoute(0x0A000203)->routers.size(), 3);
+  EXPECT_EQ(routes.findRoute(0x0A000103)->routers.size(), 4);
+  EXPECT_EQ(routes.findRoute(0x0B000103), nullptr);
+
+  SimulatedNetworkConfig config = getLosslessConfig();
+  config.routes = &routes;
+  SimulatedNetwork network(config);
+  PacketReceiverCallback callback = getIgnoringCallback();
+  UdpProber prober(&callback, 0, 1, 53, "test", true, 0);
+
+  auto responses = sendProbe(&network, &prober, 0x0A000203, 2);
+  ASSERT_EQ(responses.size(), 1);
+  EXPECT_EQ(responses[0].responder.getIpv4Address(), 0xAC100001);
+  responses = sendProbe(&network, &prober, 0x0A000203, 32);
+  ASSERT_EQ(responses.size(), 1);
+  EXPECT_EQ(responses[0].distance, 4);
+  EXPECT_TRUE(responses[0].fromDestination);
+
+  // Silent hops and destinations do not reply.
+  EXPECT_TRUE(sendProbe(&network, &prober, 0x0A000103, 2).empty());
+  EXPECT_EQ(sendProbe(&network, &prober, 0x0A000103, 4).size(), 1);
+  EXPECT_TRUE(sendProbe(&network, &prober, 0x0A000103, 32).empty());
+
+  // Other destinations keep the synthetic topology.
+  EXPECT_EQ(network.getPathLength(0x0B000103),
+            SimulatedNetwork(getLosslessConfig()).getPathLength(0x0B000103));
+}
+
+TEST(SimulatedNetwork, NetworkManagerTest) {
+  SimulatedNetwork network(getLosslessConfig());
+  std::vector<uint8_t> distances;
+  PacketReceiverCallback callback =
+      [&distances](const IpAddress& /* destination */,
+                   const IpAddress& /* responder */, uint8_t distance,
+                   uint32_t /* rtt */, bool /* fromDestination */,
+                   bool /* ipv4 */, void* /* packetHeader */,
+                   size_t /* headerLen */) {
+        distances.push_back(distance);
+      };
+  UdpProber prober(&callback, 0, 1, 53, "test", true, 0);
+
+  NetworkManager networkManager(&prober, &network, 1000);
+  networkManager.startListening();
+  for (uint8_t ttl = 1; ttl <= 4; ttl++) {
+    networkManager.scheduleProbeRemoteHost(Ipv4Address(0x0A010203), ttl);
+  }
+  for (int i = 0; i < 100 && networkManager.getReceivedPacketCount() < 4;
+       i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  networkManager.stopListening();
+
+  EXPECT_EQ(networkManager.getSentPacketCount(), 4);
+  EXPECT_EQ(networkManager.getReceivedPacketCount(), 4);
+  ASSERT_EQ(distances.size(), 4);
+  std::sort(distances.begin(), distances.end());
+  for (uint8_t ttl = 1; ttl <= 4; ttl++) EXPECT_EQ(distances[ttl - 1], ttl);
+}
+
+TEST(SimulatedNetwork, TimestampingTest) {
+  SimulatedNetworkConfig config = getLosslessConfig();
+  config.baseRttUs = 20000;
+  SimulatedNetwork network(config);
+  std::vector<uint32_t> rtts;
+  PacketReceiverCallback callback =
+      [&rtts](const IpAddress& /* destination */,
+              const IpAddress& /* responder */, uint8_t /* distance */,
+              uint32_t rtt, bool /* fromDestination */, bool /* ipv4 */,
+              void* /* packetHeader */,
+              size_t /* headerLen */) { rtts.push_back(rtt); };
+  UdpProber prober(&callback, 0, 1, 53, "test", true, 0);
+
+  NetworkManager networkManager(&prober, &network, 1000);
+  networkManager.setTimestampingMode(TimestampingMode::SOFTWARE);
+  networkManager.startListening();
+  networkManager.scheduleProbeRemoteHost(Ipv4Address(0x0A010203), 1);
+  for (int i = 0; i < 100 && networkManager.getReceivedPacketCount() < 1;
+       i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  networkManager.stopListening();
+
+  // The RTT is in microseconds and is not rounded to the millisecond clock.
+  ASSERT_EQ(rtts.size(), 1);
+  EXPECT_GE(rtts[0], 20000);
+  EXPECT_LT(rtts[0], 40000);
+}
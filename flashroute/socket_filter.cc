@@ -0,0 +1,181 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/socket_filter.h"
+
+#include <endian.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+
+#include "glog/logging.h"
+
+namespace flashroute {
+
+namespace {
+
+// Offsets from the IP header of a response, with the same fixed header sizes
+// which the probers assume: a 20-byte Ipv4 header without options, a 40-byte
+// Ipv6 header without extension headers and an 8-byte ICMP header. Ipv6 has
+// no ID.
+struct ResponseLayout {
+  uint32_t protocol;
+  uint32_t icmpProtocol;
+  uint32_t icmpType;
+  uint32_t timeExceeded;
+  uint32_t destinationUnreachable;
+  uint32_t quotedId;
+  uint32_t quotedProtocol;
+  uint32_t quotedDestination;
+  uint32_t quotedDestinationWords;
+  uint32_t quotedSourcePort;
+  uint32_t quotedDestinationPort;
+};
+
+const ResponseLayout kIpv4Layout = {
+    9, IPPROTO_ICMP, 20, ICMP_TIME_EXCEEDED, ICMP_DEST_UNREACH,
+    32, 37, 44, 2, 48, 50};
+
+const ResponseLayout kIpv6Layout = {
+    6, IPPROTO_ICMPV6, 40, ICMP6_TIME_EXCEEDED, ICMP6_DST_UNREACH,
+    0, 54, 72, 8, 88, 90};
+
+// Value returned to keep the whole packet.
+const uint32_t kAcceptPacket = 0xFFFFFFFF;
+
+// A program under construction. Failed checks jump to the final drop, whose
+// distance is only known at the end.
+class ProgramBuilder {
+ public:
+  explicit ProgramBuilder(int32_t networkOffset)
+      : networkOffset_(networkOffset) {}
+
+  void load(uint16_t size, uint32_t offset) {
+    add(BPF_STMT(BPF_LD | size | BPF_ABS,
+                 static_cast<uint32_t>(networkOffset_ + offset)));
+  }
+
+  void statement(uint16_t code, uint32_t k) { add(BPF_STMT(code, k)); }
+
+  // Continue if A equals k, otherwise drop.
+  void expect(uint32_t k) {
+    dropJumps_.push_back(program_.size());
+    add(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, k, 0, 0));
+  }
+
+  // Continue if A equals k1 or k2, otherwise drop.
+  void expectEither(uint32_t k1, uint32_t k2) {
+    add(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, k1, 1, 0));
+    expect(k2);
+  }
+
+  // Continue if A equals X, otherwise drop.
+  void expectX() {
+    dropJumps_.push_back(program_.size());
+    add(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, 0, 0));
+  }
+
+  std::vector<struct sock_filter> finish() {
+    statement(BPF_RET | BPF_K, kAcceptPacket);
+    size_t drop = program_.size();
+    statement(BPF_RET | BPF_K, 0);
+    for (size_t jump : dropJumps_) {
+      program_[jump].jf = static_cast<uint8_t>(drop - jump - 1);
+    }
+    return program_;
+  }
+
+ private:
+  int32_t networkOffset_;
+  std::vector<struct sock_filter> program_;
+  std::vector<size_t> dropJumps_;
+
+  void add(struct sock_filter instruction) { program_.push_back(instruction); }
+};
+
+// Swap the bytes of the 16-bit value in A.
+void swapBytes(ProgramBuilder* builder) {
+  builder->statement(BPF_ST, 0);
+  builder->statement(BPF_ALU | BPF_AND | BPF_K, 0xFF);
+  builder->statement(BPF_ALU | BPF_LSH | BPF_K, 8);
+  builder->statement(BPF_MISC | BPF_TAX, 0);
+  builder->statement(BPF_LD | BPF_MEM, 0);
+  builder->statement(BPF_ALU | BPF_RSH | BPF_K, 8);
+  builder->statement(BPF_ALU | BPF_OR | BPF_X, 0);
+}
+
+// Fold the carries of the 32-bit sum in A into its low 16 bits.
+void foldChecksum(ProgramBuilder* builder) {
+  builder->statement(BPF_ST, 0);
+  builder->statement(BPF_ALU | BPF_RSH | BPF_K, 16);
+  builder->statement(BPF_MISC | BPF_TAX, 0);
+  builder->statement(BPF_LD | BPF_MEM, 0);
+  builder->statement(BPF_ALU | BPF_AND | BPF_K, 0xFFFF);
+  builder->statement(BPF_ALU | BPF_ADD | BPF_X, 0);
+}
+
+}  // namespace
+
+std::vector<struct sock_filter> compileResponseFilter(
+    const ResponseFilter& filter, int32_t networkOffset) {
+  const ResponseLayout& layout = filter.ipv4 ? kIpv4Layout : kIpv6Layout;
+  ProgramBuilder builder(networkOffset);
+  // Loads past the end of a packet drop it, which rejects truncated responses
+  // as well.
+  builder.load(BPF_B, layout.protocol);
+  builder.expect(layout.icmpProtocol);
+  builder.load(BPF_B, layout.icmpType);
+  builder.expectEither(layout.timeExceeded, layout.destinationUnreachable);
+  builder.load(BPF_B, layout.quotedProtocol);
+  builder.expect(IPPROTO_UDP);
+  builder.load(BPF_H, layout.quotedDestinationPort);
+  builder.expect(filter.destinationPort);
+  if (filter.checksumField == ChecksumField::SOURCE_PORT ||
+      (filter.checksumField == ChecksumField::IP_ID && filter.ipv4)) {
+    // Sum the 16-bit words of the quoted destination in X, fold the sum
+    // twice, which is enough for 8 words, and complement it.
+    builder.load(BPF_H, layout.quotedDestination);
+    for (uint32_t i = 1; i < layout.quotedDestinationWords; i++) {
+      builder.statement(BPF_MISC | BPF_TAX, 0);
+      builder.load(BPF_H, layout.quotedDestination + 2 * i);
+      builder.statement(BPF_ALU | BPF_ADD | BPF_X, 0);
+    }
+    foldChecksum(&builder);
+    foldChecksum(&builder);
+    builder.statement(BPF_ALU | BPF_XOR | BPF_K, 0xFFFF);
+    builder.statement(BPF_ALU | BPF_ADD | BPF_K, filter.checksumOffset);
+    builder.statement(BPF_ALU | BPF_AND | BPF_K, 0xFFFF);
+    if (filter.checksumField == ChecksumField::SOURCE_PORT) {
+      builder.statement(BPF_MISC | BPF_TAX, 0);
+      builder.load(BPF_H, layout.quotedSourcePort);
+    } else {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+      // Loads are in network byte order.
+      swapBytes(&builder);
+#endif
+      builder.statement(BPF_MISC | BPF_TAX, 0);
+      builder.load(BPF_H, layout.quotedId);
+    }
+    builder.expectX();
+  }
+  return builder.finish();
+}
+
+bool attachSocketFilter(int socket,
+                        const std::vector<struct sock_filter>& program) {
+  struct sock_fprog filter;
+  filter.len = static_cast<uint16_t>(program.size());
+  filter.filter = const_cast<struct sock_filter*>(program.data());
+  if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter,
+                 sizeof(filter)) < 0) {
+    LOG(ERROR) << "Socket filter: Failed to attach the filter. Errno: "
+               << errno;
+    return false;
+  }
+  return true;
+}
+
+bool attachResponseFilter(int socket, const ResponseFilter& filter) {
+  return attachSocketFilter(socket, compileResponseFilter(filter));
+}
+
+}  // namespace flashroute
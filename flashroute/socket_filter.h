@@ -0,0 +1,40 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <linux/filter.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace flashroute {
+
+// The field of the quoted probe which carries the Internet checksum of the
+// quoted destination address plus an offset.
+// SOURCE_PORT: the UDP source port, as written by UdpProber and UdpProberIpv6.
+// IP_ID: the Ipv4 ID in host byte order, as written by UdpIdempotentProber.
+enum class ChecksumField { NONE, SOURCE_PORT, IP_ID };
+
+// The responses a prober accepts: ICMP Time-Exceeded and
+// Destination-Unreachable messages quoting a UDP probe to destinationPort,
+// whose checksum field matches checksumOffset.
+struct ResponseFilter {
+  bool ipv4 = true;
+  uint16_t destinationPort = 0;
+  ChecksumField checksumField = ChecksumField::NONE;
+  uint16_t checksumOffset = 0;
+};
+
+// Compile the filter into a classic BPF program which accepts or drops a
+// packet whose IP header is at networkOffset of the data seen by the program.
+// SKF_NET_OFF finds the IP header of any socket type.
+std::vector<struct sock_filter> compileResponseFilter(
+    const ResponseFilter& filter, int32_t networkOffset = SKF_NET_OFF);
+
+// Make the kernel drop the packets rejected by the program before they are
+// queued to the socket. Attaching replaces the program attached before.
+bool attachSocketFilter(int socket,
+                        const std::vector<struct sock_filter>& program);
+
+bool attachResponseFilter(int socket, const ResponseFilter& filter);
+
+}  // namespace flashroute
@@ -0,0 +1,148 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/prober_test_util.h"
+#include "flashroute/socket_filter.h"
+#include "flashroute/udp_idempotent_prober.h"
+#include "flashroute/udp_prober.h"
+#include "flashroute/udp_prober_v6.h"
+
+using namespace flashroute;
+
+namespace {
+
+const size_t kTestBufferSize = 512;
+const uint16_t kTestPort = 33434;
+
+PacketReceiverCallback ignoreResponse = getIgnoringCallback();
+
+// Run the program in the kernel: the packet is sent through a datagram
+// socket pair whose receiving end has the program attached. The data seen by
+// the program starts at the IP header.
+bool passesFilter(const std::vector<struct sock_filter>& program,
+                  const uint8_t* packet, size_t size) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0) return false;
+  bool passed = attachSocketFilter(sockets[1], program) &&
+                send(sockets[0], packet, size, 0) ==
+                    static_cast<ssize_t>(size);
+  uint8_t received[kTestBufferSize];
+  passed = passed && recv(sockets[1], received, sizeof(received),
+                          MSG_DONTWAIT) == static_cast<ssize_t>(size);
+  close(sockets[0]);
+  close(sockets[1]);
+  return passed;
+}
+
+// Build an ICMP response of the given type quoting a probe of the prober.
+size_t packResponse(Prober* prober, const IpAddress& destination,
+                    const IpAddress& source, uint8_t icmpType, bool ipv4,
+                    uint8_t* buffer) {
+  memset(buffer, 0, kTestBufferSize);
+  size_t headerSize = ipv4 ? 28 : 48;
+  size_t probeSize =
+      prober->packProbe(destination, source, 16, buffer + headerSize);
+  if (ipv4) {
+    buffer[0] = 0x45;
+    buffer[9] = IPPROTO_ICMP;
+    buffer[20] = icmpType;
+  } else {
+    buffer[0] = 0x60;
+    buffer[6] = IPPROTO_ICMPV6;
+    buffer[40] = icmpType;
+  }
+  return headerSize + probeSize;
+}
+
+}  // namespace
+
+TEST(SocketFilter, UdpProberTest) {
+  UdpProber prober(&ignoreResponse, 3, 1, kTestPort, "test", true, 0);
+  ResponseFilter filter;
+  ASSERT_TRUE(prober.getResponseFilter(&filter));
+  auto program = compileResponseFilter(filter, 0);
+
+  uint8_t buffer[kTestBufferSize];
+  // Destinations whose checksums carry or not.
+  for (uint32_t destination : {0x01020304u, 0xFFFFFFFFu, 0x0000FFFFu,
+                               0xC0A80001u, 1u}) {
+    Ipv4Address destinationIp(destination);
+    Ipv4Address sourceIp(0x0A000001);
+    size_t size =
+        packResponse(&prober, destinationIp, sourceIp, 11, true, buffer);
+    EXPECT_TRUE(passesFilter(program, buffer, size)) << destination;
+    size = packResponse(&prober, destinationIp, sourceIp, 3, true, buffer);
+    EXPECT_TRUE(passesFilter(program, buffer, size)) << destination;
+    // Echo replies and truncated responses are dropped.
+    size = packResponse(&prober, destinationIp, sourceIp, 0, true, buffer);
+    EXPECT_FALSE(passesFilter(program, buffer, size));
+    size = packResponse(&prober, destinationIp, sourceIp, 11, true, buffer);
+    EXPECT_FALSE(passesFilter(program, buffer, 49));
+    // The source port of a probe of another scan does not match.
+    prober.setChecksumOffset(4);
+    size = packResponse(&prober, destinationIp, sourceIp, 11, true, buffer);
+    prober.setChecksumOffset(3);
+    EXPECT_FALSE(passesFilter(program, buffer, size));
+  }
+
+  // Probes to another port are dropped.
+  UdpProber otherProber(&ignoreResponse, 3, 1, kTestPort + 1, "test", true,
+                        0);
+  size_t size = packResponse(&otherProber, Ipv4Address(0x01020304),
+                             Ipv4Address(0x0A000001), 11, true, buffer);
+  EXPECT_FALSE(passesFilter(program, buffer, size));
+}
+
+TEST(SocketFilter, UdpIdempotentProberTest) {
+  UdpIdempotentProber prober(&ignoreResponse, 0, 1, kTestPort, "test", true,
+                             0);
+  ResponseFilter filter;
+  ASSERT_TRUE(prober.getResponseFilter(&filter));
+  auto program = compileResponseFilter(filter, 0);
+
+  uint8_t buffer[kTestBufferSize];
+  for (uint32_t destination : {0x01020304u, 0xFFFFFFFFu, 0xC0A80001u}) {
+    Ipv4Address destinationIp(destination);
+    Ipv4Address sourceIp(0x0A000001);
+    size_t size =
+        packResponse(&prober, destinationIp, sourceIp, 11, true, buffer);
+    EXPECT_TRUE(passesFilter(program, buffer, size)) << destination;
+    prober.setChecksumOffset(1);
+    size = packResponse(&prober, destinationIp, sourceIp, 11, true, buffer);
+    prober.setChecksumOffset(0);
+    EXPECT_FALSE(passesFilter(program, buffer, size));
+  }
+}
+
+TEST(SocketFilter, UdpProberIpv6Test) {
+  UdpProberIpv6 prober(&ignoreResponse, 0, 1, kTestPort, "test", 0);
+  ResponseFilter filter;
+  ASSERT_TRUE(prober.getResponseFilter(&filter));
+  EXPECT_FALSE(filter.ipv4);
+  auto program = compileResponseFilter(filter, 0);
+
+  uint8_t buffer[kTestBufferSize];
+  Ipv6Address sourceIp(absl::MakeUint128(0x20010DB800000000ULL, 1));
+  for (absl::uint128 destination :
+       {absl::MakeUint128(0x20010DB800000000ULL, 2),
+        absl::MakeUint128(~0ULL, ~0ULL)}) {
+    Ipv6Address destinationIp(destination);
+    size_t size =
+        packResponse(&prober, destinationIp, sourceIp, 3, false, buffer);
+    EXPECT_TRUE(passesFilter(program, buffer, size));
+    size = packResponse(&prober, destinationIp, sourceIp, 1, false, buffer);
+    EXPECT_TRUE(passesFilter(program, buffer, size));
+    size = packResponse(&prober, destinationIp, sourceIp, 129, false, buffer);
+    EXPECT_FALSE(passesFilter(program, buffer, size));
+    prober.setChecksumOffset(1);
+    size = packResponse(&prober, destinationIp, sourceIp, 3, false, buffer);
+    prober.setChecksumOffset(0);
+    EXPECT_FALSE(passesFilter(program, buffer, size));
+  }
+}
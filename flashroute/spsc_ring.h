@@ -0,0 +1,158 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace flashroute {
+
+const size_t kCacheLineSize = 64;
+const uint32_t kSpscSpinCount = 1024;  // Retries before blocking calls sleep.
+const uint32_t kSpscSleepUs = 50;
+
+/**
+ * SpscRing is a lock-free bounded FIFO for exactly one producer thread and one
+ * consumer thread. It keeps the interface of BoundedBuffer: items pushed by
+ * pushFront are popped by popBack in the same order.
+ *
+ * The producer and the consumer only touch their own index and a cached copy
+ * of the other's, which are padded to separate cache lines. Blocking calls
+ * spin for a while and then sleep, so there is no lock or condition variable
+ * on the fast path.
+ *
+ * Example:
+ *
+ * SpscRing<ProbeUnitIpv4> ring(
+ *    100000      // Capacity, rounded up to a power of 2.
+ * );
+ *
+ * // Producer thread.
+ * ring.pushFront(unit);
+ *
+ * // Consumer thread.
+ * ProbeUnitIpv4 units[64];
+ * size_t count = ring.popBackBulk(units, 64);
+ */
+template <class T>
+class SpscRing {
+ public:
+  typedef size_t SizeType;
+  typedef T ValueType;
+
+  explicit SpscRing(SizeType capacity)
+      : head_(0), cachedTail_(0), tail_(0), cachedHead_(0) {
+    SizeType size = 2;
+    while (size < capacity) size <<= 1;
+    mask_ = size - 1;
+    buffer_.resize(size);
+  }
+
+  SizeType capacity() const { return mask_ + 1; }
+
+  // Producer: push an item if there is room. Return false if the ring is
+  // full.
+  bool tryPushFront(const ValueType& item) {
+    return pushFrontBulk(&item, 1) == 1;
+  }
+
+  // Producer: push an item, wait if the ring is full.
+  void pushFront(const ValueType& item) {
+    for (uint32_t spins = 0; !tryPushFront(item); spins++) {
+      backOff(spins);
+    }
+  }
+
+  // Producer: push up to count items without blocking. Return the number of
+  // pushed items.
+  SizeType pushFrontBulk(const ValueType* pItems, SizeType count) {
+    SizeType head = head_.load(std::memory_order_relaxed);
+    SizeType room = capacity() - (head - cachedTail_);
+    if (room < count) {
+      cachedTail_ = tail_.load(std::memory_order_acquire);
+      room = capacity() - (head - cachedTail_);
+    }
+    count = std::min(count, room);
+    for (SizeType i = 0; i < count; i++) {
+      buffer_[(head + i) & mask_] = pItems[i];
+    }
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer: pop an item if there is any. Return false if the ring is empty.
+  bool tryPopBack(ValueType* pItem) { return popBackBulk(pItem, 1) == 1; }
+
+  // Consumer: pop an item, wait if the ring is empty.
+  void popBack(ValueType* pItem) {
+    for (uint32_t spins = 0; !tryPopBack(pItem); spins++) {
+      backOff(spins);
+    }
+  }
+
+  // Consumer: pop up to maxCount items without blocking. Return the number of
+  // popped items.
+  SizeType popBackBulk(ValueType* pItems, SizeType maxCount) {
+    SizeType tail = tail_.load(std::memory_order_relaxed);
+    SizeType available = cachedHead_ - tail;
+    if (available < maxCount) {
+      cachedHead_ = head_.load(std::memory_order_acquire);
+      available = cachedHead_ - tail;
+    }
+    SizeType count = std::min(maxCount, available);
+    for (SizeType i = 0; i < count; i++) {
+      pItems[i] = buffer_[(tail + i) & mask_];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer: wait up to timeout for an item without popping it. Return true
+  // if the ring is not empty.
+  bool waitNotEmpty(std::chrono::microseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (uint32_t spins = 0; empty(); spins++) {
+      if (std::chrono::steady_clock::now() >= deadline) return false;
+      backOff(spins);
+    }
+    return true;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // Tail is loaded first, so the size never underflows when a third thread
+  // (e.g., the monitor) reads it.
+  SizeType size() const {
+    SizeType tail = tail_.load(std::memory_order_acquire);
+    return head_.load(std::memory_order_acquire) - tail;
+  }
+
+ private:
+  SpscRing(const SpscRing&);             // Disabled copy constructor.
+  SpscRing& operator=(const SpscRing&);  // Disabled assign operator.
+
+  static void backOff(uint32_t spins) {
+    if (spins < kSpscSpinCount) return;
+    std::this_thread::sleep_for(std::chrono::microseconds(kSpscSleepUs));
+  }
+
+  // Written by producer.
+  std::atomic<SizeType> head_;
+  SizeType cachedTail_;
+  char producerPadding_[kCacheLineSize - sizeof(std::atomic<SizeType>) -
+                        sizeof(SizeType)];
+  // Written by consumer.
+  std::atomic<SizeType> tail_;
+  SizeType cachedHead_;
+  char consumerPadding_[kCacheLineSize - sizeof(std::atomic<SizeType>) -
+                        sizeof(SizeType)];
+  // Read-only after construction.
+  SizeType mask_;
+  std::vector<ValueType> buffer_;
+};
+
+}  // namespace flashroute
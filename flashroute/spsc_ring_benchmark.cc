@@ -0,0 +1,145 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+// Measure the throughput of a producer/consumer pair on BoundedBuffer and
+// SpscRing.
+//
+// bazel run -c opt //flashroute:spsc_ring_benchmark
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flashroute/bounded_buffer.h"
+#include "flashroute/spsc_ring.h"
+
+using namespace flashroute;
+
+const uint64_t kBenchmarkItems = 10000000;
+const size_t kBenchmarkCapacity = 100000;
+const size_t kBenchmarkBatchSize = 64;
+
+// The same 16 bytes as ProbeUnitIpv4.
+struct BenchmarkItem {
+  uint64_t sequence;
+  uint64_t payload;
+};
+
+template <class Producer, class Consumer>
+void runBenchmark(const std::string& name, Producer producer,
+                  Consumer consumer) {
+  auto start = std::chrono::steady_clock::now();
+  std::thread producerThread(producer);
+  uint64_t checksum = consumer();
+  producerThread.join();
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << name << ": " << static_cast<uint64_t>(kBenchmarkItems / elapsed)
+            << " ops/sec (checksum " << checksum << ")" << std::endl;
+}
+
+int main() {
+  {
+    BoundedBuffer<BenchmarkItem> buffer(kBenchmarkCapacity);
+    runBenchmark(
+        "BoundedBuffer pushFront/popBack",
+        [&buffer]() {
+          for (uint64_t i = 0; i < kBenchmarkItems; i++) {
+            buffer.pushFront({i, i});
+          }
+        },
+        [&buffer]() {
+          uint64_t checksum = 0;
+          BenchmarkItem item;
+          for (uint64_t i = 0; i < kBenchmarkItems; i++) {
+            buffer.popBack(&item);
+            checksum += item.sequence;
+          }
+          return checksum;
+        });
+  }
+
+  {
+    BoundedBuffer<BenchmarkItem> buffer(kBenchmarkCapacity);
+    runBenchmark(
+        "BoundedBuffer pushFront/popBackBulk",
+        [&buffer]() {
+          for (uint64_t i = 0; i < kBenchmarkItems; i++) {
+            buffer.pushFront({i, i});
+          }
+        },
+        [&buffer]() {
+          uint64_t checksum = 0;
+          std::vector<BenchmarkItem> items(kBenchmarkBatchSize);
+          uint64_t popped = 0;
+          while (popped < kBenchmarkItems) {
+            size_t count = buffer.popBackBulk(items.data(), items.size());
+            if (count == 0) std::this_thread::yield();
+            for (size_t i = 0; i < count; i++) checksum += items[i].sequence;
+            popped += count;
+          }
+          return checksum;
+        });
+  }
+
+  {
+    SpscRing<BenchmarkItem> ring(kBenchmarkCapacity);
+    runBenchmark(
+        "SpscRing pushFront/popBack",
+        [&ring]() {
+          for (uint64_t i = 0; i < kBenchmarkItems; i++) {
+            ring.pushFront({i, i});
+          }
+        },
+        [&ring]() {
+          uint64_t checksum = 0;
+          BenchmarkItem item;
+          for (uint64_t i = 0; i < kBenchmarkItems; i++) {
+            ring.popBack(&item);
+            checksum += item.sequence;
+          }
+          return checksum;
+        });
+  }
+
+  {
+    SpscRing<BenchmarkItem> ring(kBenchmarkCapacity);
+    runBenchmark(
+        "SpscRing pushFrontBulk/popBackBulk",
+        [&ring]() {
+          std::vector<BenchmarkItem> items(kBenchmarkBatchSize);
+          uint64_t pushed = 0;
+          while (pushed < kBenchmarkItems) {
+            size_t count = std::min<uint64_t>(kBenchmarkBatchSize,
+                                              kBenchmarkItems - pushed);
+            for (size_t i = 0; i < count; i++) {
+              items[i] = {pushed + i, pushed + i};
+            }
+            size_t done = 0;
+            while (done < count) {
+              size_t result =
+                  ring.pushFrontBulk(items.data() + done, count - done);
+              if (result == 0) std::this_thread::yield();
+              done += result;
+            }
+            pushed += count;
+          }
+        },
+        [&ring]() {
+          uint64_t checksum = 0;
+          std::vector<BenchmarkItem> items(kBenchmarkBatchSize);
+          uint64_t popped = 0;
+          while (popped < kBenchmarkItems) {
+            size_t count = ring.popBackBulk(items.data(), items.size());
+            if (count == 0) std::this_thread::yield();
+            for (size_t i = 0; i < count; i++) checksum += items[i].sequence;
+            popped += count;
+          }
+          return checksum;
+        });
+  }
+  return 0;
+}
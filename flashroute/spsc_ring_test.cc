@@ -0,0 +1,65 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "flashroute/spsc_ring.h"
+
+using namespace flashroute;
+
+TEST(SpscRing, CapacityTest) {
+  SpscRing<uint32_t> ring(1000);
+  EXPECT_EQ(ring.capacity(), 1024);
+  for (uint32_t i = 0; i < 1024; i++) {
+    EXPECT_TRUE(ring.tryPushFront(i));
+  }
+  EXPECT_FALSE(ring.tryPushFront(1024));
+  EXPECT_EQ(ring.size(), 1024);
+
+  uint32_t items[2000];
+  EXPECT_EQ(ring.popBackBulk(items, 2000), 1024);
+  for (uint32_t i = 0; i < 1024; i++) {
+    EXPECT_EQ(items[i], i);
+  }
+  EXPECT_TRUE(ring.empty());
+  EXPECT_FALSE(ring.waitNotEmpty(std::chrono::microseconds(100)));
+}
+
+TEST(SpscRing, ProducerConsumerOrderTest) {
+  const uint64_t kItems = 1000000;
+  SpscRing<uint64_t> ring(128);
+  std::thread producer([&ring, kItems]() {
+    uint64_t items[16];
+    uint64_t next = 0;
+    while (next < kItems) {
+      if (next % 3 == 0) {
+        ring.pushFront(next++);
+        continue;
+      }
+      uint64_t count = 0;
+      for (; count < 16 && next + count < kItems; count++) {
+        items[count] = next + count;
+      }
+      next += ring.pushFrontBulk(items, count);
+    }
+  });
+
+  uint64_t expected = 0;
+  uint64_t items[32];
+  while (expected < kItems) {
+    if (expected % 2 == 0) {
+      uint64_t item;
+      ring.popBack(&item);
+      ASSERT_EQ(item, expected++);
+      continue;
+    }
+    size_t count = ring.popBackBulk(items, 32);
+    for (size_t i = 0; i < count; i++) {
+      ASSERT_EQ(items[i], expected++);
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(ring.empty());
+}
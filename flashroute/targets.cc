@@ -11,6 +11,7 @@
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 #include "flashroute/blacklist.h"
+#include "flashroute/cyclic_permutation.h"
 #include "flashroute/dcb_manager.h"
 #include "flashroute/utils.h"
 #include "glog/logging.h"
@@ -25,22 +26,57 @@ Targets::Targets(const uint8_t defaultSplitTtl, const uint32_t seed,
       defaultSplitTtl_(defaultSplitTtl),
       seed_(seed) {}
 
+void Targets::setShard(const uint32_t shardCount, const uint32_t shard) {
+  shardCount_ = shardCount;
+  shard_ = shard;
+}
+
+bool Targets::checkShardable(const absl::uint128 count) const {
+  if (shardCount_ <= 1 || count <= kMaxPermutationSize) return true;
+  LOG(ERROR) << "Cannot shard " << count << " targets, at most "
+             << kMaxPermutationSize << " targets can be sharded.";
+  return false;
+}
+
+std::unique_ptr<CyclicPermutation> Targets::getShard(
+    const uint64_t count) const {
+  if (shardCount_ <= 1) return nullptr;
+  LOG(INFO) << boost::format("Keep shard %1% of %2% of %3% targets.") %
+                   shard_ % shardCount_ % count;
+  return std::make_unique<CyclicPermutation>(count, seed_, shardCount_,
+                                             shard_);
+}
+
 DcbManager* Targets::loadTargetsFromFile(
     absl::string_view filePath, const uint8_t granularity,
     const bool LookupByPrefixSupport) const {
-  DcbManager* dcbManager =
-      new DcbManager(1000, granularity, seed_, LookupByPrefixSupport);
   if (filePath.empty()) {
     VLOG(2) << "Targets disabled.";
-    return dcbManager;
+    return new DcbManager(1000, granularity, seed_, LookupByPrefixSupport);
   }
 
   VLOG(2) << "Load targets from file: " << filePath;
   auto filePathStr = std::string(filePath);
+  std::unique_ptr<CyclicPermutation> shard;
+  if (shardCount_ > 1) {
+    // Count the targets to shard them.
+    std::ifstream countIn(filePathStr);
+    uint64_t lines = 0;
+    for (std::string line; std::getline(countIn, line);) {
+      if (!line.empty()) lines++;
+    }
+    if (!checkShardable(lines)) return nullptr;
+    shard = getShard(lines);
+  }
+  DcbManager* dcbManager =
+      new DcbManager(1000, granularity, seed_, LookupByPrefixSupport);
   std::ifstream in(filePathStr);
   int64_t count = 0;
+  uint64_t lineIndex = 0;
   for (std::string line; std::getline(in, line);) {
     if (!line.empty()) {
+      // Skip the targets of other shards.
+      if (shard != nullptr && !shard->contains(lineIndex++)) continue;
       // Example
       // 127.0.0.1:10   IPAddress is 127.0.0.1 and split ttl is 10
       std::vector<absl::string_view> parts = absl::StrSplit(line, ":");
@@ -71,8 +107,7 @@ DcbManager* Targets::loadTargetsFromFile(
 DcbManager* Targets::generateTargetsFromNetwork(
     absl::string_view targetNetwork, const uint8_t granularity,
     const bool LookupByPrefixSupport) const {
-  DcbManager* dcbManager =
-      new DcbManager(1000, granularity, seed_, LookupByPrefixSupport);
+  DcbManager* dcbManager = nullptr;
 
   std::vector<absl::string_view> parts = absl::StrSplit(targetNetwork, "/");
   if (parts.size() != 2) {
@@ -109,7 +144,13 @@ DcbManager* Targets::generateTargetsFromNetwork(
     uint64_t blockFactor_ =
         static_cast<uint64_t>(std::pow(2, 32 - granularity));
     uint64_t dcbCount = static_cast<uint64_t>(targetNetworkSize / blockFactor_);
+    // Every block of the network has at most one target, so the DCBs are
+    // kept in a dense store indexed by block.
+    dcbManager = new DcbManager(
+        static_cast<const Ipv4Address&>(*targetNetworkFirstAddress_), dcbCount,
+        granularity, seed_, LookupByPrefixSupport);
 
+    std::unique_ptr<CyclicPermutation> shard = getShard(dcbCount);
     // set random seed.
     std::srand(seed_);
     uint32_t actualCount = 0;
@@ -120,6 +161,8 @@ DcbManager* Targets::generateTargetsFromNetwork(
       Ipv4Address tmp(targetNetworkFirstAddress_->getIpv4Address() +
                       ((i) << (32 - granularity)) +
                       (rand() % (blockFactor_ - 3)) + 2);
+      // Every shard draws the same addresses, and keeps its own.
+      if (shard != nullptr && !shard->contains(i)) continue;
 
       if ((blacklist_ == nullptr || !blacklist_->contains(tmp)) &&
           (bogerFilter_ == nullptr || !bogerFilter_->isBogonAddress(tmp))) {
@@ -141,7 +184,12 @@ DcbManager* Targets::generateTargetsFromNetwork(
         static_cast<absl::uint128>(std::pow(2, 128 - granularity));
     absl::uint128 dcbCount =
         static_cast<absl::uint128>(targetNetworkSize / blockFactor_);
+    if (!checkShardable(dcbCount)) return nullptr;
+    dcbManager =
+        new DcbManager(1000, granularity, seed_, LookupByPrefixSupport);
 
+    std::unique_ptr<CyclicPermutation> shard =
+        getShard(static_cast<uint64_t>(dcbCount));
     // set random seed.
     absl::uint128 actualCount = 0;
     std::srand(seed_);
@@ -151,6 +199,9 @@ DcbManager* Targets::generateTargetsFromNetwork(
       Ipv6Address tmp(htonll(
           ntohll(targetNetworkFirstAddress_->getIpv6Address()) +
           ((i) << (128 - granularity)) + (rand() % (blockFactor_ - 3)) + 2));
+      if (shard != nullptr && !shard->contains(static_cast<uint64_t>(i))) {
+        continue;
+      }
       if (blacklist_ != nullptr && !blacklist_->contains(tmp)) {
         dcbManager->addDcb(tmp, defaultSplitTtl_);
         actualCount++;
@@ -1,11 +1,14 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #pragma once
 
+#include <memory>
 #include <string>
 
+#include "absl/numeric/int128.h"
 #include "absl/strings/string_view.h"
 
 #include "flashroute/blacklist.h"
+#include "flashroute/cyclic_permutation.h"
 #include "flashroute/dcb_manager.h"
 #include "flashroute/bogon_filter.h"
 
@@ -16,12 +19,18 @@ class Targets {
   Targets(const uint8_t defaultSplitTtl, const uint32_t seed,
           Blacklist* blacklist, BogonFilter* bogerFilter);
 
-  // Load targets from file.
+  // Keep only the targets of one of shardCount disjoint shards of a cyclic
+  // permutation of the targets, so that hosts using the same seed split a
+  // scan.
+  void setShard(const uint32_t shardCount, const uint32_t shard);
+
+  // Load targets from file. Return nullptr if the targets cannot be sharded.
   DcbManager* loadTargetsFromFile(absl::string_view filePath,
                                   const uint8_t granularity,
                                   const bool LookupByPrefixSupport) const;
 
-  // Generate targets from a range.
+  // Generate targets from a range. Return nullptr if the targets cannot be
+  // sharded.
   DcbManager* generateTargetsFromNetwork(absl::string_view targetNetwork,
                                          const uint8_t granularity,
                                          const bool LookupByPrefixSupport) const;
@@ -32,6 +41,16 @@ class Targets {
   uint8_t defaultSplitTtl_;
   uint32_t seed_;
   uint32_t granularity_;
+  uint32_t shardCount_ = 1;
+  uint32_t shard_ = 0;
+
+  // Return false and log an error if count targets are too many to shard.
+  bool checkShardable(const absl::uint128 count) const;
+
+  // Return the permutation whose shard holds the targets to keep, or nullptr
+  // if the targets are not sharded. Membership is tested per target, so no
+  // state is kept for the targets of other shards.
+  std::unique_ptr<CyclicPermutation> getShard(const uint64_t count) const;
 
 };
 
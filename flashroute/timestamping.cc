@@ -0,0 +1,210 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/timestamping.h"
+
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace flashroute {
+
+namespace {
+
+// Large enough for a probe and the link layer header in front of it.
+const size_t kLoopedPacketSize = 2048;
+// Max number of transmit timestamps read by one readTransmitTimestamps.
+const size_t kMaxTransmitTimestamps = 256;
+// Offsets at which the IP header of a looped probe may start: no link layer
+// header (e.g., TUN), ethernet, and ethernet with a VLAN tag.
+const size_t kLinkHeaderSizes[] = {0, 14, 18};
+
+// Find the IP header of a sent packet returned by the error queue, which
+// starts at the link layer header. Return false if there is none.
+bool parseLoopedProbe(const uint8_t* packet, size_t size,
+                      uint64_t* destinationKey, uint8_t* ttl) {
+  for (size_t offset : kLinkHeaderSizes) {
+    if (offset + sizeof(struct ip) > size) break;
+    const uint8_t* header = packet + offset;
+    uint8_t version = header[0] >> 4;
+    if (version == 4) {
+      const struct ip* ip = reinterpret_cast<const struct ip*>(header);
+      if (ntohs(ip->ip_len) != size - offset) continue;
+      *destinationKey = getDestinationKey(ntohl(ip->ip_dst.s_addr));
+      *ttl = ip->ip_ttl;
+      return true;
+    }
+    if (version == 6 && offset + sizeof(struct ip6_hdr) <= size) {
+      const struct ip6_hdr* ip =
+          reinterpret_cast<const struct ip6_hdr*>(header);
+      if (ntohs(ip->ip6_plen) + sizeof(struct ip6_hdr) != size - offset) {
+        continue;
+      }
+      // Same layout as the addresses parsed by the Ipv6 prober.
+      const uint8_t* destination =
+          reinterpret_cast<const uint8_t*>(&ip->ip6_dst);
+      uint64_t low;
+      uint64_t high;
+      memcpy(&low, destination, sizeof(low));
+      memcpy(&high, destination + sizeof(low), sizeof(high));
+      *destinationKey = getDestinationKey(absl::MakeUint128(high, low));
+      *ttl = ip->ip6_hlim;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+int64_t getRealtimeNanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+bool enableSocketTimestamping(int socket, TimestampingMode mode,
+                              bool transmit) {
+  if (mode == TimestampingMode::NONE) return true;
+  uint32_t flags = 0;
+  if (mode == TimestampingMode::HARDWARE) {
+    flags = SOF_TIMESTAMPING_RAW_HARDWARE |
+            (transmit ? SOF_TIMESTAMPING_TX_HARDWARE
+                      : SOF_TIMESTAMPING_RX_HARDWARE);
+  } else {
+    flags = SOF_TIMESTAMPING_SOFTWARE |
+            (transmit ? SOF_TIMESTAMPING_TX_SOFTWARE
+                      : SOF_TIMESTAMPING_RX_SOFTWARE);
+  }
+  if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) <
+      0) {
+    LOG(ERROR) << "Timestamping: Failed to enable SO_TIMESTAMPING. Errno: "
+               << errno;
+    return false;
+  }
+  return true;
+}
+
+bool enableHardwareTimestamping(const std::string& interface) {
+  int control = socket(AF_INET, SOCK_DGRAM, 0);
+  struct hwtstamp_config config;
+  memset(&config, 0, sizeof(config));
+  config.tx_type = HWTSTAMP_TX_ON;
+  config.rx_filter = HWTSTAMP_FILTER_ALL;
+  struct ifreq request;
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, interface.c_str(), IFNAMSIZ - 1);
+  request.ifr_data = reinterpret_cast<char*>(&config);
+  bool success = control >= 0 && ioctl(control, SIOCSHWTSTAMP, &request) == 0;
+  if (!success) {
+    LOG(ERROR) << "Timestamping: " << interface
+               << " does not support hardware timestamps. Errno: " << errno;
+  }
+  if (control >= 0) close(control);
+  return success;
+}
+
+int64_t getControlTimestamp(const struct msghdr* message,
+                            TimestampingMode mode) {
+  for (struct cmsghdr* control =
+           CMSG_FIRSTHDR(const_cast<struct msghdr*>(message));
+       control != nullptr;
+       control = CMSG_NXTHDR(const_cast<struct msghdr*>(message), control)) {
+    if (control->cmsg_level != SOL_SOCKET ||
+        control->cmsg_type != SCM_TIMESTAMPING) {
+      continue;
+    }
+    struct scm_timestamping timestamps;
+    memcpy(&timestamps, CMSG_DATA(control), sizeof(timestamps));
+    // ts[0] carries software timestamps and ts[2] hardware ones.
+    const struct timespec& timestamp =
+        timestamps.ts[mode == TimestampingMode::HARDWARE ? 2 : 0];
+    return static_cast<int64_t>(timestamp.tv_sec) * 1000000000 +
+           timestamp.tv_nsec;
+  }
+  return 0;
+}
+
+ProbeTimestamps::ProbeTimestamps(size_t slots) {
+  size_t size = 1;
+  while (size < slots) size <<= 1;
+  slots_.reset(new Slot[size]);
+  mask_ = size - 1;
+}
+
+uint64_t ProbeTimestamps::getTag(uint64_t destinationKey, uint8_t ttl) {
+  // SplitMix64 finalizer.
+  uint64_t z = destinationKey * 0x9E3779B97F4A7C15ULL + ttl;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  return z != 0 ? z : 1;
+}
+
+void ProbeTimestamps::record(uint64_t destinationKey, uint8_t ttl,
+                             int64_t sentTimestamp) {
+  uint64_t tag = getTag(destinationKey, ttl);
+  Slot& slot = slots_[tag & mask_];
+  slot.tag.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.timestamp.store(sentTimestamp, std::memory_order_relaxed);
+  slot.tag.store(tag, std::memory_order_release);
+}
+
+int64_t ProbeTimestamps::lookup(uint64_t destinationKey, uint8_t ttl) const {
+  uint64_t tag = getTag(destinationKey, ttl);
+  const Slot& slot = slots_[tag & mask_];
+  if (slot.tag.load(std::memory_order_acquire) != tag) return 0;
+  int64_t timestamp = slot.timestamp.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.tag.load(std::memory_order_relaxed) != tag) return 0;
+  return timestamp;
+}
+
+uint32_t ProbeTimestamps::getRtt(uint64_t destinationKey, uint8_t ttl,
+                                 int64_t receivedTimestamp) const {
+  int64_t sentTimestamp = lookup(destinationKey, ttl);
+  if (sentTimestamp == 0 || receivedTimestamp < sentTimestamp) return 0;
+  return static_cast<uint32_t>((receivedTimestamp - sentTimestamp) / 1000);
+}
+
+size_t ProbeTimestamps::readTransmitTimestamps(int socket,
+                                               TimestampingMode mode) {
+  uint8_t packet[kLoopedPacketSize];
+  uint8_t control[kTimestampControlSize];
+  struct iovec iov;
+  iov.iov_base = packet;
+  iov.iov_len = sizeof(packet);
+  struct msghdr message;
+  size_t recorded = 0;
+  for (size_t i = 0; i < kMaxTransmitTimestamps; i++) {
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t size = recvmsg(socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT);
+    if (size < 0) break;
+    int64_t timestamp = getControlTimestamp(&message, mode);
+    uint64_t destinationKey = 0;
+    uint8_t ttl = 0;
+    if (timestamp != 0 &&
+        parseLoopedProbe(packet, static_cast<size_t>(size), &destinationKey,
+                         &ttl)) {
+      record(destinationKey, ttl, timestamp);
+      recorded += 1;
+    }
+  }
+  return recorded;
+}
+
+}  // namespace flashroute
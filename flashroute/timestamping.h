@@ -0,0 +1,111 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/numeric/int128.h"
+
+namespace flashroute {
+
+// The source of the send and receive times of probes and responses.
+// NONE: the prober encodes a 16-bit millisecond clock into the probe and reads
+// the clock again when it parses the response, the RTT is in milliseconds.
+// SOFTWARE: the kernel timestamps probes as they leave the driver and
+// responses as they enter the stack (SO_TIMESTAMPING), the RTT is in
+// microseconds.
+// HARDWARE: same as SOFTWARE with the timestamps of the NIC, which must
+// support them.
+enum class TimestampingMode { NONE, SOFTWARE, HARDWARE };
+
+// Size of the control buffer for a SCM_TIMESTAMPING message.
+const size_t kTimestampControlSize = 256;
+
+// Key of a destination, shared by the sending shards and the probe timestamp
+// table.
+inline uint64_t getDestinationKey(uint32_t destination) { return destination; }
+
+inline uint64_t getDestinationKey(absl::uint128 destination) {
+  return absl::Uint128Low64(destination) ^ absl::Uint128High64(destination);
+}
+
+// CLOCK_REALTIME in nanoseconds, the clock of software timestamps.
+int64_t getRealtimeNanoseconds();
+
+// Ask the kernel to timestamp the packets sent (transmit) or received on the
+// socket. Transmit timestamps are queued to the error queue of the socket
+// together with the sent packet.
+bool enableSocketTimestamping(int socket, TimestampingMode mode,
+                              bool transmit);
+
+// Turn on the timestamping of all packets in the NIC of the interface.
+bool enableHardwareTimestamping(const std::string& interface);
+
+// Return the timestamp in nanoseconds carried by the SCM_TIMESTAMPING control
+// message of a received message, or 0 if there is none.
+int64_t getControlTimestamp(const struct msghdr* message,
+                            TimestampingMode mode);
+
+/**
+ * ProbeTimestamps remembers when the probes were sent, so that an RTT can be
+ * computed from the receive time of a response. A probe is identified by its
+ * destination and its initial TTL. Sending threads record and receiving
+ * threads look up concurrently without locks.
+ *
+ * The table is direct-mapped: a probe overwrites whatever was sent before it
+ * to the same slot, so the slots should outnumber the probes in flight.
+ *
+ * Example:
+ *
+ * ProbeTimestamps timestamps(
+ *    1 << 20   // The number of slots, rounded up to a power of 2.
+ * );
+ *
+ * // Sending thread.
+ * timestamps.record(getDestinationKey(destination), ttl,
+ *                   getRealtimeNanoseconds());
+ *
+ * // Receiving thread. 0 if the probe is unknown.
+ * uint32_t rtt = timestamps.getRtt(getDestinationKey(destination), ttl,
+ *                                  receivedTimestamp);
+ */
+class ProbeTimestamps {
+ public:
+  explicit ProbeTimestamps(size_t slots);
+
+  void record(uint64_t destinationKey, uint8_t ttl, int64_t sentTimestamp);
+
+  // Return the send time of the probe in nanoseconds, or 0 if it is unknown.
+  int64_t lookup(uint64_t destinationKey, uint8_t ttl) const;
+
+  // Return the RTT in microseconds of the response received at the given time
+  // in nanoseconds, or 0 if the probe is unknown.
+  uint32_t getRtt(uint64_t destinationKey, uint8_t ttl,
+                  int64_t receivedTimestamp) const;
+
+  // Read the transmit timestamps of probes sent on the socket from its error
+  // queue and record them, without blocking. Return the number of recorded
+  // probes.
+  size_t readTransmitTimestamps(int socket, TimestampingMode mode);
+
+ private:
+  // A slot is a sequence lock: the tag is cleared while the timestamp is
+  // written, so a reader which sees the same tag before and after reading the
+  // timestamp has read a consistent slot.
+  struct Slot {
+    std::atomic<uint64_t> tag{0};
+    std::atomic<int64_t> timestamp{0};
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  uint64_t mask_;
+
+  // Tag of a probe, never 0.
+  static uint64_t getTag(uint64_t destinationKey, uint8_t ttl);
+};
+
+}  // namespace flashroute
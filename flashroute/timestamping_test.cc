@@ -0,0 +1,57 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <thread>
+
+#include "flashroute/timestamping.h"
+
+using namespace flashroute;
+
+TEST(ProbeTimestamps, RecordAndLookupTest) {
+  ProbeTimestamps timestamps(1000);
+  uint64_t destination = getDestinationKey(0x0A000001u);
+  timestamps.record(destination, 5, 1000000);
+  EXPECT_EQ(timestamps.lookup(destination, 5), 1000000);
+  // Probes to other hops or destinations are unknown.
+  EXPECT_EQ(timestamps.lookup(destination, 6), 0);
+  EXPECT_EQ(timestamps.lookup(getDestinationKey(0x0A000002u), 5), 0);
+
+  // RTTs are in microseconds.
+  EXPECT_EQ(timestamps.getRtt(destination, 5, 3500000), 2500);
+  EXPECT_EQ(timestamps.getRtt(destination, 5, 999999), 0);
+  EXPECT_EQ(timestamps.getRtt(destination, 6, 3500000), 0);
+
+  // A probe sent again replaces the earlier one.
+  timestamps.record(destination, 5, 2000000);
+  EXPECT_EQ(timestamps.getRtt(destination, 5, 3500000), 1500);
+}
+
+TEST(ProbeTimestamps, Ipv6KeyTest) {
+  absl::uint128 destination = absl::MakeUint128(0x20010DB800000000ULL, 1);
+  EXPECT_NE(getDestinationKey(destination),
+            getDestinationKey(absl::MakeUint128(0x20010DB800000000ULL, 2)));
+  ProbeTimestamps timestamps(16);
+  timestamps.record(getDestinationKey(destination), 32, 42);
+  EXPECT_EQ(timestamps.lookup(getDestinationKey(destination), 32), 42);
+}
+
+TEST(ProbeTimestamps, ConcurrentLookupTest) {
+  // A reader never sees the timestamp of another probe in a slot which is
+  // being overwritten.
+  ProbeTimestamps timestamps(1);
+  std::atomic<bool> stopped(false);
+  std::thread writer([&timestamps, &stopped]() {
+    for (int64_t i = 1; !stopped; i++) {
+      timestamps.record(i % 2, 1, (i % 2) + 1);
+    }
+  });
+  for (int32_t i = 0; i < 1000000; i++) {
+    int64_t timestamp = timestamps.lookup(i % 2, 1);
+    if (timestamp != 0) {
+      EXPECT_EQ(timestamp, (i % 2) + 1);
+    }
+  }
+  stopped = true;
+  writer.join();
+}
@@ -0,0 +1,144 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace flashroute {
+
+const uint32_t kTimingWheelSlotBits = 8;
+const uint32_t kTimingWheelLevels = 4;
+
+/**
+ * TimingWheel holds items until a deadline, counted in ticks, and releases
+ * them in deadline order at the granularity of a tick. It is a hierarchical
+ * wheel: level i has 256 slots of 256^i ticks, so scheduling and releasing an
+ * item are O(1) whatever the deadline. An item is placed on the lowest level
+ * whose slots still distinguish its deadline from the current tick, and moves
+ * down a level when the wheel reaches its slot. Deadlines beyond the last
+ * level, about 4.3 * 10^9 ticks, wait in an overflow list.
+ *
+ * Not thread-safe.
+ *
+ * Example:
+ *
+ * TimingWheel<DestinationControlBlock*> wheel(
+ *    now   // the current tick, e.g., in milliseconds.
+ * );
+ *
+ * wheel.schedule(dcb, now + 1000);
+ *
+ * std::vector<DestinationControlBlock*> due;
+ * wheel.advance(now + 1000, &due);  // due holds dcb.
+ */
+template <class T>
+class TimingWheel {
+ public:
+  explicit TimingWheel(uint64_t now = 0) : current_(now), size_(0) {
+    for (uint32_t level = 0; level < kTimingWheelLevels; level++) {
+      slots_[level].resize(1 << kTimingWheelSlotBits);
+      levelSizes_[level] = 0;
+    }
+  }
+
+  // Schedule the item to be released at the deadline. An item whose deadline
+  // has passed is released by the next advance.
+  void schedule(const T& item, uint64_t deadline) {
+    if (deadline <= current_) deadline = current_ + 1;
+    place(Entry{item, deadline});
+    size_++;
+  }
+
+  // Move the wheel to the tick now and append the items whose deadlines are
+  // not after it to due, in deadline order.
+  void advance(uint64_t now, std::vector<T>* due) {
+    if (size_ == 0) {
+      if (now > current_) current_ = now;
+      return;
+    }
+    while (current_ < now && size_ > 0) {
+      // Nothing is due before the next slot of the lowest non-empty level.
+      uint32_t level = 0;
+      while (level < kTimingWheelLevels && levelSizes_[level] == 0) level++;
+      if (level > 0) {
+        current_ = std::min<uint64_t>(
+            current_ | ((1ULL << (kTimingWheelSlotBits * level)) - 1), now);
+        if (current_ == now) break;
+      }
+      current_++;
+      cascade();
+      std::vector<Entry>& slot = slots_[0][getSlot(current_, 0)];
+      for (const Entry& entry : slot) due->push_back(entry.item);
+      size_ -= slot.size();
+      levelSizes_[0] -= slot.size();
+      slot.clear();
+    }
+    if (now > current_) current_ = now;
+  }
+
+  uint64_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  uint64_t now() const { return current_; }
+
+ private:
+  struct Entry {
+    T item;
+    uint64_t deadline;
+  };
+
+  // slots_[level][slot].
+  std::vector<std::vector<Entry>> slots_[kTimingWheelLevels];
+  std::vector<Entry> overflow_;
+  uint64_t levelSizes_[kTimingWheelLevels];
+  // The last tick that has been released.
+  uint64_t current_;
+  uint64_t size_;
+
+  static uint64_t getSlot(uint64_t tick, uint32_t level) {
+    return (tick >> (kTimingWheelSlotBits * level)) &
+           ((1 << kTimingWheelSlotBits) - 1);
+  }
+
+  // The entry goes to the level of the highest slot digit in which its
+  // deadline differs from the current tick.
+  void place(const Entry& entry) {
+    uint64_t difference = entry.deadline ^ current_;
+    uint32_t level = 0;
+    while (level < kTimingWheelLevels &&
+           (difference >> (kTimingWheelSlotBits * (level + 1))) != 0) {
+      level++;
+    }
+    if (level == kTimingWheelLevels) {
+      overflow_.push_back(entry);
+    } else {
+      slots_[level][getSlot(entry.deadline, level)].push_back(entry);
+      levelSizes_[level]++;
+    }
+  }
+
+  // When the current tick enters a new slot of an upper level, spread the
+  // entries of that slot over the levels below, from the top level down.
+  void cascade() {
+    uint64_t lowerTicks = current_ & ((1ULL << kTimingWheelSlotBits) - 1);
+    if (lowerTicks != 0) return;
+    if ((current_ &
+         ((1ULL << (kTimingWheelSlotBits * kTimingWheelLevels)) - 1)) == 0) {
+      std::vector<Entry> moved;
+      moved.swap(overflow_);
+      for (const Entry& entry : moved) place(entry);
+    }
+    for (uint32_t level = kTimingWheelLevels - 1; level > 0; level--) {
+      if ((current_ & ((1ULL << (kTimingWheelSlotBits * level)) - 1)) == 0) {
+        std::vector<Entry> moved;
+        moved.swap(slots_[level][getSlot(current_, level)]);
+        levelSizes_[level] -= moved.size();
+        for (const Entry& entry : moved) place(entry);
+      }
+    }
+  }
+};
+
+}  // namespace flashroute
@@ -0,0 +1,85 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flashroute/timing_wheel.h"
+
+using namespace flashroute;
+
+TEST(TimingWheel, ReleaseTest) {
+  TimingWheel<int> wheel(100);
+  wheel.schedule(1, 101);
+  wheel.schedule(2, 150);
+  // Passed deadlines are released by the next advance.
+  wheel.schedule(3, 50);
+  EXPECT_EQ(wheel.size(), 3);
+
+  std::vector<int> due;
+  wheel.advance(100, &due);
+  EXPECT_TRUE(due.empty());
+  wheel.advance(101, &due);
+  EXPECT_EQ(due, std::vector<int>({1, 3}));
+
+  due.clear();
+  wheel.advance(149, &due);
+  EXPECT_TRUE(due.empty());
+  wheel.advance(1000, &due);
+  EXPECT_EQ(due, std::vector<int>({2}));
+  EXPECT_TRUE(wheel.empty());
+  EXPECT_EQ(wheel.now(), 1000);
+}
+
+TEST(TimingWheel, LevelTest) {
+  // Deadlines on every level and in the overflow, across the boundaries of
+  // their slots.
+  const uint64_t kStart = (1ULL << 32) - 300;
+  std::vector<uint64_t> deadlines = {kStart + 255,
+                                     kStart + 256,
+                                     kStart + 300,
+                                     kStart + 70000,
+                                     kStart + (1ULL << 24) + 5,
+                                     kStart + (1ULL << 32) + 7,
+                                     kStart + 3 * (1ULL << 32)};
+  TimingWheel<uint64_t> wheel(kStart);
+  for (uint64_t deadline : deadlines) wheel.schedule(deadline, deadline);
+
+  std::vector<uint64_t> due;
+  for (uint64_t deadline : deadlines) {
+    wheel.advance(deadline - 1, &due);
+    EXPECT_TRUE(due.empty()) << deadline;
+    wheel.advance(deadline, &due);
+    EXPECT_EQ(due, std::vector<uint64_t>({deadline}));
+    due.clear();
+  }
+  EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimingWheel, RandomTest) {
+  std::mt19937_64 random(7);
+  TimingWheel<uint64_t> wheel(0);
+  std::vector<uint64_t> due;
+  uint64_t released = 0;
+  uint64_t previous = 0;
+  for (uint64_t now = 1; now <= 200000; now += random() % 50) {
+    // Reschedule the released items like the probing of destinations.
+    for (uint64_t deadline : due) {
+      EXPECT_GT(deadline, previous);
+      EXPECT_LE(deadline, wheel.now());
+      uint64_t next = now + random() % 100000;
+      wheel.schedule(next, next);
+      released++;
+    }
+    due.clear();
+    if (wheel.size() < 1000) {
+      uint64_t next = now + random() % 100000;
+      wheel.schedule(next, next);
+    }
+    previous = wheel.now();
+    wheel.advance(now, &due);
+  }
+  EXPECT_GT(released, 1000);
+  EXPECT_EQ(wheel.size() + due.size(), 1000);
+}
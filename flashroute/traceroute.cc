@@ -16,8 +16,10 @@
 #include "absl/strings/numbers.h"
 #include "absl/strings/string_view.h"
 #include "flashroute/dcb.h"
+#include "flashroute/latency_histogram.h"
 #include "flashroute/network.h"
 #include "flashroute/prober.h"
+#include "flashroute/timing_wheel.h"
 #include "flashroute/udp_idempotent_prober.h"
 #include "flashroute/udp_prober.h"
 #include "flashroute/udp_prober_v6.h"
@@ -30,7 +32,8 @@ namespace flashroute {
 // /24 ip address block, the corresponding value is 24
 const uint8_t kProbingGranularity = 24;
 
-const uint32_t kDiscoverySetCapacity = 100;
+// Locks guarding the DCBs of the prefixes in distance prediction.
+const uint32_t kPredictionMutexes = 64;
 
 const uint32_t kThreadPoolSize = 2;
 
@@ -48,6 +51,48 @@ const uint8_t kMaxTtl = 32;
 // to control how long we need to wait for those inflight response.
 const uint32_t kHaltTimeAfterPreprobingSequenceMs = 3000;
 
+// Names of the registered metrics of the tracerouter.
+const char kPreprobeUpdatesMetric[] = "flashroute_preprobe_updates";
+const char kDroppedResponsesMetric[] = "flashroute_dropped_responses";
+const char kNonstopHitsMetric[] = "flashroute_nonstop_hits";
+const char kSendingRateMetric[] = "flashroute_sending_rate";
+const char kReceivingRateMetric[] = "flashroute_receiving_rate";
+const char kDestinationsMetric[] = "flashroute_destinations";
+const char kLiveDestinationsMetric[] = "flashroute_live_destinations";
+const char kBackwardInterfacesMetric[] = "flashroute_backward_interfaces";
+const char kForwardInterfacesMetric[] = "flashroute_forward_interfaces";
+const char kProbePhaseMetric[] = "flashroute_probe_phase";
+const char kProbingRoundsMetric[] = "flashroute_probing_rounds";
+const char* const kTracerouterMetrics[] = {
+    kPreprobeUpdatesMetric,
+    kDroppedResponsesMetric,
+    kNonstopHitsMetric,
+    kSendingRateMetric,
+    kReceivingRateMetric,
+    kDestinationsMetric,
+    kLiveDestinationsMetric,
+    kBackwardInterfacesMetric,
+    kForwardInterfacesMetric,
+    kProbePhaseMetric,
+    kProbingRoundsMetric};
+
+// Median and 99th percentile of the stages in microseconds, e.g.,
+// "pack_probe: 0.21/0.48 send_call: 3.07/9.98".
+std::string formatStageLatencies(
+    const std::vector<HistogramSnapshot>& snapshots) {
+  std::string result;
+  for (uint32_t i = 0; i < snapshots.size(); i++) {
+    if (snapshots[i].count == 0) continue;
+    if (!result.empty()) result += " ";
+    result += boost::str(
+        boost::format("%s: %.2f/%.2f") %
+        getPipelineStageName(static_cast<PipelineStage>(i)) %
+        (snapshots[i].getPercentile(0.5) / 1000.0) %
+        (snapshots[i].getPercentile(0.99) / 1000.0));
+  }
+  return result;
+}
+
 Tracerouter::Tracerouter(
     DcbManager* dcbManager, NetworkManager* networkManager,
     ResultDumper* resultDumper, NonstopSet* nonstopSet,
@@ -57,7 +102,8 @@ Tracerouter::Tracerouter(
     const bool preprobingPrediction, const int32_t predictionProximitySpan,
     const int32_t scanCount, const uint16_t srcPort, const uint16_t dstPort,
     const std::string& defaultPayloadMessage, const bool encodeTimestamp,
-    const uint8_t ttlOffset, bool randomizeAddressinExtraScans)
+    const uint8_t ttlOffset, bool randomizeAddressinExtraScans,
+    const uint32_t probeIntervalMs)
     : dcbManager_(dcbManager),
       stopProbing_(false),
       probePhase_(ProbePhase::NONE),
@@ -75,10 +121,11 @@ Tracerouter::Tracerouter(
       preprobingPredictionProximitySpan_(predictionProximitySpan),
       scanCount_(scanCount),
       randomizeAddressInExtraScans_(randomizeAddressinExtraScans),
+      probeIntervalMs_(probeIntervalMs),
       sentPreprobes_(0),
-      preprobeUpdatedCount_(0),
       sentProbes_(0),
       receivedResponses_(0),
+      kernelDroppedResponses_(0),
       stopMonitoringMark_(false),
       probingIterationRounds_(0),
       srcPort_(srcPort),
@@ -87,13 +134,17 @@ Tracerouter::Tracerouter(
       encodeTimestamp_(encodeTimestamp) {
   // Thread pool for handling different purposes.
   threadPool_ = std::make_unique<boost::asio::thread_pool>(kThreadPoolSize);
-
-  // initialize the data structure to remember visited interfaces;
-  backwardProbingStopSet_.reserve(kDiscoverySetCapacity);
-  forwardProbingDiscoverySet_.reserve(kDiscoverySetCapacity);
+  predictionMutexes_ =
+      std::unique_ptr<std::mutex[]>(new std::mutex[kPredictionMutexes]);
 }
 
 Tracerouter::~Tracerouter() {
+  if (metricsRegistry_ != nullptr) {
+    for (const char* name : kTracerouterMetrics) {
+      metricsRegistry_->remove(name);
+    }
+    Prober::removeMetrics(metricsRegistry_);
+  }
   stopMonitoringMark_ = true;
   if (threadPool_.get() != nullptr) {
     threadPool_->join();
@@ -102,6 +153,65 @@ Tracerouter::~Tracerouter() {
   VLOG(2) << "Traceroute Module: Tracerouter is recycled.";
 }
 
+void Tracerouter::setMetricsRegistry(MetricsRegistry* registry) {
+  metricsRegistry_ = registry;
+  metricsRegistry_->registerCounter(
+      kPreprobeUpdatesMetric,
+      "Destinations whose split TTL preprobing updated.",
+      &preprobeUpdatedCount_);
+  metricsRegistry_->registerCounter(
+      kDroppedResponsesMetric,
+      "Responses which match no destination being probed.",
+      &droppedResponses_);
+  metricsRegistry_->registerCounter(
+      kNonstopHitsMetric, "Responses from interfaces of the nonstop set.",
+      &hitNonstopCount_);
+  // Gauges are updated by the monitoring thread.
+  metricsRegistry_->registerGauge(
+      kSendingRateMetric, "Probes sent per second in the last interval.",
+      &sendingRateGauge_);
+  metricsRegistry_->registerGauge(
+      kReceivingRateMetric,
+      "Responses received per second in the last interval.",
+      &receivingRateGauge_);
+  metricsRegistry_->registerGauge(kDestinationsMetric,
+                                  "Destinations of the scan.",
+                                  &destinationsGauge_);
+  metricsRegistry_->registerGauge(kLiveDestinationsMetric,
+                                  "Destinations still being probed.",
+                                  &liveDestinationsGauge_);
+  metricsRegistry_->registerGauge(
+      kBackwardInterfacesMetric,
+      "Interfaces discovered by backward probing.",
+      &backwardInterfacesGauge_);
+  metricsRegistry_->registerGauge(kForwardInterfacesMetric,
+                                  "Interfaces discovered by forward probing.",
+                                  &forwardInterfacesGauge_);
+  metricsRegistry_->registerGauge(
+      kProbePhaseMetric, "Probe phase: 0 none, 1 preprobing, 2 probing.",
+      &probePhaseGauge_);
+  metricsRegistry_->registerGauge(kProbingRoundsMetric,
+                                  "Rounds of the main probing phase.",
+                                  &probingRoundsGauge_);
+  if (prober_ != nullptr) prober_->registerMetrics(metricsRegistry_);
+}
+
+void Tracerouter::setProbePhase(ProbePhase probePhase) {
+  probePhase_ = probePhase;
+  int64_t state = 0;
+  if (probePhase == ProbePhase::PREPROBE) state = 1;
+  if (probePhase == ProbePhase::PROBE) state = 2;
+  probePhaseGauge_.set(state);
+}
+
+void Tracerouter::resetProber(std::unique_ptr<Prober> prober) {
+  // The counters of the new prober replace the old ones in the registry before
+  // the old prober is destroyed.
+  if (metricsRegistry_ != nullptr) prober->registerMetrics(metricsRegistry_);
+  networkManager_->resetProber(prober.get());
+  prober_ = std::move(prober);
+}
+
 void Tracerouter::startMetricMonitoring() {
   VLOG(2) << "Traceroute Module: Monitoring thread initialized.";
   stopMonitoringMark_ = false;
@@ -109,12 +219,17 @@ void Tracerouter::startMetricMonitoring() {
     auto lastSeenTimestamp = std::chrono::steady_clock::now();
     uint64_t lastSeenSentPackets = 0;
     uint64_t lastSeenReceivedPackets = 0;
+    uint64_t lastSeenDroppedPackets = 0;
+    std::vector<HistogramSnapshot> lastStageSnapshots =
+        snapshotStageHistograms();
 
     while (!stopMonitoringMark_ && !stopProbing_) {
       if (networkManager_ != nullptr) {
         uint64_t shadowSentPacket = networkManager_->getSentPacketCount();
         uint64_t shadowReceivedPacket =
             networkManager_->getReceivedPacketCount();
+        uint64_t shadowDroppedPacket =
+            networkManager_->getDroppedPacketCount();
 
         double timeDifference =
             std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -128,25 +243,62 @@ void Tracerouter::startMetricMonitoring() {
                                                     lastSeenReceivedPackets) /
                                 timeDifference * 1000;
 
+        // Share of the responses in the interval dropped by the kernel.
+        uint64_t intervalDroppedPackets =
+            shadowDroppedPacket - lastSeenDroppedPackets;
+        uint64_t intervalArrivedPackets =
+            shadowReceivedPacket - lastSeenReceivedPackets +
+            intervalDroppedPackets;
+        double dropProportion =
+            intervalArrivedPackets == 0
+                ? 0
+                : static_cast<double>(intervalDroppedPackets) /
+                      intervalArrivedPackets * 100;
+
         double preprobeUpdatedProportion =
-            static_cast<double>(preprobeUpdatedCount_) / sentPreprobes_ * 100;
+            static_cast<double>(preprobeUpdatedCount_.get()) /
+            sentPreprobes_ * 100;
 
         double remainingBlockProportion =
             static_cast<double>(dcbManager_->liveDcbSize()) /
             dcbManager_->size() * 100;
+        sendingRateGauge_.set(static_cast<int64_t>(sendingSpeed));
+        receivingRateGauge_.set(static_cast<int64_t>(receivingSpeed));
+        destinationsGauge_.set(dcbManager_->size());
+        liveDestinationsGauge_.set(dcbManager_->liveDcbSize());
+        backwardInterfacesGauge_.set(backwardProbingStopSet_.size());
+        forwardInterfacesGauge_.set(forwardProbingDiscoverySet_.size());
+        probingRoundsGauge_.set(probingIterationRounds_);
         if (lastSeenSentPackets != 0 && lastSeenReceivedPackets != 0) {
           LOG(INFO) << boost::format(
-                           "R: %d S: %5.2fk R: %5.2fk PreP: %5.2f RmnP: %5.2f "
-                           "IfCnt: %d FwIfCnt: %d") %
+                           "R: %d S: %5.2fk R: %5.2fk DrpP: %5.2f PreP: %5.2f "
+                           "RmnP: %5.2f IfCnt: %d FwIfCnt: %d") %
                            probingIterationRounds_ % (sendingSpeed / 1000) %
-                           (receivingSpeed / 1000) % preprobeUpdatedProportion %
+                           (receivingSpeed / 1000) % dropProportion %
+                           preprobeUpdatedProportion %
                            remainingBlockProportion %
                            backwardProbingStopSet_.size() %
                            forwardProbingDiscoverySet_.size();
         }
+        if (kStageTimingEnabled) {
+          // Latencies of the stages in the interval.
+          std::vector<HistogramSnapshot> stageSnapshots =
+              snapshotStageHistograms();
+          std::vector<HistogramSnapshot> intervalSnapshots;
+          for (uint32_t i = 0; i < stageSnapshots.size(); i++) {
+            intervalSnapshots.push_back(
+                stageSnapshots[i].since(lastStageSnapshots[i]));
+          }
+          std::string latencies = formatStageLatencies(intervalSnapshots);
+          if (!latencies.empty()) {
+            LOG(INFO) << "Stage p50/p99 (us): " << latencies;
+          }
+          lastStageSnapshots = stageSnapshots;
+        }
 
         lastSeenSentPackets = shadowSentPacket;
         lastSeenReceivedPackets = shadowReceivedPacket;
+        lastSeenDroppedPackets = shadowDroppedPacket;
         lastSeenTimestamp = std::chrono::steady_clock::now();
       } else {
         LOG(INFO) << "Temporary no metrics.";
@@ -163,8 +315,8 @@ void Tracerouter::startScan(ProberType proberType, bool ipv4,
   stopProbing_ = false;
   checksumMismatches_ = 0;
   distanceAbnormalities_ = 0;
-  droppedResponses_ = 0;
-  hitNonstopCount_ = 0;
+  droppedResponses_.reset();
+  hitNonstopCount_.reset();
   auto startTimestamp = std::chrono::steady_clock::now();
   VLOG(2) << "There are " << dcbManager_->size() << " targets to probe.";
 
@@ -200,35 +352,119 @@ void Tracerouter::stopMetricMonitoring() {
   std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 }
 
+template <class AddressT>
+void Tracerouter::schedulePreprobes() {
+  uint64_t dcbCount = dcbManager_->liveDcbSize();
+  for (uint64_t i = 0; i < dcbCount && !stopProbing_; i++) {
+    networkManager_->scheduleProbeRemoteHost(
+        static_cast<const AddressT&>(*(dcbManager_->next()->ipAddress)),
+        defaultPreprobingTTL_);
+  }
+}
+
+template <class AddressT>
+void Tracerouter::scheduleProbes(int scanCount) {
+  auto scanTimestamp = std::chrono::steady_clock::now();
+  // Milliseconds since the start of the scan, the ticks of the wheel.
+  auto getTick = [&scanTimestamp]() -> uint64_t {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - scanTimestamp)
+        .count();
+  };
+  TimingWheel<DestinationControlBlock*> wheel;
+
+  // The first round walks the ring. A removed Dcb keeps its link to the
+  // next one, so the walk goes on after removing the current Dcb.
+  probingIterationRounds_ = 1;
+  for (uint64_t remaining = dcbManager_->liveDcbSize();
+       remaining > 0 && !stopProbing_; remaining--) {
+    DestinationControlBlock* dcb = dcbManager_->next();
+    if (probeDcb<AddressT>(dcb, scanCount)) {
+      wheel.schedule(dcb, getTick() + probeIntervalMs_);
+    }
+  }
+
+  // Then every Dcb is probed again once its interval has passed, instead of
+  // waiting for the round of the whole ring.
+  std::vector<DestinationControlBlock*> due;
+  while (!stopProbing_ && !wheel.empty()) {
+    uint64_t tick = getTick();
+    probingIterationRounds_ = 1 + tick / probeIntervalMs_;
+    due.clear();
+    wheel.advance(tick, &due);
+    if (due.empty()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    for (DestinationControlBlock* dcb : due) {
+      if (stopProbing_) break;
+      if (probeDcb<AddressT>(dcb, scanCount)) {
+        wheel.schedule(dcb, getTick() + probeIntervalMs_);
+      }
+    }
+  }
+}
+
+template <class AddressT>
+bool Tracerouter::probeDcb(DestinationControlBlock* dcb, int scanCount) {
+  uint8_t nextForwardTask = dcb->pullForwardTask();
+  uint8_t nextBackwardTask = dcb->pullBackwardTask(ttlOffset_);
+
+  bool hasForwardTask = nextForwardTask != 0;
+  bool hasBackwardTask = nextBackwardTask != 0;
+  // An entry will be removed only if backward and forward probings are
+  // all done.
+  if (!hasBackwardTask &&
+      (!forwardProbingMark_ || scanCount > 0 || !hasForwardTask)) {
+    dcbManager_->removeDcbFromIteration(dcb);
+    return false;
+  }
+  if (forwardProbingMark_ && hasForwardTask) {
+    // forward probing
+    networkManager_->scheduleProbeRemoteHost(
+        static_cast<const AddressT&>(*dcb->ipAddress), nextForwardTask);
+  }
+  if (hasBackwardTask) {
+    // backward probing
+    networkManager_->scheduleProbeRemoteHost(
+        static_cast<const AddressT&>(*dcb->ipAddress), nextBackwardTask);
+  }
+  return true;
+}
+
 void Tracerouter::startPreprobing(ProberType proberType, bool ipv4) {
   // Update status.
-  probePhase_ = ProbePhase::PREPROBE;
+  setProbePhase(ProbePhase::PREPROBE);
   // Set up callback function.
   PacketReceiverCallback callback =
       [this](const IpAddress& destination, const IpAddress& responder,
              uint8_t distance, uint32_t rtt, bool fromDestination, bool ipv4,
              void* receivedPacket, size_t packetLen) {
+        StageStamp handling = StageStamp::now();
         if (parseIcmpPreprobing(destination, responder, distance,
                                 fromDestination) &&
             resultDumper_ != nullptr) {
-          resultDumper_->scheduleDumpData(destination, responder, distance, rtt,
+          resultDumper_->scheduleDumpData(getReceiverIndex(), destination,
+                                          responder, distance, rtt,
                                           fromDestination, ipv4, receivedPacket,
                                           packetLen);
         }
+        recordStage(PipelineStage::PARSE_CALLBACK, handling);
       };
 
+  std::unique_ptr<Prober> prober;
   if (proberType == ProberType::UDP_PROBER) {
     if (ipv4) {
-      prober_ = std::make_unique<UdpProber>(&callback, 0, kPreProbePhase,
-                                            dstPort_, defaultPayloadMessage_,
-                                            encodeTimestamp_, ttlOffset_);
+      prober = std::make_unique<UdpProber>(&callback, 0, kPreProbePhase,
+                                           dstPort_, defaultPayloadMessage_,
+                                           encodeTimestamp_, ttlOffset_);
     } else {
-      prober_ = std::make_unique<UdpProberIpv6>(
+      prober = std::make_unique<UdpProberIpv6>(
           &callback, 0, kPreProbePhase, dstPort_, defaultPayloadMessage_,
           ttlOffset_);
     }
   } else if (proberType == ProberType::UDP_IDEMPOTENT_PROBER) {
-    prober_ = std::make_unique<UdpIdempotentProber>(
+    prober = std::make_unique<UdpIdempotentProber>(
         &callback, 0, kPreProbePhase, dstPort_, defaultPayloadMessage_,
         encodeTimestamp_, ttlOffset_);
   } else {
@@ -236,15 +472,15 @@ void Tracerouter::startPreprobing(ProberType proberType, bool ipv4) {
   }
 
   // Set network manager
-  networkManager_->resetProber(prober_.get());
+  resetProber(std::move(prober));
   networkManager_->startListening();
 
   auto startTimestamp = std::chrono::steady_clock::now();
   LOG(INFO) << "Start preprobing.";
-  uint64_t dcbCount = dcbManager_->liveDcbSize();
-  for (uint64_t i = 0; i < dcbCount && !stopProbing_; i++) {
-    networkManager_->scheduleProbeRemoteHost(*(dcbManager_->next()->ipAddress),
-                                             defaultPreprobingTTL_);
+  if (ipv4) {
+    schedulePreprobes<Ipv4Address>();
+  } else {
+    schedulePreprobes<Ipv6Address>();
   }
   std::this_thread::sleep_for(
       std::chrono::milliseconds(kHaltTimeAfterPreprobingSequenceMs));
@@ -263,7 +499,7 @@ void Tracerouter::startPreprobing(ProberType proberType, bool ipv4) {
 
 void Tracerouter::startProbing(ProberType proberType, bool ipv4) {
   // Update status
-  probePhase_ = ProbePhase::PROBE;
+  setProbePhase(ProbePhase::PROBE);
   // Set up callback function.
   PacketReceiverCallback callback = [this](const IpAddress& destination,
                                            const IpAddress& responder,
@@ -271,37 +507,40 @@ void Tracerouter::startProbing(ProberType proberType, bool ipv4) {
                                            bool fromDestination, bool ipv4,
                                            void* receivedPacket,
                                            size_t packetLen) {
+    StageStamp handling = StageStamp::now();
     if (parseIcmpProbing(destination, responder, distance, fromDestination) &&
         resultDumper_ != nullptr) {
-      resultDumper_->scheduleDumpData(destination, responder, distance, rtt,
+      resultDumper_->scheduleDumpData(getReceiverIndex(), destination,
+                                      responder, distance, rtt,
                                       fromDestination, ipv4, receivedPacket,
                                       packetLen);
     }
+    recordStage(PipelineStage::PARSE_CALLBACK, handling);
   };
 
+  std::unique_ptr<Prober> prober;
   if (proberType == ProberType::UDP_PROBER) {
     if (ipv4) {
-      prober_ = std::make_unique<UdpProber>(&callback, 0, kMainProbePhase,
+      prober = std::make_unique<UdpProber>(&callback, 0, kMainProbePhase,
                                             dstPort_, defaultPayloadMessage_,
-                                            encodeTimestamp_, ttlOffset_);
+                                           encodeTimestamp_, ttlOffset_);
 
     } else {
-      prober_ = std::make_unique<UdpProberIpv6>(
+      prober = std::make_unique<UdpProberIpv6>(
           &callback, 0, kPreProbePhase, dstPort_, defaultPayloadMessage_,
           ttlOffset_);
     }
   } else if (proberType == ProberType::UDP_IDEMPOTENT_PROBER) {
-    prober_ = std::make_unique<UdpIdempotentProber>(
+    prober = std::make_unique<UdpIdempotentProber>(
         &callback, 0, kMainProbePhase, dstPort_, defaultPayloadMessage_,
         encodeTimestamp_, ttlOffset_);
   } else {
     LOG(FATAL) << "Error in creating prober.";
   }
 
-  networkManager_->resetProber(prober_.get());
+  resetProber(std::move(prober));
   networkManager_->startListening();
   auto startTimestamp = std::chrono::steady_clock::now();
-  auto lastRoundTimestamp = std::chrono::steady_clock::now();
 
   // Take a snapshot for DCBs' links.
   if (scanCount_ > 1) {
@@ -309,7 +548,6 @@ void Tracerouter::startProbing(ProberType proberType, bool ipv4) {
   }
 
   LOG(INFO) << "Start main probing.";
-  int32_t scanRound = -1;
   for (int scanCount = 0; scanCount < scanCount_ && !stopProbing_;
        scanCount++) {
     if (scanCount > 0) {
@@ -322,49 +560,15 @@ void Tracerouter::startProbing(ProberType proberType, bool ipv4) {
         LOG(INFO) << "Randomize addresses for the coming scan.";
         dcbManager_->shuffleAddress();
       }
-      probingIterationRounds_ = 0;
       prober_->setChecksumOffset(scanCount);
+      networkManager_->updateResponseFilter();
     }
     // send probes to all targeting blocks
-    do {
-      if (dcbManager_->scanRound > scanRound) {
-        probingIterationRounds_ += 1;
-        // Sleep one second if the delta is less than one second.
-        int32_t delta =
-            std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::steady_clock::now() - lastRoundTimestamp)
-                .count();
-        if (delta < 1000) {
-          std::this_thread::sleep_for(std::chrono::milliseconds(1000 - delta));
-        }
-        lastRoundTimestamp = std::chrono::steady_clock::now();
-        scanRound = dcbManager_->scanRound;
-      }
-      DestinationControlBlock& dcb = *dcbManager_->next();
-
-      uint8_t nextForwardTask = dcb.pullForwardTask();
-      uint8_t nextBackwardTask = dcb.pullBackwardTask(ttlOffset_);
-
-      bool hasForwardTask = nextForwardTask != 0;
-      bool hasBackwardTask = nextBackwardTask != 0;
-      // An entry will be removed only if backward and forward probings are
-      // all done.
-      if (!hasBackwardTask &&
-          (!forwardProbingMark_ || scanCount > 0 || !hasForwardTask)) {
-        dcbManager_->removeDcbFromIteration(&dcb);
-      } else {
-        if (forwardProbingMark_ && hasForwardTask) {
-          // forward probing
-          networkManager_->scheduleProbeRemoteHost(*dcb.ipAddress,
-                                                   nextForwardTask);
-        }
-        if (hasBackwardTask) {
-          // backward probing
-          networkManager_->scheduleProbeRemoteHost(*dcb.ipAddress,
-                                                   nextBackwardTask);
-        }
-      }
-    } while (!stopProbing_ && dcbManager_->hasNext());
+    if (ipv4) {
+      scheduleProbes<Ipv4Address>(scanCount);
+    } else {
+      scheduleProbes<Ipv6Address>(scanCount);
+    }
     LOG(INFO) << "Scan finished.";
   }
   networkManager_->stopListening();
@@ -376,41 +580,46 @@ void Tracerouter::startProbing(ProberType proberType, bool ipv4) {
                    timeDifference;
 
   // Update status
-  probePhase_ = ProbePhase::NONE;
+  setProbePhase(ProbePhase::NONE);
   sentProbes_ = networkManager_->getSentPacketCount();
   receivedResponses_ = networkManager_->getReceivedPacketCount();
+  kernelDroppedResponses_ = networkManager_->getDroppedPacketCount();
   checksumMismatches_ = prober_->getChecksumMismatches();
   distanceAbnormalities_ = prober_->getDistanceAbnormalities();
   // Dropped responses for other reasons.
-  droppedResponses_ += prober_->getOtherMismatches();
+  droppedResponses_.add(prober_->getOtherMismatches());
 }
 
 bool Tracerouter::parseIcmpPreprobing(const IpAddress& destination,
                                       const IpAddress& responder,
                                       uint8_t distance, bool fromDestination) {
   if (!fromDestination) {
-    droppedResponses_++;
+    droppedResponses_.add();
     return false;
   }
 
   DestinationControlBlock* dcb = dcbManager_->getDcbByAddress(destination);
   if (dcb == nullptr) {
-    droppedResponses_++;
+    droppedResponses_.add();
     return false;
   }
 
   // The preprobe should update the max ttl always shorter than the ttl of
   // preprobes, otherwise, the target host won't receive preprobe.
   if (dcb->updateSplitTtl(distance, true)) {
-    preprobeUpdatedCount_ += 1;
+    preprobeUpdatedCount_.add();
   }
   if (preprobingPredictionMark_) {
     std::vector<DestinationControlBlock*>* result =
         dcbManager_->getDcbsByAddress(destination);
     if (result != nullptr) {
+      // Responses of the prefix may arrive on several receiving threads.
+      std::lock_guard<std::mutex> guard(
+          predictionMutexes_[reinterpret_cast<uintptr_t>(result) /
+                             sizeof(*result) % kPredictionMutexes]);
       for (auto it = result->begin(); it != result->end(); it++) {
         if ((*it)->updateSplitTtl(distance, false)) {
-          preprobeUpdatedCount_++;
+          preprobeUpdatedCount_.add();
         }
       }
       // remove all dcbs from future update.
@@ -431,32 +640,25 @@ bool Tracerouter::parseIcmpProbing(const IpAddress& destination,
     if (result != nullptr && result->size() == 1) {
       dcb = result->at(0);
     } else {
-      droppedResponses_++;
+      droppedResponses_.add();
       return false;
     }
   }
   if (!fromDestination) {
     // Time Exceeded
-    if (dcb->initialBackwardProbingTtl < distance) {
+    if (dcb->getInitialBackwardProbingTtl() < distance) {
       // The response is from forward probing / the distance is error if
       // forward probing is not activated.
-      forwardProbingDiscoverySet_.insert(responder.clone());
-    } else {
-      // The response is from backward probing.
-      if (backwardProbingStopSet_.find(&(const_cast<IpAddress&>(responder))) !=
-          backwardProbingStopSet_.end()) {
-        // We stop only for router interfaces discovered in backward
-        // probing.
-        if (redundancyRemovalMark_) {
-          if (nonstopSet_ == nullptr || !nonstopSet_->contains(&responder)) {
-            static_cast<uint64_t>(dcb->stopBackwardProbing());
-          } else {
-            hitNonstopCount_++;
-          }
+      forwardProbingDiscoverySet_.insert(responder);
+    } else if (!backwardProbingStopSet_.insert(responder)) {
+      // The response is from backward probing. We stop only for router
+      // interfaces discovered in backward probing.
+      if (redundancyRemovalMark_) {
+        if (nonstopSet_ == nullptr || !nonstopSet_->contains(&responder)) {
+          static_cast<uint64_t>(dcb->stopBackwardProbing());
+        } else {
+          hitNonstopCount_.add();
         }
-      } else {
-        // Only add address to stop set if it is not in nonstop set.
-        backwardProbingStopSet_.insert(responder.clone());
       }
     }
     if (distance <= dcb->getMaxProbedDistance()) {
@@ -488,26 +690,44 @@ void Tracerouter::calculateStatistic(uint64_t elapsedTime) {
                    (sentProbes_ + sentPreprobes_);
   LOG(INFO) << boost::format("Received packets: %|30t|%ld") %
                    receivedResponses_;
+  LOG(INFO) << boost::format("Dropped by kernel: %|30t|%ld") %
+                   kernelDroppedResponses_;
   LOG(INFO) << boost::format("Total Dropped responses: %|30t|%ld") %
                    (checksumMismatches_ + distanceAbnormalities_ +
-                    droppedResponses_);
-  LOG(INFO) << boost::format("Other dropped: %|30t|%ld") % (droppedResponses_);
+                    droppedResponses_.get());
+  LOG(INFO) << boost::format("Other dropped: %|30t|%ld") %
+                   droppedResponses_.get();
   LOG(INFO) << boost::format("Checksum Mismatches: %|30t|%ld") %
                    (checksumMismatches_);
   LOG(INFO) << boost::format("Distance Abnormalities: %|30t|%ld") %
                    (distanceAbnormalities_);
   LOG(INFO) << boost::format("Sent probes: %|30t|%1%") % sentProbes_;
   LOG(INFO) << boost::format("Sent preprobes: %|30t|%ld") % sentPreprobes_;
-  LOG(INFO) << boost::format("Hit nonstop: %|30t|%ld") % hitNonstopCount_;
+  LOG(INFO) << boost::format("Hit nonstop: %|30t|%ld") %
+                   hitNonstopCount_.get();
 
   LOG(INFO) << boost::format("Interfaces Forward-probing: %|30t|%ld") %
                    forwardProbingDiscoverySet_.size();
   LOG(INFO) << boost::format("Interfaces Backward-probing: %|30t|%ld") %
                    backwardProbingStopSet_.size();
-  backwardProbingStopSet_.insert(forwardProbingDiscoverySet_.begin(),
-                                 forwardProbingDiscoverySet_.end());
+  backwardProbingStopSet_.insertAll(forwardProbingDiscoverySet_);
   LOG(INFO) << boost::format("Discovered Interfaces: %|30t|%1%") %
                    (backwardProbingStopSet_.size());
+
+  std::vector<HistogramSnapshot> stageSnapshots = snapshotStageHistograms();
+  for (uint32_t i = 0; i < stageSnapshots.size(); i++) {
+    const HistogramSnapshot& snapshot = stageSnapshots[i];
+    if (snapshot.count == 0) continue;
+    LOG(INFO) << boost::format(
+                     "Stage %s: %|30t|count %d mean %.2f p50 %.2f p90 %.2f "
+                     "p99 %.2f max %.2f us") %
+                     getPipelineStageName(static_cast<PipelineStage>(i)) %
+                     snapshot.count % (snapshot.getMean() / 1000) %
+                     (snapshot.getPercentile(0.5) / 1000.0) %
+                     (snapshot.getPercentile(0.9) / 1000.0) %
+                     (snapshot.getPercentile(0.99) / 1000.0) %
+                     (snapshot.getMax() / 1000.0);
+  }
 }
 
 // void Tracerouter::dumpAllTargetsToFile(const std::string& filePath) {
@@ -557,4 +777,29 @@ bool NonstopSet::contains(const IpAddress* addr) {
           internalSet_.end());
 }
 
+InterfaceSet::InterfaceSet()
+    : shards_(new Shard[kInterfaceSetShards]), size_(0) {}
+
+InterfaceSet::~InterfaceSet() {
+  for (uint32_t i = 0; i < kInterfaceSetShards; i++) {
+    for (IpAddress* address : shards_[i].addresses) delete address;
+  }
+}
+
+bool InterfaceSet::insert(const IpAddress& address) {
+  IpAddress* key = &const_cast<IpAddress&>(address);
+  Shard& shard = shards_[IpAddressHash()(key) % kInterfaceSetShards];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  if (shard.addresses.find(key) != shard.addresses.end()) return false;
+  shard.addresses.insert(address.clone());
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void InterfaceSet::insertAll(const InterfaceSet& other) {
+  for (uint32_t i = 0; i < kInterfaceSetShards; i++) {
+    for (IpAddress* address : other.shards_[i].addresses) insert(*address);
+  }
+}
+
 }  // namespace flashroute
@@ -1,6 +1,7 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <iostream>
@@ -19,6 +20,7 @@
 #include "flashroute/dcb.h"
 #include "flashroute/dcb_manager.h"
 #include "flashroute/dump_result.h"
+#include "flashroute/metrics.h"
 #include "flashroute/network.h"
 #include "flashroute/prober.h"
 
@@ -38,6 +40,50 @@ class NonstopSet {
        internalSet_;
 };
 
+// Number of shards of an InterfaceSet.
+const uint32_t kInterfaceSetShards = 64;
+
+/**
+ * InterfaceSet records the router interfaces discovered by the receiving
+ * threads. The addresses are split into shards by hash, each with a lock of
+ * its own, so the threads only wait for each other when they update the same
+ * shard at once. The set owns the addresses it stores.
+ *
+ * Example:
+ *
+ * InterfaceSet interfaces;
+ *
+ * // Receiving threads.
+ * if (!interfaces.insert(responder)) {
+ *   // the interface was seen before.
+ * }
+ *
+ * // Monitoring thread.
+ * LOG(INFO) << interfaces.size();
+ */
+class InterfaceSet {
+ public:
+  InterfaceSet();
+  ~InterfaceSet();
+
+  // Insert a copy of the address. Return false if it was in the set already.
+  bool insert(const IpAddress& address);
+
+  // Insert the addresses of another set, which is not updated meanwhile.
+  void insertAll(const InterfaceSet& other);
+
+  uint64_t size() const { return size_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_set<IpAddress*, IpAddressHash, IpAddressEquality> addresses;
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<uint64_t> size_;
+};
+
 /**
  * Traceroute module contains the major logics and strategies of probing.
  * Examples:
@@ -68,7 +114,9 @@ class NonstopSet {
  *    true,                       // Control whether to encode timestamp to each
  *                                // probe. (Test function).
  *    0,                          // ttl offset to shift the range of ttl
- *    true                        // Randomize addresses in following scans.
+ *    true,                       // Randomize addresses in following scans.
+ *    1000                        // Minimum interval in milliseconds between
+ *                                // two probes to the same target.
  * );
  * 
  * // startScan accepts two parameters:
@@ -95,7 +143,8 @@ class Tracerouter {
               const uint16_t srcPort, const uint16_t dstPort,
               const std::string& defaultPayloadMessage,
               const bool encodeTimestamp, const uint8_t ttlOffset,
-              const bool randomizeAddressinExtraScans);
+              const bool randomizeAddressinExtraScans,
+              const uint32_t probeIntervalMs);
 
   ~Tracerouter();
 
@@ -104,6 +153,9 @@ class Tracerouter {
 
   void stopScan() { stopProbing_ = true; }
 
+  // Register the response counters of the scan and of the running prober.
+  void setMetricsRegistry(MetricsRegistry* registry);
+
  private:
   DcbManager* dcbManager_;
   // Control probing to stop
@@ -113,10 +165,18 @@ class Tracerouter {
 
   ResultDumper* resultDumper_;
 
+  // The response callbacks of the receiving threads run concurrently: the
+  // DCBs update their state atomically, the discovery sets are sharded and
+  // every thread has a dumping ring of its own. Only clearing the DCBs of a
+  // prefix in distance prediction takes a lock, one of these picked by the
+  // prefix.
+  std::unique_ptr<std::mutex[]> predictionMutexes_;
+
   std::unique_ptr<boost::asio::thread_pool> threadPool_;
 
   std::unique_ptr<Prober> prober_;
   NetworkManager* networkManager_;
+  MetricsRegistry* metricsRegistry_ = nullptr;
   
   NonstopSet* nonstopSet_;
 
@@ -149,29 +209,42 @@ class Tracerouter {
   int32_t scanCount_;
   bool randomizeAddressInExtraScans_;
 
+  // A target is probed again only after this interval, so that the responses
+  // to its last probes can arrive and update its probing progress.
+  uint32_t probeIntervalMs_;
+
   // Metrics
   uint64_t sentPreprobes_;
-  uint64_t preprobeUpdatedCount_;
+  Counter preprobeUpdatedCount_;
 
   uint64_t sentProbes_;
   uint64_t receivedResponses_;
+  // Responses dropped by the kernel because the receiving sockets were full.
+  uint64_t kernelDroppedResponses_;
   bool stopMonitoringMark_;
   uint32_t probingIterationRounds_;
 
-  uint64_t droppedResponses_;
+  Counter droppedResponses_;
   uint64_t checksumMismatches_;
   uint64_t distanceAbnormalities_;
-  uint64_t hitNonstopCount_;
+  Counter hitNonstopCount_;
+
+  // Snapshots of the progress taken by the monitoring thread, so that
+  // reading them never touches the state of the probing threads.
+  Gauge sendingRateGauge_;
+  Gauge receivingRateGauge_;
+  Gauge destinationsGauge_;
+  Gauge liveDestinationsGauge_;
+  Gauge backwardInterfacesGauge_;
+  Gauge forwardInterfacesGauge_;
+  Gauge probePhaseGauge_;
+  Gauge probingRoundsGauge_;
 
   // Record all observed interfaces in backward probing.
-  std::unordered_set<IpAddress*, IpAddressHash,
-                     IpAddressEquality>
-      backwardProbingStopSet_;
+  InterfaceSet backwardProbingStopSet_;
 
   // Record all observed interfaces in forward probing.
-  std::unordered_set<IpAddress*, IpAddressHash,
-                     IpAddressEquality>
-      forwardProbingDiscoverySet_;
+  InterfaceSet forwardProbingDiscoverySet_;
 
   // Seed for randomization.
   uint32_t seed_;
@@ -191,10 +264,31 @@ class Tracerouter {
   // The variable to encode timestamp.
   bool encodeTimestamp_;
 
+  void setProbePhase(ProbePhase probePhase);
+
+  // Hand the prober of the next phase to the network manager.
+  void resetProber(std::unique_ptr<Prober> prober);
+
   void startPreprobing(ProberType proberType, bool ipv4);
 
   void startProbing(ProberType proberType, bool ipv4);
 
+  // Schedule a preprobe to every live Dcb. Templated on the address family so
+  // scheduling does not check or cast the address of every Dcb.
+  template <class AddressT>
+  void schedulePreprobes();
+
+  // Schedule the probes of one scan over the live Dcbs. Every Dcb is due at
+  // the start of the scan, in the order of the ring, and again
+  // probeIntervalMs_ after each of its probes until it has no task.
+  template <class AddressT>
+  void scheduleProbes(int scanCount);
+
+  // Schedule the next probes of the Dcb, or remove it from the iteration if
+  // its probing is done. Return true if the Dcb is still live.
+  template <class AddressT>
+  bool probeDcb(DestinationControlBlock* dcb, int scanCount);
+
   bool parseIcmpPreprobing(const IpAddress& destination,
                            const IpAddress& responder, uint8_t distance,
                            bool fromDestination);
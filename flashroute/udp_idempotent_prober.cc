@@ -10,6 +10,9 @@
 #include <cstring>
 
 #include "glog/logging.h"
+#include "flashroute/checksum.h"
+#include "flashroute/timestamping.h"
+#include "flashroute/utils.h"
 
 namespace flashroute {
 
@@ -21,6 +24,10 @@ const uint8_t kMaxTtl = 32;
 // value.
 const uint16_t kDefaultIPID = 1234;
 
+// Probe size range. The size encodes the destination group and TTL.
+const int32_t kIdempotentProbeMinSize = 64;
+const int32_t kIdempotentProbeMaxSize = 512;
+
 UdpIdempotentProber::UdpIdempotentProber(PacketReceiverCallback* callback,
                                          const int32_t checksumOffset,
                                          const uint8_t probePhaseCode,
@@ -35,9 +42,7 @@ UdpIdempotentProber::UdpIdempotentProber(PacketReceiverCallback* callback,
   payloadMessage_ = payloadMessage;
   destinationPort_ = htons(destinationPort);
   encodeTimestamp_ = encodeTimestamp;
-  checksumMismatches_ = 0;
-  distanceAbnormalities_ = 0;
-  otherMismatches_ = 0;
+  buildProbeTemplate();
   VLOG(2) << "UdpIdempotentProber is initialized";
 }
 
@@ -45,10 +50,22 @@ size_t UdpIdempotentProber::packProbe(const IpAddress& destinationIp,
                                       const IpAddress& sourceIp,
                                       const uint8_t ttl,
                                       uint8_t* packetBuffer) {
-  uint32_t destinationIpDecimal =
-      htonl((dynamic_cast<const Ipv4Address&>(destinationIp)).getIpv4Address());
-  uint32_t sourceIpDecimal =
-      htonl((dynamic_cast<const Ipv4Address&>(sourceIp)).getIpv4Address());
+  return packProbe(dynamic_cast<const Ipv4Address&>(destinationIp),
+                   dynamic_cast<const Ipv4Address&>(sourceIp), ttl,
+                   packetBuffer);
+}
+
+size_t UdpIdempotentProber::packProbe(const Ipv4Address& destinationIp,
+                                      const Ipv4Address& sourceIp,
+                                      const uint8_t ttl,
+                                      uint8_t* packetBuffer) {
+  uint32_t destinationIpDecimal = htonl(destinationIp.getIpv4Address());
+  uint32_t sourceIpDecimal = htonl(sourceIp.getIpv4Address());
+
+  if (packingMode_ == PackingMode::TEMPLATE && !probeTemplate_.empty()) {
+    return packProbeFromTemplate(destinationIpDecimal, sourceIpDecimal, ttl,
+                                 packetBuffer);
+  }
 
   struct PacketUdp* packet =
       reinterpret_cast<struct PacketUdp*>(packetBuffer);
@@ -64,15 +81,7 @@ size_t UdpIdempotentProber::packProbe(const IpAddress& destinationIp,
   packet->ip.ip_p = kUdpProtocol;  // UDP protocol
   packet->ip.ip_ttl = ttl;
 
-  int32_t packetExpectedSize = 0;
-  uint8_t groupOfDestination =
-      static_cast<uint8_t>((destinationIpDecimal % 7) + 1);
-
-  // packet-size encodes 3-bit destination group.
-  packetExpectedSize = (groupOfDestination & 0x7) << 6;
-  // packet-size encodes 6-bit: 5-bit TTL and 1 bit for encoding protoType.
-  packetExpectedSize = packetExpectedSize | ((ttl - ttlOffset_) & 0x1F) |
-                       ((probePhaseCode_ & 0x1) << 5);
+  int32_t packetExpectedSize = getPacketSize(destinationIpDecimal, ttl);
 
   // In OSX, please use: packet->ip.ip_len = packetExpectedSize;
   // Otherwise, you will have an Errno-22.
@@ -98,11 +107,10 @@ size_t UdpIdempotentProber::packProbe(const IpAddress& destinationIp,
   // if you set a checksum to zero, your kernel's IP stack should fill in
   // the correct checksum during transmission
   // packet->udp.uh_sum = 0;
-  packet->udp.uh_sum = getChecksum(
-      kUdpProtocol, packetExpectedSize - sizeof(packet->ip),
-      reinterpret_cast<uint16_t*>(&sourceIpDecimal),
-      reinterpret_cast<uint16_t*>(&destinationIpDecimal),
-      reinterpret_cast<uint16_t*>(packetBuffer + sizeof(struct ip)));
+  packet->udp.uh_sum = getIpv4PseudoHeaderChecksum(
+      sourceIpDecimal, destinationIpDecimal, kUdpProtocol,
+      packetBuffer + sizeof(struct ip),
+      packetExpectedSize - sizeof(packet->ip));
 #else
   packet->udp.dest = destinationPort_;
   packet->udp.source =
@@ -112,11 +120,10 @@ size_t UdpIdempotentProber::packProbe(const IpAddress& destinationIp,
   // if you set a checksum to zero, your kernel's IP stack should fill in
   // the correct checksum during transmission
   // packet->udp.uh_sum = 0;
-  packet->udp.check = getChecksum(
-      kUdpProtocol, packetExpectedSize - sizeof(packet->ip),
-      reinterpret_cast<uint16_t*>(&sourceIpDecimal),
-      reinterpret_cast<uint16_t*>(&destinationIpDecimal),
-      reinterpret_cast<uint16_t*>(packetBuffer + sizeof(struct ip)));
+  packet->udp.check = getIpv4PseudoHeaderChecksum(
+      sourceIpDecimal, destinationIpDecimal, kUdpProtocol,
+      packetBuffer + sizeof(struct ip),
+      packetExpectedSize - sizeof(packet->ip));
 #endif
 
   return packetExpectedSize;
@@ -126,9 +133,36 @@ void UdpIdempotentProber::setChecksumOffset(int32_t checksumOffset) {
   checksumOffset_ = checksumOffset;
 }
 
+bool UdpIdempotentProber::getResponseFilter(ResponseFilter* filter) const {
+  filter->ipv4 = true;
+  filter->destinationPort = ntohs(destinationPort_);
+  filter->checksumField = ChecksumField::IP_ID;
+  filter->checksumOffset = static_cast<uint16_t>(checksumOffset_);
+  return true;
+}
+
 void UdpIdempotentProber::parseResponse(uint8_t* buffer, size_t size,
-                              SocketType socketType) {
-  if (socketType != SocketType::ICMP || size < 56) return;
+                                        SocketType socketType) {
+  ReceivedPacket packet = {buffer, size};
+  parseResponses(&packet, 1, socketType);
+}
+
+void UdpIdempotentProber::parseResponses(const ReceivedPacket* packets,
+                                         size_t count, SocketType socketType) {
+  parseResponses(packets, count, socketType,
+                 [this](const ProbeResponse<Ipv4Address>& response,
+                        const ReceivedPacket& packet) {
+                   (*callback_)(response.destination, response.responder,
+                                response.distance, response.rtt,
+                                response.fromDestination, true, packet.buffer,
+                                packet.size);
+                 });
+}
+
+bool UdpIdempotentProber::decodeResponse(
+    uint8_t* buffer, size_t size, SocketType socketType,
+    int64_t packetTimestamp, ProbeResponse<Ipv4Address>* response) {
+  if (socketType != SocketType::ICMP || size < 56) return false;
   struct PacketIcmp* parsedPacket =
       reinterpret_cast<struct PacketIcmp*>(buffer);
   struct PacketUdp* residualUdpPacket =
@@ -145,16 +179,16 @@ void UdpIdempotentProber::parseResponse(uint8_t* buffer, size_t size,
           reinterpret_cast<uint16_t*>(&residualUdpPacket->ip.ip_dst.s_addr),
           checksumOffset_) != residualUdpPacket->ip.ip_id) {
     // Checksum unmatched.
-    checksumMismatches_ += 1;
-    return;
+    checksumMismatches_.add();
+    return false;
   }
 #else
   if (getDestAddrChecksum(
           reinterpret_cast<uint16_t*>(&residualUdpPacket->ip.ip_dst.s_addr),
           checksumOffset_) != ntohs(residualUdpPacket->ip.ip_id)) {
     // Checksum unmatched.
-    checksumMismatches_ += 1;
-    return;
+    checksumMismatches_.add();
+    return false;
   }
 #endif
   destination = ntohl(residualUdpPacket->ip.ip_dst.s_addr);
@@ -178,6 +212,12 @@ void UdpIdempotentProber::parseResponse(uint8_t* buffer, size_t size,
   if (initialTTL == 0) initialTTL = 32;
   initialTTL+=ttlOffset_;
 
+  if (probeTimestamps_ != nullptr) {
+    rtt = probeTimestamps_->getRtt(getDestinationKey(destination),
+                                   static_cast<uint8_t>(initialTTL),
+                                   packetTimestamp);
+  }
+
   if (parsedPacket->icmp.icmp_type == 3 &&
       (parsedPacket->icmp.icmp_code == 3 || parsedPacket->icmp.icmp_code == 2 ||
        parsedPacket->icmp.icmp_code == 1)) {
@@ -189,7 +229,7 @@ void UdpIdempotentProber::parseResponse(uint8_t* buffer, size_t size,
     // Other Unreachable
     fromDestination = false;
     distance = initialTTL - residualUdpPacket->ip.ip_ttl + 1;
-    return;
+    return false;
   } else if (parsedPacket->icmp.icmp_type == 11 &&
              parsedPacket->icmp.icmp_code == 0) {
     // Time Exceeded
@@ -197,117 +237,133 @@ void UdpIdempotentProber::parseResponse(uint8_t* buffer, size_t size,
     distance = initialTTL;
   } else {
     // Other packets.
-    return;
+    return false;
   }
 
   if (distance <= ttlOffset_ || distance > (kMaxTtl + ttlOffset_)) {
-    distanceAbnormalities_ += 1;
-    return;
+    distanceAbnormalities_.add();
+    return false;
   }
 
-  Ipv4Address ipv4Destination(destination);
-  Ipv4Address ipv4Responder(responder);
-
-  (*callback_)(ipv4Destination, ipv4Responder, static_cast<uint8_t>(distance),
-               rtt, fromDestination, true, buffer, size);
+  response->destination = Ipv4Address(destination);
+  response->responder = Ipv4Address(responder);
+  response->distance = static_cast<uint8_t>(distance);
+  response->rtt = rtt;
+  response->fromDestination = fromDestination;
+  return true;
 }
 
 uint16_t UdpIdempotentProber::getDestAddrChecksum(const uint16_t* ipAddress,
                                                   const uint16_t offset) const {
-  uint32_t sum = 0;
-  sum += ntohs(ipAddress[0]);
-  sum += ntohs(ipAddress[1]);
+  uint16_t checksum = ntohs(getInternetChecksum(ipAddress, sizeof(uint32_t)));
+  return htons(static_cast<uint16_t>(checksum + offset));
+}
 
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
+int32_t UdpIdempotentProber::getPacketSize(const uint32_t destinationIpDecimal,
+                                           const uint8_t ttl) const {
+  uint8_t groupOfDestination =
+      static_cast<uint8_t>((destinationIpDecimal % 7) + 1);
 
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum + offset));
+  // packet-size encodes 3-bit destination group.
+  int32_t packetSize = (groupOfDestination & 0x7) << 6;
+  // packet-size encodes 6-bit: 5-bit TTL and 1 bit for encoding protoType.
+  packetSize = packetSize | ((ttl - ttlOffset_) & 0x1F) |
+               ((probePhaseCode_ & 0x1) << 5);
+  return packetSize;
 }
 
-uint16_t UdpIdempotentProber::getChecksum(const uint8_t protocolValue,
-                                     size_t packetLength,
-                                     const uint16_t* sourceIpAddress,
-                                     const uint16_t* destinationIpAddress,
-                                     uint16_t* buff) const {
-  /* Check if the tcp length is even or odd.  Add padding if odd. */
-  if ((packetLength % 2) == 1) {
-    // Empty space in the ip buffer should be 0 anyway.
-    buff[packetLength] = 0;
-    packetLength += 1;  // incrase length to make even.
-  }
-
-  uint32_t sum = 0;
-  /* add the pseudo header */
-  sum += ntohs(sourceIpAddress[0]);
-  sum += ntohs(sourceIpAddress[1]);
-  sum += ntohs(destinationIpAddress[0]);
-  sum += ntohs(destinationIpAddress[1]);
-  sum += packetLength;   // already in host format.
-  sum += protocolValue;  // already in host format.
-
-  /*
-   * calculate the checksum for the tcp header and payload
-   * len_tcp represents number of 8-bit bytes,
-   * we are working with 16-bit words so divide len_tcp by 2.
-   */
-  for (uint32_t i = 0; i < (packetLength / 2); i++) {
-    sum += ntohs(buff[i]);
+void UdpIdempotentProber::buildProbeTemplate() {
+  // The payload beyond the message is zero in probes of all sizes, so it adds
+  // nothing to the checksum. Long messages are packed fully.
+  if (payloadMessage_.size() >
+      kIdempotentProbeMinSize - sizeof(struct ip) - sizeof(struct udphdr)) {
+    probeTemplate_.clear();
+    return;
   }
+  probeTemplate_.assign(kIdempotentProbeMaxSize, 0);
+  struct PacketUdp* packet =
+      reinterpret_cast<struct PacketUdp*>(probeTemplate_.data());
+  packet->ip.ip_v = 4;
+  packet->ip.ip_hl = sizeof(packet->ip) >> 2;
+  packet->ip.ip_p = kUdpProtocol;
+#ifdef __FAVOR_BSD
+  packet->udp.uh_dport = destinationPort_;
+#else
+  packet->udp.dest = destinationPort_;
+#endif
+  memcpy(packet->payload, payloadMessage_.c_str(), payloadMessage_.size());
 
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
-  // sum += (sum >> 16);
-
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum));
+  // Protocol of the pseudo header, destination port and payload.
+  uint8_t protocol[2] = {0, kUdpProtocol};
+  uint64_t sum = addChecksumWords(0, protocol, sizeof(protocol));
+  sum = addChecksumWords(sum, probeTemplate_.data() + sizeof(packet->ip),
+                         kIdempotentProbeMaxSize - sizeof(packet->ip));
+  templateChecksum_ = finishChecksum(sum);
 }
 
-uint16_t UdpIdempotentProber::getChecksum(uint16_t* buff,
-                                          uint16_t offset) const {
-  uint32_t sum = 0;
-
-  /*
-   * calculate the checksum for the tcp header and payload
-   * len_tcp represents number of 8-bit bytes,
-   * we are working with 16-bit words so divide len_tcp by 2.
-   */
-  for (uint32_t i = 0; i < 10; i++) {
-    if (i == 4) {
-      sum += buff[i] & 0xFF00;
-    } else if (i == 5 || i == 1) {
-      // do nothing
-    } else {
-      sum += buff[i];
-    }
-  }
-
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
-  // sum += (sum >> 16);
+size_t UdpIdempotentProber::packProbeFromTemplate(
+    const uint32_t destinationIpDecimal, const uint32_t sourceIpDecimal,
+    const uint8_t ttl, uint8_t* packetBuffer) {
+  int32_t packetExpectedSize = getPacketSize(destinationIpDecimal, ttl);
+  memcpy(packetBuffer, probeTemplate_.data(), packetExpectedSize);
 
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum + offset));
-}
+  struct PacketUdp* packet =
+      reinterpret_cast<struct PacketUdp*>(packetBuffer);
+  packet->ip.ip_dst.s_addr = destinationIpDecimal;
+  packet->ip.ip_src.s_addr = sourceIpDecimal;
+  packet->ip.ip_ttl = ttl;
+#if defined(__APPLE__) || defined(__MACH__)
+  packet->ip.ip_len = packetExpectedSize;
+  packet->ip.ip_id = getDestAddrChecksum(
+      reinterpret_cast<const uint16_t*>(&destinationIpDecimal),
+      checksumOffset_);
+#else
+  packet->ip.ip_len = htons(packetExpectedSize);
+  packet->ip.ip_id = htons(getDestAddrChecksum(
+      reinterpret_cast<const uint16_t*>(&destinationIpDecimal),
+      checksumOffset_));
+#endif
 
-// Get metrics information
+  // The source port is derived from the patched IP header.
+  uint16_t sourcePort =
+      getChecksum(reinterpret_cast<uint16_t*>(packetBuffer), checksumOffset_);
+  uint16_t udpLength = htons(packetExpectedSize - sizeof(packet->ip));
+
+  // The fields which are zero in the template: addresses and length of the
+  // pseudo header, source port and length of the UDP header.
+  uint64_t sum = addChecksumWords(0, &sourceIpDecimal, sizeof(uint32_t));
+  sum = addChecksumWords(sum, &destinationIpDecimal, sizeof(uint32_t));
+  sum += udpLength;
+  sum += sourcePort;
+  sum += udpLength;
+  uint16_t checksum = updateChecksum(templateChecksum_, sum);
+  // Zero stands for no checksum in UDP.
+  if (checksum == 0) checksum = 0xFFFF;
 
-uint64_t UdpIdempotentProber::getChecksumMismatches() {
-  return checksumMismatches_;
-}
+#ifdef __FAVOR_BSD
+  packet->udp.uh_sport = sourcePort;
+  packet->udp.uh_ulen = udpLength;
+  packet->udp.uh_sum = checksum;
+#else
+  packet->udp.source = sourcePort;
+  packet->udp.len = udpLength;
+  packet->udp.check = checksum;
+#endif
 
-uint64_t UdpIdempotentProber::getDistanceAbnormalities() {
-  return distanceAbnormalities_;
+  return packetExpectedSize;
 }
 
-uint64_t UdpIdempotentProber::getOtherMismatches() {
-  return otherMismatches_;
+uint16_t UdpIdempotentProber::getChecksum(uint16_t* buff,
+                                          uint16_t offset) const {
+  // Words of the Ipv4 header which routers do not change: version, type of
+  // service, ID, fragment offset, protocol and addresses. Total length, TTL
+  // and header checksum are skipped.
+  uint64_t sum = addChecksumWords(0, buff, sizeof(uint16_t));
+  sum = addChecksumWords(sum, buff + 2, 2 * sizeof(uint16_t));
+  uint8_t protocol[2] = {0, reinterpret_cast<uint8_t*>(buff)[9]};
+  sum = addChecksumWords(sum, protocol, sizeof(protocol));
+  sum = addChecksumWords(sum, buff + 6, 4 * sizeof(uint16_t));
+  return htons(static_cast<uint16_t>(finishChecksum(sum) + offset));
 }
 
 }  // namespace flashroute
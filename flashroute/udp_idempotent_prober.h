@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "flashroute/prober.h"
 
@@ -43,8 +44,10 @@ namespace flashroute {
  * );
  *
  */
-class UdpIdempotentProber : public virtual Prober {
+class UdpIdempotentProber final : public virtual Prober {
  public:
+  typedef Ipv4Address AddressType;
+
   UdpIdempotentProber(PacketReceiverCallback* callback,
                       const int32_t checksumOffset,
                       const uint8_t probePhaseCode,
@@ -56,17 +59,47 @@ class UdpIdempotentProber : public virtual Prober {
   size_t packProbe(const IpAddress& destinationIp, const IpAddress& sourceIp,
                    const uint8_t ttl, uint8_t* packetBuffer) override;
 
+  // Same as above without the virtual call and the dynamic casts. Chosen by
+  // overload resolution when the addresses are Ipv4Address.
+  size_t packProbe(const Ipv4Address& destinationIp,
+                   const Ipv4Address& sourceIp, const uint8_t ttl,
+                   uint8_t* packetBuffer);
+
   // Parse responses.
   void parseResponse(uint8_t* buffer, size_t size,
                      SocketType socketType) override;
 
+  void parseResponses(const ReceivedPacket* packets, size_t count,
+                      SocketType socketType) override;
+
+  // Same as above but hand the accepted responses to handler instead of the
+  // callback. The handler is called as
+  // handler(const ProbeResponse<Ipv4Address>&, const ReceivedPacket&) and can
+  // be inlined.
+  template <class Handler>
+  void parseResponses(const ReceivedPacket* packets, size_t count,
+                      SocketType socketType, Handler&& handler) {
+    ProbeResponse<Ipv4Address> response;
+    for (size_t i = 0; i < count; i++) {
+      if (decodeResponse(packets[i].buffer, packets[i].size, socketType,
+                         packets[i].timestamp, &response)) {
+        handler(response, packets[i]);
+      }
+    }
+  }
+
+  // Decode a response. Return false and update the metrics if the response is
+  // dropped. Idempotent probes carry no timestamp, so the RTT is 0 unless it
+  // is computed from probe timestamps and packetTimestamp, the timestamp of
+  // the received packet.
+  bool decodeResponse(uint8_t* buffer, size_t size, SocketType socketType,
+                      int64_t packetTimestamp,
+                      ProbeResponse<Ipv4Address>* response);
+
   // Change checksum offset (support discovery-optimized mode.)
   void setChecksumOffset(int32_t checksumOffset);
 
-  // Get metrics information
-  uint64_t getChecksumMismatches() override;
-  uint64_t getDistanceAbnormalities() override;
-  uint64_t getOtherMismatches() override;
+  bool getResponseFilter(ResponseFilter* filter) const override;
 
  private:
   PacketReceiverCallback* callback_;
@@ -77,20 +110,29 @@ class UdpIdempotentProber : public virtual Prober {
   std::string payloadMessage_;
   bool encodeTimestamp_;
 
-  // Metrics
-  uint64_t checksumMismatches_;
-  uint64_t distanceAbnormalities_;
-  uint64_t otherMismatches_;
+  // Pre-filled probe of the maximum size for TEMPLATE packing. Empty if the
+  // payload does not fit.
+  std::vector<uint8_t> probeTemplate_;
+  // UDP checksum of the template, whose variable fields are all zero.
+  uint16_t templateChecksum_;
+
+  // The packet size encodes the destination group, initial TTL and probe
+  // phase.
+  int32_t getPacketSize(const uint32_t destinationIpDecimal,
+                        const uint8_t ttl) const;
+
+  void buildProbeTemplate();
+
+  // Pack a probe by patching a copy of the template. Addresses are in network
+  // byte order.
+  size_t packProbeFromTemplate(const uint32_t destinationIpDecimal,
+                               const uint32_t sourceIpDecimal,
+                               const uint8_t ttl, uint8_t* packetBuffer);
 
   // Calculate checksum of ip address.
   uint16_t getDestAddrChecksum(const uint16_t* ipaddress,
                                const uint16_t offset) const;
 
-  // Calculate checksum of packet.
-  uint16_t getChecksum(const uint8_t protocolValue, size_t packetLength,
-                       const uint16_t* src_addr, const uint16_t* dest_addr,
-                       uint16_t* buff) const;
-
   uint16_t getChecksum(uint16_t* buff, uint16_t offset) const;
 };
 
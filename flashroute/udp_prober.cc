@@ -11,6 +11,9 @@
 
 #include "glog/logging.h"
 #include "flashroute/address.h"
+#include "flashroute/checksum.h"
+#include "flashroute/timestamping.h"
+#include "flashroute/utils.h"
 
 namespace flashroute {
 
@@ -19,6 +22,10 @@ const uint8_t kUdpProtocol = 17;  // Default UDP protocol id.
 // The maximum ttl we will explore.
 const uint8_t kMaxTtl = 32;
 
+// Probe size before and after encoding the 6-bit timestamp.
+const int32_t kUdpProbeMinSize = 128;
+const int32_t kUdpProbeMaxSize = 256;
+
 UdpProber::UdpProber(PacketReceiverCallback* callback,
                      const int32_t checksumOffset, const uint8_t probePhaseCode,
                      const uint16_t destinationPort,
@@ -31,24 +38,32 @@ UdpProber::UdpProber(PacketReceiverCallback* callback,
   destinationPort_ = htons(destinationPort);
   encodeTimestamp_ = encodeTimestamp;
   ttlOffset_ = ttlOffset;
-  checksumMismatches_ = 0;
-  distanceAbnormalities_ = 0;
-  otherMismatches_ = 0;
+  buildProbeTemplate();
   VLOG(2) << "UdpProber is initialized";
 }
 
 size_t UdpProber::packProbe(const IpAddress& destinationIp,
                             const IpAddress& sourceIp, const uint8_t ttl,
                             uint8_t* packetBuffer) {
-  uint32_t destinationIpDecimal =
-      htonl((dynamic_cast<const Ipv4Address&>(destinationIp)).getIpv4Address());
-  uint32_t sourceIpDecimal =
-      htonl((dynamic_cast<const Ipv4Address&>(sourceIp)).getIpv4Address());
+  return packProbe(dynamic_cast<const Ipv4Address&>(destinationIp),
+                   dynamic_cast<const Ipv4Address&>(sourceIp), ttl,
+                   packetBuffer);
+}
+
+size_t UdpProber::packProbe(const Ipv4Address& destinationIp,
+                            const Ipv4Address& sourceIp, const uint8_t ttl,
+                            uint8_t* packetBuffer) {
+  uint32_t destinationIpDecimal = htonl(destinationIp.getIpv4Address());
+  uint32_t sourceIpDecimal = htonl(sourceIp.getIpv4Address());
+
+  if (packingMode_ == PackingMode::TEMPLATE && !probeTemplate_.empty()) {
+    return packProbeFromTemplate(destinationIpDecimal, sourceIpDecimal, ttl,
+                                 packetBuffer);
+  }
 
   struct PacketUdp* packet =
       reinterpret_cast<struct PacketUdp*>(packetBuffer);
 
-  uint16_t timestamp = getTimestamp();
   // Fabricate the IP header or we can use the
   // standard header structures but assign our own values.
   memset(&packet->ip, 0, sizeof(packet->ip));
@@ -59,18 +74,9 @@ size_t UdpProber::packProbe(const IpAddress& destinationIp,
   packet->ip.ip_src = *(reinterpret_cast<struct in_addr*>(&sourceIpDecimal));
   packet->ip.ip_p = kUdpProtocol;  // UDP protocol
   packet->ip.ip_ttl = ttl;
-  // ipid: 5-bit for encoding intiial TTL, 1 bit for encoding probeType, 10-bit
-  // for encoding timestamp.
-  // 0x3FF = 2^10 to extract first 10-bit of timestamp
-  uint16_t ipid = ((ttl - ttlOffset_) & 0x1F) | ((probePhaseCode_ & 0x1) << 5);
-  int32_t packetExpectedSize = 128;
-
-  if (encodeTimestamp_) {
-    ipid = ipid | ((timestamp & 0x3FF) << 6);
-    // packet-size encode 6-bit timestamp
-    // (((timestamp >> 10) & 0x3F) << 6): the rest 6-bit of timestamp
-    packetExpectedSize = packetExpectedSize | (((timestamp >> 10) & 0x3F) << 1);
-  }
+  uint16_t ipid = 0;
+  int32_t packetExpectedSize = 0;
+  encodeProbe(ttl, &ipid, &packetExpectedSize);
   // In OSX, please use: packet->ip.ip_len = packetExpectedSize;
   // Otherwise, you will have an Errno-22.
 #if defined(__APPLE__) || defined(__MACH__)
@@ -94,11 +100,10 @@ size_t UdpProber::packProbe(const IpAddress& destinationIp,
   // if you set a checksum to zero, your kernel's IP stack should fill in
   // the correct checksum during transmission
   // packet->udp.uh_sum = 0;
-  packet->udp.uh_sum = getChecksum(
-      kUdpProtocol, packetExpectedSize - sizeof(packet->ip),
-      reinterpret_cast<uint16_t*>(&sourceIpDecimal),
-      reinterpret_cast<uint16_t*>(&destinationIpDecimal),
-      reinterpret_cast<uint16_t*>(packetBuffer + sizeof(struct ip)));
+  packet->udp.uh_sum = getIpv4PseudoHeaderChecksum(
+      sourceIpDecimal, destinationIpDecimal, kUdpProtocol,
+      packetBuffer + sizeof(struct ip),
+      packetExpectedSize - sizeof(packet->ip));
 #else
   packet->udp.dest = destinationPort_;
   packet->udp.source = getChecksum(
@@ -108,11 +113,10 @@ size_t UdpProber::packProbe(const IpAddress& destinationIp,
   // if you set a checksum to zero, your kernel's IP stack should fill in
   // the correct checksum during transmission
   // packet->udp.uh_sum = 0;
-  packet->udp.check = getChecksum(
-      kUdpProtocol, packetExpectedSize - sizeof(packet->ip),
-      reinterpret_cast<uint16_t*>(&sourceIpDecimal),
-      reinterpret_cast<uint16_t*>(&destinationIpDecimal),
-      reinterpret_cast<uint16_t*>(packetBuffer + sizeof(struct ip)));
+  packet->udp.check = getIpv4PseudoHeaderChecksum(
+      sourceIpDecimal, destinationIpDecimal, kUdpProtocol,
+      packetBuffer + sizeof(struct ip),
+      packetExpectedSize - sizeof(packet->ip));
 #endif
 
   return packetExpectedSize;
@@ -122,9 +126,38 @@ void UdpProber::setChecksumOffset(int32_t checksumOffset) {
   checksumOffset_ = checksumOffset;
 }
 
+bool UdpProber::getResponseFilter(ResponseFilter* filter) const {
+  filter->ipv4 = true;
+  filter->destinationPort = ntohs(destinationPort_);
+  filter->checksumField = ChecksumField::SOURCE_PORT;
+  filter->checksumOffset = static_cast<uint16_t>(checksumOffset_);
+  return true;
+}
+
 void UdpProber::parseResponse(uint8_t* buffer, size_t size,
                               SocketType socketType) {
-  if (socketType != SocketType::ICMP || size < 56) return;
+  ReceivedPacket packet = {buffer, size};
+  parseResponses(&packet, 1, socketType);
+}
+
+void UdpProber::parseResponses(const ReceivedPacket* packets, size_t count,
+                               SocketType socketType) {
+  parseResponses(packets, count, socketType,
+                 [this](const ProbeResponse<Ipv4Address>& response,
+                        const ReceivedPacket& packet) {
+                   (*callback_)(response.destination, response.responder,
+                                response.distance, response.rtt,
+                                response.fromDestination, true, packet.buffer,
+                                packet.size);
+                 });
+}
+
+bool UdpProber::decodeResponse(uint8_t* buffer, size_t size,
+                               SocketType socketType,
+                               int64_t receivedTimestamp,
+                               int64_t packetTimestamp,
+                               ProbeResponse<Ipv4Address>* response) {
+  if (socketType != SocketType::ICMP || size < 56) return false;
   struct PacketIcmp* parsedPacket =
       reinterpret_cast<struct PacketIcmp*>(buffer);
   struct PacketUdp* residualUdpPacket =
@@ -140,16 +173,16 @@ void UdpProber::parseResponse(uint8_t* buffer, size_t size,
           reinterpret_cast<uint16_t*>(&residualUdpPacket->ip.ip_dst.s_addr),
           checksumOffset_) != residualUdpPacket->udp.uh_sport) {
     // Checksum unmatched.
-    checksumMismatches += 1;
-    return;
+    checksumMismatches_.add();
+    return false;
   }
 #else
   if (getChecksum(
           reinterpret_cast<uint16_t*>(&residualUdpPacket->ip.ip_dst.s_addr),
           checksumOffset_) != residualUdpPacket->udp.source) {
     // Checksum unmatched.
-    checksumMismatches_ += 1;
-    return;
+    checksumMismatches_.add();
+    return false;
   }
 #endif
   destination = ntohl(residualUdpPacket->ip.ip_dst.s_addr);
@@ -171,7 +204,6 @@ void UdpProber::parseResponse(uint8_t* buffer, size_t size,
                            (((probeIpLen >> 1) & 0x3F) << 10);
   uint8_t probePhase = (probeIpId >> 5) & 0x1;
 
-  int64_t receivedTimestamp = getTimestamp();
   uint32_t rtt = static_cast<uint32_t>(receivedTimestamp - sentTimestamp +
                                        kTimestampSlot) %
                  kTimestampSlot;
@@ -180,6 +212,12 @@ void UdpProber::parseResponse(uint8_t* buffer, size_t size,
   if (initialTTL == 0) initialTTL = 32;
   initialTTL += ttlOffset_;
 
+  if (probeTimestamps_ != nullptr) {
+    rtt = probeTimestamps_->getRtt(getDestinationKey(destination),
+                                   static_cast<uint8_t>(initialTTL),
+                                   packetTimestamp);
+  }
+
   if (parsedPacket->icmp.icmp_type == 3 &&
       (parsedPacket->icmp.icmp_code == 3 || parsedPacket->icmp.icmp_code == 2 ||
        parsedPacket->icmp.icmp_code == 1)) {
@@ -191,7 +229,7 @@ void UdpProber::parseResponse(uint8_t* buffer, size_t size,
     // Other Unreachable
     fromDestination = false;
     distance = initialTTL - residualUdpPacket->ip.ip_ttl + 1;
-    return;
+    return false;
   } else if (parsedPacket->icmp.icmp_type == 11 &&
              parsedPacket->icmp.icmp_code == 0) {
     // Time Exceeded
@@ -199,20 +237,21 @@ void UdpProber::parseResponse(uint8_t* buffer, size_t size,
     distance = initialTTL;
   } else {
     // Other packets.
-    otherMismatches_++;
-    return;
+    otherMismatches_.add();
+    return false;
   }
 
   if (distance <= ttlOffset_ || distance > (kMaxTtl + ttlOffset_)) {
-    distanceAbnormalities_ += 1;
-    return;
+    distanceAbnormalities_.add();
+    return false;
   }
 
-  Ipv4Address ipv4Destination(destination);
-  Ipv4Address ipv4Responder(responder);
-
-  (*callback_)(ipv4Destination, ipv4Responder, static_cast<uint8_t>(distance),
-               rtt, fromDestination, true, buffer, size);
+  response->destination = Ipv4Address(destination);
+  response->responder = Ipv4Address(responder);
+  response->distance = static_cast<uint8_t>(distance);
+  response->rtt = rtt;
+  response->fromDestination = fromDestination;
+  return true;
 }
 
 uint16_t UdpProber::getTimestamp() const {
@@ -223,73 +262,107 @@ uint16_t UdpProber::getTimestamp() const {
   return static_cast<uint16_t>(millisecond);
 }
 
-uint16_t UdpProber::getChecksum(const uint16_t* ipAddress,
-                                     uint16_t offset) const {
-  uint32_t sum = 0;
-  sum += ntohs(ipAddress[0]);
-  sum += ntohs(ipAddress[1]);
-
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
-
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum + offset));
-}
+void UdpProber::encodeProbe(const uint8_t ttl, uint16_t* ipid,
+                            int32_t* packetSize) const {
+  uint16_t timestamp = getTimestamp();
+  // ipid: 5-bit for encoding intiial TTL, 1 bit for encoding probeType, 10-bit
+  // for encoding timestamp.
+  // 0x3FF = 2^10 to extract first 10-bit of timestamp
+  *ipid = ((ttl - ttlOffset_) & 0x1F) | ((probePhaseCode_ & 0x1) << 5);
+  *packetSize = kUdpProbeMinSize;
 
-uint16_t UdpProber::getChecksum(const uint8_t protocolValue,
-                                     size_t packetLength,
-                                     const uint16_t* sourceIpAddress,
-                                     const uint16_t* destinationIpAddress,
-                                     uint16_t* buff) const {
-  /* Check if the tcp length is even or odd.  Add padding if odd. */
-  if ((packetLength % 2) == 1) {
-    // Empty space in the ip buffer should be 0 anyway.
-    buff[packetLength] = 0;
-    packetLength += 1;  // incrase length to make even.
+  if (encodeTimestamp_) {
+    *ipid = *ipid | ((timestamp & 0x3FF) << 6);
+    // packet-size encode 6-bit timestamp
+    // (((timestamp >> 10) & 0x3F) << 6): the rest 6-bit of timestamp
+    *packetSize = *packetSize | (((timestamp >> 10) & 0x3F) << 1);
   }
+}
 
-  uint32_t sum = 0;
-  /* add the pseudo header */
-  sum += ntohs(sourceIpAddress[0]);
-  sum += ntohs(sourceIpAddress[1]);
-  sum += ntohs(destinationIpAddress[0]);
-  sum += ntohs(destinationIpAddress[1]);
-  sum += packetLength;   // already in host format.
-  sum += protocolValue;  // already in host format.
-
-  /*
-   * calculate the checksum for the tcp header and payload
-   * len_tcp represents number of 8-bit bytes,
-   * we are working with 16-bit words so divide len_tcp by 2.
-   */
-  for (uint32_t i = 0; i < (packetLength / 2); i++) {
-    sum += ntohs(buff[i]);
+void UdpProber::buildProbeTemplate() {
+  // The payload beyond the message is zero in probes of all sizes, so it adds
+  // nothing to the checksum. Long messages are packed fully.
+  if (payloadMessage_.size() >
+      kUdpProbeMinSize - sizeof(struct ip) - sizeof(struct udphdr)) {
+    probeTemplate_.clear();
+    return;
   }
+  probeTemplate_.assign(kUdpProbeMaxSize, 0);
+  struct PacketUdp* packet =
+      reinterpret_cast<struct PacketUdp*>(probeTemplate_.data());
+  packet->ip.ip_v = 4;
+  packet->ip.ip_hl = sizeof(packet->ip) >> 2;
+  packet->ip.ip_p = kUdpProtocol;
+#ifdef __FAVOR_BSD
+  packet->udp.uh_dport = destinationPort_;
+#else
+  packet->udp.dest = destinationPort_;
+#endif
+  memcpy(packet->payload, payloadMessage_.c_str(), payloadMessage_.size());
 
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
-  // sum += (sum >> 16);
-
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum));
+  // Protocol of the pseudo header, destination port and payload.
+  uint8_t protocol[2] = {0, kUdpProtocol};
+  uint64_t sum = addChecksumWords(0, protocol, sizeof(protocol));
+  sum = addChecksumWords(sum, probeTemplate_.data() + sizeof(packet->ip),
+                         kUdpProbeMaxSize - sizeof(packet->ip));
+  templateChecksum_ = finishChecksum(sum);
 }
 
-// Get metrics information
+size_t UdpProber::packProbeFromTemplate(const uint32_t destinationIpDecimal,
+                                        const uint32_t sourceIpDecimal,
+                                        const uint8_t ttl,
+                                        uint8_t* packetBuffer) {
+  uint16_t ipid = 0;
+  int32_t packetExpectedSize = 0;
+  encodeProbe(ttl, &ipid, &packetExpectedSize);
+  memcpy(packetBuffer, probeTemplate_.data(), packetExpectedSize);
 
-uint64_t UdpProber::getChecksumMismatches() {
-  return checksumMismatches_;
-}
+  struct PacketUdp* packet =
+      reinterpret_cast<struct PacketUdp*>(packetBuffer);
+  packet->ip.ip_dst.s_addr = destinationIpDecimal;
+  packet->ip.ip_src.s_addr = sourceIpDecimal;
+  packet->ip.ip_ttl = ttl;
+#if defined(__APPLE__) || defined(__MACH__)
+  packet->ip.ip_len = packetExpectedSize;
+  packet->ip.ip_id = ipid;
+#else
+  packet->ip.ip_len = htons(packetExpectedSize);
+  packet->ip.ip_id = htons(ipid);
+#endif
+
+  uint16_t sourcePort = getChecksum(
+      reinterpret_cast<const uint16_t*>(&destinationIpDecimal),
+      checksumOffset_);
+  uint16_t udpLength = htons(packetExpectedSize - sizeof(packet->ip));
+
+  // The fields which are zero in the template: addresses and length of the
+  // pseudo header, source port and length of the UDP header.
+  uint64_t sum = addChecksumWords(0, &sourceIpDecimal, sizeof(uint32_t));
+  sum = addChecksumWords(sum, &destinationIpDecimal, sizeof(uint32_t));
+  sum += udpLength;
+  sum += sourcePort;
+  sum += udpLength;
+  uint16_t checksum = updateChecksum(templateChecksum_, sum);
+  // Zero stands for no checksum in UDP.
+  if (checksum == 0) checksum = 0xFFFF;
+
+#ifdef __FAVOR_BSD
+  packet->udp.uh_sport = sourcePort;
+  packet->udp.uh_ulen = udpLength;
+  packet->udp.uh_sum = checksum;
+#else
+  packet->udp.source = sourcePort;
+  packet->udp.len = udpLength;
+  packet->udp.check = checksum;
+#endif
 
-uint64_t UdpProber::getDistanceAbnormalities() {
-  return distanceAbnormalities_;
+  return packetExpectedSize;
 }
 
-uint64_t UdpProber::getOtherMismatches() {
-  return otherMismatches_;
+uint16_t UdpProber::getChecksum(const uint16_t* ipAddress,
+                                uint16_t offset) const {
+  uint16_t checksum = ntohs(getInternetChecksum(ipAddress, sizeof(uint32_t)));
+  return htons(static_cast<uint16_t>(checksum + offset));
 }
 
 }  // namespace flashroute
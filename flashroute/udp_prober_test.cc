@@ -1,21 +1,69 @@
 /* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include <cstring>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "flashroute/prober.h"
+#include "flashroute/prober_test_util.h"
+#include "flashroute/udp_idempotent_prober.h"
 #include "flashroute/udp_prober.h"
+#include "flashroute/udp_prober_v6.h"
+#include "flashroute/checksum.h"
 
 using namespace flashroute;
 
 const uint16_t kTestBufferSize = 512;
 
+// Verify the UDP checksum of a packet which starts at the IP header.
+bool hasValidUdpChecksum(const uint8_t* packet, size_t size, bool ipv4) {
+  size_t headerSize = ipv4 ? 20 : 40;
+  uint16_t udpLength = htons(size - headerSize);
+  uint8_t protocol[2] = {0, IPPROTO_UDP};
+  // Addresses of pseudo header.
+  uint64_t sum = ipv4 ? addChecksumWords(0, packet + 12, 8)
+                      : addChecksumWords(0, packet + 8, 32);
+  sum = addChecksumWords(sum, protocol, sizeof(protocol));
+  sum += udpLength;
+  sum = addChecksumWords(sum, packet + headerSize, size - headerSize);
+  return finishChecksum(sum) == 0;
+}
+
+// Pack probes in both modes and check that they only differ in the UDP
+// checksum, and the checksums of both modes are valid. Bytes in
+// [ignoredBegin, ignoredEnd) may differ, e.g., a timestamp.
+void expectSamePackets(Prober* prober, const IpAddress& destinationIp,
+                       const IpAddress& sourceIp, uint8_t ttl, bool ipv4,
+                       size_t ignoredBegin, size_t ignoredEnd) {
+  uint8_t fullBuffer[kTestBufferSize];
+  uint8_t templateBuffer[kTestBufferSize];
+  memset(fullBuffer, 0, kTestBufferSize);
+  memset(templateBuffer, 0xAA, kTestBufferSize);
+
+  prober->setPackingMode(PackingMode::FULL);
+  size_t fullSize =
+      prober->packProbe(destinationIp, sourceIp, ttl, fullBuffer);
+  prober->setPackingMode(PackingMode::TEMPLATE);
+  size_t templateSize =
+      prober->packProbe(destinationIp, sourceIp, ttl, templateBuffer);
+
+  ASSERT_EQ(fullSize, templateSize);
+  size_t checksumOffset = ipv4 ? 26 : 46;
+  for (size_t i = 0; i < fullSize; i++) {
+    if (i == checksumOffset || i == checksumOffset + 1) continue;
+    if (i >= ignoredBegin && i < ignoredEnd) continue;
+    EXPECT_EQ(fullBuffer[i], templateBuffer[i]) << "Byte " << i;
+  }
+  EXPECT_TRUE(hasValidUdpChecksum(fullBuffer, fullSize, ipv4));
+  EXPECT_TRUE(hasValidUdpChecksum(templateBuffer, templateSize, ipv4));
+}
+
 TEST(UdpProber, PackProbeTest) {
   Ipv4Address destinationIp{12456};
   Ipv4Address sourceIp{6789};
   uint8_t initialTtl = 17;
-  PacketReceiverCallback response_handler =
-      [](const IpAddress& destination, const IpAddress& responder,
-         uint8_t distance, uint32_t rtt, bool fromDestination, bool ipv4,
-         void* packetHeader, size_t headerLen) {};
+  PacketReceiverCallback response_handler = getIgnoringCallback();
 
   UdpProber prober(&response_handler, 0, 1, 0, "test", true, 0);
 
@@ -39,3 +87,177 @@ TEST(UdpProber, PackProbeTest) {
   EXPECT_EQ(packetDestinationIp, htonl(destinationIp.getIpv4Address()));
   EXPECT_EQ(probePhase, 1);
 }
+
+TEST(UdpProber, ParseResponsesTest) {
+  Ipv4Address sourceIp{6789};
+  Ipv4Address responderIp{98765};
+  std::vector<uint32_t> destinations;
+  std::vector<uint8_t> distances;
+  PacketReceiverCallback response_handler =
+      [&destinations, &distances](
+          const IpAddress& destination, const IpAddress& /* responder */,
+          uint8_t distance, uint32_t /* rtt */, bool /* fromDestination */,
+          bool /* ipv4 */, void* /* packetHeader */, size_t /* headerLen */) {
+        destinations.push_back(destination.getIpv4Address());
+        distances.push_back(distance);
+      };
+
+  UdpProber prober(&response_handler, 0, 1, 0, "test", true, 0);
+
+  // Time Exceeded responses quoting the probes.
+  const size_t kBatchSize = 3;
+  uint8_t buffers[kBatchSize][kTestBufferSize];
+  ReceivedPacket packets[kBatchSize];
+  for (size_t i = 0; i < kBatchSize; i++) {
+    memset(buffers[i], 0, kTestBufferSize);
+    Ipv4Address destinationIp{static_cast<uint32_t>(12456 + i)};
+    size_t probeSize = prober.packProbe(destinationIp, sourceIp,
+                                        static_cast<uint8_t>(10 + i),
+                                        buffers[i] + 28);
+    struct PacketIcmp* response =
+        reinterpret_cast<struct PacketIcmp*>(buffers[i]);
+    response->ip.ip_src.s_addr = htonl(responderIp.getIpv4Address());
+    response->icmp.icmp_type = 11;
+    response->icmp.icmp_code = 0;
+    packets[i].buffer = buffers[i];
+    packets[i].size = 28 + probeSize;
+  }
+
+  prober.parseResponses(packets, kBatchSize, SocketType::ICMP);
+
+  ASSERT_EQ(destinations.size(), kBatchSize);
+  for (size_t i = 0; i < kBatchSize; i++) {
+    EXPECT_EQ(destinations[i], 12456 + i);
+    EXPECT_EQ(distances[i], 10 + i);
+  }
+}
+
+TEST(UdpProber, TypedPipelineTest) {
+  Ipv4Address sourceIp{6789};
+  Ipv4Address responderIp{98765};
+  std::vector<uint32_t> callbackDestinations;
+  PacketReceiverCallback response_handler =
+      [&callbackDestinations](
+          const IpAddress& destination, const IpAddress& /* responder */,
+          uint8_t /* distance */, uint32_t /* rtt */,
+          bool /* fromDestination */, bool /* ipv4 */,
+          void* /* packetHeader */, size_t /* headerLen */) {
+        callbackDestinations.push_back(destination.getIpv4Address());
+      };
+
+  UdpProber prober(&response_handler, 0, 1, 0, "test", false, 0);
+  Prober* virtualProber = &prober;
+
+  const size_t kBatchSize = 3;
+  uint8_t buffers[kBatchSize][kTestBufferSize];
+  ReceivedPacket packets[kBatchSize];
+  for (size_t i = 0; i < kBatchSize; i++) {
+    memset(buffers[i], 0, kTestBufferSize);
+    Ipv4Address destinationIp{static_cast<uint32_t>(12456 + i)};
+    uint8_t ttl = static_cast<uint8_t>(10 + i);
+    // The typed overload packs the same probe as the virtual one.
+    uint8_t virtualBuffer[kTestBufferSize];
+    size_t virtualSize = virtualProber->packProbe(destinationIp, sourceIp, ttl,
+                                                  virtualBuffer);
+    size_t probeSize =
+        prober.packProbe(destinationIp, sourceIp, ttl, buffers[i] + 28);
+    ASSERT_EQ(probeSize, virtualSize);
+    EXPECT_EQ(memcmp(buffers[i] + 28, virtualBuffer, probeSize), 0);
+
+    struct PacketIcmp* response =
+        reinterpret_cast<struct PacketIcmp*>(buffers[i]);
+    response->ip.ip_src.s_addr = htonl(responderIp.getIpv4Address());
+    response->icmp.icmp_type = 11;
+    response->icmp.icmp_code = 0;
+    packets[i].buffer = buffers[i];
+    packets[i].size = 28 + probeSize;
+  }
+
+  // The handler sees the same responses as the callback.
+  std::vector<ProbeResponse<Ipv4Address>> responses;
+  prober.parseResponses(packets, kBatchSize, SocketType::ICMP,
+                        [&responses](const ProbeResponse<Ipv4Address>& response,
+                                     const ReceivedPacket& /* packet */) {
+                          responses.push_back(response);
+                        });
+  virtualProber->parseResponses(packets, kBatchSize, SocketType::ICMP);
+
+  ASSERT_EQ(responses.size(), kBatchSize);
+  ASSERT_EQ(callbackDestinations.size(), kBatchSize);
+  for (size_t i = 0; i < kBatchSize; i++) {
+    EXPECT_EQ(responses[i].destination.getIpv4Address(),
+              callbackDestinations[i]);
+    EXPECT_EQ(responses[i].destination.getIpv4Address(), 12456 + i);
+    EXPECT_EQ(responses[i].responder.getIpv4Address(),
+              responderIp.getIpv4Address());
+    EXPECT_EQ(responses[i].distance, 10 + i);
+  }
+}
+
+TEST(UdpProber, ReceiverMetricsTest) {
+  Ipv4Address sourceIp{6789};
+  PacketReceiverCallback response_handler = getIgnoringCallback();
+
+  UdpProber prober(&response_handler, 0, 1, 0, "test", true, 0);
+  const uint32_t kReceivers = 4;
+
+  // A response whose quoted destination does not match the checksum.
+  uint8_t buffer[kTestBufferSize];
+  memset(buffer, 0, kTestBufferSize);
+  size_t probeSize =
+      prober.packProbe(Ipv4Address{12456}, sourceIp, 10, buffer + 28);
+  struct PacketUdp* residualPacket =
+      reinterpret_cast<struct PacketUdp*>(buffer + 28);
+  residualPacket->ip.ip_dst.s_addr = htonl(12457);
+  struct PacketIcmp* response = reinterpret_cast<struct PacketIcmp*>(buffer);
+  response->icmp.icmp_type = 11;
+  response->icmp.icmp_code = 0;
+
+  // Every receiving thread counts into its own slot of the counters.
+  std::vector<std::thread> receivers;
+  for (uint32_t i = 0; i < kReceivers; i++) {
+    receivers.emplace_back([&prober, &buffer, probeSize, i]() {
+      std::vector<uint8_t> packet(buffer, buffer + 28 + probeSize);
+      for (uint32_t j = 0; j <= i; j++) {
+        prober.parseResponse(packet.data(), packet.size(), SocketType::ICMP);
+      }
+    });
+  }
+  for (auto& receiver : receivers) receiver.join();
+
+  EXPECT_EQ(prober.getChecksumMismatches(), 1 + 2 + 3 + 4);
+  EXPECT_EQ(prober.getDistanceAbnormalities(), 0);
+}
+
+TEST(UdpProber, TemplatePackingTest) {
+  PacketReceiverCallback response_handler = getIgnoringCallback();
+  Ipv4Address sourceIp{0xC0A80001};
+
+  UdpProber prober(&response_handler, 3, 1, 53, "test", false, 0);
+  UdpIdempotentProber idempotentProber(&response_handler, 3, 1, 53, "test",
+                                       false, 0);
+  for (uint32_t i = 0; i < 64; i++) {
+    Ipv4Address destinationIp{0x01020304 * (i + 1)};
+    uint8_t ttl = static_cast<uint8_t>(i % 32 + 1);
+    expectSamePackets(&prober, destinationIp, sourceIp, ttl, true, 0, 0);
+    expectSamePackets(&idempotentProber, destinationIp, sourceIp, ttl, true, 0,
+                      0);
+  }
+
+  // The timestamp is encoded in the IP ID and the size.
+  UdpProber timestampProber(&response_handler, 0, 1, 53, "test", true, 0);
+  uint8_t buffer[kTestBufferSize];
+  size_t size = timestampProber.packProbe(Ipv4Address{12456}, sourceIp, 10,
+                                          buffer);
+  EXPECT_TRUE(hasValidUdpChecksum(buffer, size, true));
+
+  UdpProberIpv6 proberIpv6(&response_handler, 3, 1, 53, "test", 0);
+  Ipv6Address sourceIpv6{absl::MakeUint128(0x20010DB800000000ULL, 1)};
+  for (uint32_t i = 0; i < 64; i++) {
+    Ipv6Address destinationIpv6{
+        absl::MakeUint128(0x20010DB8000000FFULL * (i + 1), 0x1234 * i)};
+    // The timestamp of flashroute header may tick between the two probes.
+    expectSamePackets(&proberIpv6, destinationIpv6, sourceIpv6,
+                      static_cast<uint8_t>(i % 32 + 1), false, 52, 56);
+  }
+}
@@ -11,6 +11,8 @@
 
 #include "glog/logging.h"
 #include "flashroute/address.h"
+#include "flashroute/checksum.h"
+#include "flashroute/timestamping.h"
 #include "flashroute/utils.h"
 
 namespace flashroute {
@@ -39,19 +41,28 @@ UdpProberIpv6::UdpProberIpv6(PacketReceiverCallback* callback,
   payloadMessage_ = payloadMessage;
   destinationPort_ = htons(destinationPort);
   ttlOffset_ = ttlOffset;
-  checksumMismatches_ = 0;
-  distanceAbnormalities_ = 0;
-  otherMismatches_ = 0;
+  buildProbeTemplate();
   VLOG(2) << "UdpProber is initialized";
 }
 
 size_t UdpProberIpv6::packProbe(const IpAddress& destinationIp,
                             const IpAddress& sourceIp, const uint8_t ttl,
                             uint8_t* packetBuffer) {
-  absl::uint128 destinationIpDecimal =
-      (dynamic_cast<const Ipv6Address&>(destinationIp)).getIpv6Address();
-  absl::uint128 sourceIpDecimal =
-      (dynamic_cast<const Ipv6Address&>(sourceIp)).getIpv6Address();
+  return packProbe(dynamic_cast<const Ipv6Address&>(destinationIp),
+                   dynamic_cast<const Ipv6Address&>(sourceIp), ttl,
+                   packetBuffer);
+}
+
+size_t UdpProberIpv6::packProbe(const Ipv6Address& destinationIp,
+                                const Ipv6Address& sourceIp, const uint8_t ttl,
+                                uint8_t* packetBuffer) {
+  absl::uint128 destinationIpDecimal = destinationIp.getIpv6Address();
+  absl::uint128 sourceIpDecimal = sourceIp.getIpv6Address();
+
+  if (packingMode_ == PackingMode::TEMPLATE) {
+    return packProbeFromTemplate(destinationIpDecimal, sourceIpDecimal, ttl,
+                                 packetBuffer);
+  }
 
   struct PacketUdpIpv6* packet =
       reinterpret_cast<struct PacketUdpIpv6*>(packetBuffer);
@@ -104,11 +115,10 @@ size_t UdpProberIpv6::packProbe(const IpAddress& destinationIp,
   // if you set a checksum to zero, your kernel's IP stack should fill in
   // the correct checksum during transmission
   // packet->udp.uh_sum = 0;
-  packet->udp.uh_sum = getChecksum(
-      kUdpProtocol, packetExpectedSize - sizeof(packet->ip),
-      reinterpret_cast<uint16_t*>(&sourceIpDecimal),
-      reinterpret_cast<uint16_t*>(&destinationIpDecimal),
-      reinterpret_cast<uint16_t*>(packetBuffer + sizeof(struct ip6_hdr)));
+  packet->udp.uh_sum = getIpv6PseudoHeaderChecksum(
+      &sourceIpDecimal, &destinationIpDecimal, kUdpProtocol,
+      packetBuffer + sizeof(struct ip6_hdr),
+      packetExpectedSize - sizeof(packet->ip));
 
 #else
   packet->udp.dest = destinationPort_;
@@ -118,11 +128,10 @@ size_t UdpProberIpv6::packProbe(const IpAddress& destinationIp,
   // if you set a checksum to zero, your kernel's IP stack should fill in
   // the correct checksum during transmission
   // packet->udp.check= 0;
-  packet->udp.check = getChecksum(
-      kUdpProtocol, packetExpectedSize - sizeof(packet->ip),
-      reinterpret_cast<uint16_t*>(&sourceIpDecimal),
-      reinterpret_cast<uint16_t*>(&destinationIpDecimal),
-      reinterpret_cast<uint16_t*>(packetBuffer + sizeof(struct ip6_hdr)));
+  packet->udp.check = getIpv6PseudoHeaderChecksum(
+      &sourceIpDecimal, &destinationIpDecimal, kUdpProtocol,
+      packetBuffer + sizeof(struct ip6_hdr),
+      packetExpectedSize - sizeof(packet->ip));
 #endif
 
   return packetExpectedSize;
@@ -132,14 +141,45 @@ void UdpProberIpv6::setChecksumOffset(int32_t checksumOffset) {
   checksumOffset_ = checksumOffset;
 }
 
+bool UdpProberIpv6::getResponseFilter(ResponseFilter* filter) const {
+  filter->ipv4 = false;
+  filter->destinationPort = ntohs(destinationPort_);
+  filter->checksumField = ChecksumField::SOURCE_PORT;
+  filter->checksumOffset = static_cast<uint16_t>(checksumOffset_);
+  return true;
+}
+
 void UdpProberIpv6::parseResponse(uint8_t* buffer, size_t size,
                               SocketType socketType) {
-  if (socketType != SocketType::ICMP || size < 96) return;
+  ReceivedPacket packet = {buffer, size};
+  parseResponses(&packet, 1, socketType);
+}
+
+void UdpProberIpv6::parseResponses(const ReceivedPacket* packets, size_t count,
+                                   SocketType socketType) {
+  parseResponses(packets, count, socketType,
+                 [this](const ProbeResponse<Ipv6Address>& response,
+                        const ReceivedPacket& packet) {
+                   (*callback_)(response.destination, response.responder,
+                                response.distance, response.rtt,
+                                response.fromDestination, false,
+                                packet.buffer, packet.size);
+                 });
+}
+
+bool UdpProberIpv6::decodeResponse(uint8_t* buffer, size_t size,
+                                   SocketType socketType,
+                                   int64_t receivedTimestamp,
+                                   int64_t packetTimestamp,
+                                   ProbeResponse<Ipv6Address>* response) {
+  if (socketType != SocketType::ICMP || size < 96) return false;
   struct PacketIcmpIpv6* parsedPacket =
       reinterpret_cast<struct PacketIcmpIpv6*>(buffer);
   struct PacketUdpIpv6* residualUdpPacket =
       reinterpret_cast<struct PacketUdpIpv6*>(buffer + 48);
-  if (parsedPacket->ip.ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_ICMPV6) return;
+  if (parsedPacket->ip.ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_ICMPV6) {
+    return false;
+  }
 
   absl::uint128 destination = 0;
   absl::uint128 responder = 0;
@@ -152,16 +192,16 @@ void UdpProberIpv6::parseResponse(uint8_t* buffer, size_t size,
           reinterpret_cast<uint16_t*>(&residualUdpPacket->ip.ip6_dst),
           checksumOffset_) != residualUdpPacket->udp.uh_sport) {
     // Checksum unmatched.
-    checksumMismatches += 1;
-    return;
+    checksumMismatches_.add();
+    return false;
   }
 #else
   if (getChecksum(
           reinterpret_cast<uint16_t*>(&residualUdpPacket->ip.ip6_dst),
           checksumOffset_) != residualUdpPacket->udp.source) {
     // Checksum unmatched.
-    checksumMismatches_ += 1;
-    return;
+    checksumMismatches_.add();
+    return false;
   }
 #endif
 
@@ -173,19 +213,24 @@ void UdpProberIpv6::parseResponse(uint8_t* buffer, size_t size,
   int16_t initialTTL =
       static_cast<int16_t>(residualUdpPacket->flashrouteHeader.initialTtl);
 
-  int64_t receivedTimestamp = getTimestamp();
   uint32_t rtt = static_cast<uint32_t>(receivedTimestamp - sentTimestamp +
                                        kTimestampSlot) %
                  kTimestampSlot;
-  if (probePhase != probePhaseCode_) return;
+  if (probePhase != probePhaseCode_) return false;
 
   if (residualUdpPacket->udp.source !=
       getChecksum(reinterpret_cast<uint16_t*>(&destination), checksumOffset_))
-    return;
+    return false;
 
   if (initialTTL == 0) initialTTL = 32;
   initialTTL += ttlOffset_;
 
+  if (probeTimestamps_ != nullptr) {
+    rtt = probeTimestamps_->getRtt(getDestinationKey(destination),
+                                   static_cast<uint8_t>(initialTTL),
+                                   packetTimestamp);
+  }
+
   if (parsedPacket->icmp.icmp6_type == 1 &&
       (parsedPacket->icmp.icmp6_code == 4 ||
        parsedPacket->icmp.icmp6_code == 3)) {
@@ -199,7 +244,7 @@ void UdpProberIpv6::parseResponse(uint8_t* buffer, size_t size,
     fromDestination = false;
     distance =
         initialTTL - residualUdpPacket->ip.ip6_ctlun.ip6_un1.ip6_un1_hlim + 1;
-    return;
+    return false;
   } else if (parsedPacket->icmp.icmp6_type == 3 &&
              parsedPacket->icmp.icmp6_code == 0) {
     // Time Exceeded
@@ -207,20 +252,21 @@ void UdpProberIpv6::parseResponse(uint8_t* buffer, size_t size,
     distance = initialTTL;
   } else {
     // Other packets.
-    otherMismatches_++;
-    return;
+    otherMismatches_.add();
+    return false;
   }
 
   if (distance <= ttlOffset_ || distance > (kMaxTtl + ttlOffset_)) {
-    distanceAbnormalities_ += 1;
-    return;
+    distanceAbnormalities_.add();
+    return false;
   }
 
-  Ipv6Address ipv4Destination(destination);
-  Ipv6Address ipv4Responder(responder);
-
-  (*callback_)(ipv4Destination, ipv4Responder, static_cast<uint8_t>(distance),
-               rtt, fromDestination, false, buffer, size);
+  response->destination = Ipv6Address(destination);
+  response->responder = Ipv6Address(responder);
+  response->distance = static_cast<uint8_t>(distance);
+  response->rtt = rtt;
+  response->fromDestination = fromDestination;
+  return true;
 }
 
 uint16_t UdpProberIpv6::getTimestamp() const {
@@ -231,74 +277,88 @@ uint16_t UdpProberIpv6::getTimestamp() const {
   return static_cast<uint16_t>(millisecond);
 }
 
-uint16_t UdpProberIpv6::getChecksum(const uint16_t* ipAddress,
-                                             uint16_t offset) const {
-  uint32_t sum = 0;
-  for (int i = 0; i < 8; i ++) {
-    sum += ntohs(ipAddress[i]);
-  }
-
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
+void UdpProberIpv6::buildProbeTemplate() {
+  uint32_t packetSize =
+      IP6_HDRLEN + ICMP_HDRLEN + FLASHROUTE_HDRLEN + payloadMessage_.size();
+  // One more zero byte pads an odd packet for the checksum.
+  probeTemplate_.assign(packetSize + 1, 0);
+  struct PacketUdpIpv6* packet =
+      reinterpret_cast<struct PacketUdpIpv6*>(probeTemplate_.data());
+  memcpy(packet->payload + FLASHROUTE_HDRLEN, payloadMessage_.c_str(),
+         payloadMessage_.size());
+  packet->ip.ip6_ctlun.ip6_un1.ip6_un1_nxt = kUdpProtocol;
+#if defined(__APPLE__) || defined(__MACH__)
+  packet->ip.ip6_ctlun.ip6_un1.ip6_un1_plen = packetSize;
+#else
+  packet->ip.ip6_ctlun.ip6_un1.ip6_un1_plen = htons(packetSize - IP6_HDRLEN);
+#endif
+  uint16_t udpLength = htons(packetSize - IP6_HDRLEN);
+#ifdef __FAVOR_BSD
+  packet->udp.uh_dport = destinationPort_;
+  packet->udp.uh_ulen = udpLength;
+#else
+  packet->udp.dest = destinationPort_;
+  packet->udp.len = udpLength;
+#endif
 
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum + offset));
+  // Protocol and length of the pseudo header, UDP header and payload. The
+  // flashroute header is left zero.
+  uint8_t protocol[2] = {0, kUdpProtocol};
+  uint64_t sum = addChecksumWords(0, protocol, sizeof(protocol));
+  sum += udpLength;
+  sum = addChecksumWords(sum, probeTemplate_.data() + IP6_HDRLEN,
+                         packetSize - IP6_HDRLEN);
+  templateChecksum_ = finishChecksum(sum);
 }
 
-uint16_t UdpProberIpv6::getChecksum(const uint8_t protocolValue,
-                                     size_t packetLength,
-                                     const uint16_t* sourceIpAddress,
-                                     const uint16_t* destinationIpAddress,
-                                     uint16_t* buff) const {
-  /* Check if the content length is even or odd.  Add padding if odd. */
-  if ((packetLength % 2) == 1) {
-    // Empty space in the ip buffer should be 0 anyway.
-    buff[packetLength] = 0;
-    packetLength += 1;  // incrase length to make even.
-  }
-
-  uint32_t sum = 0;
-  /* add the pseudo header */
-  for (int i = 0; i < 8; i ++) {
-    sum += ntohs(sourceIpAddress[i]);
-    sum += ntohs(destinationIpAddress[i]);
-  }
-  sum += packetLength;   // already in host format.
-  sum += protocolValue;  // already in host format.
-
-  /*
-   * calculate the checksum for the tcp header and payload
-   * len_tcp represents number of 8-bit bytes,
-   * we are working with 16-bit words so divide len_tcp by 2.
-   */
-  for (uint32_t i = 0; i < (packetLength / 2); i++) {
-    sum += ntohs(buff[i]);
-  }
+size_t UdpProberIpv6::packProbeFromTemplate(
+    const absl::uint128& destinationIpDecimal,
+    const absl::uint128& sourceIpDecimal, const uint8_t ttl,
+    uint8_t* packetBuffer) {
+  size_t packetExpectedSize = probeTemplate_.size() - 1;
+  memcpy(packetBuffer, probeTemplate_.data(), packetExpectedSize);
 
-  // keep only the last 16 bits of the 32 bit calculated sum and add the
-  // carries
-  sum = (sum & 0xFFFF) + (sum >> 16);
-  // sum += (sum >> 16);
+  struct PacketUdpIpv6* packet =
+      reinterpret_cast<struct PacketUdpIpv6*>(packetBuffer);
+  packet->flashrouteHeader.initialTtl = ttl;
+  packet->flashrouteHeader.timestamp = getTimestamp();
+  packet->flashrouteHeader.probeStatus = probePhaseCode_;
 
-  // Take the bitwise complement of sum
-  sum = ~sum;
-  return htons(((uint16_t)sum));
-}
+  uint16_t destinationChecksum = getChecksum(
+      reinterpret_cast<const uint16_t*>(&destinationIpDecimal),
+      checksumOffset_);
+  packet->ip.ip6_ctlun.ip6_un1.ip6_un1_flow =
+      htonl((6 << 28) | (0 << 20) | (destinationChecksum & 0xFFFFF));
+  packet->ip.ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
+  memcpy(&(packet->ip.ip6_dst), &destinationIpDecimal, sizeof(absl::uint128));
+  memcpy(&(packet->ip.ip6_src), &sourceIpDecimal, sizeof(absl::uint128));
 
-// Get metrics information
+  // The fields which are zero in the template: addresses of the pseudo
+  // header, source port and flashroute header.
+  uint64_t sum = addChecksumWords(0, &sourceIpDecimal, sizeof(absl::uint128));
+  sum = addChecksumWords(sum, &destinationIpDecimal, sizeof(absl::uint128));
+  sum += destinationChecksum;
+  sum = addChecksumWords(sum, &packet->flashrouteHeader, FLASHROUTE_HDRLEN);
+  uint16_t checksum = updateChecksum(templateChecksum_, sum);
+  // Zero stands for no checksum in UDP.
+  if (checksum == 0) checksum = 0xFFFF;
 
-uint64_t UdpProberIpv6::getChecksumMismatches() {
-  return checksumMismatches_;
-}
+#ifdef __FAVOR_BSD
+  packet->udp.uh_sport = destinationChecksum;
+  packet->udp.uh_sum = checksum;
+#else
+  packet->udp.source = destinationChecksum;
+  packet->udp.check = checksum;
+#endif
 
-uint64_t UdpProberIpv6::getDistanceAbnormalities() {
-  return distanceAbnormalities_;
+  return packetExpectedSize;
 }
 
-uint64_t UdpProberIpv6::getOtherMismatches() {
-  return otherMismatches_;
+uint16_t UdpProberIpv6::getChecksum(const uint16_t* ipAddress,
+                                    uint16_t offset) const {
+  uint16_t checksum =
+      ntohs(getInternetChecksum(ipAddress, sizeof(absl::uint128)));
+  return htons(static_cast<uint16_t>(checksum + offset));
 }
 
 }  // namespace flashroute
@@ -5,6 +5,7 @@
 #include <netinet/ip6.h>    // struct ip6_hdr
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "flashroute/address.h"
 #include "flashroute/prober.h"
@@ -66,8 +67,10 @@ struct PacketIcmpIpv6 {
  * );
  *
  */
-class UdpProberIpv6 : public virtual Prober {
+class UdpProberIpv6 final : public virtual Prober {
  public:
+  typedef Ipv6Address AddressType;
+
   UdpProberIpv6(PacketReceiverCallback* callback, const int32_t checksumOffset,
                 const uint8_t probePhaseCode, const uint16_t destinationPort,
                 const std::string& payloadMessage, const uint8_t ttlOffset);
@@ -76,22 +79,54 @@ class UdpProberIpv6 : public virtual Prober {
   size_t packProbe(const IpAddress& destinationIp, const IpAddress& sourceIp,
                    const uint8_t ttl, uint8_t* packetBuffer) override;
 
+  // Same as above without the virtual call and the dynamic casts. Chosen by
+  // overload resolution when the addresses are Ipv6Address.
+  size_t packProbe(const Ipv6Address& destinationIp,
+                   const Ipv6Address& sourceIp, const uint8_t ttl,
+                   uint8_t* packetBuffer);
+
   // Parse responses.
   void parseResponse(uint8_t* buffer, size_t size,
                      SocketType socketType) override;
 
+  void parseResponses(const ReceivedPacket* packets, size_t count,
+                      SocketType socketType) override;
+
+  // Same as above but hand the accepted responses to handler instead of the
+  // callback. The handler is called as
+  // handler(const ProbeResponse<Ipv6Address>&, const ReceivedPacket&) and can
+  // be inlined.
+  template <class Handler>
+  void parseResponses(const ReceivedPacket* packets, size_t count,
+                      SocketType socketType, Handler&& handler) {
+    // Packets of a batch are received at the same time, read the clock once.
+    int64_t receivedTimestamp = getTimestamp();
+    ProbeResponse<Ipv6Address> response;
+    for (size_t i = 0; i < count; i++) {
+      if (decodeResponse(packets[i].buffer, packets[i].size, socketType,
+                         receivedTimestamp, packets[i].timestamp,
+                         &response)) {
+        handler(response, packets[i]);
+      }
+    }
+  }
+
+  // Decode a response received at the given timestamp. packetTimestamp is
+  // the timestamp of the received packet, used instead if probe timestamps
+  // are set. Return false and update the metrics if the response is dropped.
+  bool decodeResponse(uint8_t* buffer, size_t size, SocketType socketType,
+                      int64_t receivedTimestamp, int64_t packetTimestamp,
+                      ProbeResponse<Ipv6Address>* response);
+
   // Change checksum offset (support discovery-optimized mode.)
   void setChecksumOffset(int32_t checksumOffset);
 
+  bool getResponseFilter(ResponseFilter* filter) const override;
+
 
   // Put here for testing purpose.
   uint16_t getTimestamp() const;
 
-  // Get metrics information
-  uint64_t getChecksumMismatches() override;
-  uint64_t getDistanceAbnormalities() override;
-  uint64_t getOtherMismatches() override;
-
  private:
   PacketReceiverCallback* callback_;
   int32_t checksumOffset_;
@@ -101,20 +136,23 @@ class UdpProberIpv6 : public virtual Prober {
   std::string payloadMessage_;
   bool encodeTimestamp_;
 
-  // Metrics
-  uint64_t checksumMismatches_;
-  uint64_t distanceAbnormalities_;
-  uint64_t otherMismatches_;
+  // Pre-filled probe for TEMPLATE packing followed by a zero byte which pads
+  // an odd packet.
+  std::vector<uint8_t> probeTemplate_;
+  // UDP checksum of the template, whose variable fields are all zero.
+  uint16_t templateChecksum_;
+
+  void buildProbeTemplate();
+
+  // Pack a probe by patching a copy of the template.
+  size_t packProbeFromTemplate(const absl::uint128& destinationIpDecimal,
+                               const absl::uint128& sourceIpDecimal,
+                               const uint8_t ttl, uint8_t* packetBuffer);
 
   // Calculate checksum of ip address.
   uint16_t getChecksum(const uint16_t* ipaddress,
                                   uint16_t offset) const;
 
-  // Calculate checksum of packet.
-  uint16_t getChecksum(const uint8_t protocolValue, size_t packetLength,
-                       const uint16_t* sourceIpAddress,
-                       const uint16_t* destinationIpAddress,
-                       uint16_t* buff) const;
 };
 
 }  // namespace flashroute
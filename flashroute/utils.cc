@@ -3,12 +3,17 @@
 
 #include "glog/logging.h"
 
+#include <cstring>
+#include <fstream>
 #include <vector>
 #include <memory>
 #include <string>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <ifaddrs.h>
+#include <netinet/ip.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 #include <boost/process.hpp>
 #include "absl/strings/str_cat.h"
@@ -245,4 +250,80 @@ std::string getDefaultInterface() {
   return tmp;
 }
 
+bool parseMacAddress(const std::string& input, uint8_t* mac) {
+  std::vector<absl::string_view> parts = absl::StrSplit(input, ":");
+  if (parts.size() != 6) {
+    return false;
+  }
+  for (uint32_t i = 0; i < 6; i++) {
+    std::string octet(parts[i]);
+    char* end = nullptr;
+    uint64_t value = strtoul(octet.c_str(), &end, 16);
+    if (octet.size() != 2 || *end != '\0') {
+      return false;
+    }
+    mac[i] = static_cast<uint8_t>(value);
+  }
+  return true;
+}
+
+bool getMacAddressByInterface(const std::string& interface, uint8_t* mac) {
+  struct ifreq ifr;
+  if (interface.size() >= sizeof(ifr.ifr_name)) return false;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) return false;
+  memset(&ifr, 0, sizeof(ifr));
+  memcpy(ifr.ifr_name, interface.c_str(), interface.size());
+  bool result = ioctl(fd, SIOCGIFHWADDR, &ifr) == 0;
+  if (result) {
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+  }
+  ::close(fd);
+  return result;
+}
+
+bool getGatewayMacAddress(const std::string& interface, uint8_t* mac) {
+  // Find the default gateway of the interface from the routing table.
+  // Example line of /proc/net/route:
+  // eth0  00000000  0101A8C0  0003  0  0  0  00000000  0  0  0
+  std::ifstream routeTable("/proc/net/route");
+  std::string gateway;
+  for (std::string line; std::getline(routeTable, line);) {
+    std::vector<absl::string_view> parts =
+        absl::StrSplit(line, absl::ByAnyChar(" \t"), absl::SkipEmpty());
+    if (parts.size() < 3 || parts[0] != interface || parts[1] != "00000000") {
+      continue;
+    }
+    // The routing table stores address in network order.
+    uint32_t gatewayDecimal = static_cast<uint32_t>(
+        strtoul(std::string(parts[2]).c_str(), nullptr, 16));
+    if (gatewayDecimal != 0) {
+      gateway = parseIpv4FromIntToString(ntohl(gatewayDecimal));
+      break;
+    }
+  }
+  if (gateway.empty()) {
+    VLOG(2) << "No default gateway is found for interface " << interface;
+    return false;
+  }
+
+  // Look up the MAC address of gateway from the ARP table.
+  // Example line of /proc/net/arp:
+  // 192.168.1.1  0x1  0x2  aa:bb:cc:dd:ee:ff  *  eth0
+  std::ifstream arpTable("/proc/net/arp");
+  for (std::string line; std::getline(arpTable, line);) {
+    std::vector<absl::string_view> parts =
+        absl::StrSplit(line, absl::ByAnyChar(" \t"), absl::SkipEmpty());
+    if (parts.size() < 6 || parts[0] != gateway || parts[5] != interface) {
+      continue;
+    }
+    if (parseMacAddress(std::string(parts[3]), mac)) {
+      VLOG(2) << "Gateway " << gateway << " MAC address: " << parts[3];
+      return true;
+    }
+  }
+  VLOG(2) << "Gateway " << gateway << " is not found in the ARP table.";
+  return false;
+}
+
 }  // namespace flashroute
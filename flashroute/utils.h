@@ -62,4 +62,16 @@ bool isValidDestiantion(const std::string& input);
 
 std::string getDefaultInterface();
 
+// Parse a MAC address in the form of "aa:bb:cc:dd:ee:ff". Return false if the
+// input is malformed.
+bool parseMacAddress(const std::string& input, uint8_t* mac);
+
+// Get MAC address by interface name. Return false if interface does not exist.
+bool getMacAddressByInterface(const std::string& interface, uint8_t* mac);
+
+// Get the MAC address of the default IPv4 gateway of the interface by looking
+// up the kernel routing and ARP tables. Return false if the gateway cannot be
+// resolved.
+bool getGatewayMacAddress(const std::string& interface, uint8_t* mac);
+
 }  // namespace flashroute
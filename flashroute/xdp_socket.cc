@@ -0,0 +1,467 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#include "flashroute/xdp_socket.h"
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>  // XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "glog/logging.h"
+
+#include "flashroute/checksum.h"
+#include "flashroute/utils.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace flashroute {
+
+const uint32_t kXdpFrameSize = 2048;
+const uint32_t kXdpFrameCount = 4096;  // Half for RX, half for TX.
+const uint32_t kXdpRingSize = kXdpFrameCount / 2;  // Has to be power of 2.
+const int32_t kXdpPollTimeoutMs = 100;
+const uint32_t kXdpProgramLogSize = 65536;
+
+namespace {
+
+int bpf(int command, union bpf_attr* attr) {
+  return static_cast<int>(syscall(__NR_bpf, command, attr, sizeof(*attr)));
+}
+
+// A BPF instruction whose jump offset is resolved from the index of target
+// instruction.
+struct XdpInstruction {
+  struct bpf_insn instruction;
+  int32_t target;
+};
+
+XdpInstruction instruction(uint8_t code, uint8_t dst, uint8_t src, int16_t off,
+                           int32_t imm) {
+  XdpInstruction result;
+  memset(&result, 0, sizeof(result));
+  result.instruction.code = code;
+  result.instruction.dst_reg = dst;
+  result.instruction.src_reg = src;
+  result.instruction.off = off;
+  result.instruction.imm = imm;
+  result.target = -1;
+  return result;
+}
+
+XdpInstruction jump(uint8_t code, uint8_t dst, uint8_t src, int32_t imm,
+                    int32_t target) {
+  XdpInstruction result = instruction(BPF_JMP | code, dst, src, 0, imm);
+  result.target = target;
+  return result;
+}
+
+}  // namespace
+
+XdpSocket::XdpSocket(const std::string& interface, const uint32_t queueId,
+                     const uint8_t* destinationMac, const bool ipv4)
+    : socket_(-1),
+      ifindex_(if_nametoindex(interface.c_str())),
+      queueId_(queueId),
+      ipv4_(ipv4),
+      zeroCopy_(false),
+      umem_(nullptr),
+      umemSize_(0),
+      acquiredFrame_(0),
+      pendingFrames_(0),
+      xskMap_(-1),
+      program_(-1),
+      link_(-1) {
+  memset(&fillRing_, 0, sizeof(fillRing_));
+  memset(&completionRing_, 0, sizeof(completionRing_));
+  memset(&rxRing_, 0, sizeof(rxRing_));
+  memset(&txRing_, 0, sizeof(txRing_));
+
+  memset(&ethernetHeader_, 0, sizeof(ethernetHeader_));
+  memcpy(ethernetHeader_.h_dest, destinationMac, ETH_ALEN);
+  if (ifindex_ == 0 ||
+      !getMacAddressByInterface(interface, ethernetHeader_.h_source)) {
+    LOG(FATAL) << "XDP: Failed to get MAC address of " << interface;
+  }
+  ethernetHeader_.h_proto = htons(ipv4_ ? ETH_P_IP : ETH_P_IPV6);
+
+  socket_ = socket(AF_XDP, SOCK_RAW, 0);
+  if (socket_ < 0) {
+    LOG(FATAL) << "XDP: AF_XDP socket failed to initialize. Errno: " << errno;
+  }
+  createUmem();
+  loadProgram();
+  attachProgram();
+  bindSocket();
+
+  // Register the socket to the queue, so the program can redirect to it.
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  uint32_t key = queueId_;
+  uint32_t value = static_cast<uint32_t>(socket_);
+  attr.map_fd = static_cast<uint32_t>(xskMap_);
+  attr.key = reinterpret_cast<uint64_t>(&key);
+  attr.value = reinterpret_cast<uint64_t>(&value);
+  attr.flags = BPF_ANY;
+  if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+    LOG(FATAL) << "XDP: Failed to register socket to XSKMAP. Errno: "
+               << errno;
+  }
+
+  VLOG(2) << "XDP: AF_XDP socket initialized on " << interface << " queue "
+          << queueId_ << (zeroCopy_ ? " (zero-copy)." : " (copy mode).");
+}
+
+XdpSocket::~XdpSocket() {
+  // Closing the link detaches the program from the interface.
+  if (link_ >= 0) close(link_);
+  if (program_ >= 0) close(program_);
+  if (xskMap_ >= 0) close(xskMap_);
+  Ring* rings[] = {&fillRing_, &completionRing_, &rxRing_, &txRing_};
+  for (Ring* ring : rings) {
+    if (ring->map != nullptr) munmap(ring->map, ring->mapSize);
+  }
+  if (socket_ >= 0) close(socket_);
+  if (umem_ != nullptr) munmap(umem_, umemSize_);
+}
+
+bool XdpSocket::createUmem() {
+  umemSize_ = static_cast<size_t>(kXdpFrameCount) * kXdpFrameSize;
+  void* umem = mmap(nullptr, umemSize_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (umem == MAP_FAILED) {
+    LOG(FATAL) << "XDP: Failed to allocate UMEM.";
+    return false;
+  }
+  umem_ = reinterpret_cast<uint8_t*>(umem);
+
+  struct xdp_umem_reg umemRegister;
+  memset(&umemRegister, 0, sizeof(umemRegister));
+  umemRegister.addr = reinterpret_cast<uint64_t>(umem_);
+  umemRegister.len = umemSize_;
+  umemRegister.chunk_size = kXdpFrameSize;
+  umemRegister.headroom = 0;
+  if (setsockopt(socket_, SOL_XDP, XDP_UMEM_REG, &umemRegister,
+                 sizeof(umemRegister)) < 0) {
+    LOG(FATAL) << "XDP: Failed to register UMEM. Errno: " << errno;
+    return false;
+  }
+
+  uint32_t ringSize = kXdpRingSize;
+  if (setsockopt(socket_, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize,
+                 sizeof(ringSize)) < 0 ||
+      setsockopt(socket_, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize,
+                 sizeof(ringSize)) < 0 ||
+      setsockopt(socket_, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) <
+          0 ||
+      setsockopt(socket_, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) <
+          0) {
+    LOG(FATAL) << "XDP: Failed to create rings. Errno: " << errno;
+    return false;
+  }
+
+  struct xdp_mmap_offsets offsets;
+  socklen_t optlen = sizeof(offsets);
+  if (getsockopt(socket_, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) < 0) {
+    LOG(FATAL) << "XDP: Failed to get ring offsets. Errno: " << errno;
+    return false;
+  }
+
+  mapRing(&fillRing_, XDP_UMEM_PGOFF_FILL_RING, offsets.fr, kXdpRingSize,
+          sizeof(uint64_t));
+  mapRing(&completionRing_, XDP_UMEM_PGOFF_COMPLETION_RING, offsets.cr,
+          kXdpRingSize, sizeof(uint64_t));
+  mapRing(&rxRing_, XDP_PGOFF_RX_RING, offsets.rx, kXdpRingSize,
+          sizeof(struct xdp_desc));
+  mapRing(&txRing_, XDP_PGOFF_TX_RING, offsets.tx, kXdpRingSize,
+          sizeof(struct xdp_desc));
+
+  // The first half of frames receive packets.
+  uint64_t* fillAddresses = reinterpret_cast<uint64_t*>(fillRing_.descriptors);
+  uint32_t producer = *fillRing_.producer;
+  for (uint32_t i = 0; i < kXdpFrameCount / 2; i++) {
+    fillAddresses[(producer + i) & (fillRing_.size - 1)] =
+        static_cast<uint64_t>(i) * kXdpFrameSize;
+  }
+  __atomic_store_n(fillRing_.producer, producer + kXdpFrameCount / 2,
+                   __ATOMIC_RELEASE);
+
+  // The second half of frames carry probes.
+  for (uint32_t i = kXdpFrameCount / 2; i < kXdpFrameCount; i++) {
+    freeTxFrames_.push_back(static_cast<uint64_t>(i) * kXdpFrameSize);
+  }
+  return true;
+}
+
+bool XdpSocket::mapRing(Ring* ring, uint64_t offset,
+                        const struct xdp_ring_offset& o, uint32_t size,
+                        size_t descriptorSize) {
+  ring->mapSize = o.desc + size * descriptorSize;
+  void* map = mmap(nullptr, ring->mapSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, socket_, offset);
+  if (map == MAP_FAILED) {
+    LOG(FATAL) << "XDP: Failed to map ring. Errno: " << errno;
+    ring->map = nullptr;
+    return false;
+  }
+  uint8_t* base = reinterpret_cast<uint8_t*>(map);
+  ring->map = map;
+  ring->producer = reinterpret_cast<uint32_t*>(base + o.producer);
+  ring->consumer = reinterpret_cast<uint32_t*>(base + o.consumer);
+  ring->flags = reinterpret_cast<uint32_t*>(base + o.flags);
+  ring->descriptors = base + o.desc;
+  ring->size = size;
+  return true;
+}
+
+bool XdpSocket::loadProgram() {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = queueId_ + 1;
+  xskMap_ = bpf(BPF_MAP_CREATE, &attr);
+  if (xskMap_ < 0) {
+    LOG(FATAL) << "XDP: Failed to create XSKMAP. Errno: " << errno;
+    return false;
+  }
+
+  // Redirect ICMP Destination-Unreachable/Time-Exceeded and their ICMPv6
+  // counterparts to the socket registered for the receiving queue. Everything
+  // else, including ICMPv6 neighbor discovery, goes to the kernel.
+  const int32_t kPass = 31;
+  const int32_t kIpv4 = 10;
+  const int32_t kIpv6 = 19;
+  const int32_t kRedirect = 25;
+  std::vector<XdpInstruction> program = {
+      // 0: r6 = ctx, r2 = data, r3 = data_end
+      instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+      instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 0, 0),
+      instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, 4, 0),
+      // 3: Bound check of ethernet + ipv6 header + icmp type.
+      instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+      instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 56),
+      jump(BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, kPass),
+      // 6: Ethernet type.
+      instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0),
+      jump(BPF_JEQ | BPF_K, BPF_REG_5, 0, htons(ETH_P_IP), kIpv4),
+      jump(BPF_JEQ | BPF_K, BPF_REG_5, 0, htons(ETH_P_IPV6), kIpv6),
+      jump(BPF_JA, 0, 0, 0, kPass),
+      // 10: Ipv4 without options carrying ICMP type 3 or 11.
+      instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14, 0),
+      instruction(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x0F),
+      jump(BPF_JNE | BPF_K, BPF_REG_5, 0, 5, kPass),
+      instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 23, 0),
+      jump(BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_ICMP, kPass),
+      instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 34, 0),
+      jump(BPF_JEQ | BPF_K, BPF_REG_5, 0, 3, kRedirect),
+      jump(BPF_JEQ | BPF_K, BPF_REG_5, 0, 11, kRedirect),
+      jump(BPF_JA, 0, 0, 0, kPass),
+      // 19: Ipv6 carrying ICMPv6 type 1 or 3.
+      instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 20, 0),
+      jump(BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_ICMPV6, kPass),
+      instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 54, 0),
+      jump(BPF_JEQ | BPF_K, BPF_REG_5, 0, 1, kRedirect),
+      jump(BPF_JEQ | BPF_K, BPF_REG_5, 0, 3, kRedirect),
+      jump(BPF_JA, 0, 0, 0, kPass),
+      // 25: return bpf_redirect_map(xskMap, rx_queue_index, XDP_PASS)
+      instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 16, 0),
+      instruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+                  xskMap_),
+      instruction(0, 0, 0, 0, 0),
+      instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+      instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+      instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+      // 31: return XDP_PASS
+      instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+      instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+
+  std::vector<struct bpf_insn> instructions;
+  for (size_t i = 0; i < program.size(); i++) {
+    struct bpf_insn tmp = program[i].instruction;
+    if (program[i].target >= 0) {
+      tmp.off = static_cast<int16_t>(program[i].target - i - 1);
+    }
+    instructions.push_back(tmp);
+  }
+
+  static const char kLicense[] = "GPL";
+  std::vector<char> log(kXdpProgramLogSize, 0);
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insns = reinterpret_cast<uint64_t>(instructions.data());
+  attr.insn_cnt = static_cast<uint32_t>(instructions.size());
+  attr.license = reinterpret_cast<uint64_t>(kLicense);
+  attr.log_buf = reinterpret_cast<uint64_t>(log.data());
+  attr.log_size = kXdpProgramLogSize;
+  attr.log_level = 1;
+  program_ = bpf(BPF_PROG_LOAD, &attr);
+  if (program_ < 0) {
+    LOG(FATAL) << "XDP: Failed to load XDP program. Errno: " << errno << "\n"
+               << log.data();
+    return false;
+  }
+  return true;
+}
+
+bool XdpSocket::attachProgram() {
+  union bpf_attr attr;
+  // Try driver mode first, then generic mode for drivers without XDP support.
+  uint32_t modes[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+  for (uint32_t mode : modes) {
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = static_cast<uint32_t>(program_);
+    attr.link_create.target_ifindex = ifindex_;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = mode;
+    link_ = bpf(BPF_LINK_CREATE, &attr);
+    if (link_ >= 0) {
+      VLOG(2) << "XDP: Program attached in "
+              << (mode == XDP_FLAGS_DRV_MODE ? "driver" : "generic")
+              << " mode.";
+      return true;
+    }
+    VLOG(2) << "XDP: Failed to attach program in mode " << mode
+            << ". Errno: " << errno;
+  }
+  LOG(FATAL) << "XDP: Failed to attach XDP program. Errno: " << errno;
+  return false;
+}
+
+bool XdpSocket::bindSocket() {
+  struct sockaddr_xdp address;
+  // Try zero-copy first, then copy mode.
+  uint16_t modes[] = {XDP_ZEROCOPY, XDP_COPY};
+  for (uint16_t mode : modes) {
+    memset(&address, 0, sizeof(address));
+    address.sxdp_family = AF_XDP;
+    address.sxdp_ifindex = ifindex_;
+    address.sxdp_queue_id = queueId_;
+    address.sxdp_flags = mode;
+    if (bind(socket_, reinterpret_cast<struct sockaddr*>(&address),
+             sizeof(address)) == 0) {
+      zeroCopy_ = mode == XDP_ZEROCOPY;
+      return true;
+    }
+    VLOG(2) << "XDP: Failed to bind socket in mode " << mode
+            << ". Errno: " << errno;
+  }
+  LOG(FATAL) << "XDP: Failed to bind AF_XDP socket. Errno: " << errno;
+  return false;
+}
+
+void XdpSocket::reclaimTxFrames() {
+  uint32_t consumer = *completionRing_.consumer;
+  uint32_t producer =
+      __atomic_load_n(completionRing_.producer, __ATOMIC_ACQUIRE);
+  if (consumer == producer) return;
+  uint64_t* addresses =
+      reinterpret_cast<uint64_t*>(completionRing_.descriptors);
+  for (uint32_t i = consumer; i != producer; i++) {
+    freeTxFrames_.push_back(addresses[i & (completionRing_.size - 1)]);
+  }
+  __atomic_store_n(completionRing_.consumer, producer, __ATOMIC_RELEASE);
+}
+
+uint8_t* XdpSocket::acquireFrame() {
+  reclaimTxFrames();
+  while (freeTxFrames_.empty()) {
+    // All frames are in flight, kick the kernel and wait.
+    sendto(socket_, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+    struct pollfd pfd;
+    pfd.fd = socket_;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, kXdpPollTimeoutMs);
+    reclaimTxFrames();
+  }
+  acquiredFrame_ = freeTxFrames_.back();
+  freeTxFrames_.pop_back();
+  return umem_ + acquiredFrame_ + sizeof(ethhdr);
+}
+
+void XdpSocket::commitFrame(size_t length) {
+  uint8_t* frame = umem_ + acquiredFrame_;
+  memcpy(frame, &ethernetHeader_, sizeof(ethernetHeader_));
+  if (ipv4_) {
+    fillIpv4HeaderChecksum(frame + sizeof(ethhdr));
+  }
+
+  // A frame is either free or in TX/completion ring, so TX ring never
+  // overflows.
+  uint32_t producer = *txRing_.producer;
+  struct xdp_desc* descriptors =
+      reinterpret_cast<struct xdp_desc*>(txRing_.descriptors);
+  struct xdp_desc& descriptor = descriptors[producer & (txRing_.size - 1)];
+  descriptor.addr = acquiredFrame_;
+  descriptor.len = static_cast<uint32_t>(length + sizeof(ethhdr));
+  descriptor.options = 0;
+  __atomic_store_n(txRing_.producer, producer + 1, __ATOMIC_RELEASE);
+  pendingFrames_ += 1;
+}
+
+int32_t XdpSocket::flush() {
+  if (pendingFrames_ == 0) return 0;
+  if (sendto(socket_, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 &&
+      errno != EAGAIN && errno != EBUSY && errno != ENOBUFS &&
+      errno != ENETDOWN) {
+    LOG(ERROR) << "XDP: Flush failed. Errno: " << errno;
+    return -1;
+  }
+  int32_t flushed = static_cast<int32_t>(pendingFrames_);
+  pendingFrames_ = 0;
+  return flushed;
+}
+
+uint32_t XdpSocket::receive(const XdpPacketHandler& handler,
+                            int32_t timeoutMs) {
+  uint32_t consumer = *rxRing_.consumer;
+  uint32_t producer = __atomic_load_n(rxRing_.producer, __ATOMIC_ACQUIRE);
+  if (consumer == producer) {
+    struct pollfd pfd;
+    pfd.fd = socket_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeoutMs) <= 0) return 0;
+    producer = __atomic_load_n(rxRing_.producer, __ATOMIC_ACQUIRE);
+  }
+
+  struct xdp_desc* descriptors =
+      reinterpret_cast<struct xdp_desc*>(rxRing_.descriptors);
+  uint64_t* fillAddresses = reinterpret_cast<uint64_t*>(fillRing_.descriptors);
+  uint32_t fillProducer = *fillRing_.producer;
+  uint32_t count = 0;
+  for (uint32_t i = consumer; i != producer; i++) {
+    const struct xdp_desc& descriptor =
+        descriptors[i & (rxRing_.size - 1)];
+    if (descriptor.len > sizeof(ethhdr)) {
+      handler(umem_ + descriptor.addr + sizeof(ethhdr),
+              descriptor.len - sizeof(ethhdr));
+    }
+    // Give the frame back to kernel. Fill ring holds all RX frames, so it
+    // never overflows.
+    fillAddresses[fillProducer++ & (fillRing_.size - 1)] =
+        descriptor.addr - descriptor.addr % kXdpFrameSize;
+    count++;
+  }
+  __atomic_store_n(rxRing_.consumer, producer, __ATOMIC_RELEASE);
+  __atomic_store_n(fillRing_.producer, fillProducer, __ATOMIC_RELEASE);
+  return count;
+}
+
+}  // namespace flashroute
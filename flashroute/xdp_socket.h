@@ -0,0 +1,127 @@
+/* Copyright (C) 2019 Neo Huang - All Rights Reserved */
+#pragma once
+
+#include <linux/if_ether.h>  // struct ethhdr
+#include <linux/if_xdp.h>    // struct xdp_desc, struct sockaddr_xdp
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace flashroute {
+
+using XdpPacketHandler = std::function<void(uint8_t* packet, size_t size)>;
+
+/**
+ * XdpSocket wraps an AF_XDP socket bound to one queue of an interface. The
+ * UMEM frame pool is split into two halves: the first half feeds the RX ring
+ * and the second half holds outgoing probes. An XDP program steers inbound
+ * ICMP/ICMPv6 packets of the queue into the RX ring; all other traffic is
+ * passed to the kernel as usual.
+ *
+ * The socket tries driver mode XDP and zero-copy first, and falls back to
+ * generic (copy) mode if the driver does not support them, so it also works on
+ * veth pairs.
+ *
+ * The TX side (acquireFrame/commitFrame/flush) and the RX side (receive) can
+ * be driven by two different threads.
+ *
+ * Example:
+ *
+ * XdpSocket xdpSocket(
+ *    "eth0",           // The interface to send and receive packets.
+ *    0,                // The queue of the interface.
+ *    gatewayMac,       // Destination MAC of the ethernet header.
+ *    true              // Frames carry Ipv4 or Ipv6 packets.
+ * );
+ *
+ * uint8_t* buffer = xdpSocket.acquireFrame();
+ * size_t packetSize = prober.packProbe(destination, source, ttl, buffer);
+ * xdpSocket.commitFrame(packetSize);
+ * xdpSocket.flush();
+ *
+ * // Receive ICMP packets, the handler gets the packet from the IP header.
+ * xdpSocket.receive(handler, 100);
+ */
+class XdpSocket {
+ public:
+  XdpSocket(const std::string& interface, const uint32_t queueId,
+            const uint8_t* destinationMac, const bool ipv4);
+
+  ~XdpSocket();
+
+  // Return the buffer of a free UMEM frame which starts at the IP header.
+  // Block and kick the kernel if all frames are in flight.
+  uint8_t* acquireFrame();
+
+  // Put the acquired frame into TX ring. Length is the size of IP packet.
+  void commitFrame(size_t length);
+
+  // Wake up the kernel to send all committed frames. Return the number of
+  // frames handed to kernel.
+  int32_t flush();
+
+  uint32_t pendingFrames() const { return pendingFrames_; }
+
+  // Wait up to timeoutMs for inbound packets and pass each of them to the
+  // handler. Return the number of handled packets.
+  uint32_t receive(const XdpPacketHandler& handler, int32_t timeoutMs);
+
+  bool isZeroCopy() const { return zeroCopy_; }
+
+ private:
+  // A producer/consumer ring shared with the kernel.
+  struct Ring {
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    void* descriptors;
+    uint32_t size;
+    void* map;
+    size_t mapSize;
+  };
+
+  int socket_;
+  uint32_t ifindex_;
+  uint32_t queueId_;
+  bool ipv4_;
+  bool zeroCopy_;
+
+  uint8_t* umem_;
+  size_t umemSize_;
+
+  Ring fillRing_;
+  Ring completionRing_;
+  Ring rxRing_;
+  Ring txRing_;
+
+  // UMEM addresses of TX frames that are not in flight.
+  std::vector<uint64_t> freeTxFrames_;
+  uint64_t acquiredFrame_;
+  uint32_t pendingFrames_;
+
+  // BPF objects.
+  int xskMap_;
+  int program_;
+  int link_;
+
+  // Prefilled ethernet header.
+  struct ethhdr ethernetHeader_;
+
+  bool createUmem();
+
+  bool mapRing(Ring* ring, uint64_t offset, const struct xdp_ring_offset& o,
+               uint32_t size, size_t descriptorSize);
+
+  bool loadProgram();
+
+  bool attachProgram();
+
+  bool bindSocket();
+
+  // Move the frames whose transmission is completed back to free list.
+  void reclaimTxFrames();
+};
+
+}  // namespace flashroute